@@ -0,0 +1,196 @@
+// Connectionless telemetry: sensors broadcasting readings as service data, taken straight from their advertisements
+// Each advertisement (flags, a name, manufacturer data, a reading under the Environmental Sensing service and a service
+// list, 45 bytes in all) is pushed through cobble_event_advertisement() as a backend would, and delivered in batches by
+// cobble_queue_process() (or straight away with the realtime core).
+//
+// Reports time and heap allocations per advertisement for the callback ignoring the view, reading the one reading it
+// wants, and looking at every structure, against the same advertisements sent as scan results. Then checks that every
+// reading arrived, in order.
+//
+// Usage: bench_ad_ingest [advertisements] [sensors]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_ad.h"
+
+#include "alloc_count.h"
+
+#ifdef BENCH_REALTIME
+#define MODE "realtime"
+#else
+#define MODE "deferred"
+#endif
+
+// Advertisements made between each call to cobble_queue_process(), well within the queue length
+#define BATCH 256
+
+#define MAX_SENSORS 1024
+
+typedef enum {
+    Read_Nothing,
+    Read_Reading,
+    Read_Everything,
+} ReadMode;
+
+typedef struct {
+    char identifier[24];
+    char name[16];
+    uint32_t sequence;
+    uint8_t data[COBBLE_AD_MAX_LENGTH];
+    int length;
+    int readingOffset; // Where the sequence number is, to change it in place
+} sensor;
+
+static sensor sensors[MAX_SENSORS];
+static int sensorCount = 64;
+
+static ReadMode readMode;
+static uint64_t delivered;
+static uint64_t checksum;
+static uint64_t outOfOrder;
+static uint32_t lastSequence[MAX_SENSORS];
+
+static const cobble_uuid ENVIRONMENTAL_SENSING = COBBLE_UUID16(0x181A);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_advertisement(const char* identifier, int rssi, const cobble_ad_view* view) {
+
+    delivered++;
+    if (readMode == Read_Nothing)
+        return;
+
+    if (readMode == Read_Everything) {
+        int type, len;
+        const uint8_t* data;
+        for (int i = 0; cobble_ad_get(view, i, &type, &data, &len); i++)
+            checksum += type + len + data[0];
+    }
+
+    // Sensors are numbered by the last two bytes of their address
+    const uint8_t* reading;
+    int len;
+    if (!cobble_ad_service_data(view, &ENVIRONMENTAL_SENSING, &reading, &len) || len < 6)
+        return;
+    int index = (int)strtol(identifier + 15, NULL, 16) + 256 * (int)strtol(identifier + 12, NULL, 16);
+    uint32_t sequence = reading[0] | reading[1] << 8 | reading[2] << 16 | (uint32_t)reading[3] << 24;
+    if (index < sensorCount && sequence != lastSequence[index] + 1)
+        outOfOrder++;
+    if (index < sensorCount)
+        lastSequence[index] = sequence;
+    checksum += (uint64_t)(reading[4] | reading[5] << 8) + rssi;
+}
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+    (void)identifier;
+    delivered++;
+    checksum += (uint64_t)name[0] + rssi;
+}
+
+static void make_sensors(void) {
+
+    static const uint8_t flags = 0x06;
+    static const uint8_t manufacturer[] = { 0x01, 0x02, 0x03, 0x04 };
+    const cobble_uuid services[] = { COBBLE_UUID16(0x181A), COBBLE_UUID16(0x180F) };
+
+    for (int i = 0; i < sensorCount; i++) {
+        sensor* s = &sensors[i];
+        snprintf(s->identifier, sizeof(s->identifier), "C0:00:00:00:%02X:%02X", i / 256, i % 256);
+        snprintf(s->name, sizeof(s->name), "Sensor %i", i);
+        s->sequence = 0;
+
+        uint8_t reading[8] = { 0 };
+        int len = cobble_ad_append(s->data, 0, AdType_Flags, &flags, 1);
+        len = cobble_ad_append(s->data, len, AdType_Name, (const uint8_t*)s->name, (int)strlen(s->name));
+        len = cobble_ad_append_manufacturer_data(s->data, len, 0x0059, manufacturer, sizeof(manufacturer));
+        s->readingOffset = len + 4; // After the length, type and 16-bit UUID
+        len = cobble_ad_append_service_data(s->data, len, &ENVIRONMENTAL_SENSING, reading, sizeof(reading));
+        len = cobble_ad_append_services(s->data, len, services, 2);
+        s->length = len;
+    }
+}
+
+static void advertise(sensor* s, int i, bool asScanResult) {
+
+    if (asScanResult) {
+        cobble_event_scanresult(s->name, -60, s->identifier);
+        return;
+    }
+
+    // A new reading: the sequence number and a value
+    uint8_t* reading = s->data + s->readingOffset;
+    s->sequence++;
+    for (int b = 0; b < 4; b++)
+        reading[b] = (uint8_t)(s->sequence >> (8 * b));
+    reading[4] = (uint8_t)i;
+    reading[5] = (uint8_t)(i >> 8);
+    cobble_event_advertisement(s->identifier, -60, s->data, s->length);
+}
+
+static void run(const char* label, ReadMode mode, bool asScanResult, int advertisements) {
+
+    readMode = mode;
+    register_advertisement_cb(asScanResult ? NULL : &on_advertisement);
+    register_scanresult_cb(asScanResult ? &on_scanresult : NULL);
+
+    // Warm up, then measure
+    for (int pass = 0; pass < 2; pass++) {
+        make_sensors();
+        memset(lastSequence, 0, sizeof(lastSequence));
+        delivered = outOfOrder = 0;
+        uint64_t dropped = cobble_queue_dropped_get();
+        uint64_t allocations = bench_allocations();
+        uint64_t start = now_ns();
+
+        for (int i = 0; i < advertisements; i += BATCH) {
+            for (int j = 0; j < BATCH && i + j < advertisements; j++)
+                advertise(&sensors[(i + j) % sensorCount], i + j, asScanResult);
+#ifndef BENCH_REALTIME
+            cobble_queue_process();
+#endif
+        }
+
+        uint64_t elapsed = now_ns() - start;
+        allocations = bench_allocations() - allocations;
+        dropped = cobble_queue_dropped_get() - dropped;
+        if (pass == 0)
+            continue;
+
+        printf("{\"mode\": \"%s\", \"callback\": \"%s\", \"advertisements\": %i, \"bytes\": %i, \"ns_per_advertisement\": %.1f, "
+            "\"allocations_per_advertisement\": %.3f, \"delivered\": %llu, \"dropped\": %llu, \"out_of_order\": %llu}\n",
+            MODE, label, advertisements, sensors[0].length, (double)elapsed / advertisements, (double)allocations / advertisements,
+            (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)outOfOrder);
+        fprintf(stderr, "%-8s %-22s %7.1f ns/advertisement  %6.3f allocations  %8llu delivered  %llu dropped  %llu out of order\n",
+            MODE, label, (double)elapsed / advertisements, (double)allocations / advertisements,
+            (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)outOfOrder);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    int advertisements = (argc > 1) ? atoi(argv[1]) : 1000000;
+    sensorCount = (argc > 2) ? atoi(argv[2]) : 64;
+    if (advertisements < 1 || sensorCount < 1 || sensorCount > MAX_SENSORS) {
+        fprintf(stderr, "Usage: bench_ad_ingest [advertisements] [sensors (up to %i)]\n", MAX_SENSORS);
+        return 1;
+    }
+
+    run("scan result", Read_Nothing, true, advertisements);
+    run("view untouched", Read_Nothing, false, advertisements);
+    run("reading", Read_Reading, false, advertisements);
+    run("every structure", Read_Everything, false, advertisements);
+
+    // Keep the checksum live
+    if (checksum == 42)
+        printf("\n");
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc_count.h"
+
+// glibc exports its allocator under these names, so ours can forward to it
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void __libc_free(void* p);
+
+static volatile uint64_t allocations = 0;
+
+void* malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+void free(void* p) {
+    __libc_free(p);
+}
+
+uint64_t bench_allocations(void) {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,9 @@
+// Counts heap allocations made anywhere in the process (including operator new), by wrapping the glibc allocator
+#ifndef BENCH_ALLOC_COUNT_H
+#define BENCH_ALLOC_COUNT_H
+
+#include <stdint.h>
+
+uint64_t bench_allocations(void);
+
+#endif
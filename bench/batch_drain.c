@@ -0,0 +1,160 @@
+// Notifications taken one call at a time against many at a time, as a binding in another language would take them
+// Values are pushed through cobble_event_updatevalue_c() as a backend would, then taken from the deferred core with a
+// callback per value, with register_batch_cb(), and with cobble_events_drain() at 1, 64 and 1024 records per call.
+//
+// Every call into the application stands for a crossing of the language boundary, which is what costs in Python or C#.
+// Each run reports the time per value, the calls made per value and the heap allocations per value, and checks that every
+// value arrived intact and in order. A cost in nanoseconds can be given to spend on each call, to see how it adds up.
+//
+// Usage: bench_batch_drain [values] [payload bytes] [ns per call]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+
+#include "alloc_count.h"
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+
+// Values pushed between each delivery, well within the queue length and the payload budget
+#define BATCH 1024
+
+#define MAX_PAYLOAD 512
+
+static cobble_char_handle characteristic;
+static int payloadLength = 20;
+static uint64_t callCost = 0;
+
+static uint64_t delivered;
+static uint64_t calls;
+static uint64_t corrupt;
+static uint32_t expected;
+
+static cobble_value_record records[BATCH];
+static uint8_t payload[BATCH * MAX_PAYLOAD];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Stands in for the binding's side of the crossing
+static void cross(void) {
+    calls++;
+    if (callCost == 0)
+        return;
+    uint64_t until = now_ns() + callCost;
+    while (now_ns() < until)
+        ;
+}
+
+// Each value starts with its sequence number
+static void check(cobble_char_handle c, const uint8_t* data, uint32_t len) {
+    uint32_t sequence;
+    memcpy(&sequence, data, sizeof(sequence));
+    if (c != characteristic || len != (uint32_t)payloadLength || sequence != expected)
+        corrupt++;
+    expected = sequence + 1;
+    delivered++;
+}
+
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle c, const uint8_t* data, int len) {
+    (void)connection;
+    cross();
+    check(c, data, (uint32_t)len);
+}
+
+static void on_batch(const cobble_value_record* r, int count, const uint8_t* values) {
+    cross();
+    for (int i = 0; i < count; i++)
+        check(r[i].characteristic, values + r[i].offset, r[i].length);
+}
+
+static void push(int count, uint32_t* sequence) {
+    uint8_t value[MAX_PAYLOAD] = { 0 };
+    for (int i = 0; i < count; i++) {
+        uint32_t s = (*sequence)++;
+        memcpy(value, &s, sizeof(s));
+        cobble_event_updatevalue_c(1, characteristic, value, payloadLength);
+    }
+}
+
+// perCall is 0 to deliver through cobble_queue_process() and the registered callbacks
+static void deliver(int perCall) {
+    if (perCall == 0) {
+        cobble_queue_process();
+        return;
+    }
+
+    int count;
+    do {
+        cross();
+        count = cobble_events_drain(records, perCall, payload, perCall * MAX_PAYLOAD);
+        for (int i = 0; i < count; i++)
+            check(records[i].characteristic, payload + records[i].offset, records[i].length);
+    } while (count > 0);
+}
+
+static void run(const char* label, int perCall, int values) {
+
+    // Warm up, then measure
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t sequence = 0;
+        delivered = calls = corrupt = expected = 0;
+        uint64_t dropped = cobble_queue_dropped_get();
+        uint64_t allocations = bench_allocations();
+        uint64_t start = now_ns();
+
+        for (int i = 0; i < values; i += BATCH) {
+            push((values - i < BATCH) ? values - i : BATCH, &sequence);
+            deliver(perCall);
+        }
+
+        uint64_t elapsed = now_ns() - start;
+        allocations = bench_allocations() - allocations;
+        dropped = cobble_queue_dropped_get() - dropped;
+        if (pass == 0)
+            continue;
+
+        printf("{\"delivery\": \"%s\", \"values\": %i, \"payload\": %i, \"ns_per_call\": %llu, \"ns_per_value\": %.1f, "
+            "\"calls_per_value\": %.4f, \"allocations_per_value\": %.3f, \"delivered\": %llu, \"dropped\": %llu, \"corrupt\": %llu}\n",
+            label, values, payloadLength, (unsigned long long)callCost, (double)elapsed / values, (double)calls / values,
+            (double)allocations / values, (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)corrupt);
+        fprintf(stderr, "%-16s %8.1f ns/value  %7.4f calls/value  %6.3f allocations  %8llu delivered  %llu dropped  %llu corrupt\n",
+            label, (double)elapsed / values, (double)calls / values, (double)allocations / values,
+            (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)corrupt);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    int values = (argc > 1) ? atoi(argv[1]) : 1000000;
+    payloadLength = (argc > 2) ? atoi(argv[2]) : 20;
+    callCost = (argc > 3) ? (uint64_t)atoll(argv[3]) : 0;
+    if (values < 1 || payloadLength < 4 || payloadLength > MAX_PAYLOAD) {
+        fprintf(stderr, "Usage: bench_batch_drain [values] [payload bytes (4 to %i)] [ns per call]\n", MAX_PAYLOAD);
+        return 1;
+    }
+
+    characteristic = cobble_characteristic_handle(CHARACTERISTIC);
+
+    // Callbacks first, as once cobble_events_drain() has been called cobble_queue_process() leaves values to it
+    register_updatevalue_c_cb(&on_updatevalue);
+    run("callback", 0, values);
+    register_updatevalue_c_cb(NULL);
+
+    register_batch_cb(&on_batch);
+    run("batch callback", 0, values);
+    register_batch_cb(NULL);
+
+    run("drain 1", 1, values);
+    run("drain 64", 64, values);
+    run("drain 1024", 1024, values);
+
+    return 0;
+}
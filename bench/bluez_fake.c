@@ -0,0 +1,789 @@
+// End-to-end test of the BlueZ backend against a fake bluetoothd, so that it can be run without Bluetooth hardware
+// It starts a private dbus-daemon, points DBUS_SYSTEM_BUS_ADDRESS at it, and for each scenario runs itself again as a
+// fake org.bluez with one device, "FakeDevice", which has a Battery Level characteristic (read and notify) and a
+// characteristic for writes without response:
+// * acquire:      scan, connect, discovery, a read, notifications through AcquireNotify, writes through AcquireWrite
+//                 (with a socket too small for a burst of writes, so some wait for room in it) and a disconnection
+// * fallback:     the same where BlueZ offers neither AcquireNotify nor AcquireWrite, so notifications arrive as
+//                 PropertiesChanged signals after StartNotify, and writes go by WriteValue
+// * connect_fail: Connect fails, which must be reported as a failed connection
+//
+// The fake counts the calls it was made and what arrived on each socket, and reports them when it is stopped.
+// Results are written to stdout as JSON, and each check to stderr. Exits with an error if any check fails.
+// Needs dbus-daemon on the PATH.
+//
+// Usage: bench_bluez_fake
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+
+#define ADAPTER_PATH "/org/bluez/hci0"
+#define DEVICE_PATH ADAPTER_PATH "/dev_AA_BB_CC_DD_EE_01"
+#define SERVICE_PATH DEVICE_PATH "/service0001"
+#define BATTERY_PATH SERVICE_PATH "/char0002"
+#define WRITE_PATH SERVICE_PATH "/char0003"
+
+#define DEVICE_ADDRESS "AA:BB:CC:DD:EE:01"
+#define DEVICE_NAME "FakeDevice"
+#define BATTERY_CHARACTERISTIC "00002A19-0000-1000-8000-00805F9B34FB"
+#define WRITE_CHARACTERISTIC "C5D70002-C45D-4F12-8693-7EF838E96446"
+
+#define ATT_MTU 185
+
+// Notifications sent on the AcquireNotify socket, and as signals after StartNotify
+#define SOCKET_NOTIFICATIONS 500
+#define SIGNAL_NOTIFICATIONS 5
+
+// Writes sent at once, after the socket has been acquired by a first write. The fake gives the write socket a small
+// send buffer and doesn't read it for a while, so the burst fills it.
+#define WRITE_BURST 24
+#define WRITE_LENGTH 20
+#define WRITE_SOCKET_BUFFER 4096
+#define WRITE_SINK_PAUSE_US 300000
+
+typedef enum {
+    Scenario_Acquire,
+    Scenario_Fallback,
+    Scenario_ConnectFail,
+} Scenario;
+
+static const char* scenarioNames[] = { "acquire", "fallback", "connect_fail" };
+
+/*
+ * The fake bluetoothd
+ */
+
+static DBusConnection* fakeBus;
+static Scenario fakeScenario;
+static bool fakeConnected = false;
+static volatile sig_atomic_t fakeStopping = 0;
+
+// What the fake has been asked to do, reported when it stops
+static int acquireNotifyCalls = 0;
+static int acquireWriteCalls = 0;
+static int startNotifyCalls = 0;
+static int readValueCalls = 0;
+static int writeValueCalls = 0;
+static int writeValueReordered = 0;
+static uint32_t writeValueLatest = 0;
+static volatile int socketWrites = 0;
+static volatile int socketReordered = 0;
+
+static void append_variant(DBusMessageIter* dict, const char* key, int type, const void* value) {
+
+    DBusMessageIter entry, variant;
+    char signature[2] = { (char)type, '\0' };
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_strings(DBusMessageIter* dict, const char* key, const char** values, int count) {
+
+    DBusMessageIter entry, variant, array;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "as", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &array);
+    for (int i = 0; i < count; i++)
+        dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &values[i]);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_bytes(DBusMessageIter* dict, const char* key, const uint8_t* bytes, int length) {
+
+    DBusMessageIter entry, variant, array;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "ay", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "y", &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &bytes, length);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+// Opens an object's entry in GetManagedObjects' reply, with one interface, for its properties to be added to
+static void open_object(DBusMessageIter* objects, DBusMessageIter* object, DBusMessageIter* interfaces, DBusMessageIter* interface,
+    DBusMessageIter* properties, const char* path, const char* name) {
+
+    dbus_message_iter_open_container(objects, DBUS_TYPE_DICT_ENTRY, NULL, object);
+    dbus_message_iter_append_basic(object, DBUS_TYPE_OBJECT_PATH, &path);
+    dbus_message_iter_open_container(object, DBUS_TYPE_ARRAY, "{sa{sv}}", interfaces);
+    dbus_message_iter_open_container(interfaces, DBUS_TYPE_DICT_ENTRY, NULL, interface);
+    dbus_message_iter_append_basic(interface, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_open_container(interface, DBUS_TYPE_ARRAY, "{sv}", properties);
+}
+
+static void close_object(DBusMessageIter* objects, DBusMessageIter* object, DBusMessageIter* interfaces, DBusMessageIter* interface,
+    DBusMessageIter* properties) {
+
+    dbus_message_iter_close_container(interface, properties);
+    dbus_message_iter_close_container(interfaces, interface);
+    dbus_message_iter_close_container(object, interfaces);
+    dbus_message_iter_close_container(objects, object);
+}
+
+static DBusMessage* managed_objects(DBusMessage* call) {
+
+    DBusMessage* reply = dbus_message_new_method_return(call);
+    DBusMessageIter iter, objects, object, interfaces, interface, properties;
+    dbus_bool_t yes = TRUE, no = FALSE, connected = fakeConnected;
+    bool acquire = (fakeScenario != Scenario_Fallback);
+    const char* s;
+    uint16_t mtu = ATT_MTU;
+
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects);
+
+    open_object(&objects, &object, &interfaces, &interface, &properties, ADAPTER_PATH, "org.bluez.Adapter1");
+    append_variant(&properties, "Powered", DBUS_TYPE_BOOLEAN, &yes);
+    close_object(&objects, &object, &interfaces, &interface, &properties);
+
+    open_object(&objects, &object, &interfaces, &interface, &properties, DEVICE_PATH, "org.bluez.Device1");
+    s = DEVICE_ADDRESS;
+    append_variant(&properties, "Address", DBUS_TYPE_STRING, &s);
+    s = DEVICE_NAME;
+    append_variant(&properties, "Name", DBUS_TYPE_STRING, &s);
+    append_variant(&properties, "Connected", DBUS_TYPE_BOOLEAN, &connected);
+    append_variant(&properties, "ServicesResolved", DBUS_TYPE_BOOLEAN, &connected);
+    const char* uuids[] = { "0000180f-0000-1000-8000-00805f9b34fb" };
+    append_strings(&properties, "UUIDs", uuids, 1);
+    close_object(&objects, &object, &interfaces, &interface, &properties);
+
+    if (fakeConnected) {
+        // Characteristics come before their service, as BlueZ doesn't promise any order
+        open_object(&objects, &object, &interfaces, &interface, &properties, BATTERY_PATH, "org.bluez.GattCharacteristic1");
+        s = "00002a19-0000-1000-8000-00805f9b34fb";
+        append_variant(&properties, "UUID", DBUS_TYPE_STRING, &s);
+        s = SERVICE_PATH;
+        append_variant(&properties, "Service", DBUS_TYPE_OBJECT_PATH, &s);
+        const char* batteryFlags[] = { "read", "notify" };
+        append_strings(&properties, "Flags", batteryFlags, 2);
+        if (acquire)
+            append_variant(&properties, "NotifyAcquired", DBUS_TYPE_BOOLEAN, &no);
+        append_variant(&properties, "MTU", DBUS_TYPE_UINT16, &mtu);
+        close_object(&objects, &object, &interfaces, &interface, &properties);
+
+        open_object(&objects, &object, &interfaces, &interface, &properties, WRITE_PATH, "org.bluez.GattCharacteristic1");
+        s = "c5d70002-c45d-4f12-8693-7ef838e96446";
+        append_variant(&properties, "UUID", DBUS_TYPE_STRING, &s);
+        s = SERVICE_PATH;
+        append_variant(&properties, "Service", DBUS_TYPE_OBJECT_PATH, &s);
+        const char* writeFlags[] = { "write-without-response" };
+        append_strings(&properties, "Flags", writeFlags, 1);
+        if (acquire)
+            append_variant(&properties, "WriteAcquired", DBUS_TYPE_BOOLEAN, &no);
+        close_object(&objects, &object, &interfaces, &interface, &properties);
+
+        open_object(&objects, &object, &interfaces, &interface, &properties, SERVICE_PATH, "org.bluez.GattService1");
+        s = "0000180f-0000-1000-8000-00805f9b34fb";
+        append_variant(&properties, "UUID", DBUS_TYPE_STRING, &s);
+        close_object(&objects, &object, &interfaces, &interface, &properties);
+    }
+
+    dbus_message_iter_close_container(&iter, &objects);
+    return reply;
+}
+
+static void send_properties_changed(const char* path, const char* interfaceName, void (*append)(DBusMessageIter*, const void*), const void* arg) {
+
+    DBusMessage* signal = dbus_message_new_signal(path, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+    DBusMessageIter iter, properties, invalidated;
+
+    dbus_message_iter_init_append(signal, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interfaceName);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &properties);
+    append(&properties, arg);
+    dbus_message_iter_close_container(&iter, &properties);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+    dbus_message_iter_close_container(&iter, &invalidated);
+
+    dbus_connection_send(fakeBus, signal, NULL);
+    dbus_message_unref(signal);
+}
+
+static void append_rssi(DBusMessageIter* properties, const void* arg) {
+    int16_t rssi = *(const int16_t*)arg;
+    append_variant(properties, "RSSI", DBUS_TYPE_INT16, &rssi);
+}
+
+static void append_connected(DBusMessageIter* properties, const void* arg) {
+    dbus_bool_t connected = fakeConnected;
+    (void)arg;
+    append_variant(properties, "Connected", DBUS_TYPE_BOOLEAN, &connected);
+    append_variant(properties, "ServicesResolved", DBUS_TYPE_BOOLEAN, &connected);
+}
+
+static void append_value(DBusMessageIter* properties, const void* arg) {
+    uint32_t sequence = *(const uint32_t*)arg;
+    uint8_t value[4];
+    memcpy(value, &sequence, sizeof(value));
+    append_bytes(properties, "Value", value, sizeof(value));
+}
+
+static void reply_empty(DBusMessage* call) {
+    DBusMessage* reply = dbus_message_new_method_return(call);
+    dbus_connection_send(fakeBus, reply, NULL);
+    dbus_message_unref(reply);
+}
+
+static void* notify_socket(void* arg) {
+
+    int fd = (int)(intptr_t)arg;
+    uint8_t value[20] = { 0 };
+
+    for (uint32_t sequence = 1; sequence <= SOCKET_NOTIFICATIONS; sequence++) {
+        memcpy(value, &sequence, sizeof(sequence));
+        if (send(fd, value, sizeof(value), MSG_NOSIGNAL) != sizeof(value))
+            break;
+        if (sequence % 64 == 0)
+            usleep(1000);
+    }
+    // Left open, as a notification socket stays open until the subscription ends
+    return NULL;
+}
+
+// Reads writes from the socket, after leaving it unread for long enough for a burst to fill it
+static void* write_socket(void* arg) {
+
+    int fd = (int)(intptr_t)arg;
+    uint8_t value[600];
+    uint32_t latest = writeValueLatest;
+    ssize_t n;
+
+    usleep(WRITE_SINK_PAUSE_US);
+    while ((n = recv(fd, value, sizeof(value), 0)) > 0) {
+        uint32_t sequence;
+        memcpy(&sequence, value, sizeof(sequence));
+        if (sequence <= latest)
+            __atomic_add_fetch(&socketReordered, 1, __ATOMIC_RELAXED);
+        latest = sequence;
+        __atomic_add_fetch(&socketWrites, 1, __ATOMIC_RELEASE);
+    }
+    close(fd);
+    return NULL;
+}
+
+// AcquireNotify and AcquireWrite both hand back one end of a socket pair, with the MTU
+static void acquire(DBusMessage* call, void* (*run)(void*), int sendBuffer) {
+
+    int fds[2];
+    uint16_t mtu = ATT_MTU;
+    pthread_t thread;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        DBusMessage* reply = dbus_message_new_error(call, "org.bluez.Error.Failed", strerror(errno));
+        dbus_connection_send(fakeBus, reply, NULL);
+        dbus_message_unref(reply);
+        return;
+    }
+    // bluetoothd's sockets are non-blocking, so a full one fails with EAGAIN
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    if (sendBuffer > 0)
+        setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+
+    DBusMessage* reply = dbus_message_new_method_return(call);
+    dbus_message_append_args(reply, DBUS_TYPE_UNIX_FD, &fds[1], DBUS_TYPE_UINT16, &mtu, DBUS_TYPE_INVALID);
+    dbus_connection_send(fakeBus, reply, NULL);
+    dbus_message_unref(reply);
+    close(fds[1]);
+
+    pthread_create(&thread, NULL, run, (void*)(intptr_t)fds[0]);
+    pthread_detach(thread);
+}
+
+static void write_value(DBusMessage* call) {
+
+    DBusMessageIter iter, array;
+    const uint8_t* value;
+    int length;
+
+    dbus_message_iter_init(call, &iter);
+    dbus_message_iter_recurse(&iter, &array);
+    dbus_message_iter_get_fixed_array(&array, &value, &length);
+
+    if (length >= 4) {
+        uint32_t sequence;
+        memcpy(&sequence, value, sizeof(sequence));
+        if (sequence <= writeValueLatest)
+            writeValueReordered++;
+        writeValueLatest = sequence;
+    }
+    writeValueCalls++;
+
+    // Writes without response are sent without asking for a reply
+    if (!dbus_message_get_no_reply(call))
+        reply_empty(call);
+}
+
+static DBusHandlerResult fake_handler(DBusConnection* bus, DBusMessage* call, void* data) {
+
+    (void)bus;
+    (void)data;
+
+    if (dbus_message_get_type(call) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    const char* member = dbus_message_get_member(call);
+    const char* path = dbus_message_get_path(call);
+
+    if (strcmp(member, "GetManagedObjects") == 0) {
+        DBusMessage* reply = managed_objects(call);
+        dbus_connection_send(fakeBus, reply, NULL);
+        dbus_message_unref(reply);
+    } else if (strcmp(member, "StartDiscovery") == 0) {
+        reply_empty(call);
+        int16_t rssi = -42;
+        send_properties_changed(DEVICE_PATH, "org.bluez.Device1", append_rssi, &rssi);
+    } else if (strcmp(member, "Connect") == 0) {
+        if (fakeScenario == Scenario_ConnectFail) {
+            DBusMessage* reply = dbus_message_new_error(call, "org.bluez.Error.Failed", "Page Timeout");
+            dbus_connection_send(fakeBus, reply, NULL);
+            dbus_message_unref(reply);
+        } else {
+            fakeConnected = true;
+            reply_empty(call);
+            send_properties_changed(DEVICE_PATH, "org.bluez.Device1", append_connected, NULL);
+        }
+    } else if (strcmp(member, "Disconnect") == 0) {
+        fakeConnected = false;
+        reply_empty(call);
+        send_properties_changed(DEVICE_PATH, "org.bluez.Device1", append_connected, NULL);
+    } else if (strcmp(member, "ReadValue") == 0) {
+        DBusMessage* reply = dbus_message_new_method_return(call);
+        DBusMessageIter iter, array;
+        const uint8_t value[] = { 0x55, 0x66, 0x77 };
+        const uint8_t* v = value;
+        readValueCalls++;
+        dbus_message_iter_init_append(reply, &iter);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "y", &array);
+        dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &v, sizeof(value));
+        dbus_message_iter_close_container(&iter, &array);
+        dbus_connection_send(fakeBus, reply, NULL);
+        dbus_message_unref(reply);
+    } else if (strcmp(member, "AcquireNotify") == 0 && fakeScenario != Scenario_Fallback) {
+        acquireNotifyCalls++;
+        acquire(call, notify_socket, 0);
+    } else if (strcmp(member, "AcquireWrite") == 0 && fakeScenario != Scenario_Fallback) {
+        acquireWriteCalls++;
+        acquire(call, write_socket, WRITE_SOCKET_BUFFER);
+    } else if (strcmp(member, "StartNotify") == 0) {
+        startNotifyCalls++;
+        reply_empty(call);
+        for (uint32_t sequence = 1; sequence <= SIGNAL_NOTIFICATIONS; sequence++)
+            send_properties_changed(path, "org.bluez.GattCharacteristic1", append_value, &sequence);
+    } else if (strcmp(member, "WriteValue") == 0) {
+        write_value(call);
+    } else if (strcmp(member, "SetDiscoveryFilter") == 0 || strcmp(member, "StopDiscovery") == 0 || strcmp(member, "StopNotify") == 0) {
+        reply_empty(call);
+    } else {
+        DBusMessage* reply = dbus_message_new_error(call, "org.bluez.Error.NotSupported", member);
+        dbus_connection_send(fakeBus, reply, NULL);
+        dbus_message_unref(reply);
+    }
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void on_fake_stop(int signal) {
+    (void)signal;
+    fakeStopping = 1;
+}
+
+// Runs until SIGTERM, then writes what it saw to the report pipe
+static int run_fake(Scenario scenario, int reportFd) {
+
+    DBusError err;
+    char report[256];
+
+    fakeScenario = scenario;
+    signal(SIGTERM, on_fake_stop);
+    dbus_error_init(&err);
+
+    fakeBus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+    if (fakeBus == NULL || dbus_bus_request_name(fakeBus, "org.bluez", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "The fake could not take org.bluez: %s\n", err.message);
+        return 1;
+    }
+    dbus_connection_add_filter(fakeBus, fake_handler, NULL, NULL);
+
+    if (write(reportFd, "ready\n", 6) != 6)
+        return 1;
+
+    while (!fakeStopping && dbus_connection_read_write_dispatch(fakeBus, 50))
+        ;
+
+    // Anything still in a write socket
+    usleep(100000);
+
+    int length = snprintf(report, sizeof(report), "%i %i %i %i %i %i %i %i\n", acquireNotifyCalls, acquireWriteCalls,
+        startNotifyCalls, readValueCalls, writeValueCalls, writeValueReordered,
+        __atomic_load_n(&socketWrites, __ATOMIC_ACQUIRE), __atomic_load_n(&socketReordered, __ATOMIC_ACQUIRE));
+    if (write(reportFd, report, length) != length)
+        return 1;
+    return 0;
+}
+
+/*
+ * The application, using the backend
+ */
+
+typedef struct {
+    int acquireNotifyCalls;
+    int acquireWriteCalls;
+    int startNotifyCalls;
+    int readValueCalls;
+    int writeValueCalls;
+    int writeValueReordered;
+    int socketWrites;
+    int socketReordered;
+} fake_report;
+
+static int scanResults = 0;
+static int connected = 0;
+static int connectFailed = 0;
+static int disconnected = 0;
+static int characteristicsFound = 0;
+static int discoveryComplete = 0;
+static int reads = 0;
+static int notifications = 0;
+static int notificationsReordered = 0;
+static uint32_t notificationLatest = 0;
+
+static int failures = 0;
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+    (void)rssi;
+    if (name != NULL && strcmp(name, DEVICE_NAME) == 0 && strcmp(identifier, DEVICE_ADDRESS) == 0)
+        scanResults++;
+}
+
+static void on_connectionstatus(const char* identifier, int status) {
+    if (strcmp(identifier, DEVICE_ADDRESS) != 0)
+        return;
+    if (status == ConnectionStatus_DidConnect)
+        connected++;
+    else if (status == ConnectionStatus_DidConnectFailed)
+        connectFailed++;
+    else if (status == ConnectionStatus_DidDisconnect)
+        disconnected++;
+}
+
+static void on_characteristicdiscovered(const char* service, const char* characteristic) {
+    (void)service;
+    if (strcmp(characteristic, BATTERY_CHARACTERISTIC) == 0 || strcmp(characteristic, WRITE_CHARACTERISTIC) == 0)
+        characteristicsFound++;
+}
+
+static void on_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+    (void)connection;
+    (void)services;
+    (void)characteristics;
+    (void)elapsedMs;
+    discoveryComplete++;
+}
+
+// The read's reply is three bytes, and each notification carries its sequence number
+static void on_updatevalue(const char* uuid, const uint8_t* data, int len) {
+
+    if (strcmp(uuid, BATTERY_CHARACTERISTIC) != 0)
+        return;
+
+    if (len == 3 && data[0] == 0x55 && data[1] == 0x66 && data[2] == 0x77) {
+        reads++;
+        return;
+    }
+
+    uint32_t sequence;
+    if (len < 4)
+        return;
+    memcpy(&sequence, data, sizeof(sequence));
+    if (sequence <= notificationLatest)
+        notificationsReordered++;
+    notificationLatest = sequence;
+    notifications++;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Takes events until the counter reaches the target, or the time runs out
+static bool pump_until(const int* counter, int target, int timeoutMs) {
+    uint64_t until = now_ms() + timeoutMs;
+    do {
+        cobble_queue_wait(10);
+        cobble_queue_process();
+        if (counter != NULL && *counter >= target)
+            return true;
+    } while (now_ms() < until);
+    return counter == NULL;
+}
+
+static void check(const char* scenario, const char* what, bool passed) {
+    fprintf(stderr, "%-13s %-46s %s\n", scenario, what, passed ? "ok" : "FAILED");
+    if (!passed)
+        failures++;
+}
+
+static void write_numbered(uint32_t sequence) {
+    uint8_t value[WRITE_LENGTH] = { 0 };
+    memcpy(value, &sequence, sizeof(sequence));
+    cobble_write(WRITE_CHARACTERISTIC, value, sizeof(value));
+}
+
+static pid_t start_fake(Scenario scenario, int* reportFd) {
+
+    int fds[2];
+    char fd[16];
+    char line[16];
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(fds[1], F_SETFD, 0);
+        snprintf(fd, sizeof(fd), "%i", fds[1]);
+        execl("/proc/self/exe", "bench_bluez_fake", "--fake", scenarioNames[scenario], fd, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    FILE* f = fdopen(fds[0], "r");
+    if (pid < 0 || fgets(line, sizeof(line), f) == NULL || strcmp(line, "ready\n") != 0) {
+        fclose(f);
+        return -1;
+    }
+    *reportFd = dup(fds[0]);
+    fclose(f);
+    return pid;
+}
+
+static bool stop_fake(pid_t pid, int reportFd, fake_report* r) {
+
+    char line[256];
+    bool read = false;
+
+    kill(pid, SIGTERM);
+    FILE* f = fdopen(reportFd, "r");
+    if (fgets(line, sizeof(line), f) != NULL) {
+        read = sscanf(line, "%i %i %i %i %i %i %i %i", &r->acquireNotifyCalls, &r->acquireWriteCalls, &r->startNotifyCalls,
+            &r->readValueCalls, &r->writeValueCalls, &r->writeValueReordered, &r->socketWrites, &r->socketReordered) == 8;
+    }
+    fclose(f);
+    waitpid(pid, NULL, 0);
+    return read;
+}
+
+static void run(Scenario scenario) {
+
+    const char* name = scenarioNames[scenario];
+    fake_report report;
+    int reportFd;
+
+    scanResults = connected = connectFailed = disconnected = 0;
+    characteristicsFound = discoveryComplete = reads = 0;
+    notifications = notificationsReordered = 0;
+    notificationLatest = 0;
+    memset(&report, 0, sizeof(report));
+    int failuresBefore = failures;
+
+    pid_t fake = start_fake(scenario, &reportFd);
+    if (fake < 0) {
+        check(name, "fake bluetoothd started", false);
+        return;
+    }
+
+    cobble_init();
+    check(name, "initialised", cobble_status_wait(Initialised, 2000) == Initialised);
+
+    cobble_scan_start(NULL);
+    check(name, "scan result", pump_until(&scanResults, 1, 2000));
+    cobble_scan_stop();
+
+    cobble_connect(DEVICE_ADDRESS);
+    if (scenario == Scenario_ConnectFail) {
+        check(name, "connection failure reported", pump_until(&connectFailed, 1, 2000));
+        check(name, "no connection reported", connected == 0);
+    } else {
+        check(name, "connected", pump_until(&connected, 1, 2000));
+        check(name, "discovery complete", pump_until(&discoveryComplete, 1, 2000));
+        check(name, "both characteristics found", characteristicsFound == 2);
+
+        cobble_read(BATTERY_CHARACTERISTIC);
+        check(name, "read", pump_until(&reads, 1, 2000));
+
+        int expected = (scenario == Scenario_Acquire) ? SOCKET_NOTIFICATIONS : SIGNAL_NOTIFICATIONS;
+        cobble_subscribe(BATTERY_CHARACTERISTIC);
+        check(name, "every notification", pump_until(&notifications, expected, 5000) && notifications == expected);
+        check(name, "notifications in order", notificationsReordered == 0);
+
+        // The first write asks for a socket (where there is one) and goes by WriteValue while waiting for it
+        write_numbered(1);
+        pump_until(NULL, 0, 100);
+        for (uint32_t sequence = 2; sequence <= WRITE_BURST + 1; sequence++)
+            write_numbered(sequence);
+        pump_until(NULL, 0, WRITE_SINK_PAUSE_US / 1000 + 500);
+
+        cobble_disconnect();
+        check(name, "disconnected", pump_until(&disconnected, 1, 2000));
+    }
+
+    cobble_deinit();
+
+    if (!stop_fake(fake, reportFd, &report)) {
+        check(name, "fake bluetoothd report", false);
+        return;
+    }
+
+    if (scenario == Scenario_Acquire) {
+        check(name, "AcquireNotify used", report.acquireNotifyCalls == 1 && report.startNotifyCalls == 0);
+        check(name, "socket acquired once, and kept when full", report.acquireWriteCalls == 1);
+        check(name, "only the first write by WriteValue", report.writeValueCalls == 1);
+        check(name, "the rest by the socket, in order", report.socketWrites == WRITE_BURST && report.socketReordered == 0);
+    } else if (scenario == Scenario_Fallback) {
+        check(name, "StartNotify used", report.startNotifyCalls == 1 && report.acquireNotifyCalls == 0);
+        check(name, "every write by WriteValue, in order",
+            report.writeValueCalls == WRITE_BURST + 1 && report.writeValueReordered == 0 && report.socketWrites == 0);
+    }
+    check(name, "one ReadValue", report.readValueCalls == (scenario == Scenario_ConnectFail ? 0 : 1));
+
+    printf("{\"scenario\": \"%s\", \"scan_results\": %i, \"connected\": %i, \"connect_failed\": %i, \"characteristics\": %i, "
+        "\"notifications\": %i, \"acquire_notify\": %i, \"acquire_write\": %i, \"start_notify\": %i, \"write_value\": %i, "
+        "\"socket_writes\": %i, \"reordered\": %i, \"passed\": %s}\n",
+        name, scanResults, connected, connectFailed, characteristicsFound, notifications, report.acquireNotifyCalls,
+        report.acquireWriteCalls, report.startNotifyCalls, report.writeValueCalls, report.socketWrites,
+        notificationsReordered + report.writeValueReordered + report.socketReordered, failures == failuresBefore ? "true" : "false");
+}
+
+/*
+ * The private bus
+ */
+
+static pid_t start_bus(char* directory) {
+
+    char config[600];
+    char address[512];
+    char printAddress[32];
+    int fds[2];
+
+    if (mkdtemp(directory) == NULL)
+        return -1;
+
+    snprintf(config, sizeof(config), "%s/bus.conf", directory);
+    FILE* f = fopen(config, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\" "
+        "\"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+        "<busconfig>\n"
+        "  <type>session</type>\n"
+        "  <listen>unix:path=%s/bus</listen>\n"
+        "  <auth>EXTERNAL</auth>\n"
+        "  <policy context=\"default\"><allow send_destination=\"*\"/><allow receive_sender=\"*\"/>"
+        "<allow own=\"*\"/><allow user=\"*\"/></policy>\n"
+        "</busconfig>\n", directory);
+    fclose(f);
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(fds[1], F_SETFD, 0);
+        snprintf(config, sizeof(config), "--config-file=%s/bus.conf", directory);
+        snprintf(printAddress, sizeof(printAddress), "--print-address=%i", fds[1]);
+        execlp("dbus-daemon", "dbus-daemon", config, "--nofork", printAddress, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    f = fdopen(fds[0], "r");
+    if (pid < 0 || fgets(address, sizeof(address), f) == NULL) {
+        fclose(f);
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+        return -1;
+    }
+    fclose(f);
+
+    address[strcspn(address, "\n")] = '\0';
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", address, 1);
+    return pid;
+}
+
+static void stop_bus(pid_t pid, const char* directory) {
+
+    char path[600];
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    snprintf(path, sizeof(path), "%s/bus.conf", directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/bus", directory);
+    unlink(path);
+    rmdir(directory);
+}
+
+int main(int argc, char** argv) {
+
+    char directory[] = "/tmp/cobble_bluez_fake.XXXXXX";
+
+    if (argc == 4 && strcmp(argv[1], "--fake") == 0) {
+        for (int s = 0; s <= Scenario_ConnectFail; s++) {
+            if (strcmp(argv[2], scenarioNames[s]) == 0)
+                return run_fake((Scenario)s, atoi(argv[3]));
+        }
+        return 1;
+    }
+
+    pid_t bus = start_bus(directory);
+    if (bus < 0) {
+        fprintf(stderr, "Could not start a private dbus-daemon (is it on the PATH?)\n");
+        return 1;
+    }
+
+    register_scanresult_cb(&on_scanresult);
+    register_connectionstatus_cb(&on_connectionstatus);
+    register_characteristicdiscovered_cb(&on_characteristicdiscovered);
+    register_discoverycomplete_cb(&on_discoverycomplete);
+    register_updatevalue_cb(&on_updatevalue);
+
+    run(Scenario_Acquire);
+    run(Scenario_Fallback);
+    run(Scenario_ConnectFail);
+
+    stop_bus(bus, directory);
+
+    fprintf(stderr, "%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+// Benchmark for the two ways the BlueZ backend receives notifications
+// * socket: values arrive on a SOCK_SEQPACKET socketpair, as from AcquireNotify, and are received straight into the event
+//   queue's payload pool by bluez_notify_recv()
+// * copy:   the same socket, but each value is received into a local buffer and then copied into the queue
+// * dbus:   values arrive as PropertiesChanged signals over a peer-to-peer D-Bus connection and are parsed by
+//   bluez_notify_signal(). The real system bus adds a hop through dbus-daemon, so this flatters the D-Bus route.
+// In each case a producer thread plays the part of bluetoothd, and the main thread delivers values with
+// cobble_queue_process() as an application would. Reports messages/sec and heap allocations per message (both threads).
+// Then values are received by bluez_notify_recv() while the application doesn't take them, so the queue backs up, and
+// reports how many were queued and how many dropped once it was full.
+//
+// Usage: bluez_notify [messages] [payload bytes]
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+#include "../src/platforms/bluez/BlueZNotify.h"
+
+#include "alloc_count.h"
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+#define CHARACTERISTIC_PATH "/org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF/service0010/char0011"
+
+// Largest value the socket routes expect, as for an MTU of 247
+#define CAPACITY 244
+
+// Values sent while the queue isn't taken, more than it can hold
+#define BACKLOG_VALUES 8192
+
+static int messages;
+static int payloadLength;
+static cobble_char_handle handle;
+
+static volatile uint64_t delivered = 0;
+
+static void on_updatevalue(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    (void)characteristic;
+    (void)data;
+    (void)len;
+    delivered++;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Socket routes
+ */
+
+typedef struct {
+    int fd;
+    int count;
+} producerArgs;
+
+static void* socket_producer(void* arg) {
+
+    producerArgs* args = (producerArgs*)arg;
+    uint8_t* payload = calloc(payloadLength, 1);
+
+    for (int i = 0; i < args->count; i++) {
+        payload[0] = (uint8_t)i;
+        if (send(args->fd, payload, payloadLength, 0) != payloadLength) {
+            perror("send");
+            break;
+        }
+    }
+
+    free(payload);
+    return NULL;
+}
+
+// The receive loop the backend used before values went straight into the pool
+static int recv_copy(int fd, cobble_char_handle characteristic) {
+
+    uint8_t buffer[512];
+    int count;
+
+    for (count = 0; count < BLUEZ_NOTIFY_BATCH; count++) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len <= 0)
+            return (len < 0 && errno == EAGAIN) ? count : -1;
+        cobble_event_updatevalue_h(characteristic, buffer, (int)len);
+    }
+
+    return count;
+}
+
+static void run_socket(bool zeroCopy) {
+
+    int fds[2];
+    pthread_t producer;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    producerArgs args = { fds[1], messages };
+    pthread_create(&producer, NULL, socket_producer, &args);
+
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    while (delivered < (uint64_t)messages) {
+        if (poll(&pfd, 1, 1000) <= 0)
+            break;
+        int n = zeroCopy ? bluez_notify_recv(fds[0], COBBLE_CONNECTION_NONE, handle, CAPACITY) : recv_copy(fds[0], handle);
+        cobble_queue_process();
+        if (n < 0)
+            break;
+    }
+
+    pthread_join(producer, NULL);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Values are taken off the socket as the backend's event loop does, but not from the queue until the producer is done
+static void run_backlog(void) {
+
+    int fds[2];
+    pthread_t producer;
+    uint64_t before;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    delivered = 0;
+    uint64_t dropped = cobble_queue_dropped_get();
+    producerArgs args = { fds[1], BACKLOG_VALUES };
+    pthread_create(&producer, NULL, socket_producer, &args);
+
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    while (poll(&pfd, 1, 200) > 0 && bluez_notify_recv(fds[0], COBBLE_CONNECTION_NONE, handle, CAPACITY) >= 0)
+        ;
+    pthread_join(producer, NULL);
+
+    do {
+        before = delivered;
+        cobble_queue_process();
+    } while (delivered != before);
+    dropped = cobble_queue_dropped_get() - dropped;
+
+    printf("%-7s %i sent while the queue wasn't taken: %llu queued, %llu dropped\n", "backlog", BACKLOG_VALUES,
+        (unsigned long long)delivered, (unsigned long long)dropped);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * D-Bus route
+ */
+
+static DBusWatch* serverWatch;
+static DBusConnection* serverSide;
+
+static dbus_bool_t add_server_watch(DBusWatch* watch, void* data) {
+    (void)data;
+    if (dbus_watch_get_flags(watch) & DBUS_WATCH_READABLE)
+        serverWatch = watch;
+    return TRUE;
+}
+
+static void remove_server_watch(DBusWatch* watch, void* data) {
+    (void)data;
+    if (serverWatch == watch)
+        serverWatch = NULL;
+}
+
+static void new_connection(DBusServer* server, DBusConnection* conn, void* data) {
+    (void)server;
+    (void)data;
+    serverSide = dbus_connection_ref(conn);
+}
+
+static DBusHandlerResult on_signal(DBusConnection* conn, DBusMessage* msg, void* data) {
+    (void)conn;
+    (void)data;
+    if (dbus_message_is_signal(msg, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged")) {
+        bluez_notify_signal(msg, COBBLE_CONNECTION_NONE, handle);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+// Build each signal as bluetoothd does: PropertiesChanged("org.bluez.GattCharacteristic1", {"Value": <ay>}, [])
+static DBusMessage* value_signal(const uint8_t* payload) {
+
+    DBusMessage* msg = dbus_message_new_signal(CHARACTERISTIC_PATH, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+    DBusMessageIter iter, changed, entry, variant, array, invalidated;
+    const char* interface = "org.bluez.GattCharacteristic1";
+    const char* key = "Value";
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &changed);
+    dbus_message_iter_open_container(&changed, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "ay", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "y", &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &payload, payloadLength);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(&changed, &entry);
+    dbus_message_iter_close_container(&iter, &changed);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+    dbus_message_iter_close_container(&iter, &invalidated);
+
+    return msg;
+}
+
+static void* dbus_producer(void* arg) {
+
+    DBusConnection* conn = (DBusConnection*)arg;
+    uint8_t* payload = calloc(payloadLength, 1);
+
+    for (int i = 0; i < messages; i++) {
+        payload[0] = (uint8_t)i;
+        DBusMessage* msg = value_signal(payload);
+        dbus_connection_send(conn, msg, NULL);
+        dbus_message_unref(msg);
+        // Don't let the outgoing queue grow without limit
+        if ((i & 63) == 63)
+            dbus_connection_flush(conn);
+    }
+
+    dbus_connection_flush(conn);
+    free(payload);
+    return NULL;
+}
+
+static void run_dbus(void) {
+
+    DBusError err;
+    dbus_error_init(&err);
+
+    DBusServer* server = dbus_server_listen("unix:tmpdir=/tmp", &err);
+    if (server == NULL) {
+        printf("Could not listen: %s\n", err.message);
+        exit(1);
+    }
+    dbus_server_set_watch_functions(server, add_server_watch, remove_server_watch, NULL, NULL, NULL);
+    dbus_server_set_new_connection_function(server, new_connection, NULL, NULL);
+
+    char* address = dbus_server_get_address(server);
+    DBusConnection* producerSide = dbus_connection_open_private(address, &err);
+    dbus_free(address);
+    if (producerSide == NULL) {
+        printf("Could not connect: %s\n", err.message);
+        exit(1);
+    }
+
+    // Accept the connection
+    while (serverSide == NULL && serverWatch != NULL) {
+        struct pollfd pfd = { dbus_watch_get_unix_fd(serverWatch), POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) > 0)
+            dbus_watch_handle(serverWatch, DBUS_WATCH_READABLE);
+    }
+    dbus_connection_add_filter(serverSide, on_signal, NULL, NULL);
+
+    // Sending blocks until authentication has finished, which needs the server side to be serviced from another thread
+    pthread_t producer;
+    pthread_create(&producer, NULL, dbus_producer, producerSide);
+
+    while (delivered < (uint64_t)messages && dbus_connection_read_write_dispatch(serverSide, 1000)) {
+        while (dbus_connection_dispatch(serverSide) == DBUS_DISPATCH_DATA_REMAINS)
+            ;
+        cobble_queue_process();
+    }
+
+    pthread_join(producer, NULL);
+
+    dbus_connection_close(producerSide);
+    dbus_connection_unref(producerSide);
+    dbus_connection_close(serverSide);
+    dbus_connection_unref(serverSide);
+    dbus_server_disconnect(server);
+    dbus_server_unref(server);
+}
+
+static void report(const char* name, void (*run)(void)) {
+
+    delivered = 0;
+
+    uint64_t allocs = bench_allocations();
+    uint64_t start = now_ns();
+
+    run();
+
+    uint64_t elapsed = now_ns() - start;
+    allocs = bench_allocations() - allocs;
+
+    printf("%-7s %llu/%i delivered, %.0f messages/sec, %.2f allocations/message\n", name, (unsigned long long)delivered, messages,
+        (double)delivered * 1e9 / elapsed, (double)allocs / messages);
+}
+
+static void socket_zero_copy(void) {
+    run_socket(true);
+}
+
+static void socket_copy(void) {
+    run_socket(false);
+}
+
+int main(int argc, char** argv) {
+
+    messages = (argc > 1) ? atoi(argv[1]) : 200000;
+    payloadLength = (argc > 2) ? atoi(argv[2]) : 20;
+
+    if (payloadLength < 1 || payloadLength > CAPACITY) {
+        printf("Payload must be 1 to %i bytes\n", CAPACITY);
+        return 1;
+    }
+
+    dbus_threads_init_default();
+
+    handle = cobble_characteristic_handle(CHARACTERISTIC);
+    register_updatevalue_h_cb(&on_updatevalue);
+
+    printf("bluez_notify: %i messages, %i byte payload\n", messages, payloadLength);
+    report("socket", socket_zero_copy);
+    report("copy", socket_copy);
+    report("dbus", run_dbus);
+    run_backlog();
+
+    return 0;
+}
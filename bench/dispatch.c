@@ -0,0 +1,243 @@
+// Notifications from several connections with a slow consumer, sent from one application thread and from the dispatcher
+// A thread stands in for a backend, sending values to each connection in turn, with a write completing every so often,
+// while the application spends some time on each value, either working (spinning) or waiting (sleeping, as it would
+// for a file or a socket). The events are taken by one thread calling cobble_queue_wait() and cobble_queue_process(),
+// then by cobble_dispatch_start() with 1, 2 and 4 threads (or the counts given).
+//
+// Each run reports the values per second, their latency from being sent, and the CPU used. Every value carries its
+// position on its connection, so each one delivered out of order on its connection is counted, along with any callback
+// which began while another for the same connection was still running. Results are written to stdout as JSON, and a
+// summary to stderr.
+//
+// Usage: bench_dispatch [connections] [values per connection] [us per value] [spin|sleep] [threads...]
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+
+#define MAX_CONNECTIONS 16
+#define MAX_THREAD_COUNTS 8
+
+// Events sent but not yet delivered, kept low enough that the write completions fit in their queue
+#define IN_FLIGHT 256
+
+// A write completes after this many values on each connection
+#define WRITE_EVERY 16
+
+static cobble_char_handle characteristic;
+static cobble_conn_handle connections[MAX_CONNECTIONS];
+static int connectionCount = 8;
+static int valuesPerConnection = 2000;
+static int workUs = 50;
+static int sleeping = 0;
+
+static volatile uint32_t sent = 0;
+static volatile uint32_t delivered = 0;
+static uint64_t droppedBefore;
+
+// Touched only by the callbacks for one connection, which the dispatcher never runs at once
+static uint32_t latest[MAX_CONNECTIONS];
+static volatile uint32_t inside[MAX_CONNECTIONS];
+static volatile uint64_t reordered = 0;
+static volatile uint64_t overlapped = 0;
+
+static uint32_t* samples;
+static volatile uint32_t sampleCount = 0;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_ns(void) {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+static int connection_number(cobble_conn_handle connection) {
+    for (int i = 0; i < connectionCount; i++) {
+        if (connections[i] == connection)
+            return i;
+    }
+    return -1;
+}
+
+static void work(void) {
+    if (sleeping) {
+        usleep(workUs);
+        return;
+    }
+    uint64_t until = now_ns() + (uint64_t)workUs * 1000;
+    while (now_ns() < until)
+        ;
+}
+
+// Checks the position against the connection's last, and that nothing else for the connection is running
+static void arrived(int c, uint32_t position) {
+    if (__atomic_exchange_n(&inside[c], 1, __ATOMIC_ACQ_REL))
+        __atomic_add_fetch(&overlapped, 1, __ATOMIC_RELAXED);
+    if (position < latest[c])
+        __atomic_add_fetch(&reordered, 1, __ATOMIC_RELAXED);
+    else
+        latest[c] = position;
+    __atomic_store_n(&inside[c], 0, __ATOMIC_RELEASE);
+}
+
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle c, const uint8_t* data, int len) {
+
+    uint32_t position;
+    uint64_t sentAt;
+    (void)c;
+    (void)len;
+
+    memcpy(&position, data, sizeof(position));
+    memcpy(&sentAt, data + 4, sizeof(sentAt));
+    int n = connection_number(connection);
+    if (n < 0)
+        return;
+
+    work();
+    arrived(n, position);
+
+    uint64_t latency = now_ns() - sentAt;
+    uint32_t sample = __atomic_fetch_add(&sampleCount, 1, __ATOMIC_RELAXED);
+    samples[sample] = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+    __atomic_add_fetch(&delivered, 1, __ATOMIC_RELEASE);
+}
+
+static void on_writecomplete(cobble_conn_handle connection, cobble_char_handle c, int position, int status) {
+    (void)c;
+    (void)status;
+    int n = connection_number(connection);
+    if (n >= 0)
+        arrived(n, (uint32_t)position);
+    __atomic_add_fetch(&delivered, 1, __ATOMIC_RELEASE);
+}
+
+static void* backend(void* arg) {
+
+    uint8_t value[20] = { 0 };
+    (void)arg;
+
+    for (uint32_t position = 1; position <= (uint32_t)valuesPerConnection; position++) {
+        for (int c = 0; c < connectionCount; c++) {
+            while (sent - __atomic_load_n(&delivered, __ATOMIC_ACQUIRE) - (cobble_queue_dropped_get() - droppedBefore) >= IN_FLIGHT)
+                sched_yield();
+            uint64_t sentAt = now_ns();
+            memcpy(value, &position, sizeof(position));
+            memcpy(value + 4, &sentAt, sizeof(sentAt));
+            sent++;
+            cobble_event_updatevalue_c(connections[c], characteristic, value, sizeof(value));
+            if (position % WRITE_EVERY == 0) {
+                sent++;
+                cobble_event_writecomplete(connections[c], characteristic, (int)position, WriteStatus_Complete);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// 0 threads takes the events on this thread with cobble_queue_process()
+static void run(int threads) {
+
+    pthread_t thread;
+    uint32_t total = (uint32_t)(connectionCount * valuesPerConnection + connectionCount * (valuesPerConnection / WRITE_EVERY));
+
+    sent = delivered = 0;
+    reordered = overlapped = 0;
+    sampleCount = 0;
+    memset(latest, 0, sizeof(latest));
+
+    if (threads > 0 && !cobble_dispatch_start(threads, NULL)) {
+        fprintf(stderr, "Could not start the dispatcher\n");
+        return;
+    }
+
+    droppedBefore = cobble_queue_dropped_get();
+    uint64_t cpuStart = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t start = now_ns();
+    pthread_create(&thread, NULL, backend, NULL);
+
+    while (__atomic_load_n(&delivered, __ATOMIC_ACQUIRE) + (cobble_queue_dropped_get() - droppedBefore) < total) {
+        if (threads > 0) {
+            usleep(1000);
+            continue;
+        }
+        cobble_queue_wait(10);
+        cobble_queue_process();
+    }
+    double elapsed = (double)(now_ns() - start);
+    double cpu = 100.0 * (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpuStart) / elapsed;
+    pthread_join(thread, NULL);
+
+    if (threads > 0)
+        cobble_dispatch_stop();
+
+    uint32_t count = sampleCount;
+    qsort(samples, count, sizeof(samples[0]), compare_u32);
+    double p50 = count ? samples[count / 2] / 1e6 : 0;
+    double p99 = count ? samples[(uint32_t)(0.99 * (count - 1))] / 1e6 : 0;
+    double rate = count / (elapsed / 1e9);
+    uint64_t dropped = cobble_queue_dropped_get() - droppedBefore;
+
+    printf("{\"threads\": %i, \"connections\": %i, \"work_us\": %i, \"work\": \"%s\", \"values\": %u, \"values_per_s\": %.0f, "
+        "\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"cpu_percent\": %.1f, \"reordered\": %llu, \"overlapped\": %llu, \"dropped\": %llu}\n",
+        threads, connectionCount, workUs, sleeping ? "sleep" : "spin", count, rate, p50, p99, cpu,
+        (unsigned long long)reordered, (unsigned long long)overlapped, (unsigned long long)dropped);
+    fprintf(stderr, "%-10s %2i  %8.0f values/s  p50 %8.3f ms  p99 %8.3f ms  cpu %6.1f%%  %llu reordered  %llu overlapped  %llu dropped\n",
+        threads > 0 ? "dispatch" : "process", threads, rate, p50, p99, cpu,
+        (unsigned long long)reordered, (unsigned long long)overlapped, (unsigned long long)dropped);
+}
+
+int main(int argc, char** argv) {
+
+    int threadCounts[MAX_THREAD_COUNTS] = { 1, 2, 4 };
+    int counts = 3;
+
+    connectionCount = (argc > 1) ? atoi(argv[1]) : 8;
+    valuesPerConnection = (argc > 2) ? atoi(argv[2]) : 2000;
+    workUs = (argc > 3) ? atoi(argv[3]) : 50;
+    sleeping = (argc > 4) ? (strcmp(argv[4], "sleep") == 0) : 1;
+    if (argc > 5) {
+        counts = 0;
+        for (int i = 5; i < argc && counts < MAX_THREAD_COUNTS; i++)
+            threadCounts[counts++] = atoi(argv[i]);
+    }
+    if (connectionCount < 1 || connectionCount > MAX_CONNECTIONS || valuesPerConnection < 1 || workUs < 0) {
+        fprintf(stderr, "Usage: bench_dispatch [connections (1 to %i)] [values per connection] [us per value] [spin|sleep] [threads...]\n", MAX_CONNECTIONS);
+        return 1;
+    }
+
+    characteristic = cobble_characteristic_handle(CHARACTERISTIC);
+    for (int c = 0; c < connectionCount; c++)
+        connections[c] = cobble_connection_open(0x5E1100000001ull + c);
+
+    samples = malloc((size_t)connectionCount * valuesPerConnection * sizeof(samples[0]));
+
+    register_updatevalue_c_cb(&on_updatevalue);
+    register_writecomplete_cb(&on_writecomplete);
+
+    run(0);
+    for (int i = 0; i < counts; i++)
+        run(threadCounts[i]);
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,277 @@
+// The order events are delivered in against the order a backend sent them, and how long a backlog holds up delivery
+// A thread stands in for a backend, sending sessions of a scan result, a connection, its discovery and MTU, a run of
+// value updates with a write completing part way through, and a disconnection, while the application's thread takes
+// them with cobble_queue_wait() and cobble_queue_process(). Every event carries the position it was sent in, so each one
+// delivered after a later one can be counted, along with any delivered out of order within its lane.
+//
+// Then a backlog of values, each taking the application some work to handle, is queued ahead of a disconnection, and
+// taken in one cobble_queue_process() call, and a frame at a time with cobble_queue_process_bounded(), in order and with
+// QueueOrder_ControlFirst. Each reports the median and longest call, and how long the disconnection took to arrive. Results are
+// written to stdout as JSON, and a summary to stderr.
+//
+// Usage: bench_event_order [sessions] [values per session] [ns of work per value] [frame budget in microseconds]
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+
+// Events sent but not yet delivered, kept well within the queues so that nothing is dropped
+#define IN_FLIGHT 512
+
+// Just short of the value queue's length, so that nothing in the backlog is dropped
+#define BACKLOG_VALUES 4000
+#define BACKLOG_ROUNDS 50
+
+static cobble_char_handle characteristic;
+static int sessions = 200;
+static int valuesPerSession = 200;
+static int workNs = 1000;
+static volatile int working = 0;
+
+static volatile uint32_t sent = 0;
+static volatile uint32_t delivered = 0;
+static volatile int producing = 0;
+
+// The latest position delivered, overall and in each lane (0 for control events, 1 for bulk data)
+static int64_t latest;
+static int64_t latestInLane[2];
+static uint64_t overtaken;
+static uint64_t reorderedInLane;
+static uint64_t disconnectedAt;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void arrived(int64_t position, int lane) {
+    if (position < latest)
+        overtaken++;
+    else
+        latest = position;
+    if (position < latestInLane[lane])
+        reorderedInLane++;
+    else
+        latestInLane[lane] = position;
+    __atomic_add_fetch(&delivered, 1, __ATOMIC_RELEASE);
+}
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+    (void)rssi;
+    (void)identifier;
+    arrived(atoll(name), 1);
+}
+
+static void on_connectionstatus(const char* identifier, int status) {
+    if (status == ConnectionStatus_DidDisconnect && disconnectedAt == 0)
+        disconnectedAt = now_ns();
+    arrived(atoll(identifier), 0);
+}
+
+static void on_characteristicdiscovered(const char* service, const char* c) {
+    (void)c;
+    arrived(atoll(service), 0);
+}
+
+static void on_mtuchanged(cobble_conn_handle connection, int mtu, int maxWrite, int maxWriteWithoutResponse) {
+    (void)connection;
+    (void)maxWrite;
+    (void)maxWriteWithoutResponse;
+    arrived(mtu, 0);
+}
+
+static void on_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int position) {
+    (void)connection;
+    (void)services;
+    (void)characteristics;
+    arrived(position, 0);
+}
+
+static void on_writecomplete(cobble_conn_handle connection, cobble_char_handle c, int position, int status) {
+    (void)connection;
+    (void)c;
+    (void)status;
+    arrived(position, 0);
+}
+
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle c, const uint8_t* data, int len) {
+    uint32_t position;
+    (void)connection;
+    (void)c;
+    (void)len;
+    memcpy(&position, data, sizeof(position));
+    if (working) {
+        uint64_t until = now_ns() + workNs;
+        while (now_ns() < until)
+            ;
+    }
+    arrived(position, 1);
+}
+
+// Waits for the application to catch up enough to send another event, and returns its position
+static uint32_t next_position(void) {
+    while (sent - __atomic_load_n(&delivered, __ATOMIC_ACQUIRE) >= IN_FLIGHT)
+        sched_yield();
+    return ++sent;
+}
+
+static void send_value(uint32_t position) {
+    uint8_t value[20] = { 0 };
+    memcpy(value, &position, sizeof(position));
+    cobble_event_updatevalue_c(1, characteristic, value, sizeof(value));
+}
+
+static void* backend(void* arg) {
+
+    char text[32];
+    (void)arg;
+
+    for (int s = 0; s < sessions; s++) {
+        snprintf(text, sizeof(text), "%u", next_position());
+        cobble_event_scanresult(text, -50, "AA:BB:CC:DD:EE:01");
+
+        snprintf(text, sizeof(text), "%u", next_position());
+        cobble_event_connectionstatus(text, ConnectionStatus_DidConnect);
+        for (int c = 0; c < 3; c++) {
+            snprintf(text, sizeof(text), "%u", next_position());
+            cobble_event_characteristicdiscovered(text, CHARACTERISTIC);
+        }
+        cobble_event_mtuchanged(1, (int)next_position(), 244, 244);
+        cobble_event_discoverycomplete(1, 1, 3, (int)next_position());
+
+        for (int v = 0; v < valuesPerSession; v++) {
+            send_value(next_position());
+            if (v == valuesPerSession / 2)
+                cobble_event_writecomplete(1, characteristic, (int)next_position(), WriteStatus_Complete);
+        }
+
+        snprintf(text, sizeof(text), "%u", next_position());
+        cobble_event_connectionstatus(text, ConnectionStatus_DidDisconnect);
+    }
+
+    __atomic_store_n(&producing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void reset(void) {
+    latest = latestInLane[0] = latestInLane[1] = -1;
+    overtaken = reorderedInLane = 0;
+    sent = delivered = 0;
+    disconnectedAt = 0;
+}
+
+static void run_order(const char* label, CobbleQueueOrder order) {
+
+    pthread_t thread;
+
+    reset();
+    cobble_queue_order_set(order);
+    producing = 1;
+    uint64_t start = now_ns();
+    pthread_create(&thread, NULL, backend, NULL);
+
+    while (__atomic_load_n(&producing, __ATOMIC_ACQUIRE) || delivered != sent) {
+        cobble_queue_wait(1);
+        cobble_queue_process();
+    }
+    pthread_join(thread, NULL);
+    double elapsed = (double)(now_ns() - start);
+
+    printf("{\"test\": \"order\", \"order\": \"%s\", \"events\": %u, \"ns_per_event\": %.1f, \"overtaken\": %llu, "
+        "\"reordered_in_lane\": %llu, \"dropped\": %llu}\n",
+        label, (unsigned)delivered, elapsed / delivered, (unsigned long long)overtaken, (unsigned long long)reorderedInLane,
+        (unsigned long long)cobble_queue_dropped_get());
+    fprintf(stderr, "%-14s %8u events  %6.1f ns/event  %6llu overtaken  %llu reordered within a lane\n",
+        label, (unsigned)delivered, elapsed / delivered, (unsigned long long)overtaken, (unsigned long long)reorderedInLane);
+}
+
+// A frame budget of 0 takes the whole backlog in one call
+static void run_backlog(const char* label, CobbleQueueOrder order, int budgetUs) {
+
+    reset();
+    cobble_queue_order_set(order);
+    working = 1;
+
+    // One call per value at most, and one for the disconnection
+    static uint64_t callTimes[BACKLOG_ROUNDS * (BACKLOG_VALUES + 1)];
+    int calls = 0;
+    double disconnect = 0;
+    for (int r = 0; r < BACKLOG_ROUNDS; r++) {
+        for (int v = 0; v < BACKLOG_VALUES; v++)
+            send_value(++sent);
+        char text[32];
+        snprintf(text, sizeof(text), "%u", ++sent);
+        disconnectedAt = 0;
+        uint64_t queuedAt = now_ns();
+        cobble_event_connectionstatus(text, ConnectionStatus_DidDisconnect);
+
+        while (delivered != sent) {
+            uint64_t callStart = now_ns();
+            if (budgetUs > 0)
+                cobble_queue_process_bounded(0, budgetUs);
+            else
+                cobble_queue_process();
+            callTimes[calls++] = now_ns() - callStart;
+        }
+        disconnect += (double)(disconnectedAt - queuedAt);
+    }
+    working = 0;
+    disconnect /= BACKLOG_ROUNDS;
+
+    // The longest call is mostly down to the scheduler, so the median shows what a frame can expect
+    qsort(callTimes, calls, sizeof(callTimes[0]), compare_u64);
+    double median = callTimes[calls / 2] / 1e6;
+    double longest = callTimes[calls - 1] / 1e6;
+
+    printf("{\"test\": \"backlog\", \"order\": \"%s\", \"values\": %i, \"work_ns\": %i, \"budget_us\": %i, \"median_call_ms\": %.3f, \"longest_call_ms\": %.3f, "
+        "\"calls_per_backlog\": %.1f, \"disconnect_after_ms\": %.3f, \"overtaken\": %llu, \"reordered_in_lane\": %llu}\n",
+        label, BACKLOG_VALUES, workNs, budgetUs, median, longest, (double)calls / BACKLOG_ROUNDS, disconnect / 1e6,
+        (unsigned long long)overtaken, (unsigned long long)reorderedInLane);
+    fprintf(stderr, "%-14s budget %5i us  calls %7.3f ms (longest %7.3f ms)  %6.1f calls  disconnect after %7.3f ms  %6llu overtaken\n",
+        label, budgetUs, median, longest, (double)calls / BACKLOG_ROUNDS, disconnect / 1e6, (unsigned long long)overtaken);
+}
+
+int main(int argc, char** argv) {
+
+    sessions = (argc > 1) ? atoi(argv[1]) : 200;
+    valuesPerSession = (argc > 2) ? atoi(argv[2]) : 200;
+    workNs = (argc > 3) ? atoi(argv[3]) : 1000;
+    int budget = (argc > 4) ? atoi(argv[4]) : 1000;
+    if (sessions < 1 || valuesPerSession < 2 || workNs < 0 || budget < 1) {
+        fprintf(stderr, "Usage: bench_event_order [sessions] [values per session (at least 2)] [ns of work per value] [frame budget in microseconds]\n");
+        return 1;
+    }
+
+    characteristic = cobble_characteristic_handle(CHARACTERISTIC);
+
+    register_scanresult_cb(&on_scanresult);
+    register_connectionstatus_cb(&on_connectionstatus);
+    register_characteristicdiscovered_cb(&on_characteristicdiscovered);
+    register_mtuchanged_cb(&on_mtuchanged);
+    register_discoverycomplete_cb(&on_discoverycomplete);
+    register_writecomplete_cb(&on_writecomplete);
+    register_updatevalue_c_cb(&on_updatevalue);
+
+    run_order("sequential", QueueOrder_Sequential);
+    run_order("control first", QueueOrder_ControlFirst);
+
+    run_backlog("sequential", QueueOrder_Sequential, 0);
+    run_backlog("sequential", QueueOrder_Sequential, budget);
+    run_backlog("control first", QueueOrder_ControlFirst, budget);
+
+    return 0;
+}
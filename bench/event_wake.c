@@ -0,0 +1,293 @@
+// Stress test for waking the application, with several producer threads racing a consumer which sleeps until events
+// are waiting. Each producer queues values one at a time with short pauses between them, so the consumer keeps running
+// out of events and going back to sleep just as more arrive. It takes them in one of these ways:
+// * wait: sleeping in cobble_queue_wait(), then calling cobble_queue_process()
+// * fd: sleeping in poll() on cobble_event_fd(), then calling cobble_queue_process()
+// * drain: sleeping in poll() on cobble_event_fd(), then taking values with cobble_events_drain() until none are left
+// A wake which is lost leaves the consumer asleep with values waiting, until the timeout. Any sleep which times out
+// while values are still to come is counted as a stall, and the test fails if there are any. Taking the values has to
+// clear the wake too, or the consumer never sleeps again: the test fails if the event fd is still readable once
+// everything has been taken, and reports how often the consumer was woken to find nothing.
+// Then the dispatcher is started and stopped over and over while the values arrive. Its feeder thread sleeps in
+// cobble_queue_wait() too, so a lost wake would stop cobble_dispatch_stop() from returning; the test fails if any stop
+// takes longer than the timeout, or if any value goes missing.
+//
+// Results are written to stdout as JSON, and a summary to stderr. Exits with an error if any mode fails.
+//
+// Usage: bench_event_wake [producers] [values per producer]
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+
+#define MAX_PRODUCERS 32
+
+// Far longer than any pause between values, so a sleep only lasts this long if a wake was lost
+#define TIMEOUT_MS 200
+
+// The longest pause a producer takes between values
+#define MAX_PAUSE_US 50
+
+typedef enum {
+    Mode_Wait,
+    Mode_Fd,
+    Mode_Drain,
+} WakeMode;
+
+static const char* modeNames[] = { "wait", "fd", "drain" };
+
+#define DRAIN_RECORDS 64
+#define DRAIN_PAYLOAD 4096
+
+static int producerCount = 4;
+static int valuesPerProducer = 20000;
+
+static cobble_conn_handle connection;
+static cobble_char_handle characteristic;
+
+static volatile int producing = 0;
+static volatile uint64_t sent = 0;
+static volatile uint64_t received = 0;
+static uint64_t droppedBefore = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_updatevalue(cobble_conn_handle c, cobble_char_handle ch, const uint8_t* data, int len) {
+    (void)c;
+    (void)ch;
+    (void)data;
+    (void)len;
+    __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+}
+
+static void* producer(void* arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    uint8_t value[8] = { 0 };
+    for (int v = 0; v < valuesPerProducer; v++) {
+        memcpy(value, &v, sizeof(v));
+        __atomic_add_fetch(&sent, 1, __ATOMIC_RELAXED);
+        cobble_event_updatevalue_c(connection, characteristic, value, sizeof(value));
+
+        // Sometimes straight after the last, sometimes after the consumer has had time to go back to sleep
+        seed = seed * 1103515245u + 12345u;
+        uint32_t pause = (seed >> 16) % (MAX_PAUSE_US + 1);
+        if (pause < MAX_PAUSE_US / 4) {
+            sched_yield();
+        } else {
+            uint64_t until = now_ns() + (uint64_t)pause * 1000;
+            while (now_ns() < until)
+                ;
+        }
+    }
+    return NULL;
+}
+
+// Whether every value sent has either been received or dropped, once the producers have finished
+static bool finished(void) {
+    uint64_t accounted = __atomic_load_n(&received, __ATOMIC_RELAXED) + cobble_queue_dropped_get() - droppedBefore;
+    return !__atomic_load_n(&producing, __ATOMIC_ACQUIRE) && accounted >= __atomic_load_n(&sent, __ATOMIC_RELAXED);
+}
+
+static bool fd_readable(int timeoutMs) {
+    struct pollfd p;
+    p.fd = cobble_event_fd();
+    p.events = POLLIN;
+    p.revents = 0;
+    return poll(&p, 1, timeoutMs) > 0;
+}
+
+static void sleep_until_events(WakeMode mode) {
+    if (mode == Mode_Wait)
+        cobble_queue_wait(TIMEOUT_MS);
+    else
+        fd_readable(TIMEOUT_MS);
+}
+
+// Returns how many values were taken
+static uint64_t take_events(WakeMode mode) {
+
+    if (mode != Mode_Drain) {
+        uint64_t before = __atomic_load_n(&received, __ATOMIC_RELAXED);
+        cobble_queue_process();
+        return __atomic_load_n(&received, __ATOMIC_RELAXED) - before;
+    }
+
+    static cobble_value_record records[DRAIN_RECORDS];
+    static uint8_t payload[DRAIN_PAYLOAD];
+    uint64_t taken = 0;
+    int count;
+    while ((count = cobble_events_drain(records, DRAIN_RECORDS, payload, DRAIN_PAYLOAD)) > 0)
+        taken += (uint64_t)count;
+    __atomic_add_fetch(&received, taken, __ATOMIC_RELAXED);
+    return taken;
+}
+
+static bool run(WakeMode mode) {
+
+    pthread_t threads[MAX_PRODUCERS];
+    uint64_t sleeps = 0, stalls = 0, idleWakes = 0;
+
+    // Start from nothing waiting
+    take_events(mode);
+    received = 0;
+    sent = 0;
+    droppedBefore = cobble_queue_dropped_get();
+
+    producing = 1;
+    uint64_t start = now_ns();
+    for (int p = 0; p < producerCount; p++)
+        pthread_create(&threads[p], NULL, producer, (void*)(uintptr_t)(p + 1));
+
+    // Reaps the producers once they have all finished, without blocking the consumer
+    int joined = 0;
+    while (!finished()) {
+        uint64_t before = now_ns();
+        sleep_until_events(mode);
+        sleeps++;
+        bool timedOut = now_ns() - before >= (uint64_t)TIMEOUT_MS * 1000000;
+        if (timedOut)
+            stalls++;
+        if (take_events(mode) == 0 && !timedOut)
+            idleWakes++;
+
+        if (!joined && __atomic_load_n(&sent, __ATOMIC_RELAXED) >= (uint64_t)producerCount * valuesPerProducer) {
+            for (int p = 0; p < producerCount; p++)
+                pthread_join(threads[p], NULL);
+            joined = 1;
+            __atomic_store_n(&producing, 0, __ATOMIC_RELEASE);
+        }
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    uint64_t dropped = cobble_queue_dropped_get() - droppedBefore;
+
+    // With everything taken, nothing should be left to wake the consumer
+    bool leftReadable = mode != Mode_Wait && fd_readable(0);
+    bool passed = stalls == 0 && !leftReadable;
+
+    printf("{\"mode\": \"%s\", \"producers\": %i, \"sent\": %llu, \"received\": %llu, \"dropped\": %llu, "
+        "\"sleeps\": %llu, \"stalls\": %llu, \"idle_wakes\": %llu, \"left_readable\": %s, \"seconds\": %.2f, "
+        "\"passed\": %s}\n",
+        modeNames[mode], producerCount, (unsigned long long)sent, (unsigned long long)received,
+        (unsigned long long)dropped, (unsigned long long)sleeps, (unsigned long long)stalls,
+        (unsigned long long)idleWakes, leftReadable ? "true" : "false", elapsed, passed ? "true" : "false");
+    fprintf(stderr, "%-5s %i producers  %llu sent  %llu received  %llu dropped  %llu sleeps  %llu stalls"
+        "  %llu idle wakes%s  %.2f s  %s\n",
+        modeNames[mode], producerCount, (unsigned long long)sent, (unsigned long long)received,
+        (unsigned long long)dropped, (unsigned long long)sleeps, (unsigned long long)stalls,
+        (unsigned long long)idleWakes, leftReadable ? "  left readable" : "", elapsed, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Ends the test if a stop never returns
+static volatile uint64_t stopStarted = 0;
+
+static void* watchdog(void* arg) {
+    (void)arg;
+    for (;;) {
+        usleep(TIMEOUT_MS * 1000);
+        uint64_t started = __atomic_load_n(&stopStarted, __ATOMIC_ACQUIRE);
+        if (started != 0 && now_ns() - started > 10ull * TIMEOUT_MS * 1000000) {
+            printf("{\"mode\": \"dispatch\", \"passed\": false}\n");
+            fprintf(stderr, "dispatch  cobble_dispatch_stop() hasn't returned after %i ms  FAILED\n", 10 * TIMEOUT_MS);
+            fflush(stdout);
+            _exit(1);
+        }
+    }
+    return NULL;
+}
+
+static bool run_dispatch(void) {
+
+    pthread_t threads[MAX_PRODUCERS];
+    pthread_t watcher;
+    uint64_t stops = 0, longestStop = 0;
+
+    cobble_queue_process();
+    received = 0;
+    sent = 0;
+    droppedBefore = cobble_queue_dropped_get();
+
+    pthread_create(&watcher, NULL, watchdog, NULL);
+    pthread_detach(watcher);
+
+    producing = 1;
+    uint64_t start = now_ns();
+    for (int p = 0; p < producerCount; p++)
+        pthread_create(&threads[p], NULL, producer, (void*)(uintptr_t)(p + 1));
+
+    while (__atomic_load_n(&sent, __ATOMIC_RELAXED) < (uint64_t)producerCount * valuesPerProducer) {
+        if (!cobble_dispatch_start(2, NULL)) {
+            fprintf(stderr, "cobble_dispatch_start() failed\n");
+            return false;
+        }
+        usleep(1000);
+
+        uint64_t before = now_ns();
+        __atomic_store_n(&stopStarted, before, __ATOMIC_RELEASE);
+        cobble_dispatch_stop();
+        __atomic_store_n(&stopStarted, 0, __ATOMIC_RELEASE);
+        uint64_t took = now_ns() - before;
+        if (took > longestStop)
+            longestStop = took;
+        stops++;
+
+        // What was queued while stopping is left for cobble_queue_process()
+        cobble_queue_process();
+    }
+
+    for (int p = 0; p < producerCount; p++)
+        pthread_join(threads[p], NULL);
+    __atomic_store_n(&producing, 0, __ATOMIC_RELEASE);
+    cobble_queue_process();
+
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    uint64_t dropped = cobble_queue_dropped_get() - droppedBefore;
+    bool passed = longestStop < (uint64_t)TIMEOUT_MS * 1000000 && finished();
+
+    printf("{\"mode\": \"dispatch\", \"producers\": %i, \"sent\": %llu, \"received\": %llu, \"dropped\": %llu, "
+        "\"stops\": %llu, \"longest_stop_ms\": %.2f, \"seconds\": %.2f, \"passed\": %s}\n",
+        producerCount, (unsigned long long)sent, (unsigned long long)received, (unsigned long long)dropped,
+        (unsigned long long)stops, longestStop / 1e6, elapsed, passed ? "true" : "false");
+    fprintf(stderr, "dispatch %i producers  %llu sent  %llu received  %llu dropped  %llu stops  longest %.2f ms  %.2f s"
+        "  %s\n",
+        producerCount, (unsigned long long)sent, (unsigned long long)received, (unsigned long long)dropped,
+        (unsigned long long)stops, longestStop / 1e6, elapsed, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+int main(int argc, char** argv) {
+
+    producerCount = (argc > 1) ? atoi(argv[1]) : 4;
+    valuesPerProducer = (argc > 2) ? atoi(argv[2]) : 20000;
+    if (producerCount < 1 || producerCount > MAX_PRODUCERS || valuesPerProducer < 1) {
+        fprintf(stderr, "Usage: bench_event_wake [producers (1 to %i)] [values per producer]\n", MAX_PRODUCERS);
+        return 1;
+    }
+
+    connection = cobble_connection_open(0x5E1100000001ull);
+    characteristic = cobble_characteristic_handle("6E400003-B5A3-F393-E0A9-E50E24DCCA9E");
+    register_updatevalue_c_cb(&on_updatevalue);
+
+    bool passed = run(Mode_Wait);
+    passed = run(Mode_Fd) && passed;
+    passed = run_dispatch() && passed;
+
+    // Last, as once values have been drained cobble_queue_process() and the dispatcher leave them for it
+    passed = run(Mode_Drain) && passed;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,441 @@
+// Throughput and latency benchmark for the event pipeline
+// Producer threads play the part of a Bluetooth stack, calling cobble_event_* at a fixed rate (or as fast as they can),
+// and each event carries the time it was sent so that the callback can measure end-to-end delivery latency.
+// Built twice by make_bench.sh, with the same source:
+// * bench_pipeline:          the deferred core (cobble_events_win.cpp), drained by a consumer thread calling
+//                            cobble_queue_process() as an application's main loop would
+// * bench_pipeline_realtime: the realtime core (cobble_events.c), which calls back on the producer threads
+//
+// Results are written to stdout as JSON, so that they can be kept and compared between releases. A summary goes to stderr.
+//
+// Usage: bench_pipeline [event=scan|value|value_h] [producers=N] [rate=events/sec per producer, 0 for flat out]
+//                       [payload=bytes] [duration=seconds] [poll_us=microseconds between cobble_queue_process() calls]
+// With no arguments, a standard set of runs is made: latency at a fixed rate, and peak throughput, for each event type.
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+
+#include "alloc_count.h"
+
+#ifdef BENCH_REALTIME
+#define MODE "realtime"
+#else
+#define MODE "deferred"
+#endif
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+#define IDENTIFIER "AA:BB:CC:DD:EE:FF"
+
+#define MAX_PRODUCERS 16
+#define MAX_LENGTH 512
+
+// Latencies beyond this many events are not recorded (16 MB of samples)
+#define MAX_SAMPLES (4 * 1024 * 1024)
+
+typedef enum {
+    Event_Scan,
+    Event_Value,
+    Event_ValueHandle,
+} EventType;
+
+static const char* eventNames[] = { "scan", "value", "value_h" };
+
+typedef struct {
+    EventType event;
+    int producers;
+    double rate;
+    int payload;
+    double duration;
+    int pollMicroseconds;
+} run_config;
+
+typedef struct {
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t dropped;
+    double elapsed;
+    uint64_t allocations;
+    long rssKb;
+    long peakRssKb;
+    uint64_t p50, p99, p999, max;
+    double mean;
+} run_result;
+
+static run_config current;
+static cobble_char_handle handle;
+
+static uint32_t* samples;
+static volatile uint64_t sampleCount = 0;
+static volatile uint64_t delivered = 0;
+
+static volatile int stopping = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(uint64_t sentAt) {
+    uint64_t latency = now_ns() - sentAt;
+    uint64_t i = __atomic_fetch_add(&sampleCount, 1, __ATOMIC_RELAXED);
+    if (i < MAX_SAMPLES)
+        samples[i] = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+    __atomic_fetch_add(&delivered, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Callbacks: recover the send time from the event
+ */
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+    (void)rssi;
+    (void)identifier;
+    record(strtoull(name, NULL, 16));
+}
+
+static void on_updatevalue(const char* uuid, const uint8_t* data, int len) {
+    uint64_t sentAt;
+    (void)uuid;
+    (void)len;
+    memcpy(&sentAt, data, sizeof(sentAt));
+    record(sentAt);
+}
+
+static void on_updatevalue_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    uint64_t sentAt;
+    (void)characteristic;
+    (void)len;
+    memcpy(&sentAt, data, sizeof(sentAt));
+    record(sentAt);
+}
+
+/*
+ * Producers
+ */
+
+typedef struct {
+    pthread_t thread;
+    uint64_t sent;
+} producer;
+
+static producer producers[MAX_PRODUCERS];
+static uint64_t runStart;
+static uint64_t runEnd;
+
+static void send_event(uint8_t* payload) {
+
+    static const char hex[] = "0123456789abcdef";
+    uint64_t t = now_ns();
+
+    switch (current.event) {
+    case Event_Scan: {
+        char name[17];
+        for (int i = 15; i >= 0; i--, t >>= 4)
+            name[i] = hex[t & 0xF];
+        name[16] = '\0';
+        cobble_event_scanresult(name, -60, IDENTIFIER);
+        break;
+    }
+    case Event_Value:
+        memcpy(payload, &t, sizeof(t));
+        cobble_event_updatevalue(CHARACTERISTIC, payload, current.payload);
+        break;
+    case Event_ValueHandle:
+        memcpy(payload, &t, sizeof(t));
+        cobble_event_updatevalue_h(handle, payload, current.payload);
+        break;
+    }
+}
+
+static void* produce(void* arg) {
+
+    producer* p = (producer*)arg;
+    uint8_t payload[MAX_LENGTH] = { 0 };
+    double period = (current.rate > 0) ? 1e9 / current.rate : 0;
+
+    for (uint64_t i = 0;; i++) {
+
+        uint64_t now = now_ns();
+        if (now >= runEnd)
+            break;
+
+        // Keep to an absolute schedule, so that a late event is followed by an early one rather than slipping
+        if (period > 0) {
+            uint64_t due = runStart + (uint64_t)(i * period);
+            if (due >= runEnd)
+                break;
+            if (due > now) {
+                struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+        }
+
+        send_event(payload);
+        p->sent++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Consumer (deferred mode only): the application's main loop
+ */
+
+#ifndef BENCH_REALTIME
+static void* consume(void* arg) {
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        cobble_queue_process();
+        if (current.pollMicroseconds > 0)
+            usleep(current.pollMicroseconds);
+    }
+    cobble_queue_process();
+    return NULL;
+}
+#endif
+
+/*
+ * Measurement
+ */
+
+// Reads a field (in kB) from /proc/self/status, or returns -1
+static long proc_status_kb(const char* field) {
+
+    char line[256];
+    long value = -1;
+    size_t len = strlen(field);
+    FILE* f = fopen("/proc/self/status", "r");
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Restart the peak RSS (VmHWM) from the current RSS, so that each run's peak is its own
+static void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0)
+            ;
+        close(fd);
+    }
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t count, double p) {
+    if (count == 0)
+        return 0;
+    uint64_t i = (uint64_t)(p * (count - 1) + 0.5);
+    return samples[i];
+}
+
+static void run(const run_config* config, run_result* r) {
+
+    current = *config;
+    memset(r, 0, sizeof(*r));
+
+    sampleCount = 0;
+    delivered = 0;
+    stopping = 0;
+
+    switch (config->event) {
+    case Event_Scan:
+        register_scanresult_cb(&on_scanresult);
+        break;
+    case Event_Value:
+        register_updatevalue_cb(&on_updatevalue);
+        break;
+    case Event_ValueHandle:
+        register_updatevalue_h_cb(&on_updatevalue_h);
+        break;
+    }
+
+    uint64_t dropped = cobble_queue_dropped_get();
+    reset_peak_rss();
+    r->rssKb = proc_status_kb("VmRSS");
+    uint64_t allocations = bench_allocations();
+
+#ifndef BENCH_REALTIME
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consume, NULL);
+#endif
+
+    runStart = now_ns() + 1000000;
+    runEnd = runStart + (uint64_t)(config->duration * 1e9);
+
+    for (int i = 0; i < config->producers; i++) {
+        producers[i].sent = 0;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+    for (int i = 0; i < config->producers; i++) {
+        pthread_join(producers[i].thread, NULL);
+        r->sent += producers[i].sent;
+    }
+
+    // Give the consumer up to a second to deliver what is still queued
+    uint64_t drainEnd = now_ns() + 1000000000ull;
+    while (__atomic_load_n(&delivered, __ATOMIC_RELAXED) + (cobble_queue_dropped_get() - dropped) < r->sent && now_ns() < drainEnd)
+        usleep(100);
+
+#ifndef BENCH_REALTIME
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(consumer, NULL);
+#endif
+
+    r->elapsed = (now_ns() - runStart) / 1e9;
+    if (r->elapsed < config->duration)
+        r->elapsed = config->duration;
+    r->allocations = bench_allocations() - allocations;
+    r->peakRssKb = proc_status_kb("VmHWM");
+    r->delivered = delivered;
+    r->dropped = cobble_queue_dropped_get() - dropped;
+
+    register_scanresult_cb(NULL);
+    register_updatevalue_cb(NULL);
+    register_updatevalue_h_cb(NULL);
+
+    uint64_t count = (sampleCount < MAX_SAMPLES) ? sampleCount : MAX_SAMPLES;
+    qsort(samples, count, sizeof(samples[0]), compare_u32);
+
+    double total = 0;
+    for (uint64_t i = 0; i < count; i++)
+        total += samples[i];
+
+    r->mean = count ? total / count : 0;
+    r->p50 = percentile(count, 0.50);
+    r->p99 = percentile(count, 0.99);
+    r->p999 = percentile(count, 0.999);
+    r->max = count ? samples[count - 1] : 0;
+}
+
+static void print_result(const run_config* c, const run_result* r, bool last) {
+
+    printf("    {\"event\": \"%s\", \"producers\": %i, \"rate_per_producer\": %.0f, \"payload\": %i, \"duration_s\": %.3f, \"poll_us\": %i,\n",
+        eventNames[c->event], c->producers, c->rate, c->payload, c->duration, c->pollMicroseconds);
+    printf("     \"sent\": %llu, \"delivered\": %llu, \"dropped\": %llu, \"throughput_per_s\": %.0f,\n",
+        (unsigned long long)r->sent, (unsigned long long)r->delivered, (unsigned long long)r->dropped, r->delivered / r->elapsed);
+    printf("     \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p99_9\": %llu, \"max\": %llu, \"mean\": %.0f},\n",
+        (unsigned long long)r->p50, (unsigned long long)r->p99, (unsigned long long)r->p999, (unsigned long long)r->max, r->mean);
+    printf("     \"allocations_per_event\": %.4f, \"rss_kb\": %li, \"peak_rss_kb\": %li}%s\n",
+        r->sent ? (double)r->allocations / r->sent : 0.0, r->rssKb, r->peakRssKb, last ? "" : ",");
+
+    fprintf(stderr, "%-8s %-7s producers=%i rate=%-6.0f payload=%-3i  %9.0f events/s  p50 %7.1f us  p99 %8.1f us  p99.9 %8.1f us  dropped %llu\n",
+        MODE, eventNames[c->event], c->producers, c->rate, c->payload, r->delivered / r->elapsed, r->p50 / 1e3, r->p99 / 1e3, r->p999 / 1e3,
+        (unsigned long long)r->dropped);
+}
+
+static bool parse_arg(run_config* c, const char* arg) {
+
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    value++;
+
+    if (strncmp(arg, "event=", 6) == 0) {
+        for (int i = 0; i < 3; i++) {
+            if (strcmp(value, eventNames[i]) == 0) {
+                c->event = (EventType)i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (strncmp(arg, "producers=", 10) == 0)
+        c->producers = atoi(value);
+    else if (strncmp(arg, "rate=", 5) == 0)
+        c->rate = atof(value);
+    else if (strncmp(arg, "payload=", 8) == 0)
+        c->payload = atoi(value);
+    else if (strncmp(arg, "duration=", 9) == 0)
+        c->duration = atof(value);
+    else if (strncmp(arg, "poll_us=", 8) == 0)
+        c->pollMicroseconds = atoi(value);
+    else
+        return false;
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    run_config defaults = { Event_ValueHandle, 2, 10000, 20, 1.0, 100 };
+    run_config runs[8];
+    int runCount = 0;
+
+    if (argc > 1) {
+        runs[0] = defaults;
+        for (int i = 1; i < argc; i++) {
+            if (!parse_arg(&runs[0], argv[i])) {
+                fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+                return 1;
+            }
+        }
+        runCount = 1;
+    } else {
+        // Latency at a steady rate, then peak throughput, for each kind of event
+        for (int e = Event_Scan; e <= Event_ValueHandle; e++) {
+            runs[runCount] = defaults;
+            runs[runCount++].event = (EventType)e;
+            runs[runCount] = defaults;
+            runs[runCount].event = (EventType)e;
+            runs[runCount++].rate = 0;
+        }
+    }
+
+    for (int i = 0; i < runCount; i++) {
+        run_config* c = &runs[i];
+        if (c->producers < 1 || c->producers > MAX_PRODUCERS || c->duration <= 0 || c->rate < 0) {
+            fprintf(stderr, "Need 1 to %i producers, a positive duration and a rate of 0 or more\n", MAX_PRODUCERS);
+            return 1;
+        }
+        // Values carry their send time in the first 8 bytes
+        if (c->event != Event_Scan && (c->payload < 8 || c->payload > MAX_LENGTH)) {
+            fprintf(stderr, "Payload must be 8 to %i bytes\n", MAX_LENGTH);
+            return 1;
+        }
+    }
+
+    long startRssKb = proc_status_kb("VmRSS");
+
+    // Touch every sample up front, so that it shows in the baseline RSS rather than as growth during a run
+    // (not with zeros, which the compiler would turn into a calloc() of untouched pages)
+    samples = malloc(MAX_SAMPLES * sizeof(samples[0]));
+    memset(samples, 0xFF, MAX_SAMPLES * sizeof(samples[0]));
+
+    handle = cobble_characteristic_handle(CHARACTERISTIC);
+
+    printf("{\n  \"benchmark\": \"pipeline\",\n  \"mode\": \"%s\",\n  \"cpus\": %li,\n  \"startup_rss_kb\": %li,\n  \"results\": [\n",
+        MODE, sysconf(_SC_NPROCESSORS_ONLN), startRssKb);
+
+    for (int i = 0; i < runCount; i++) {
+        run_result r;
+        run(&runs[i], &r);
+        print_result(&runs[i], &r, i == runCount - 1);
+    }
+
+    printf("  ]\n}\n");
+
+    free(samples);
+    return 0;
+}
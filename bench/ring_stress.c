@@ -0,0 +1,187 @@
+// Stress test for cobble_ring with several producer and consumer threads, under both overflow policies
+// Each producer pushes a numbered run of entries into a small ring while the consumers pop them, so the ring is full
+// most of the time. Every entry carries its producer, its position in that producer's run and a check word, and the test
+// fails if any consumer sees a producer's entries out of order, an entry is torn or delivered twice, or the entries
+// pushed don't add up to those delivered and dropped (including any discarded as the oldest).
+//
+// Results are written to stdout as JSON, and a summary to stderr. Exits with an error if either policy fails.
+//
+// Usage: bench_ring_stress [producers] [consumers] [entries per producer] [ring capacity]
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble_ring.h"
+
+#define MAX_PRODUCERS 32
+#define MAX_CONSUMERS 32
+
+// Producers give up the CPU after this many entries, so that consumers get a turn even on a single core
+#define YIELD_EVERY 32
+
+typedef struct {
+    uint32_t producer;
+    uint32_t position;
+    uint64_t check;
+} entry;
+
+typedef struct {
+    uint64_t popped;
+    uint64_t reordered;
+    uint64_t torn;
+    uint32_t latest[MAX_PRODUCERS];
+} consumer;
+
+static cobble_ring ring;
+static int producerCount = 4;
+static int consumerCount = 2;
+static int entriesPerProducer = 200000;
+
+// One byte per entry, set when it is delivered or discarded
+static volatile uint8_t* seen;
+static volatile uint64_t duplicates = 0;
+static volatile uint64_t discarded = 0;
+static volatile uint64_t attempts = 0;
+static volatile int producing = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t check_word(uint32_t producer, uint32_t position) {
+    return ((uint64_t)producer << 32 | position) * 0x9E3779B97F4A7C15ull;
+}
+
+static void mark_seen(const entry* e) {
+    if (e->producer >= (uint32_t)producerCount || e->position >= (uint32_t)entriesPerProducer)
+        return;
+    if (__atomic_exchange_n(&seen[(size_t)e->producer * entriesPerProducer + e->position], 1, __ATOMIC_RELAXED))
+        __atomic_add_fetch(&duplicates, 1, __ATOMIC_RELAXED);
+}
+
+static void on_discard(void* ctx, void* elem) {
+    (void)ctx;
+    mark_seen((const entry*)elem);
+    __atomic_add_fetch(&discarded, 1, __ATOMIC_RELAXED);
+}
+
+static void* produce(void* arg) {
+    uint32_t producer = (uint32_t)(uintptr_t)arg;
+    for (uint32_t position = 0; position < (uint32_t)entriesPerProducer; position++) {
+        entry e = { producer, position, check_word(producer, position) };
+        cobble_ring_push(&ring, &e);
+        __atomic_add_fetch(&attempts, 1, __ATOMIC_RELAXED);
+        if (position % YIELD_EVERY == YIELD_EVERY - 1)
+            sched_yield();
+    }
+    return NULL;
+}
+
+// Positions start at 0, so each consumer's latest is kept one ahead
+static void* consume(void* arg) {
+    consumer* c = (consumer*)arg;
+    entry e;
+    for (;;) {
+        if (!cobble_ring_pop(&ring, &e)) {
+            if (!__atomic_load_n(&producing, __ATOMIC_ACQUIRE) && cobble_ring_count(&ring) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        c->popped++;
+        if (e.producer >= (uint32_t)producerCount || e.check != check_word(e.producer, e.position)) {
+            c->torn++;
+            continue;
+        }
+        if (e.position + 1 <= c->latest[e.producer])
+            c->reordered++;
+        else
+            c->latest[e.producer] = e.position + 1;
+        mark_seen(&e);
+    }
+    return NULL;
+}
+
+static bool run(const char* label, CobbleRingPolicy policy, size_t capacity) {
+
+    pthread_t producers[MAX_PRODUCERS];
+    pthread_t consumers[MAX_CONSUMERS];
+    consumer state[MAX_CONSUMERS];
+    size_t total = (size_t)producerCount * entriesPerProducer;
+
+    if (!cobble_ring_init(&ring, capacity, sizeof(entry), policy)) {
+        fprintf(stderr, "Could not allocate the ring\n");
+        return false;
+    }
+    cobble_ring_set_discard(&ring, &on_discard, NULL);
+    seen = calloc(total, 1);
+    duplicates = discarded = attempts = 0;
+    memset(state, 0, sizeof(state));
+
+    uint64_t start = now_ns();
+    producing = 1;
+    for (int i = 0; i < consumerCount; i++)
+        pthread_create(&consumers[i], NULL, consume, &state[i]);
+    for (int i = 0; i < producerCount; i++)
+        pthread_create(&producers[i], NULL, produce, (void*)(uintptr_t)i);
+    for (int i = 0; i < producerCount; i++)
+        pthread_join(producers[i], NULL);
+    __atomic_store_n(&producing, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < consumerCount; i++)
+        pthread_join(consumers[i], NULL);
+    double elapsed = (double)(now_ns() - start);
+
+    uint64_t delivered = 0, reordered = 0, torn = 0;
+    for (int i = 0; i < consumerCount; i++) {
+        delivered += state[i].popped;
+        reordered += state[i].reordered;
+        torn += state[i].torn;
+    }
+    uint64_t pushed = cobble_ring_pushed(&ring);
+    uint64_t dropped = cobble_ring_dropped(&ring);
+
+    // Rejected entries are only counted as dropped, discarded ones were pushed first
+    uint64_t rejected = dropped - discarded;
+    bool balanced = attempts == pushed + rejected && pushed == delivered + discarded && attempts == delivered + dropped;
+    bool passed = balanced && reordered == 0 && torn == 0 && duplicates == 0;
+    if (policy == RingPolicy_DropOldest)
+        passed = passed && rejected == 0;
+
+    printf("{\"policy\": \"%s\", \"producers\": %i, \"consumers\": %i, \"capacity\": %zu, \"attempts\": %llu, \"pushed\": %llu, "
+        "\"delivered\": %llu, \"dropped\": %llu, \"discarded\": %llu, \"reordered\": %llu, \"torn\": %llu, \"duplicates\": %llu, "
+        "\"ns_per_entry\": %.1f, \"passed\": %s}\n",
+        label, producerCount, consumerCount, capacity, (unsigned long long)attempts, (unsigned long long)pushed,
+        (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)discarded, (unsigned long long)reordered,
+        (unsigned long long)torn, (unsigned long long)duplicates, elapsed / attempts, passed ? "true" : "false");
+    fprintf(stderr, "%-12s %llu pushed  %llu delivered  %llu dropped (%llu of them oldest)  %llu reordered  %llu torn  %llu duplicates  %s\n",
+        label, (unsigned long long)pushed, (unsigned long long)delivered, (unsigned long long)dropped, (unsigned long long)discarded,
+        (unsigned long long)reordered, (unsigned long long)torn, (unsigned long long)duplicates, passed ? "passed" : "FAILED");
+
+    free((void*)seen);
+    cobble_ring_free(&ring);
+    return passed;
+}
+
+int main(int argc, char** argv) {
+
+    producerCount = (argc > 1) ? atoi(argv[1]) : 4;
+    consumerCount = (argc > 2) ? atoi(argv[2]) : 2;
+    entriesPerProducer = (argc > 3) ? atoi(argv[3]) : 200000;
+    int capacity = (argc > 4) ? atoi(argv[4]) : 64;
+    if (producerCount < 1 || producerCount > MAX_PRODUCERS || consumerCount < 1 || consumerCount > MAX_CONSUMERS
+        || entriesPerProducer < 1 || capacity < 2) {
+        fprintf(stderr, "Usage: bench_ring_stress [producers (1 to %i)] [consumers (1 to %i)] [entries per producer] [ring capacity]\n",
+            MAX_PRODUCERS, MAX_CONSUMERS);
+        return 1;
+    }
+
+    bool passed = run("drop newest", RingPolicy_DropNewest, (size_t)capacity);
+    passed = run("drop oldest", RingPolicy_DropOldest, (size_t)capacity) && passed;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+// Scan results from a room full of beacons, with and without coalescing (see src/cobble_scan_table.h)
+// A producer thread plays the part of a Bluetooth stack reporting every advertisement, as CoreBluetooth does when
+// duplicates are allowed and Windows always does, while the main thread calls cobble_queue_process() once a frame.
+// Each beacon's RSSI varies by up to noise dBm either side of its own mean, and only every other advertisement carries
+// its name, as when names come in scan responses.
+//
+// For each coalescing interval, reports the advertisements made, the scan results delivered and dropped, the most results
+// any one device had in a second, how far the delivered RSSI was from each beacon's mean, and how many results came
+// without a name. Then half the beacons fall silent, and the device count is checked once they have expired.
+//
+// Usage: bench_scan_coalesce [beacons=N] [advertising=ms] [noise=dBm] [duration=seconds] [interval=ms]
+// Without interval=, runs are made without coalescing and with 250 ms and 1000 ms intervals.
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_scan_table.h"
+
+#define MAX_BEACONS 600
+#define FRAME_US 16000
+#define EXPIRY_MS 1000
+
+typedef struct {
+    char identifier[24];
+    char name[32];
+    int mean;
+    volatile bool silent;
+    uint64_t sent;
+    uint64_t nextAdvertisement;
+} beacon;
+
+static beacon beacons[MAX_BEACONS];
+
+static int beaconCount = 300;
+static double advertisingMs = 20;
+static int noise = 8;
+static double duration = 2;
+
+static volatile bool producing;
+static uint64_t advertisements;
+
+// Per-device tallies, kept by the callback on the main thread
+static uint64_t delivered;
+static uint64_t unnamed;
+static double rssiError;
+static int resultsThisSecond[MAX_BEACONS];
+static int mostInASecond;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+
+    // Identifiers are C0:00:00:00:hh:ll, the beacon's index
+    int index = (int)strtol(identifier + 12, NULL, 16) * 256 + (int)strtol(identifier + 15, NULL, 16);
+    if (index < 0 || index >= beaconCount)
+        return;
+
+    delivered++;
+    if (name == NULL || name[0] == '\0')
+        unnamed++;
+    rssiError += abs(rssi - beacons[index].mean);
+    if (++resultsThisSecond[index] > mostInASecond)
+        mostInASecond = resultsThisSecond[index];
+}
+
+static void* producer(void* arg) {
+
+    (void)arg;
+
+    while (producing) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < beaconCount; i++) {
+            beacon* b = &beacons[i];
+            if (b->silent || now < b->nextAdvertisement)
+                continue;
+            b->nextAdvertisement += (uint64_t)(advertisingMs * 1000000);
+            int rssi = b->mean + rand() % (2 * noise + 1) - noise;
+            cobble_event_scanresult((b->sent++ % 2 == 0) ? b->name : NULL, rssi, b->identifier);
+            advertisements++;
+        }
+        usleep(500);
+    }
+
+    return NULL;
+}
+
+static void reset_beacons(void) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < beaconCount; i++) {
+        beacon* b = &beacons[i];
+        snprintf(b->identifier, sizeof(b->identifier), "C0:00:00:00:%02X:%02X", i / 256, i % 256);
+        snprintf(b->name, sizeof(b->name), "Beacon %i", i);
+        b->mean = -50 - (i * 37) % 45;
+        b->silent = false;
+        b->sent = 0;
+        // Spread across the advertising interval, as real beacons are not in step
+        b->nextAdvertisement = now + (uint64_t)(advertisingMs * 1000000) * i / beaconCount;
+    }
+}
+
+static void run(int interval) {
+
+    cobble_scan_coalesce_set(interval, EXPIRY_MS);
+    cobble_queue_process();
+    reset_beacons();
+
+    uint64_t dropped = cobble_queue_dropped_get();
+    delivered = unnamed = advertisements = 0;
+    rssiError = 0;
+    mostInASecond = 0;
+    memset(resultsThisSecond, 0, sizeof(resultsThisSecond));
+
+    pthread_t thread;
+    producing = true;
+    pthread_create(&thread, NULL, producer, NULL);
+
+    uint64_t start = now_ns();
+    uint64_t second = start;
+    while (now_ns() - start < (uint64_t)(duration * 1e9)) {
+        usleep(FRAME_US);
+        cobble_queue_process();
+        if (now_ns() - second >= 1000000000ull) {
+            memset(resultsThisSecond, 0, sizeof(resultsThisSecond));
+            second += 1000000000ull;
+        }
+    }
+
+    // Half the beacons go quiet, and should be forgotten once they have been quiet for the expiry time
+    for (int i = 0; i < beaconCount; i += 2)
+        beacons[i].silent = true;
+    uint64_t quietFrom = now_ns();
+    while (now_ns() - quietFrom < (EXPIRY_MS + 200) * 1000000ull) {
+        usleep(FRAME_US);
+        cobble_queue_process();
+    }
+    int remaining = cobble_scan_device_count();
+
+    producing = false;
+    pthread_join(thread, NULL);
+    cobble_queue_process();
+    dropped = cobble_queue_dropped_get() - dropped;
+
+    char label[32];
+    if (interval == 0)
+        snprintf(label, sizeof(label), "off");
+    else
+        snprintf(label, sizeof(label), "%i ms", interval);
+
+    printf("{\"interval_ms\": %i, \"beacons\": %i, \"advertisements\": %llu, \"delivered\": %llu, \"dropped\": %llu, "
+        "\"max_per_device_per_second\": %i, \"mean_rssi_error\": %.2f, \"unnamed\": %llu, \"devices_after_expiry\": %i}\n",
+        interval, beaconCount, (unsigned long long)advertisements, (unsigned long long)delivered, (unsigned long long)dropped,
+        mostInASecond, delivered ? rssiError / delivered : 0, (unsigned long long)unnamed, remaining);
+    fprintf(stderr, "%-8s %8llu advertisements  %8llu delivered  %7llu dropped  %4i/s per device  RSSI error %5.2f dBm  %3.0f%% unnamed  %i devices left of %i\n",
+        label, (unsigned long long)advertisements, (unsigned long long)delivered, (unsigned long long)dropped, mostInASecond,
+        delivered ? rssiError / delivered : 0, delivered ? 100.0 * unnamed / delivered : 0, remaining, beaconCount);
+}
+
+int main(int argc, char** argv) {
+
+    int interval = -1;
+
+    for (int i = 1; i < argc; i++) {
+        char* eq = strchr(argv[i], '=');
+        if (eq == NULL) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+        const char* value = eq + 1;
+        if (strcmp(argv[i], "beacons") == 0)
+            beaconCount = atoi(value);
+        else if (strcmp(argv[i], "advertising") == 0)
+            advertisingMs = atof(value);
+        else if (strcmp(argv[i], "noise") == 0)
+            noise = atoi(value);
+        else if (strcmp(argv[i], "duration") == 0)
+            duration = atof(value);
+        else if (strcmp(argv[i], "interval") == 0)
+            interval = atoi(value);
+        else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (beaconCount < 1 || beaconCount > MAX_BEACONS || advertisingMs <= 0) {
+        fprintf(stderr, "beacons must be from 1 to %i, and advertising more than 0\n", MAX_BEACONS);
+        return 1;
+    }
+
+    register_scanresult_cb(&on_scanresult);
+    srand(1);
+
+    if (interval >= 0) {
+        run(interval);
+    } else {
+        run(0);
+        run(250);
+        run(1000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+// The cost of a scan among many devices, of which few are wanted, with and without the scan filter (see
+// src/cobble_scan_filter.h)
+// Each advertisement goes through a backend's path: it is checked against the filter, and if it passes (or there is no
+// filter) its identifier is formatted and it is queued as a scan result, which cobble_queue_process() delivers in batches.
+// One device in every `wanted` is a sensor the application is looking for. Without a filter, the application picks them
+// out by name in its callback, as it had to before.
+//
+// For each filter, reports the time and heap allocations per advertisement, and the scan results queued and delivered.
+//
+// Usage: bench_scan_filter [advertisements] [devices] [wanted]
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_scan_filter.h"
+
+#include "alloc_count.h"
+
+#define MAX_DEVICES 4096
+
+// Advertisements made between each call to cobble_queue_process(), well within the queue length
+#define BATCH 256
+
+#define SENSOR_COMPANY 0x0059
+#define OTHER_COMPANY 0x004C
+
+typedef struct {
+    uint64_t address;
+    char name[32];
+    int rssi;
+    cobble_uuid service;
+    int manufacturerId;
+    uint8_t manufacturerData[4];
+} device;
+
+static device devices[MAX_DEVICES];
+
+static const char* SENSOR_SERVICE = "C5D70001-C45D-4F12-8693-7EF838E96446";
+static const char* OTHER_SERVICE = "0000FEAA-0000-1000-8000-00805F9B34FB";
+
+static uint64_t delivered = 0;
+static uint64_t wantedDelivered = 0;
+
+static void on_scanresult(const char* name, int rssi, const char* identifier) {
+    (void)rssi;
+    (void)identifier;
+    delivered++;
+    if (name != NULL && strncmp(name, "Sensor", 6) == 0)
+        wantedDelivered++;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void make_devices(int count, int wanted) {
+    cobble_uuid sensor, other;
+    cobble_uuid_parse(SENSOR_SERVICE, &sensor);
+    cobble_uuid_parse(OTHER_SERVICE, &other);
+
+    for (int i = 0; i < count; i++) {
+        device* d = &devices[i];
+        bool isSensor = (i % wanted) == 0;
+        d->address = 0xC00000000000ULL | (uint64_t)i;
+        snprintf(d->name, sizeof(d->name), "%s %i", isSensor ? "Sensor" : "Beacon", i);
+        // Sensors are near, and most other devices further away
+        d->rssi = isSensor ? -55 : -60 - (i * 37) % 40;
+        d->service = isSensor ? sensor : other;
+        d->manufacturerId = isSensor ? SENSOR_COMPANY : OTHER_COMPANY;
+        d->manufacturerData[0] = isSensor ? 0x01 : 0x02;
+        d->manufacturerData[1] = (uint8_t)i;
+        d->manufacturerData[2] = 0xAA;
+        d->manufacturerData[3] = 0xBB;
+    }
+}
+
+// As a backend does it: the filter first, then the formatting
+static void advertise(const device* d) {
+
+    cobble_advertisement adv;
+    adv.fields = ScanField_Services | ScanField_Name | ScanField_Manufacturer | ScanField_Rssi;
+    adv.services = &d->service;
+    adv.serviceCount = 1;
+    adv.name = d->name;
+    adv.manufacturerId = d->manufacturerId;
+    adv.manufacturerData = d->manufacturerData;
+    adv.manufacturerLength = sizeof(d->manufacturerData);
+    adv.rssi = d->rssi;
+    if (!cobble_scan_filter_match(&adv))
+        return;
+
+    char identifier[24];
+    snprintf(identifier, sizeof(identifier), "%02X:%02X:%02X:%02X:%02X:%02X",
+        (unsigned)(d->address >> 40) & 0xFF, (unsigned)(d->address >> 32) & 0xFF, (unsigned)(d->address >> 24) & 0xFF,
+        (unsigned)(d->address >> 16) & 0xFF, (unsigned)(d->address >> 8) & 0xFF, (unsigned)d->address & 0xFF);
+    cobble_event_scanresult(d->name, d->rssi, identifier);
+}
+
+static void run(const char* label, const cobble_scan_filter* filter, int advertisements, int count) {
+
+    if (!cobble_scan_filter_set(filter)) {
+        fprintf(stderr, "Filter %s was not accepted\n", label);
+        exit(1);
+    }
+    cobble_scan_filter_begin(NULL);
+
+    // Warm up, then measure
+    for (int pass = 0; pass < 2; pass++) {
+        delivered = wantedDelivered = 0;
+        uint64_t dropped = cobble_queue_dropped_get();
+        uint64_t allocations = bench_allocations();
+        uint64_t start = now_ns();
+
+        for (int i = 0; i < advertisements; i += BATCH) {
+            for (int j = 0; j < BATCH && i + j < advertisements; j++)
+                advertise(&devices[(i + j) % count]);
+            cobble_queue_process();
+        }
+
+        uint64_t elapsed = now_ns() - start;
+        allocations = bench_allocations() - allocations;
+        dropped = cobble_queue_dropped_get() - dropped;
+        if (pass == 0)
+            continue;
+
+        printf("{\"filter\": \"%s\", \"advertisements\": %i, \"ns_per_advertisement\": %.1f, \"allocations_per_advertisement\": %.3f, "
+            "\"delivered\": %llu, \"wanted_delivered\": %llu, \"dropped\": %llu}\n",
+            label, advertisements, (double)elapsed / advertisements, (double)allocations / advertisements,
+            (unsigned long long)delivered, (unsigned long long)wantedDelivered, (unsigned long long)dropped);
+        fprintf(stderr, "%-14s %7.1f ns/advertisement  %6.3f allocations  %8llu delivered  %8llu wanted\n",
+            label, (double)elapsed / advertisements, (double)allocations / advertisements,
+            (unsigned long long)delivered, (unsigned long long)wantedDelivered);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    int advertisements = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int count = (argc > 2) ? atoi(argv[2]) : 500;
+    int wanted = (argc > 3) ? atoi(argv[3]) : 25;
+    if (advertisements < 1 || count < 1 || count > MAX_DEVICES || wanted < 1) {
+        fprintf(stderr, "Usage: bench_scan_filter [advertisements] [devices (up to %i)] [wanted]\n", MAX_DEVICES);
+        return 1;
+    }
+
+    register_scanresult_cb(&on_scanresult);
+    make_devices(count, wanted);
+
+    const uint8_t data[] = { 0x01 };
+    const uint8_t masked[] = { 0x01, 0x00, 0xAA };
+    const uint8_t mask[] = { 0xFF, 0x00, 0xFF };
+
+    cobble_scan_filter byName = { NULL, "Sensor", COBBLE_MANUFACTURER_ANY, NULL, NULL, 0, 0 };
+    cobble_scan_filter byCompany = { NULL, NULL, SENSOR_COMPANY, data, NULL, sizeof(data), 0 };
+    cobble_scan_filter byMask = { NULL, NULL, SENSOR_COMPANY, masked, mask, sizeof(masked), 0 };
+    cobble_scan_filter byService = { "180F,180A,FE59,C5D70001-C45D-4F12-8693-7EF838E96446", NULL, COBBLE_MANUFACTURER_ANY, NULL, NULL, 0, 0 };
+    cobble_scan_filter byRssi = { NULL, NULL, COBBLE_MANUFACTURER_ANY, NULL, NULL, 0, -58 };
+
+    run("none", NULL, advertisements, count);
+    run("name", &byName, advertisements, count);
+    run("manufacturer", &byCompany, advertisements, count);
+    run("masked", &byMask, advertisements, count);
+    run("services", &byService, advertisements, count);
+    run("rssi", &byRssi, advertisements, count);
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+// Aggregate throughput with several devices connected at once, using the simulated backend
+// The simulator plays a number of identical peripherals, each streaming notifications at a fixed rate over its own link.
+// For each number of links, every device is connected and subscribed to, then the values arriving through the deferred
+// event core are counted per connection for a while. As each link carries its own values, the total delivered should
+// grow in step with the number of links, while the latency of each value (from the time the peripheral generated it,
+// which includes waiting for the link's next connection event) stays the same. Each link is subscribed to once its
+// discovery is complete, and the time discovery took on each is reported too.
+//
+// Results are written to stdout as JSON, and a summary to stderr, as with bench_pipeline. Cobble's own messages are sent
+// to stderr too, so that they don't get into the JSON.
+//
+// Usage: bench_sim_connections [links=N] [rate=values/sec per link] [interval=ms] [payload=bytes] [duration=seconds]
+//                              [poll_us=microseconds between cobble_queue_process() calls]
+// With no links argument, runs are made with 1, 2, 5, 10 and 20 links.
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define TX_CHARACTERISTIC "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
+#define FIRST_ADDRESS 0x5E1100000001ull
+
+#define MAX_LINKS COBBLE_MAX_CONNECTIONS
+#define MAX_RUNS 8
+
+// Latencies beyond this many values are not recorded (16 MB of samples)
+#define MAX_SAMPLES (4 * 1024 * 1024)
+
+typedef struct {
+    int links;
+    double rate;
+    double interval;
+    int payload;
+    double duration;
+    int pollMicroseconds;
+} run_config;
+
+typedef struct {
+    uint64_t delivered;
+    uint64_t dropped;
+    double elapsed;
+    uint64_t minPerLink, maxPerLink;
+    uint64_t p50, p99, max;
+    double mean;
+    int discoveryMeanMs, discoveryMaxMs;
+} run_result;
+
+static FILE* json;
+static cobble_char_handle txHandle;
+
+// Indexed by cobble_connection_index()
+static cobble_conn_handle handles[COBBLE_MAX_CONNECTIONS];
+static uint64_t received[COBBLE_MAX_CONNECTIONS];
+static int connected = 0;
+static int subscribed = 0;
+static int failed = 0;
+static int discoveryTotalMs = 0;
+static int discoveryMaxMs = 0;
+
+static uint32_t* samples;
+static uint64_t sampleCount = 0;
+static bool measuring = false;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Callbacks, all made on the main thread by cobble_queue_process()
+ */
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)connection;
+    (void)identifier;
+    if (status == ConnectionStatus_DidConnect)
+        connected++;
+    else if (status == ConnectionStatus_DidConnectFailed)
+        failed++;
+    else
+        connected--;
+}
+
+static void on_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+    (void)services;
+    (void)characteristics;
+    discoveryTotalMs += elapsedMs;
+    if (elapsedMs > discoveryMaxMs)
+        discoveryMaxMs = elapsedMs;
+    cobble_subscribe_c(connection, txHandle);
+    subscribed++;
+}
+
+// The simulator puts the time the value was generated after the sequence number
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    uint64_t generatedAt;
+
+    if (!measuring || characteristic != txHandle || len < 12)
+        return;
+
+    received[cobble_connection_index(connection)]++;
+
+    memcpy(&generatedAt, data + 4, sizeof(generatedAt));
+    uint64_t latency = now_ns() - generatedAt;
+    if (sampleCount < MAX_SAMPLES)
+        samples[sampleCount] = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+    sampleCount++;
+}
+
+/*
+ * Runs
+ */
+
+static void pump_until(const run_config* c, uint64_t until, const volatile int* counter, int target) {
+    while (now_ns() < until && (counter == NULL || *counter != target)) {
+        cobble_queue_process();
+        usleep(c->pollMicroseconds);
+    }
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t count, double p) {
+    if (count == 0)
+        return 0;
+    uint64_t i = (uint64_t)(p * (count - 1));
+    return samples[i];
+}
+
+static bool run(const run_config* c, run_result* r) {
+
+    char script[256];
+    char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+
+    snprintf(script, sizeof(script), "devices=%i;rate=%f;interval=%f;payload=%i;mtu=247;connect_delay=10",
+        c->links, c->rate, c->interval, c->payload);
+    if (!cobble_sim_configure(script))
+        return false;
+
+    connected = subscribed = failed = 0;
+    discoveryTotalMs = discoveryMaxMs = 0;
+    memset(received, 0, sizeof(received));
+    memset(handles, 0, sizeof(handles));
+    sampleCount = 0;
+    measuring = false;
+
+    cobble_init();
+
+    for (int i = 0; i < c->links; i++) {
+        cobble_address_format(FIRST_ADDRESS + i, identifier);
+        cobble_conn_handle h = cobble_connect(identifier);
+        if (h == COBBLE_CONNECTION_NONE) {
+            fprintf(stderr, "Could not connect to %s\n", identifier);
+            cobble_deinit();
+            return false;
+        }
+        handles[cobble_connection_index(h)] = h;
+    }
+
+    // Wait for every link to come up and be subscribed, then let the values settle into their steady rate
+    pump_until(c, now_ns() + 5000000000ull, (volatile int*)&subscribed, c->links);
+    if (subscribed != c->links || failed != 0) {
+        fprintf(stderr, "Only %i of %i links were subscribed\n", subscribed, c->links);
+        cobble_deinit();
+        return false;
+    }
+    pump_until(c, now_ns() + 100000000ull, NULL, 0);
+    r->discoveryMeanMs = discoveryTotalMs / c->links;
+    r->discoveryMaxMs = discoveryMaxMs;
+
+    uint64_t droppedBefore = cobble_queue_dropped_get();
+    uint64_t start = now_ns();
+    measuring = true;
+    pump_until(c, start + (uint64_t)(c->duration * 1e9), NULL, 0);
+    measuring = false;
+    r->elapsed = (now_ns() - start) / 1e9;
+    r->dropped = cobble_queue_dropped_get() - droppedBefore;
+
+    cobble_disconnect();
+    pump_until(c, now_ns() + 1000000000ull, (volatile int*)&connected, 0);
+    cobble_deinit();
+
+    r->delivered = 0;
+    r->minPerLink = UINT64_MAX;
+    r->maxPerLink = 0;
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        if (handles[i] == COBBLE_CONNECTION_NONE)
+            continue;
+        r->delivered += received[i];
+        if (received[i] < r->minPerLink)
+            r->minPerLink = received[i];
+        if (received[i] > r->maxPerLink)
+            r->maxPerLink = received[i];
+    }
+
+    uint64_t count = (sampleCount < MAX_SAMPLES) ? sampleCount : MAX_SAMPLES;
+    double sum = 0;
+    for (uint64_t i = 0; i < count; i++)
+        sum += samples[i];
+    qsort(samples, count, sizeof(samples[0]), compare_u32);
+    r->p50 = percentile(count, 0.5);
+    r->p99 = percentile(count, 0.99);
+    r->max = count ? samples[count - 1] : 0;
+    r->mean = count ? sum / count : 0;
+
+    return true;
+}
+
+static void print_result(const run_config* c, const run_result* r, bool last) {
+
+    fprintf(json, "    {\"links\": %i, \"rate_per_link\": %.0f, \"interval_ms\": %.2f, \"payload\": %i, \"duration_s\": %.3f, \"poll_us\": %i,\n",
+        c->links, c->rate, c->interval, c->payload, r->elapsed, c->pollMicroseconds);
+    fprintf(json, "     \"delivered\": %llu, \"dropped\": %llu, \"throughput_per_s\": %.0f, \"per_link_min\": %llu, \"per_link_max\": %llu,\n",
+        (unsigned long long)r->delivered, (unsigned long long)r->dropped, r->delivered / r->elapsed,
+        (unsigned long long)r->minPerLink, (unsigned long long)r->maxPerLink);
+    fprintf(json, "     \"discovery_ms\": {\"mean\": %i, \"max\": %i},\n", r->discoveryMeanMs, r->discoveryMaxMs);
+    fprintf(json, "     \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu, \"mean\": %.0f}}%s\n",
+        (unsigned long long)r->p50, (unsigned long long)r->p99, (unsigned long long)r->max, r->mean, last ? "" : ",");
+
+    fprintf(stderr, "links=%-2i rate=%-5.0f  %8.0f values/s  (%6.0f per link)  p50 %6.2f ms  p99 %6.2f ms  dropped %llu\n",
+        c->links, c->rate, r->delivered / r->elapsed, r->delivered / r->elapsed / c->links, r->p50 / 1e6, r->p99 / 1e6,
+        (unsigned long long)r->dropped);
+}
+
+static bool parse_arg(run_config* c, const char* arg) {
+
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    value++;
+
+    if (strncmp(arg, "links=", 6) == 0)
+        c->links = atoi(value);
+    else if (strncmp(arg, "rate=", 5) == 0)
+        c->rate = atof(value);
+    else if (strncmp(arg, "interval=", 9) == 0)
+        c->interval = atof(value);
+    else if (strncmp(arg, "payload=", 8) == 0)
+        c->payload = atoi(value);
+    else if (strncmp(arg, "duration=", 9) == 0)
+        c->duration = atof(value);
+    else if (strncmp(arg, "poll_us=", 8) == 0)
+        c->pollMicroseconds = atoi(value);
+    else
+        return false;
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    static const int standardLinks[] = { 1, 2, 5, 10, 20 };
+
+    run_config defaults = { 0, 1000, 7.5, 20, 2.0, 500 };
+    run_config runs[MAX_RUNS];
+    int runCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!parse_arg(&defaults, argv[i])) {
+            fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (defaults.links > 0) {
+        runs[runCount++] = defaults;
+    } else {
+        for (int i = 0; i < (int)(sizeof(standardLinks) / sizeof(standardLinks[0])); i++) {
+            runs[runCount] = defaults;
+            runs[runCount++].links = standardLinks[i];
+        }
+    }
+
+    for (int i = 0; i < runCount; i++) {
+        run_config* c = &runs[i];
+        if (c->links < 1 || c->links > MAX_LINKS || c->duration <= 0 || c->rate <= 0) {
+            fprintf(stderr, "Need 1 to %i links, a positive duration and a positive rate\n", MAX_LINKS);
+            return 1;
+        }
+        // Values carry a sequence number and their generation time in the first 12 bytes
+        if (c->payload < 12) {
+            fprintf(stderr, "Payload must be at least 12 bytes\n");
+            return 1;
+        }
+    }
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    samples = malloc(MAX_SAMPLES * sizeof(samples[0]));
+    txHandle = cobble_characteristic_handle(TX_CHARACTERISTIC);
+
+    register_connectionstatus_c_cb(on_connectionstatus);
+    register_discoverycomplete_cb(on_discoverycomplete);
+    register_updatevalue_c_cb(on_updatevalue);
+
+    fprintf(json, "{\n  \"benchmark\": \"sim_connections\",\n  \"cpus\": %li,\n  \"results\": [\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (int i = 0; i < runCount; i++) {
+        run_result r;
+        if (!run(&runs[i], &r)) {
+            fclose(json);
+            free(samples);
+            return 1;
+        }
+        print_result(&runs[i], &r, i == runCount - 1);
+    }
+
+    fprintf(json, "  ]\n}\n");
+
+    fclose(json);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,394 @@
+// Nordic Secure DFU against the simulated backend's DFU target, and the CRC it depends on
+// A firmware image is sent to a simulated device in its bootloader with cobble_dfu_start(), in several ways:
+// - no_receipts: no Packet Receipt Notifications, so each object is only checked once it has all been sent
+// - lockstep: a receipt every 12 packets, waiting for each before sending more, as most DFU libraries do
+// - windowed: a receipt every 12 packets, with up to 4 groups of packets sent ahead of their receipts (the default)
+// - corrupt: as windowed, with one packet corrupted on its way to the device, so that an object has to be sent again
+// - resume: as windowed, with the device dropping the link every so often, so that the update is started again after
+//   each reconnection and carries on from where the device got to
+// The time from cobble_dfu_start() to DfuStage_Complete gives the throughput, which is compared with what the link could
+// carry: packets * (mtu - 3) bytes per connection interval. The update only completes if every object's CRC, as
+// calculated by the target, matched the image.
+//
+// The CRC-32 used to check receipts is also timed: slice-by-8 (cobble_crc32()) against a table lookup a byte at a
+// time, and the engine's CRC carried on from the last receipt against recalculating it over everything sent so far
+// at each receipt.
+//
+// Results are written to stdout as JSON, and a summary to stderr, as with bench_pipeline. Cobble's own messages are sent
+// to stderr too, so that they don't get into the JSON. Exits with 1 if an update fails.
+//
+// Usage: bench_sim_dfu [mode=no_receipts|lockstep|windowed|corrupt|resume] [size=bytes] [mtu=bytes] [interval=ms]
+//                      [packets=per connection event] [object=bytes]
+// With no mode argument, a run is made with each mode.
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+#include "../src/cobble_crc32.h"
+#include "../src/cobble_dfu.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define ADDRESS "5E:11:00:00:00:01"
+#define INIT_PACKET_SIZE 141
+
+// The receipt settings of each mode
+#define RECEIPT_PACKETS 12
+#define WINDOW 4
+
+// For resume: the link is dropped this long after each connection is made
+#define RESUME_DISCONNECT_MS 1500
+#define MAX_CONNECTIONS 100
+
+#define CRC_BLOCK (4 * 1024 * 1024)
+#define CRC_REPEATS 8
+
+#define MAX_RUNS 8
+
+typedef enum {
+    Mode_NoReceipts,
+    Mode_Lockstep,
+    Mode_Windowed,
+    Mode_Corrupt,
+    Mode_Resume,
+} Mode;
+
+static const char* modeNames[] = { "no_receipts", "lockstep", "windowed", "corrupt", "resume" };
+
+typedef struct {
+    Mode mode;
+    int size;
+    int mtu;
+    double interval;
+    int packets;
+    int object;
+} run_config;
+
+typedef struct {
+    double elapsed;
+    double throughput;
+    double capacity;
+    int confirmed;
+    int connections;
+    bool complete;
+} run_result;
+
+static FILE* json;
+static cobble_char_handle packetHandle;
+
+static bool connected = false;
+static bool disconnected = false;
+static bool discovered = false;
+
+static bool ended = false;
+static int endStage = 0;
+static int confirmed = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Callbacks, all made on the main thread by cobble_queue_process()
+ */
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)connection;
+    (void)identifier;
+    if (status == ConnectionStatus_DidConnect)
+        connected = true;
+    else
+        disconnected = true;
+}
+
+static void on_characteristicdiscovered(cobble_conn_handle connection, const char* service, const char* characteristic) {
+    (void)connection;
+    (void)service;
+    if (cobble_characteristic_handle(characteristic) == packetHandle)
+        discovered = true;
+}
+
+static void on_dfuprogress(cobble_conn_handle connection, int stage, int done, int total) {
+    (void)connection;
+    (void)total;
+    if (stage == DfuStage_Firmware)
+        confirmed = done;
+    if (stage == DfuStage_Complete || stage == DfuStage_Failed) {
+        endStage = stage;
+        ended = true;
+    }
+}
+
+/*
+ * Runs
+ */
+
+static bool pump_until(uint64_t until, const volatile bool* done) {
+    while (now_ns() < until && !*done) {
+        cobble_queue_process();
+        usleep(200);
+    }
+    return *done;
+}
+
+static cobble_conn_handle connect_and_discover(void) {
+
+    connected = disconnected = discovered = false;
+
+    cobble_conn_handle connection = cobble_connect(ADDRESS);
+    if (connection == COBBLE_CONNECTION_NONE || !pump_until(now_ns() + 5000000000ull, (volatile bool*)&discovered)) {
+        fprintf(stderr, "The DFU characteristics were not discovered\n");
+        return COBBLE_CONNECTION_NONE;
+    }
+    return connection;
+}
+
+static bool run(const run_config* c, run_result* r) {
+
+    char script[256];
+    uint8_t init[INIT_PACKET_SIZE];
+    uint8_t* firmware = malloc(c->size);
+
+    // Different bytes all the way through, so that a part sent to the wrong place would fail its CRC
+    for (int i = 0; i < INIT_PACKET_SIZE; i++)
+        init[i] = (uint8_t)(i * 13);
+    for (int i = 0; i < c->size; i++)
+        firmware[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    // The corrupted packet is part way into the firmware, after the init packet's few
+    snprintf(script, sizeof(script), "mtu=%i;interval=%f;packets=%i;connect_delay=10;rate=0;dfu=on;dfu_object=%i;dfu_corrupt=%i;disconnect_after=%i",
+        c->mtu, c->interval, c->packets, c->object,
+        (c->mode == Mode_Corrupt) ? (c->size / (c->mtu - 3)) / 2 : 0,
+        (c->mode == Mode_Resume) ? RESUME_DISCONNECT_MS : 0);
+    if (!cobble_sim_configure(script)) {
+        free(firmware);
+        return false;
+    }
+
+    if (c->mode == Mode_NoReceipts)
+        cobble_dfu_receipts_set(0, 1);
+    else
+        cobble_dfu_receipts_set(RECEIPT_PACKETS, (c->mode == Mode_Lockstep) ? 1 : WINDOW);
+
+    ended = false;
+    confirmed = 0;
+    r->connections = 0;
+
+    cobble_init();
+
+    uint64_t start = now_ns();
+
+    // Each connection, but the last for resume, ends with the update failing as the device disconnects
+    while (!ended || (c->mode == Mode_Resume && endStage == DfuStage_Failed && disconnected)) {
+        cobble_conn_handle connection = connect_and_discover();
+        if (connection == COBBLE_CONNECTION_NONE || ++r->connections > MAX_CONNECTIONS)
+            break;
+
+        ended = false;
+        if (!cobble_dfu_start(connection, init, sizeof(init), firmware, c->size)) {
+            fprintf(stderr, "The update could not be started\n");
+            break;
+        }
+        pump_until(start + 600000000000ull, (volatile bool*)&ended);
+
+        // Let the simulator see that the link has gone before connecting again
+        if (c->mode == Mode_Resume && !disconnected)
+            pump_until(now_ns() + 2 * (uint64_t)(c->interval * 1000000), (volatile bool*)&disconnected);
+    }
+
+    r->elapsed = (now_ns() - start) / 1e9;
+    r->complete = ended && endStage == DfuStage_Complete;
+    r->confirmed = confirmed;
+    r->throughput = c->size / r->elapsed;
+    r->capacity = c->packets * (c->mtu - 3) / (c->interval / 1000);
+
+    if (!disconnected) {
+        cobble_disconnect();
+        pump_until(now_ns() + 1000000000ull, (volatile bool*)&disconnected);
+    }
+    cobble_deinit();
+
+    free(firmware);
+    return true;
+}
+
+static void print_result(const run_config* c, const run_result* r) {
+
+    fprintf(json, "    {\"mode\": \"%s\", \"size\": %i, \"mtu\": %i, \"interval_ms\": %.2f, \"packets\": %i, \"object\": %i,\n",
+        modeNames[c->mode], c->size, c->mtu, c->interval, c->packets, c->object);
+    fprintf(json, "     \"complete\": %s, \"confirmed\": %i, \"connections\": %i, \"duration_s\": %.3f, \"throughput_bytes_per_s\": %.0f,\n",
+        r->complete ? "true" : "false", r->confirmed, r->connections, r->elapsed, r->throughput);
+    fprintf(json, "     \"capacity_bytes_per_s\": %.0f, \"efficiency\": %.3f},\n", r->capacity, r->throughput / r->capacity);
+
+    fprintf(stderr, "%-12s mtu=%-3i size=%-7i %9.0f bytes/s of %9.0f (%5.1f%%)  %i connection%s  %s\n",
+        modeNames[c->mode], c->mtu, c->size, r->throughput, r->capacity, 100 * r->throughput / r->capacity,
+        r->connections, (r->connections == 1) ? " " : "s", r->complete ? "complete" : "FAILED");
+}
+
+/*
+ * CRC
+ */
+
+static uint32_t bytewise_table[256];
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    while (len-- > 0)
+        crc = bytewise_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static double crc_rate(uint32_t (*crc32)(uint32_t, const uint8_t*, size_t), const uint8_t* block, uint32_t* result) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < CRC_REPEATS; i++)
+        *result = crc32(*result, block, CRC_BLOCK);
+    return (double)CRC_BLOCK * CRC_REPEATS / ((now_ns() - start) / 1e9);
+}
+
+// The time spent on CRCs for the receipts of an image, carrying the CRC on or recalculating it from the start
+static double receipts_time(int size, int group, bool recalculate, const uint8_t* block, uint32_t* result) {
+    uint64_t start = now_ns();
+    uint32_t crc = 0;
+    for (int offset = 0; offset < size; offset += group) {
+        int len = (size - offset < group) ? size - offset : group;
+        crc = recalculate ? cobble_crc32(0, block, offset + len) : cobble_crc32(crc, block + offset, len);
+    }
+    *result ^= crc;
+    return (now_ns() - start) / 1e9;
+}
+
+static void crc_bench(int size, int mtu) {
+
+    uint8_t* block = malloc(CRC_BLOCK);
+    uint32_t a = 0, b = 0, x = 0;
+    int group = RECEIPT_PACKETS * (mtu - 3);
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        bytewise_table[i] = crc;
+    }
+    for (int i = 0; i < CRC_BLOCK; i++)
+        block[i] = (uint8_t)(i * 31 + (i >> 11));
+
+    double slicing = crc_rate(cobble_crc32, block, &a);
+    double bytewise = crc_rate(crc32_bytewise, block, &b);
+    double carried = receipts_time(size, group, false, block, &x);
+    double recalculated = receipts_time(size, group, true, block, &x);
+
+    fprintf(json, "    {\"crc32\": \"slice_by_8\", \"bytes_per_s\": %.0f},\n", slicing);
+    fprintf(json, "    {\"crc32\": \"bytewise\", \"bytes_per_s\": %.0f},\n", bytewise);
+    fprintf(json, "    {\"receipts\": \"carried_on\", \"size\": %i, \"group\": %i, \"duration_s\": %.6f},\n", size, group, carried);
+    fprintf(json, "    {\"receipts\": \"recalculated\", \"size\": %i, \"group\": %i, \"duration_s\": %.6f, \"agree\": %s}\n",
+        size, group, recalculated, (a == b && x == 0) ? "true" : "false");
+
+    fprintf(stderr, "crc32        slice-by-8 %6.0f MB/s, bytewise %6.0f MB/s\n", slicing / 1e6, bytewise / 1e6);
+    fprintf(stderr, "receipts     carried on %8.3f ms, recalculated %8.3f ms (%i byte image, receipt every %i bytes)\n",
+        carried * 1000, recalculated * 1000, size, group);
+
+    free(block);
+}
+
+static bool parse_arg(run_config* c, bool* modeGiven, const char* arg) {
+
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    value++;
+
+    if (strncmp(arg, "mode=", 5) == 0) {
+        for (int m = 0; m < (int)(sizeof(modeNames) / sizeof(modeNames[0])); m++) {
+            if (strcmp(value, modeNames[m]) == 0) {
+                c->mode = (Mode)m;
+                *modeGiven = true;
+                return true;
+            }
+        }
+        return false;
+    } else if (strncmp(arg, "size=", 5) == 0) {
+        c->size = atoi(value);
+    } else if (strncmp(arg, "mtu=", 4) == 0) {
+        c->mtu = atoi(value);
+    } else if (strncmp(arg, "interval=", 9) == 0) {
+        c->interval = atof(value);
+    } else if (strncmp(arg, "packets=", 8) == 0) {
+        c->packets = atoi(value);
+    } else if (strncmp(arg, "object=", 7) == 0) {
+        c->object = atoi(value);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    run_config defaults = { Mode_Windowed, 256 * 1024, 247, 7.5, 6, 4096 };
+    run_config runs[MAX_RUNS];
+    int runCount = 0;
+    bool modeGiven = false;
+    bool ok = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (!parse_arg(&defaults, &modeGiven, argv[i])) {
+            fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (modeGiven) {
+        runs[runCount++] = defaults;
+    } else {
+        for (int m = 0; m < (int)(sizeof(modeNames) / sizeof(modeNames[0])); m++) {
+            runs[runCount] = defaults;
+            runs[runCount++].mode = (Mode)m;
+        }
+    }
+
+    for (int i = 0; i < runCount; i++) {
+        if (runs[i].size < 1 || runs[i].mtu < 23 || runs[i].mtu > 517 || runs[i].object < 64 || runs[i].object > 65536) {
+            fprintf(stderr, "Need a positive size, an MTU from 23 to 517 and an object size from 64 to 65536\n");
+            return 1;
+        }
+    }
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    packetHandle = cobble_characteristic_handle(COBBLE_DFU_PACKET);
+
+    register_connectionstatus_c_cb(on_connectionstatus);
+    register_characteristicdiscovered_c_cb(on_characteristicdiscovered);
+    register_dfuprogress_cb(on_dfuprogress);
+
+    fprintf(json, "{\n  \"benchmark\": \"sim_dfu\",\n  \"results\": [\n");
+
+    for (int i = 0; i < runCount; i++) {
+        run_result r;
+        if (!run(&runs[i], &r)) {
+            fclose(json);
+            return 1;
+        }
+        print_result(&runs[i], &r);
+        ok = ok && r.complete;
+    }
+
+    crc_bench(defaults.size, defaults.mtu);
+
+    fprintf(json, "  ]\n}\n");
+
+    fclose(json);
+    return ok ? 0 : 1;
+}
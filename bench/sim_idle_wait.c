@@ -0,0 +1,223 @@
+// CPU used waiting for events, using the simulated backend
+// One simulated peripheral is connected to, then left idle or subscribed to at a steady rate, while the application's
+// thread takes events from the deferred core in one of these ways:
+// * spin: calling cobble_queue_process() in a tight loop, as the Python binding's event loop did
+// * sleep: calling it every millisecond
+// * wait: sleeping in cobble_queue_wait() until there are events
+// * fd: sleeping in poll() on cobble_event_fd()
+//
+// For each, reports the CPU time used by the application's thread and by the whole process (which includes the
+// simulator's own thread) as a percentage of one core, the values delivered and their latency from the time the
+// peripheral generated them. Results are written to stdout as JSON, and a summary to stderr.
+//
+// Usage: bench_sim_idle_wait [rate=values/sec when busy] [duration=seconds]
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define TX_CHARACTERISTIC "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
+#define ADDRESS "5E:11:00:00:00:01"
+
+#define MAX_SAMPLES (1024 * 1024)
+
+typedef enum {
+    Wait_Spin,
+    Wait_Sleep,
+    Wait_Queue,
+    Wait_Fd,
+} WaitMode;
+
+static const char* modeNames[] = { "spin", "sleep", "wait", "fd" };
+
+static FILE* json;
+static cobble_char_handle txHandle;
+
+static int connected = 0;
+static int discovered = 0;
+static bool measuring = false;
+static uint64_t delivered = 0;
+static uint32_t* samples;
+static uint64_t sampleCount = 0;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_ns(void) {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)connection;
+    (void)identifier;
+    connected = (status == ConnectionStatus_DidConnect);
+}
+
+static void on_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+    (void)connection;
+    (void)services;
+    (void)characteristics;
+    (void)elapsedMs;
+    discovered = 1;
+}
+
+// The simulator puts the time the value was generated after the sequence number
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    uint64_t generatedAt;
+    (void)connection;
+
+    if (!measuring || characteristic != txHandle || len < 12)
+        return;
+
+    delivered++;
+    memcpy(&generatedAt, data + 4, sizeof(generatedAt));
+    uint64_t latency = now_ns() - generatedAt;
+    if (sampleCount < MAX_SAMPLES)
+        samples[sampleCount++] = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+}
+
+// Takes events until the time given, or until the counter reaches the target
+static void pump_until(WaitMode mode, uint64_t until, const volatile int* counter, int target) {
+
+    int fd = cobble_event_fd();
+
+    for (uint64_t now = now_ns(); now < until && (counter == NULL || *counter != target); now = now_ns()) {
+        int remainingMs = (int)((until - now + 999999) / 1000000);
+        switch (mode) {
+        case Wait_Spin:
+            break;
+        case Wait_Sleep:
+            usleep(1000);
+            break;
+        case Wait_Queue:
+            cobble_queue_wait(remainingMs);
+            break;
+        case Wait_Fd: {
+            struct pollfd p = { fd, POLLIN, 0 };
+            poll(&p, 1, remainingMs);
+            break;
+        }
+        }
+        cobble_queue_process();
+    }
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static bool run(WaitMode mode, double rate, double duration, bool last) {
+
+    char script[128];
+    snprintf(script, sizeof(script), "devices=1;rate=%f;interval=7.5;payload=20", rate > 0 ? rate : 1);
+    if (!cobble_sim_configure(script))
+        return false;
+
+    connected = discovered = 0;
+    delivered = sampleCount = 0;
+    measuring = false;
+
+    cobble_init();
+    cobble_connect(ADDRESS);
+    pump_until(mode, now_ns() + 5000000000ull, (volatile int*)&discovered, 1);
+    if (!connected || !discovered) {
+        fprintf(stderr, "Could not connect to %s\n", ADDRESS);
+        cobble_deinit();
+        return false;
+    }
+
+    // Idle is connected, with nothing subscribed to
+    if (rate > 0)
+        cobble_subscribe_h(txHandle);
+    pump_until(mode, now_ns() + 200000000ull, NULL, 0);
+
+    uint64_t threadStart = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t processStart = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t start = now_ns();
+    measuring = true;
+    pump_until(mode, start + (uint64_t)(duration * 1e9), NULL, 0);
+    measuring = false;
+    double elapsed = (double)(now_ns() - start);
+    double threadCpu = 100.0 * (clock_ns(CLOCK_THREAD_CPUTIME_ID) - threadStart) / elapsed;
+    double processCpu = 100.0 * (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - processStart) / elapsed;
+
+    cobble_disconnect();
+    pump_until(mode, now_ns() + 1000000000ull, (volatile int*)&connected, 0);
+    cobble_deinit();
+
+    qsort(samples, sampleCount, sizeof(samples[0]), compare_u32);
+    double p50 = sampleCount ? samples[sampleCount / 2] / 1e6 : 0;
+    double p99 = sampleCount ? samples[(uint64_t)(0.99 * (sampleCount - 1))] / 1e6 : 0;
+
+    fprintf(json, "    {\"mode\": \"%s\", \"rate\": %.0f, \"duration_s\": %.3f, \"thread_cpu_percent\": %.2f, \"process_cpu_percent\": %.2f, "
+        "\"delivered\": %llu, \"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f}}%s\n",
+        modeNames[mode], rate, elapsed / 1e9, threadCpu, processCpu, (unsigned long long)delivered, p50, p99, last ? "" : ",");
+    fprintf(stderr, "%-5s rate=%-5.0f  thread %6.2f%%  process %6.2f%%  %6llu delivered  p50 %6.3f ms  p99 %6.3f ms\n",
+        modeNames[mode], rate, threadCpu, processCpu, (unsigned long long)delivered, p50, p99);
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    double rate = 1000;
+    double duration = 2.0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "rate=", 5) == 0)
+            rate = atof(argv[i] + 5);
+        else if (strncmp(argv[i], "duration=", 9) == 0)
+            duration = atof(argv[i] + 9);
+        else {
+            fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (rate <= 0 || duration <= 0) {
+        fprintf(stderr, "Need a positive rate and duration\n");
+        return 1;
+    }
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    samples = malloc(MAX_SAMPLES * sizeof(samples[0]));
+    txHandle = cobble_characteristic_handle(TX_CHARACTERISTIC);
+
+    register_connectionstatus_c_cb(on_connectionstatus);
+    register_discoverycomplete_cb(on_discoverycomplete);
+    register_updatevalue_c_cb(on_updatevalue);
+
+    fprintf(json, "{\n  \"benchmark\": \"sim_idle_wait\",\n  \"results\": [\n");
+
+    const double rates[] = { 0, rate };
+    for (int r = 0; r < 2; r++) {
+        for (int m = Wait_Spin; m <= Wait_Fd; m++) {
+            if (!run((WaitMode)m, rates[r], duration, r == 1 && m == Wait_Fd)) {
+                fclose(json);
+                free(samples);
+                return 1;
+            }
+        }
+    }
+
+    fprintf(json, "  ]\n}\n");
+
+    fclose(json);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,340 @@
+// Reconnect-to-first-write latency with and without the GATT cache or a service allow-list, using the simulated backend
+// A device is connected to, its first write is sent as soon as discoverycomplete says its characteristics are known, and
+// it is disconnected again once the write has completed, a number of times over. This is done in four ways:
+// - uncached: the cache is not enabled, so every connection discovers the device
+// - cached: the cache is enabled and holds the device's table, which is reported as soon as the link is up, then
+//   confirmed against the device's Database Hash
+// - stale: as cached, but the device's Database Hash changes between each connection (its db_version alternates), so
+//   the table from the cache is found to be out of date and the device is discovered again after the write
+// - selective: the cache is not enabled, but cobble_connect_ex() discovers only the service written to
+// The peripheral has five services, as a typical sensor might. Each reconnect reports the time from cobble_connect() to
+// discoverycomplete, and to the first write completing, with the connection delay and interval given.
+//
+// Results are written to stdout as JSON, and a summary to stderr, as with bench_pipeline. Cobble's own messages are sent
+// to stderr too, so that they don't get into the JSON.
+//
+// Usage: bench_sim_reconnect [mode=uncached|cached|stale|selective] [interval=ms] [connect_delay=ms] [reconnects=N]
+// With no mode argument, runs are made with each mode, at a 7.5 ms and a 30 ms connection interval.
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+#include "../src/cobble_gatt_cache.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define DEVICE "5E:11:00:00:00:01"
+#define UART_SERVICE "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
+#define RX_CHARACTERISTIC "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
+
+#define SENSOR_GATT \
+    "service=1800;characteristic=2A00,read;characteristic=2A01,read;" \
+    "service=1801;characteristic=2A05,indicate;" \
+    "service=180A;characteristic=2A29,read;characteristic=2A24,read;characteristic=2A25,read;characteristic=2A26,read;" \
+    "service=180F;characteristic=2A19,read,notify;" \
+    "service=" UART_SERVICE ";characteristic=" RX_CHARACTERISTIC ",write,write_without_response;" \
+    "characteristic=6E400003-B5A3-F393-E0A9-E50E24DCCA9E,notify"
+
+#define MAX_RUNS 8
+#define MAX_RECONNECTS 1000
+
+typedef enum {
+    Mode_Uncached,
+    Mode_Cached,
+    Mode_Stale,
+    Mode_Selective,
+} Mode;
+
+static const char* modeNames[] = { "uncached", "cached", "stale", "selective" };
+
+typedef struct {
+    Mode mode;
+    double interval;
+    double connectDelay;
+    int reconnects;
+} run_config;
+
+typedef struct {
+    double readyMean, readyMax;
+    double writeMean, writeP50, writeMax;
+    int failures;
+    int rediscovered; // Connections which discovered the device again after using the cached table
+} run_result;
+
+static FILE* json;
+static cobble_char_handle rxHandle;
+static char cacheDirectory[] = "/tmp/cobble_gatt_cache_XXXXXX";
+
+static uint8_t firstWrite[20] = { 1, 2, 3, 4 };
+
+static volatile bool disconnected = false;
+static volatile bool complete = false;
+static int completeStatus = 0;
+static int discoveries = 0;
+static uint64_t connectAt = 0;
+static uint64_t readyAt = 0;
+static uint64_t completeAt = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Callbacks, all made on the main thread by cobble_queue_process()
+ */
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)connection;
+    (void)identifier;
+    if (status != ConnectionStatus_DidConnect)
+        disconnected = true;
+}
+
+// The first write goes as soon as the characteristics are known, whether they came from the cache or not
+static void on_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+    (void)services;
+    (void)characteristics;
+    (void)elapsedMs;
+    if (discoveries++ > 0)
+        return;
+    readyAt = now_ns();
+    if (!cobble_write_stream_c(connection, rxHandle, firstWrite, sizeof(firstWrite))) {
+        completeStatus = WriteStatus_Failed;
+        complete = true;
+    }
+}
+
+static void on_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status) {
+    (void)connection;
+    (void)characteristic;
+    (void)written;
+    completeAt = now_ns();
+    completeStatus = status;
+    complete = true;
+}
+
+/*
+ * Runs
+ */
+
+static bool pump_until(uint64_t until, const volatile bool* done) {
+    while (now_ns() < until && !*done) {
+        cobble_queue_process();
+        usleep(100);
+    }
+    return *done;
+}
+
+static void pump_for(uint64_t ns) {
+    uint64_t until = now_ns() + ns;
+    while (now_ns() < until) {
+        cobble_queue_process();
+        usleep(100);
+    }
+}
+
+// Connects, writes once discovery is complete, and disconnects. Returns false if the write did not complete.
+static bool reconnect(const run_config* c, int version, double* readyMs, double* writeMs, int* discoveryCount) {
+
+    char script[2048];
+
+    snprintf(script, sizeof(script), "interval=%f;connect_delay=%f;rate=0;db_version=%i;" SENSOR_GATT,
+        c->interval, c->connectDelay, version);
+    if (!cobble_sim_configure(script))
+        return false;
+
+    disconnected = complete = false;
+    discoveries = 0;
+
+    cobble_init();
+    connectAt = now_ns();
+    if (c->mode == Mode_Selective)
+        cobble_connect_ex(DEVICE, UART_SERVICE, ConnectFlag_None);
+    else
+        cobble_connect(DEVICE);
+
+    bool ok = pump_until(connectAt + 10000000000ull, &complete) && completeStatus == WriteStatus_Complete;
+    *readyMs = (readyAt - connectAt) / 1e6;
+    *writeMs = (completeAt - connectAt) / 1e6;
+
+    // Give a stale table time to be found out and the device discovered again
+    if (ok && c->mode == Mode_Stale)
+        pump_for((uint64_t)((12 * c->interval) * 1e6));
+    *discoveryCount = discoveries;
+
+    cobble_disconnect();
+    pump_until(now_ns() + 1000000000ull, &disconnected);
+    cobble_deinit();
+
+    return ok;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static bool run(const run_config* c, run_result* r) {
+
+    static double writes[MAX_RECONNECTS];
+    double readyMs, writeMs;
+    int discoveryCount;
+
+    bool cached = (c->mode == Mode_Cached || c->mode == Mode_Stale);
+
+    cobble_gatt_cache_enable(cached ? cacheDirectory : NULL);
+    cobble_gatt_cache_forget(DEVICE);
+
+    // Fill the cache from a first connection, which isn't counted
+    if (cached && !reconnect(c, 0, &readyMs, &writeMs, &discoveryCount)) {
+        fprintf(stderr, "The first connection failed\n");
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+
+    for (int i = 0; i < c->reconnects; i++) {
+
+        int version = (c->mode == Mode_Stale) ? (i + 1) % 2 : 0;
+
+        if (!reconnect(c, version, &readyMs, &writeMs, &discoveryCount)) {
+            r->failures++;
+            continue;
+        }
+        if (discoveryCount > 1)
+            r->rediscovered++;
+
+        writes[i - r->failures] = writeMs;
+        r->readyMean += readyMs;
+        r->writeMean += writeMs;
+        if (readyMs > r->readyMax)
+            r->readyMax = readyMs;
+    }
+
+    int count = c->reconnects - r->failures;
+    if (count > 0) {
+        qsort(writes, count, sizeof(writes[0]), compare_double);
+        r->readyMean /= count;
+        r->writeMean /= count;
+        r->writeP50 = writes[count / 2];
+        r->writeMax = writes[count - 1];
+    }
+
+    cobble_gatt_cache_forget(DEVICE);
+    cobble_gatt_cache_enable(NULL);
+    return true;
+}
+
+static void print_result(const run_config* c, const run_result* r, bool last) {
+
+    fprintf(json, "    {\"mode\": \"%s\", \"interval_ms\": %.2f, \"connect_delay_ms\": %.1f, \"reconnects\": %i, \"failures\": %i, \"rediscovered\": %i,\n",
+        modeNames[c->mode], c->interval, c->connectDelay, c->reconnects, r->failures, r->rediscovered);
+    fprintf(json, "     \"ready_ms\": {\"mean\": %.2f, \"max\": %.2f}, \"first_write_ms\": {\"p50\": %.2f, \"max\": %.2f, \"mean\": %.2f}}%s\n",
+        r->readyMean, r->readyMax, r->writeP50, r->writeMax, r->writeMean, last ? "" : ",");
+
+    fprintf(stderr, "%-9s interval=%-5.1f  ready %7.2f ms  first write p50 %7.2f ms  max %7.2f ms  rediscovered %i/%i%s\n",
+        modeNames[c->mode], c->interval, r->readyMean, r->writeP50, r->writeMax, r->rediscovered, c->reconnects,
+        r->failures ? "  FAILURES" : "");
+}
+
+static bool parse_arg(run_config* c, bool* modeGiven, const char* arg) {
+
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    value++;
+
+    if (strncmp(arg, "mode=", 5) == 0) {
+        for (int m = 0; m < (int)(sizeof(modeNames) / sizeof(modeNames[0])); m++) {
+            if (strcmp(value, modeNames[m]) == 0) {
+                c->mode = (Mode)m;
+                *modeGiven = true;
+                return true;
+            }
+        }
+        return false;
+    } else if (strncmp(arg, "interval=", 9) == 0) {
+        c->interval = atof(value);
+    } else if (strncmp(arg, "connect_delay=", 14) == 0) {
+        c->connectDelay = atof(value);
+    } else if (strncmp(arg, "reconnects=", 11) == 0) {
+        c->reconnects = atoi(value);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    run_config defaults = { Mode_Uncached, 7.5, 10, 10 };
+    run_config runs[MAX_RUNS];
+    int runCount = 0;
+    bool modeGiven = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!parse_arg(&defaults, &modeGiven, argv[i])) {
+            fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (modeGiven) {
+        runs[runCount++] = defaults;
+    } else {
+        static const double intervals[] = { 7.5, 30 };
+        for (int i = 0; i < 2; i++) {
+            for (int m = 0; m < 4; m++) {
+                runs[runCount] = defaults;
+                runs[runCount].mode = (Mode)m;
+                runs[runCount++].interval = intervals[i];
+            }
+        }
+    }
+
+    if (defaults.reconnects < 1 || defaults.reconnects > MAX_RECONNECTS || defaults.interval < 7.5) {
+        fprintf(stderr, "Need 1 to %i reconnects and an interval of at least 7.5 ms\n", MAX_RECONNECTS);
+        return 1;
+    }
+
+    if (mkdtemp(cacheDirectory) == NULL) {
+        fprintf(stderr, "Could not make a directory for the GATT cache\n");
+        return 1;
+    }
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    rxHandle = cobble_characteristic_handle(RX_CHARACTERISTIC);
+
+    register_connectionstatus_c_cb(on_connectionstatus);
+    register_discoverycomplete_cb(on_discoverycomplete);
+    register_writecomplete_cb(on_writecomplete);
+
+    fprintf(json, "{\n  \"benchmark\": \"sim_reconnect\",\n  \"results\": [\n");
+
+    bool ok = true;
+    for (int i = 0; i < runCount && ok; i++) {
+        run_result r;
+        ok = run(&runs[i], &r);
+        if (ok)
+            print_result(&runs[i], &r, i == runCount - 1);
+    }
+
+    fprintf(json, "  ]\n}\n");
+    fclose(json);
+    rmdir(cacheDirectory);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+// The library's status as connections to several devices come and go, using the simulated backend
+// Two devices are connected to in turn. The second is still connecting when the first is disconnected, which leaves
+// the library Connecting again, then it connects and is disconnected in its turn. After each step, cobble_status() is
+// checked against what the connections add up to, and the statuschanged events are checked against the moves made.
+//
+// Results are written to stdout as JSON, and a summary to stderr. Cobble's own messages are sent to stderr too, so that
+// they don't get into the JSON. Exits with an error if any check fails.
+//
+// Usage: bench_sim_status
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define FIRST_DEVICE "5E:11:00:00:00:01"
+#define SECOND_DEVICE "5E:11:00:00:00:02"
+
+// Long enough that the second device is still connecting when the first has been disconnected
+#define CONNECT_DELAY_MS 300
+
+#define MAX_CHANGES 16
+
+static FILE* json;
+
+static CobbleStatus changes[MAX_CHANGES];
+static int changeCount = 0;
+static volatile bool connected[2];
+static volatile bool disconnected[2];
+static cobble_conn_handle handles[2];
+static int failures = 0;
+
+static const char* status_name(CobbleStatus status) {
+    switch (status) {
+    case Uninitialised: return "Uninitialised";
+    case Initialised: return "Initialised";
+    case Scanning: return "Scanning";
+    case Connecting: return "Connecting";
+    case Connected: return "Connected";
+    case CobbleError: return "CobbleError";
+    }
+    return "unknown";
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Callbacks, all made on the main thread by cobble_queue_process()
+ */
+
+static void on_statuschanged(int status, int error) {
+    (void)error;
+    if (changeCount < MAX_CHANGES)
+        changes[changeCount] = (CobbleStatus)status;
+    changeCount++;
+}
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)identifier;
+    for (int d = 0; d < 2; d++) {
+        if (connection != handles[d])
+            continue;
+        if (status == ConnectionStatus_DidConnect)
+            connected[d] = true;
+        else
+            disconnected[d] = true;
+    }
+}
+
+/*
+ * Steps
+ */
+
+static bool pump_until(const volatile bool* done) {
+    uint64_t until = now_ns() + 5000000000ull;
+    while (now_ns() < until && !*done) {
+        cobble_queue_process();
+        usleep(1000);
+    }
+    cobble_queue_process();
+    return *done;
+}
+
+static void check(const char* step, bool happened, CobbleStatus expected) {
+    CobbleStatus status = cobble_status();
+    bool ok = happened && status == expected;
+    if (!ok)
+        failures++;
+    const char* result = ok ? "ok" : happened ? "FAILED" : "FAILED (timed out)";
+    fprintf(stderr, "%-40s %-13s %s\n", step, status_name(status), result);
+}
+
+int main(void) {
+
+    static const CobbleStatus expected[] = { Initialised, Connecting, Connected, Connecting, Connected, Initialised };
+    const int expectedCount = (int)(sizeof(expected) / sizeof(expected[0]));
+    char script[256];
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    snprintf(script, sizeof(script), "devices=2;connect_delay=%i;rate=0", CONNECT_DELAY_MS);
+    if (!cobble_sim_configure(script)) {
+        fprintf(stderr, "Invalid simulator script\n");
+        return 1;
+    }
+
+    register_statuschanged_cb(on_statuschanged);
+    register_connectionstatus_c_cb(on_connectionstatus);
+
+    cobble_init();
+    check("Initialised", cobble_status_wait(Initialised, 5000) == Initialised, Initialised);
+
+    handles[0] = cobble_connect(FIRST_DEVICE);
+    check("First connection made", pump_until(&connected[0]), Connected);
+
+    handles[1] = cobble_connect(SECOND_DEVICE);
+    cobble_disconnect_c(handles[0]);
+    check("First disconnected, second connecting", pump_until(&disconnected[0]) && !connected[1], Connecting);
+
+    check("Second connection made", pump_until(&connected[1]), Connected);
+
+    cobble_disconnect_c(handles[1]);
+    check("Second disconnected", pump_until(&disconnected[1]), Initialised);
+
+    cobble_deinit();
+
+    // Each move reported once, in order
+    bool changesOk = changeCount == expectedCount;
+    for (int i = 0; changesOk && i < expectedCount; i++)
+        changesOk = changes[i] == expected[i];
+    if (!changesOk)
+        failures++;
+
+    fprintf(stderr, "statuschanged:");
+    for (int i = 0; i < changeCount && i < MAX_CHANGES; i++)
+        fprintf(stderr, " %s", status_name(changes[i]));
+    fprintf(stderr, "  %s\n", changesOk ? "ok" : "FAILED");
+
+    fprintf(json, "{\"benchmark\": \"sim_status\", \"changes\": [");
+    for (int i = 0; i < changeCount && i < MAX_CHANGES; i++)
+        fprintf(json, "%s\"%s\"", i > 0 ? ", " : "", status_name(changes[i]));
+    fprintf(json, "], \"failures\": %i, \"passed\": %s}\n", failures, failures == 0 ? "true" : "false");
+    fclose(json);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+// Throughput of cobble_write_stream() against the capacity of the link, using the simulated backend
+// A block is written to a simulated peripheral in three ways:
+// - stream: cobble_write_stream(), to a characteristic which can be written without response
+// - stream_with_response: cobble_write_stream(), to a characteristic which needs a response to each write
+// - paced: 20-byte cobble_write() calls with a 10 ms sleep between each, as examples/python/NordicDFU.py does
+// The time from the first call to the writecomplete event (or the last write, for paced) gives the throughput, which is
+// compared with what the link could carry: packets * (mtu - 3) bytes per connection interval. The last part of the block
+// is then read back from the peripheral to check that the data arrived intact.
+//
+// Results are written to stdout as JSON, and a summary to stderr, as with bench_pipeline. Cobble's own messages are sent
+// to stderr too, so that they don't get into the JSON.
+//
+// Usage: bench_sim_write_stream [mode=stream|stream_with_response|paced] [size=bytes] [mtu=bytes] [interval=ms]
+//                               [packets=per connection event]
+// With no mode argument, runs are made with each mode, at the default and the minimum MTU.
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+#include "../src/platforms/sim/SimBLE.h"
+
+#define SERVICE "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
+#define RX_CHARACTERISTIC "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
+
+// As in examples/python/NordicDFU.py
+#define PACED_SEGMENT 20
+#define PACED_DELAY_US 10000
+
+#define MAX_RUNS 8
+
+typedef enum {
+    Mode_Stream,
+    Mode_StreamWithResponse,
+    Mode_Paced,
+} Mode;
+
+static const char* modeNames[] = { "stream", "stream_with_response", "paced" };
+
+typedef struct {
+    Mode mode;
+    int size;
+    int mtu;
+    double interval;
+    int packets;
+} run_config;
+
+typedef struct {
+    double elapsed;
+    double throughput;
+    double capacity;
+    int written;
+    int status;
+    bool intact;
+} run_result;
+
+static FILE* json;
+static cobble_char_handle rxHandle;
+
+static bool disconnected = false;
+static bool discovered = false;
+
+static bool complete = false;
+static int completeWritten = 0;
+static int completeStatus = 0;
+
+static bool readBack = false;
+static uint8_t readBackValue[512];
+static int readBackLength = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Callbacks, all made on the main thread by cobble_queue_process()
+ */
+
+static void on_connectionstatus(cobble_conn_handle connection, const char* identifier, int status) {
+    (void)connection;
+    (void)identifier;
+    if (status != ConnectionStatus_DidConnect)
+        disconnected = true;
+}
+
+static void on_characteristicdiscovered(cobble_conn_handle connection, const char* service, const char* characteristic) {
+    (void)connection;
+    (void)service;
+    if (cobble_characteristic_handle(characteristic) == rxHandle)
+        discovered = true;
+}
+
+static void on_updatevalue(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    (void)connection;
+    if (characteristic != rxHandle || len > (int)sizeof(readBackValue))
+        return;
+    memcpy(readBackValue, data, len);
+    readBackLength = len;
+    readBack = true;
+}
+
+static void on_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status) {
+    (void)connection;
+    (void)characteristic;
+    completeWritten = written;
+    completeStatus = status;
+    complete = true;
+}
+
+/*
+ * Runs
+ */
+
+static bool pump_until(uint64_t until, const volatile bool* done) {
+    while (now_ns() < until && !*done) {
+        cobble_queue_process();
+        usleep(200);
+    }
+    return *done;
+}
+
+// The size of each write, and so of the last part of the block, which the peripheral keeps
+static int write_size(const run_config* c) {
+    if (c->mode == Mode_Paced)
+        return PACED_SEGMENT;
+    return (c->mode == Mode_Stream) ? c->mtu - 3 : 512;
+}
+
+static bool run(const run_config* c, run_result* r) {
+
+    char script[512];
+    uint8_t* block = malloc(c->size);
+
+    // Different bytes all the way through, so that a part written in the wrong place would show up
+    for (int i = 0; i < c->size; i++)
+        block[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    snprintf(script, sizeof(script), "mtu=%i;interval=%f;packets=%i;connect_delay=10;rate=0;service=%s;characteristic=%s,read,%s",
+        c->mtu, c->interval, c->packets, SERVICE, RX_CHARACTERISTIC,
+        (c->mode == Mode_StreamWithResponse) ? "write" : "write,write_without_response");
+    if (!cobble_sim_configure(script)) {
+        free(block);
+        return false;
+    }
+
+    disconnected = discovered = complete = readBack = false;
+
+    cobble_init();
+    cobble_connect("5E:11:00:00:00:01");
+
+    if (!pump_until(now_ns() + 5000000000ull, (volatile bool*)&discovered)) {
+        fprintf(stderr, "The characteristic to write to was not discovered\n");
+        cobble_deinit();
+        free(block);
+        return false;
+    }
+
+    uint64_t start = now_ns();
+
+    if (c->mode == Mode_Paced) {
+        for (int offset = 0; offset < c->size; offset += PACED_SEGMENT) {
+            int len = (c->size - offset < PACED_SEGMENT) ? c->size - offset : PACED_SEGMENT;
+            cobble_write_h(rxHandle, block + offset, len);
+            cobble_queue_process();
+            usleep(PACED_DELAY_US);
+        }
+        // The last write goes at the next connection event
+        usleep((useconds_t)(c->interval * 1000));
+        r->elapsed = (now_ns() - start) / 1e9;
+        r->written = c->size;
+        r->status = WriteStatus_Complete;
+    } else {
+        if (!cobble_write_stream_h(rxHandle, block, c->size) || !pump_until(start + 600000000000ull, (volatile bool*)&complete)) {
+            fprintf(stderr, "The stream did not complete\n");
+            cobble_deinit();
+            free(block);
+            return false;
+        }
+        r->elapsed = (now_ns() - start) / 1e9;
+        r->written = completeWritten;
+        r->status = completeStatus;
+    }
+
+    r->throughput = r->written / r->elapsed;
+    if (c->mode == Mode_StreamWithResponse)
+        // A write of up to 512 bytes, answered at the connection event after it is sent
+        r->capacity = 512 / (2 * c->interval / 1000);
+    else
+        r->capacity = c->packets * (c->mtu - 3) / (c->interval / 1000);
+
+    // The peripheral keeps the last value written, which should be the end of the block
+    cobble_read_h(rxHandle);
+    pump_until(now_ns() + 1000000000ull, (volatile bool*)&readBack);
+    int lastLength = (c->size - 1) % write_size(c) + 1;
+    r->intact = readBack && readBackLength == lastLength && memcmp(readBackValue, block + c->size - lastLength, lastLength) == 0;
+
+    cobble_disconnect();
+    pump_until(now_ns() + 1000000000ull, (volatile bool*)&disconnected);
+    cobble_deinit();
+
+    free(block);
+    return true;
+}
+
+static void print_result(const run_config* c, const run_result* r, bool last) {
+
+    fprintf(json, "    {\"mode\": \"%s\", \"size\": %i, \"mtu\": %i, \"interval_ms\": %.2f, \"packets\": %i,\n",
+        modeNames[c->mode], c->size, c->mtu, c->interval, c->packets);
+    fprintf(json, "     \"written\": %i, \"status\": %i, \"intact\": %s, \"duration_s\": %.3f, \"throughput_bytes_per_s\": %.0f,\n",
+        r->written, r->status, r->intact ? "true" : "false", r->elapsed, r->throughput);
+    fprintf(json, "     \"capacity_bytes_per_s\": %.0f, \"efficiency\": %.3f}%s\n", r->capacity, r->throughput / r->capacity, last ? "" : ",");
+
+    fprintf(stderr, "%-20s mtu=%-3i size=%-7i %9.0f bytes/s of %9.0f (%5.1f%%)  %s\n",
+        modeNames[c->mode], c->mtu, c->size, r->throughput, r->capacity, 100 * r->throughput / r->capacity,
+        (r->status == WriteStatus_Complete && r->intact) ? "intact" : "FAILED");
+}
+
+static bool parse_arg(run_config* c, bool* modeGiven, const char* arg) {
+
+    const char* value = strchr(arg, '=');
+    if (value == NULL)
+        return false;
+    value++;
+
+    if (strncmp(arg, "mode=", 5) == 0) {
+        for (int m = 0; m < (int)(sizeof(modeNames) / sizeof(modeNames[0])); m++) {
+            if (strcmp(value, modeNames[m]) == 0) {
+                c->mode = (Mode)m;
+                *modeGiven = true;
+                return true;
+            }
+        }
+        return false;
+    } else if (strncmp(arg, "size=", 5) == 0) {
+        c->size = atoi(value);
+    } else if (strncmp(arg, "mtu=", 4) == 0) {
+        c->mtu = atoi(value);
+    } else if (strncmp(arg, "interval=", 9) == 0) {
+        c->interval = atof(value);
+    } else if (strncmp(arg, "packets=", 8) == 0) {
+        c->packets = atoi(value);
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    run_config defaults = { Mode_Stream, 256 * 1024, 247, 7.5, 6 };
+    run_config runs[MAX_RUNS];
+    int runCount = 0;
+    bool modeGiven = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!parse_arg(&defaults, &modeGiven, argv[i])) {
+            fprintf(stderr, "Unrecognised argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (modeGiven) {
+        runs[runCount++] = defaults;
+    } else {
+        // The paced writes take 10 ms for each 20 bytes, so send them less
+        run_config standard[] = {
+            { Mode_Stream, defaults.size, 247, defaults.interval, defaults.packets },
+            { Mode_Stream, defaults.size / 8, 23, defaults.interval, defaults.packets },
+            { Mode_StreamWithResponse, defaults.size / 4, 247, defaults.interval, defaults.packets },
+            { Mode_Paced, 4096, 247, defaults.interval, defaults.packets },
+        };
+        for (int i = 0; i < (int)(sizeof(standard) / sizeof(standard[0])); i++)
+            runs[runCount++] = standard[i];
+    }
+
+    for (int i = 0; i < runCount; i++) {
+        if (runs[i].size < 1 || runs[i].mtu < 23 || runs[i].mtu > 517) {
+            fprintf(stderr, "Need a positive size and an MTU from 23 to 517\n");
+            return 1;
+        }
+    }
+
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    rxHandle = cobble_characteristic_handle(RX_CHARACTERISTIC);
+
+    register_connectionstatus_c_cb(on_connectionstatus);
+    register_characteristicdiscovered_c_cb(on_characteristicdiscovered);
+    register_updatevalue_c_cb(on_updatevalue);
+    register_writecomplete_cb(on_writecomplete);
+
+    fprintf(json, "{\n  \"benchmark\": \"sim_write_stream\",\n  \"results\": [\n");
+
+    for (int i = 0; i < runCount; i++) {
+        run_result r;
+        if (!run(&runs[i], &r)) {
+            fclose(json);
+            return 1;
+        }
+        print_result(&runs[i], &r, i == runCount - 1);
+    }
+
+    fprintf(json, "  ]\n}\n");
+
+    fclose(json);
+    return 0;
+}
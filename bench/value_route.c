@@ -0,0 +1,242 @@
+// Notifications from many characteristics, found by the application comparing UUID strings in a shared callback,
+// against each characteristic having a callback and context of its own on each connection (cobble_subscribe_cb_c())
+// Values are sent round-robin over the characteristics, each carrying the number of the characteristic (and, when
+// routed, of the connection) it was sent for, so each one which reaches the wrong state is counted as misrouted. Then
+// one characteristic's callback and context are swapped back and forth by another thread while its values are
+// delivered. Any callback run with the other's context is counted as torn, and any still running after the swap away
+// from it has returned is counted as late.
+// Built twice by make_bench.sh, with the same source:
+// * bench_value_route:          the deferred core (cobble_events_win.cpp), taken with cobble_queue_process()
+// * bench_value_route_realtime: the realtime core (cobble_events.c), which calls back as each value is sent
+//
+// Results are written to stdout as JSON, and a summary to stderr.
+//
+// Usage: bench_value_route [characteristics] [values]
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+#include "../src/cobble_connections.h"
+
+#ifdef BENCH_REALTIME
+#define MODE "realtime"
+#else
+#define MODE "deferred"
+#endif
+
+#define MAX_CHARACTERISTICS 512
+
+// Values sent before they are taken, well within the deferred core's value queue
+#define PROCESS_EVERY 1024
+
+// Routed values alternate between two connections, each with its own state for every characteristic
+#define CONNECTIONS 2
+
+// Each characteristic's state, as an application would keep it
+typedef struct {
+    uint32_t number;
+    uint64_t received;
+    uint64_t misrouted;
+} characteristicState;
+
+static int characteristicCount = 64;
+static int valueCount = 2000000;
+
+static char uuids[MAX_CHARACTERISTICS][40];
+static cobble_char_handle handles[MAX_CHARACTERISTICS];
+static cobble_conn_handle connections[CONNECTIONS];
+static characteristicState states[CONNECTIONS][MAX_CHARACTERISTICS];
+
+static volatile uint64_t torn = 0;
+static volatile uint64_t late = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void received(characteristicState* state, const uint8_t* data) {
+    uint32_t number;
+    memcpy(&number, data, sizeof(number));
+    if (number != state->number)
+        state->misrouted++;
+    state->received++;
+}
+
+// The way an application finds a characteristic's state from the shared callback
+static void on_updatevalue(const char* uuid, const uint8_t* data, int len) {
+    (void)len;
+    for (int c = 0; c < characteristicCount; c++) {
+        if (strcmp(uuid, uuids[c]) == 0) {
+            received(&states[0][c], data);
+            return;
+        }
+    }
+}
+
+static void on_value(void* ctx, cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    (void)connection;
+    (void)characteristic;
+    (void)len;
+    received((characteristicState*)ctx, data);
+}
+
+// The pair swapped in for the first characteristic: each callback expects its own context, and is retired once the
+// swap away from it has returned
+static characteristicState swapA, swapB;
+static volatile int retiredA, retiredB;
+static volatile int swapping = 0;
+
+static void on_value_a(void* ctx, cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    (void)connection;
+    (void)characteristic;
+    (void)data;
+    (void)len;
+    if (ctx != &swapA)
+        __atomic_add_fetch(&torn, 1, __ATOMIC_RELAXED);
+    swapA.received++;
+    if (__atomic_load_n(&retiredA, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&late, 1, __ATOMIC_RELAXED);
+}
+
+static void on_value_b(void* ctx, cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    (void)connection;
+    (void)characteristic;
+    (void)data;
+    (void)len;
+    if (ctx != &swapB)
+        __atomic_add_fetch(&torn, 1, __ATOMIC_RELAXED);
+    swapB.received++;
+    if (__atomic_load_n(&retiredB, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&late, 1, __ATOMIC_RELAXED);
+}
+
+static void* swapper(void* arg) {
+    uint64_t swaps = 0;
+    while (__atomic_load_n(&swapping, __ATOMIC_ACQUIRE)) {
+        if (swaps++ & 1) {
+            __atomic_store_n(&retiredB, 0, __ATOMIC_RELEASE);
+            cobble_characteristic_cb_set_c(connections[0], handles[0], &on_value_b, &swapB);
+            __atomic_store_n(&retiredA, 1, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&retiredA, 0, __ATOMIC_RELEASE);
+            cobble_characteristic_cb_set_c(connections[0], handles[0], &on_value_a, &swapA);
+            __atomic_store_n(&retiredB, 1, __ATOMIC_RELEASE);
+        }
+    }
+    *(uint64_t*)arg = swaps;
+    return NULL;
+}
+
+// The number of the characteristic a value was sent for, with the connection's above it
+#define NUMBER(connection, characteristic) (((uint32_t)(connection) << 16) | (uint32_t)(characteristic))
+
+static void send_values(int onlyFirst, int connectionCount) {
+    uint8_t value[20] = { 0 };
+    for (int v = 0; v < valueCount; v++) {
+        int c = onlyFirst ? 0 : v % characteristicCount;
+        int connection = (v / characteristicCount) % connectionCount;
+        uint32_t number = NUMBER(connection, c);
+        memcpy(value, &number, sizeof(number));
+        cobble_event_updatevalue_c(connections[connection], handles[c], value, sizeof(value));
+#ifndef BENCH_REALTIME
+        if (v % PROCESS_EVERY == PROCESS_EVERY - 1)
+            cobble_queue_process();
+#endif
+    }
+#ifndef BENCH_REALTIME
+    cobble_queue_process();
+#endif
+}
+
+static void run(const char* label, int routed) {
+
+    // The shared callback isn't told the connection, so its values all come from the first
+    int connectionCount = routed ? CONNECTIONS : 1;
+
+    memset(states, 0, sizeof(states));
+    for (int n = 0; n < CONNECTIONS; n++) {
+        for (int c = 0; c < characteristicCount; c++) {
+            states[n][c].number = NUMBER(n, c);
+            cobble_characteristic_cb_set_c(connections[n], handles[c], routed ? &on_value : NULL, &states[n][c]);
+        }
+    }
+    register_updatevalue_cb(routed ? NULL : &on_updatevalue);
+    uint64_t droppedBefore = cobble_queue_dropped_get();
+
+    uint64_t start = now_ns();
+    send_values(0, connectionCount);
+    double elapsed = (double)(now_ns() - start);
+
+    uint64_t count = 0, misrouted = 0;
+    for (int n = 0; n < CONNECTIONS; n++) {
+        for (int c = 0; c < characteristicCount; c++) {
+            count += states[n][c].received;
+            misrouted += states[n][c].misrouted;
+        }
+    }
+    uint64_t dropped = cobble_queue_dropped_get() - droppedBefore;
+
+    printf("{\"core\": \"%s\", \"test\": \"%s\", \"connections\": %i, \"characteristics\": %i, \"values\": %llu, "
+        "\"ns_per_value\": %.1f, \"misrouted\": %llu, \"dropped\": %llu}\n",
+        MODE, label, connectionCount, characteristicCount, (unsigned long long)count, elapsed / valueCount,
+        (unsigned long long)misrouted, (unsigned long long)dropped);
+    fprintf(stderr, "%-9s %-9s %i connections  %4i characteristics  %6.1f ns/value  %llu misrouted  %llu dropped\n",
+        MODE, label, connectionCount, characteristicCount, elapsed / valueCount, (unsigned long long)misrouted,
+        (unsigned long long)dropped);
+}
+
+static void run_swap(void) {
+
+    pthread_t thread;
+    uint64_t swaps = 0;
+
+    torn = 0;
+    late = 0;
+    retiredA = retiredB = 0;
+    swapA.received = swapB.received = 0;
+    swapping = 1;
+    cobble_characteristic_cb_set_c(connections[0], handles[0], &on_value_a, &swapA);
+    pthread_create(&thread, NULL, swapper, &swaps);
+    send_values(1, 1);
+    __atomic_store_n(&swapping, 0, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    cobble_characteristic_cb_set_c(connections[0], handles[0], NULL, NULL);
+
+    printf("{\"core\": \"%s\", \"test\": \"swap\", \"values\": %llu, \"swaps\": %llu, \"torn\": %llu, \"late\": %llu}\n",
+        MODE, (unsigned long long)(swapA.received + swapB.received), (unsigned long long)swaps, (unsigned long long)torn,
+        (unsigned long long)late);
+    fprintf(stderr, "%-9s swap      %llu values  %llu swaps  %llu torn  %llu late\n",
+        MODE, (unsigned long long)(swapA.received + swapB.received), (unsigned long long)swaps, (unsigned long long)torn,
+        (unsigned long long)late);
+}
+
+int main(int argc, char** argv) {
+
+    characteristicCount = (argc > 1) ? atoi(argv[1]) : 64;
+    valueCount = (argc > 2) ? atoi(argv[2]) : 2000000;
+    if (characteristicCount < 1 || characteristicCount > MAX_CHARACTERISTICS || valueCount < 1) {
+        fprintf(stderr, "Usage: bench_value_route [characteristics (1 to %i)] [values]\n", MAX_CHARACTERISTICS);
+        return 1;
+    }
+
+    // Sharing all but the last few characters, as a vendor's characteristics do
+    for (int c = 0; c < characteristicCount; c++) {
+        snprintf(uuids[c], sizeof(uuids[c]), "C5D7%04X-C45D-4F12-8693-7EF838E96446", c + 0x100);
+        handles[c] = cobble_characteristic_handle(uuids[c]);
+    }
+    for (int n = 0; n < CONNECTIONS; n++)
+        connections[n] = cobble_connection_open(0x5E1100000001ull + n);
+
+    run("strcmp", 0);
+    run("routed", 1);
+    run_swap();
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+// Microbenchmark for the deferred value update path
+// Notifications are pushed through cobble_event_updatevalue() as a backend would, and delivered with cobble_queue_process().
+// Reports heap allocations and time per event, in steady state (after a warm-up pass).
+// Then the payload budget is carved up by a burst of small values, and values of the largest size are sent with each
+// overflow policy, which must still be delivered once the small ones have been taken. Exits with an error if not.
+//
+// Usage: value_update [events] [payload bytes]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/cobble.h"
+#include "../src/cobble_events.h"
+
+#include "alloc_count.h"
+
+#define CHARACTERISTIC "C5D70003-C45D-4F12-8693-7EF838E96446"
+
+// Events pushed between each call to cobble_queue_process(), well within the queue length
+#define BATCH 256
+
+// The largest value, and a burst of small ones (each in a 64-byte block) big enough to carve up the whole budget
+#define LARGE_LENGTH 512
+#define SMALL_LENGTH 40
+#define SMALL_BURST 4096
+#define LARGE_VALUES 1000
+
+static uint64_t delivered = 0;
+static uint64_t delivered_bytes = 0;
+static uint64_t delivered_large = 0;
+
+static void on_updatevalue(const char* uuid, const uint8_t* data, int len) {
+    (void)uuid;
+    (void)data;
+    delivered++;
+    delivered_bytes += len;
+    if (len == LARGE_LENGTH)
+        delivered_large++;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(int events, const uint8_t* payload, int len) {
+    for (int i = 0; i < events; i += BATCH) {
+        for (int j = 0; j < BATCH && i + j < events; j++)
+            cobble_event_updatevalue(CHARACTERISTIC, payload, len);
+        cobble_queue_process();
+    }
+}
+
+// Returns the number of large values delivered after the burst
+static uint64_t run_after_burst(CobbleQueuePolicy policy) {
+
+    uint8_t small[SMALL_LENGTH] = { 0 };
+    uint8_t large[LARGE_LENGTH] = { 0 };
+
+    cobble_queue_policy_set(policy);
+    for (int i = 0; i < SMALL_BURST; i++)
+        cobble_event_updatevalue(CHARACTERISTIC, small, sizeof(small));
+    cobble_queue_process();
+
+    delivered_large = 0;
+    for (int i = 0; i < LARGE_VALUES; i++) {
+        cobble_event_updatevalue(CHARACTERISTIC, large, sizeof(large));
+        cobble_queue_process();
+    }
+    return delivered_large;
+}
+
+int main(int argc, char** argv) {
+
+    int events = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int len = (argc > 2) ? atoi(argv[2]) : 20;
+
+    uint8_t* payload = calloc(len > 0 ? len : 1, 1);
+
+    register_updatevalue_cb(&on_updatevalue);
+
+    run(BATCH * 4, payload, len);
+    delivered = 0;
+    delivered_bytes = 0;
+
+    uint64_t allocs = bench_allocations();
+    uint64_t start = now_ns();
+
+    run(events, payload, len);
+
+    uint64_t elapsed = now_ns() - start;
+    allocs = bench_allocations() - allocs;
+
+    printf("value_update: %i events, %i byte payload, %llu delivered (%llu bytes)\n", events, len, (unsigned long long)delivered, (unsigned long long)delivered_bytes);
+    printf("  allocations/event: %.3f\n", (double)allocs / events);
+    printf("  ns/event: %.1f\n", (double)elapsed / events);
+
+    free(payload);
+
+    uint64_t droppedBefore = cobble_queue_dropped_get();
+    uint64_t newest = run_after_burst(QueuePolicy_DropNewest);
+    uint64_t oldest = run_after_burst(QueuePolicy_DropOldest);
+    uint64_t dropped = cobble_queue_dropped_get() - droppedBefore;
+
+    printf("value_update: %i byte values after a burst of %i %i byte values, %llu dropped in all\n", LARGE_LENGTH, SMALL_BURST, SMALL_LENGTH,
+        (unsigned long long)dropped);
+    printf("  delivered (drop newest): %llu of %i\n", (unsigned long long)newest, LARGE_VALUES);
+    printf("  delivered (drop oldest): %llu of %i\n", (unsigned long long)oldest, LARGE_VALUES);
+
+    return (newest == LARGE_VALUES && oldest == LARGE_VALUES) ? 0 : 1;
+}
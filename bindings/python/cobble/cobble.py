@@ -7,14 +7,16 @@ import sys
 import os
 from queue import Queue, Empty
 import signal
-from enum import IntEnum
+import struct
+import time
+from enum import IntEnum, IntFlag
 from datetime import datetime, timedelta
 
 # Required for runloop
 if platform.system() == 'Darwin':
     from PyObjCTools import AppHelper
 
-from threading import Thread
+from threading import Thread, Condition
 
 plugin_name = {
     'Darwin': 'cobble_mac.dylib',
@@ -25,7 +27,9 @@ if platform.system() not in plugin_name.keys():
     print("Platform {} does not have a corresponding Cobble library!")
     sys.exit(-1)
 
-plugin = cdll.LoadLibrary(os.path.abspath(os.path.dirname(os.path.abspath(__file__)) + "/../../../src/build/" + plugin_name[platform.system()]))
+# COBBLE_LIBRARY overrides the library to load, eg src/build/cobble_sim.so for the simulated backend
+plugin_path = os.environ.get('COBBLE_LIBRARY', os.path.dirname(os.path.abspath(__file__)) + "/../../../src/build/" + plugin_name[platform.system()])
+plugin = cdll.LoadLibrary(os.path.abspath(plugin_path))
 
 c_float_p = POINTER(c_float)
 c_byte_p = POINTER(c_byte)
@@ -33,10 +37,30 @@ c_byte_p = POINTER(c_byte)
 plugin.cobble_init.restype = None
 plugin.cobble_deinit.restype = None
 plugin.cobble_scan_start.restype = None
+plugin.cobble_scan_start.argtypes = [c_char_p]
 plugin.cobble_scan_stop.restype = None
 plugin.register_scanresult_cb.restype = None
+plugin.cobble_scan_coalesce_set.restype = None
+plugin.cobble_scan_coalesce_set.argtypes = [c_int, c_int]
+plugin.cobble_scan_device_count.restype = c_int
+
+# Matches cobble_scan_filter in cobble_scan_filter.h
+class ScanFilter(Structure):
+    _fields_ = [('service_uuids', c_char_p),
+                ('name_prefix', c_char_p),
+                ('manufacturer_id', c_int),
+                ('manufacturer_data', c_char_p),
+                ('manufacturer_mask', c_char_p),
+                ('manufacturer_length', c_int),
+                ('rssi_min', c_int)]
+
+plugin.cobble_scan_filter_set.restype = c_bool
+plugin.cobble_scan_filter_set.argtypes = [POINTER(ScanFilter)]
 
 plugin.cobble_status.restype = c_int
+plugin.cobble_status_wait.restype = c_int
+plugin.cobble_status_wait.argtypes = [c_int, c_int]
+plugin.register_statuschanged_cb.restype = None
 
 class CobbleStatus(IntEnum):
     Uninitialised = 0
@@ -46,30 +70,97 @@ class CobbleStatus(IntEnum):
     Connected = 4
     CobbleError = 5
 
+class CobbleErrorCode(IntEnum):
+    NoError = 0
+    HardwareUnsupported = 1
+    HardwareTurnedOff = 2
+    PermissionsNotGranted = 3
+    UnknownError = 0xFF
+
 class ConnectionEvent(IntEnum):
     DidDisconnect = 0
     DidConnect = 1
     DidConnectFailed = 2
 
-plugin.cobble_connect.restype = None
+# Returns a connection handle, or 0 if the connection could not be started
+plugin.cobble_connect.restype = c_uint16
 plugin.cobble_connect.argtypes = [c_char_p]
+plugin.cobble_connect_ex.restype = c_uint16
+plugin.cobble_connect_ex.argtypes = [c_char_p, c_char_p, c_uint32]
+plugin.cobble_discover_service.restype = c_bool
+plugin.cobble_discover_service.argtypes = [c_char_p]
 plugin.cobble_subscribe.restype = None
 plugin.cobble_subscribe.argtypes = [c_char_p]
 plugin.cobble_write.restype = None
 plugin.cobble_write.argtypes = [c_char_p, c_char_p, c_int]
 plugin.cobble_max_writesize_get.restype = c_int
 plugin.cobble_max_writesize_get.argtypes = [c_bool]
+plugin.cobble_write_stream.restype = c_bool
+plugin.cobble_write_stream.argtypes = [c_char_p, c_char_p, c_int]
+plugin.register_writecomplete_cb.restype = None
+plugin.cobble_mtu_request.restype = c_bool
+plugin.cobble_mtu_request.argtypes = [c_int]
+plugin.register_mtuchanged_cb.restype = None
+plugin.register_discoverycomplete_cb.restype = None
+plugin.register_batch_cb.restype = None
+plugin.cobble_characteristic_uuid_get.restype = c_char_p
+plugin.cobble_characteristic_uuid_get.argtypes = [c_uint16]
+plugin.cobble_gatt_cache_enable.restype = c_bool
+plugin.cobble_gatt_cache_enable.argtypes = [c_char_p]
+plugin.cobble_gatt_cache_forget.restype = None
+plugin.cobble_gatt_cache_forget.argtypes = [c_char_p]
+
+class ConnectFlag(IntFlag):
+    NoDiscovery = 1
+    Uncached = 2
+
+class WriteStatus(IntEnum):
+    Complete = 0
+    Failed = 1
+    Busy = 2
+
+plugin.cobble_dfu_start.restype = c_bool
+plugin.cobble_dfu_start.argtypes = [c_uint16, c_char_p, c_int, c_char_p, c_int]
+plugin.cobble_dfu_abort.restype = None
+plugin.cobble_dfu_abort.argtypes = [c_uint16]
+plugin.cobble_dfu_receipts_set.restype = None
+plugin.cobble_dfu_receipts_set.argtypes = [c_int, c_int]
+plugin.register_dfuprogress_cb.restype = None
+plugin.cobble_crc32.restype = c_uint32
+plugin.cobble_crc32.argtypes = [c_uint32, c_char_p, c_size_t]
+
+class DfuStage(IntEnum):
+    Init = 0
+    Firmware = 1
+    Complete = 2
+    Failed = 3
 
 # Windows only
 plugin.cobble_queue_process.restype = None
+plugin.cobble_queue_wait.restype = c_bool
+plugin.cobble_queue_wait.argtypes = [c_int]
+plugin.cobble_queue_wake.restype = None
+plugin.cobble_event_fd.restype = c_int
 
 
 #typedef void (*scanresult_funcptr)(const char*, int, const char*);
 
 scanresults = Queue()
+advertisements = Queue()
 updatevalues = Queue()
+writecompletes = Queue()
+dfuprogress = Queue()
 characteristics = []
 connected = False
+# (MTU, largest write with response, largest write without response) from the latest mtuchanged event
+mtu = None
+# (services, characteristics, milliseconds taken) once discovery of the connection has finished
+discovered = None
+# The library's status and, while it is CobbleError, the reason, from the latest statuschanged event
+status = CobbleStatus.Uninitialised
+error = CobbleErrorCode.NoError
+# Notified whenever connected, discovered or status change, for the await functions to sleep on
+state_changed = Condition()
 
 # Scan results from the library are sent via this callback
 # For simplicity of use, we simply add to a queue
@@ -85,6 +176,20 @@ def scanresult_cb(name, rssi, identifier):
     scanresults.put((name, rssi, identifier))
 plugin.register_scanresult_cb(scanresult_cb)
 
+# Matches cobble_ad_view in cobble_ad.h
+class AdView(Structure):
+    _fields_ = [('data', POINTER(c_uint8)),
+                ('length', c_int),
+                ('count', c_int),
+                ('offsets', c_uint8 * 32)]
+
+# Raw advertisements, only sent once watch_advertisements() has asked for them. The bytes are copied out, as the view
+# doesn't outlast the callback.
+@CFUNCTYPE(None, c_char_p, c_int, POINTER(AdView))
+def advertisement_cb(identifier, rssi, view):
+    advertisements.put((str(identifier, 'utf-8'), rssi, string_at(view.contents.data, view.contents.length)))
+plugin.register_advertisement_cb.restype = None
+
 # Discovered characteristics are sent by the library via this callback
 # For simplicity of use, we simply add to a list
 # Note that this means that results can be stale.
@@ -96,74 +201,201 @@ def characteristicdiscovered_cb(service_uuid, characteristic_uuid):
     characteristics.append((service_uuid, characteristic_uuid,))
 plugin.register_characteristicdiscovered_cb(characteristicdiscovered_cb)
 
-# Characteristic value update notifications are sent by the library via this callback
-@CFUNCTYPE(None, c_char_p, POINTER(c_char), c_int)
-def updatevalue_cb(characteristic_uuid, data, length):
-    characteristic_uuid = str(characteristic_uuid, 'utf-8')
-    buf = bytes(b''.join([data[i] for i in range(length)]))
-    # print(f"Data received on {characteristic_uuid} is size {len(buf)}, value is " + repr(buf))
-    updatevalues.put((characteristic_uuid, buf))
-plugin.register_updatevalue_cb(updatevalue_cb)
+# Characteristic value update notifications are sent by the library via this callback, many at a time, so that a busy
+# device doesn't cost a call into Python for every notification. Each record (matching cobble_value_record in
+# cobble_events.h) gives where its value is in the payload.
+value_record = struct.Struct('=HHII')
+characteristic_uuids = {}
+
+@CFUNCTYPE(None, c_void_p, c_int, c_void_p)
+def batch_cb(records, count, payload):
+    for connection, characteristic, offset, length in value_record.iter_unpack(string_at(records, count * value_record.size)):
+        characteristic_uuid = characteristic_uuids.get(characteristic)
+        if characteristic_uuid is None:
+            characteristic_uuid = str(plugin.cobble_characteristic_uuid_get(characteristic), 'utf-8')
+            characteristic_uuids[characteristic] = characteristic_uuid
+        updatevalues.put((characteristic_uuid, string_at(payload + offset, length)))
+plugin.register_batch_cb(batch_cb)
 
 
 @CFUNCTYPE(None, c_char_p, c_int)
 def connectionstatus_cb(identifier, e):
-    global connected
+    global connected, mtu, discovered
     print(f"Got a connection status change event for device {identifier}: {e}")
-    if ConnectionEvent(e) == ConnectionEvent.DidDisconnect:
-        characteristics = [] # Clear the cache
-        connected = False
-        # Preserve queued updates though, we might have a backlog
-    if ConnectionEvent(e) == ConnectionEvent.DidConnect:
-        connected = True
+    with state_changed:
+        if ConnectionEvent(e) == ConnectionEvent.DidDisconnect:
+            characteristics = [] # Clear the cache
+            connected = False
+            mtu = None
+            discovered = None
+            # Preserve queued updates though, we might have a backlog
+        if ConnectionEvent(e) == ConnectionEvent.DidConnect:
+            connected = True
+        state_changed.notify_all()
 plugin.register_connectionstatus_cb(connectionstatus_cb)
 
+# Changes to the library's status are sent via this callback, before any other events queued after them
+@CFUNCTYPE(None, c_int, c_int)
+def statuschanged_cb(new_status, new_error):
+    global status, error
+    with state_changed:
+        status = CobbleStatus(new_status)
+        error = CobbleErrorCode(new_error)
+        state_changed.notify_all()
+plugin.register_statuschanged_cb(statuschanged_cb)
+
+# The end of each write_stream() is sent by the library via this callback, with the number of bytes written
+@CFUNCTYPE(None, c_uint16, c_uint16, c_int, c_int)
+def writecomplete_cb(connection, characteristic, written, status):
+    writecompletes.put((written, WriteStatus(status)))
+plugin.register_writecomplete_cb(writecomplete_cb)
+
+# The MTU settled with the device is sent by the library via this callback, after connecting and whenever it changes
+@CFUNCTYPE(None, c_uint16, c_int, c_int, c_int)
+def mtuchanged_cb(connection, new_mtu, max_write, max_write_without_response):
+    global mtu
+    mtu = (new_mtu, max_write, max_write_without_response)
+plugin.register_mtuchanged_cb(mtuchanged_cb)
+
+# The end of discovery is sent by the library via this callback, after every characteristic has been reported
+@CFUNCTYPE(None, c_uint16, c_int, c_int, c_int)
+def discoverycomplete_cb(connection, services, characteristic_count, elapsed_ms):
+    global discovered
+    print(f"Discovered {services} services and {characteristic_count} characteristics in {elapsed_ms} ms")
+    with state_changed:
+        discovered = (services, characteristic_count, elapsed_ms)
+        state_changed.notify_all()
+plugin.register_discoverycomplete_cb(discoverycomplete_cb)
+
+# Firmware updates report their progress via this callback, ending with DfuStage.Complete or DfuStage.Failed
+@CFUNCTYPE(None, c_uint16, c_int, c_int, c_int)
+def dfuprogress_cb(connection, stage, done, total):
+    dfuprogress.put((DfuStage(stage), done, total))
+plugin.register_dfuprogress_cb(dfuprogress_cb)
+
+# Some calls must be made on the thread the library delivers events on, which is the one running the event loop in
+# run_with(). They are queued here for it to make.
+event_thread_calls = Queue()
+
+def call_on_event_thread(func):
+    if platform.system() == 'Darwin':
+        AppHelper.callAfter(func)
+    else:
+        event_thread_calls.put(func)
+        plugin.cobble_queue_wake()
+
 def init():
     print("Cobble init")
     plugin.cobble_init()
 
     # Await either completion or failure
-    while(CobbleStatus(plugin.cobble_status()) not in [CobbleStatus.Initialised, CobbleStatus.CobbleError]):
-        pass
-    
-    pass
+    plugin.cobble_status_wait(CobbleStatus.Initialised, -1)
 
 
 def start_scan():
     print("Cobble start scan")
-    plugin.cobble_scan_start()
+    plugin.cobble_scan_start(None)
     pass
 
 def stop_scan():
     plugin.cobble_scan_stop()
 
+# Report each device at most once every interval_ms, with its RSSI smoothed over the advertisements in between, so that
+# scanresults doesn't fill up with repeats. Devices which haven't advertised for expiry_ms (0 for 30 s) are forgotten.
+# An interval of 0 reports every advertisement.
+def scan_coalesce(interval_ms, expiry_ms=0):
+    plugin.cobble_scan_coalesce_set(interval_ms, expiry_ms)
+
+# Start or stop receiving every advertisement, with its bytes, through get_advertisement(). Backends which have to put
+# the bytes back together do nothing extra until this is called.
+def watch_advertisements(enable=True):
+    plugin.register_advertisement_cb(advertisement_cb if enable else None)
+
+# The number of devices seen within the expiry time while coalescing
+def scan_device_count():
+    return plugin.cobble_scan_device_count()
+
+# Only report advertisements from later scans which have one of the services, a name starting with name_prefix, the
+# company's manufacturer data starting with data (compared under mask, bytes of the same length), and at least rssi_min.
+# Anything left as None (or -1 or 0) isn't checked. With no arguments, stops filtering. Returns False if the filter
+# couldn't be used.
+def scan_filter(services=None, name_prefix=None, manufacturer_id=-1, data=None, mask=None, rssi_min=0):
+    if mask is not None and (data is None or len(mask) != len(data)):
+        return False
+    f = ScanFilter(",".join(services).encode('utf-8') if services else None,
+                   name_prefix.encode('utf-8') if name_prefix else None,
+                   manufacturer_id,
+                   bytes(data) if data else None,
+                   bytes(mask) if mask else None,
+                   len(data) if data else 0,
+                   rssi_min)
+    return plugin.cobble_scan_filter_set(byref(f))
+
+# discovered is cleared here rather than on DidConnect: a cached GATT table can be reported in the same batch of
+# events as the connection, and must not be lost
 def connect(name):
-    plugin.cobble_connect(name.encode('utf-8'))
-    pass
+    global discovered
+    discovered = None
+    return plugin.cobble_connect(name.encode('utf-8'))
+
+# Connect, discovering only the given services (a list of UUID strings), or none until discover_service() asks with
+# ConnectFlag.NoDiscovery
+def connect_ex(name, services=None, flags=0):
+    global discovered
+    discovered = None
+    service_list = ','.join(services).encode('utf-8') if services else None
+    return plugin.cobble_connect_ex(name.encode('utf-8'), service_list, flags)
+
+# Discover one more service once connected. await_discovery() then waits for its own discoverycomplete.
+def discover_service(service_uuid):
+    global discovered
+    discovered = None
+    return plugin.cobble_discover_service(service_uuid.encode('utf-8'))
 
 def await_connection(timeout=30):
-    starttime = datetime.now()
-    while((datetime.now() - starttime) < timedelta(seconds=timeout)):
-        if connected:
-            return True
-    return False
+    with state_changed:
+        return state_changed.wait_for(lambda: connected, timeout)
 
 def await_disconnection(timeout=30):
-    starttime = datetime.now()
-    while((datetime.now() - starttime) < timedelta(seconds=timeout)):
-        if not connected:
-            return True
-    return False
+    with state_changed:
+        return state_changed.wait_for(lambda: not connected, timeout)
+
+# Wait for every characteristic of the connected device to be discovered. Returns (services, characteristics,
+# milliseconds taken), or None if discovery did not finish within the timeout.
+def await_discovery(timeout=30):
+    with state_changed:
+        return state_changed.wait_for(lambda: discovered, timeout)
+
+# Waits for a statuschanged event to the status given, returning False on a timeout or if CobbleError comes first
+def await_status(wanted, timeout=30):
+    with state_changed:
+        state_changed.wait_for(lambda: status in (wanted, CobbleStatus.CobbleError), timeout)
+        return status == wanted
+
+# Each get_ function returns None straight away if nothing has arrived, or waits up to timeout seconds if one is given
+def get_scanresult(timeout=None):
+    try:
+        return scanresults.get(block=timeout is not None, timeout=timeout)
+    except Empty:
+        return None
 
-def get_scanresult():
+# (identifier, rssi, bytes) for each advertisement received, or None
+def get_advertisement(timeout=None):
     try:
-        return scanresults.get(block=False)
+        return advertisements.get(block=timeout is not None, timeout=timeout)
     except Empty:
         return None
 
-def get_updatevalue():
+# The AD structures of an advertisement's bytes, as (type, data) pairs
+def ad_structures(data):
+    i = 0
+    while i < len(data) and data[i] != 0 and i + 1 + data[i] <= len(data):
+        yield (data[i + 1], data[i + 2:i + 1 + data[i]])
+        i += 1 + data[i]
+
+def get_updatevalue(timeout=None):
     try:
-        return updatevalues.get(block=False)
+        return updatevalues.get(block=timeout is not None, timeout=timeout)
     except Empty:
         return None
 
@@ -176,6 +408,75 @@ def write(characteristic_uuid, data):
     plugin.cobble_write(characteristic_uuid.encode('utf-8'), data_converted, len(data))
     pass
 
+# Ask the device for a larger MTU. Returns False where the platform negotiates it itself; either way the outcome
+# arrives as an mtuchanged event and is kept in mtu.
+def mtu_request(new_mtu):
+    return plugin.cobble_mtu_request(new_mtu)
+
+# Keep each device's GATT table in the given directory, which must exist, so that reconnecting needn't wait for
+# discovery. None stops using the cache. Returns False if the directory can't be used.
+def gatt_cache_enable(directory):
+    return plugin.cobble_gatt_cache_enable(None if directory is None else directory.encode('utf-8'))
+
+def gatt_cache_forget(identifier):
+    plugin.cobble_gatt_cache_forget(identifier.encode('utf-8'))
+
+# Write a block of any length, split into packets and paced by the library. Returns (bytes written, WriteStatus)
+# once the whole block has gone, or None if it took longer than the timeout.
+def write_stream(characteristic_uuid, data, timeout=60):
+    assert isinstance(data, (bytearray, bytes))
+    data_converted = (c_char * len(data))(*data)
+    if not plugin.cobble_write_stream(characteristic_uuid.encode('utf-8'), data_converted, len(data)):
+        return (0, WriteStatus.Failed)
+    try:
+        return writecompletes.get(timeout=timeout)
+    except Empty:
+        return None
+
+# Update the firmware of a device in its Nordic Secure DFU bootloader, with the init packet (.dat) and firmware (.bin)
+# from the DFU package. on_progress, if given, is called with (DfuStage, bytes done, bytes in total) as the update moves
+# on. Returns (DfuStage.Complete or DfuStage.Failed, bytes of firmware the device confirmed), or None if it took longer
+# than the timeout.
+def dfu_start(connection, init_packet, firmware, on_progress=None, timeout=600):
+    assert isinstance(init_packet, (bytearray, bytes)) and isinstance(firmware, (bytearray, bytes))
+    init_converted = (c_char * len(init_packet))(*init_packet)
+    firmware_converted = (c_char * len(firmware))(*firmware)
+    started = Queue()
+
+    # Drop anything left from an earlier update
+    while not dfuprogress.empty():
+        dfuprogress.get()
+
+    call_on_event_thread(lambda: started.put(plugin.cobble_dfu_start(connection, init_converted, len(init_packet), firmware_converted, len(firmware))))
+    if not started.get(timeout=timeout):
+        return (DfuStage.Failed, 0)
+
+    endtime = datetime.now() + timedelta(seconds=timeout)
+    confirmed = 0
+    while datetime.now() < endtime:
+        try:
+            stage, done, total = dfuprogress.get(timeout=1)
+        except Empty:
+            continue
+        if on_progress is not None:
+            on_progress(stage, done, total)
+        if stage == DfuStage.Firmware:
+            confirmed = done
+        if stage in [DfuStage.Complete, DfuStage.Failed]:
+            return (stage, confirmed)
+
+    call_on_event_thread(lambda: plugin.cobble_dfu_abort(connection))
+    return None
+
+# Packets between the device's receipts (0 for none), and how many groups of packets may be sent ahead of them
+def dfu_receipts_set(packets, window):
+    plugin.cobble_dfu_receipts_set(packets, window)
+
+# CRC-32 as zlib's, carried on from an earlier crc if one is given
+def crc32(data, crc=0):
+    data_converted = (c_char * len(data))(*data)
+    return plugin.cobble_crc32(crc, data_converted, len(data))
+
 def main_wrap(main_func):
     try:
         return_code = main_func()
@@ -201,8 +502,12 @@ def run_with(main_func):
         except KeyboardInterrupt:
             AppHelper.stopEventLoop()
     else:
+        # Sleeps until there are events or calls to make, looking up every so often to see whether main has returned
         try:
             while(t.is_alive()):
+                while not event_thread_calls.empty():
+                    event_thread_calls.get()()
+                plugin.cobble_queue_wait(100)
                 plugin.cobble_queue_process()
         except KeyboardInterrupt:
             pass
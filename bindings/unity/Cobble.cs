@@ -32,6 +32,10 @@ public class Cobble : MonoBehaviour {
     [DllImport(PLUGIN_NAME)]
     private static extern void cobble_deinit();
 
+    // A CobbleStatus: 1 is Initialised, 5 is CobbleError
+    [DllImport(PLUGIN_NAME)]
+    private static extern int cobble_status();
+
     [DllImport(PLUGIN_NAME)]
     private static extern void cobble_scan_start(string service_uuids);
     [DllImport(PLUGIN_NAME)]
@@ -40,6 +44,11 @@ public class Cobble : MonoBehaviour {
     [DllImport(PLUGIN_NAME)]
     private static extern void cobble_loop();
 
+    // Sends queued events on this thread, stopping after the time given so that a backlog is spread over frames.
+    // Does nothing on platforms which send events as they happen.
+    [DllImport(PLUGIN_NAME)]
+    private static extern int cobble_queue_process_bounded(int max_events, int max_time_us);
+
     [DllImport(PLUGIN_NAME)]
     private static extern void cobble_connect(string identifier);
     [DllImport(PLUGIN_NAME)]
@@ -135,7 +144,7 @@ public class Cobble : MonoBehaviour {
 
     private bool loaded = false;
 
-    private int frames = 0;
+    private bool scanning = false;
 
     public void Awake()
     {
@@ -158,8 +167,6 @@ public class Cobble : MonoBehaviour {
 
     public void Update()
     {
-        frames++;
-
         if(!loaded)
         {
             cobble_init();
@@ -168,11 +175,15 @@ public class Cobble : MonoBehaviour {
             loaded = true;
         }
 
-        if(frames == 600) //TODO: Await cobble_status switching to Initialised (or Error)
-        { 
-            cobble_scan_start();
+        // Checked once a frame, so nothing waits for initialisation to finish
+        if(!scanning && cobble_status() == 1)
+        {
+            scanning = true;
+            cobble_scan_start(null);
         }
 
+        cobble_queue_process_bounded(0, 2000);
+
         ScanResult res;
         while(scanResults.TryDequeue(out res))
         {
@@ -3,9 +3,7 @@ import json
 from cobble import cobble
 from time import sleep
 from enum import IntEnum
-from binascii import crc32
 from tqdm import tqdm
-from datetime import datetime, timedelta
 
 # Implementation of Nordic Secure BLE using Cobble
 # Legacy has subtle differences.
@@ -144,18 +142,6 @@ def load_firmware(fname):
     return (bin_file, dat_file)
 
 
-def set_data(data, chunk_size=20):
-    # When reviewing bootloader code - note that these are still handled by nrf_dfu_req_handler
-    # They just have the type NRF_DFU_OP_OBJECT_WRITE appended automatically
-    bytes_sent = 0
-    while(bytes_sent < len(data)):
-        # Take the next chunk of data
-        next_size = min(chunk_size, len(data)-bytes_sent)
-        segment = data[bytes_sent : bytes_sent + next_size]
-        cobble.write(dfu_data_uuid, segment)
-        sleep(0.01) # TODO: Use receipt request rather than fixed delay for speed?
-        bytes_sent += next_size
-
 def set_legacy_data(data, chunk_size=20):
     # When reviewing bootloader code - note that these are still handled by nrf_dfu_req_handler
     # They just have the type NRF_DFU_OP_OBJECT_WRITE appended automatically
@@ -170,17 +156,14 @@ def set_legacy_data(data, chunk_size=20):
 
 
 
-def set_control(data):
-    cobble.write(dfu_ctrl_uuid, bytes(data))
-
 def set_legacy_control(data):
     cobble.write(legacy_ctrl_uuid, bytes(data))
 
 def await_notification():
 
     # Await a notification
-    while (notif := cobble.get_updatevalue()) == None:
-        sleep(0.01)
+    while (notif := cobble.get_updatevalue(timeout=1)) == None:
+        pass
 
     return notif[1]
     
@@ -268,7 +251,8 @@ def do_legacy_update(fname):
     cobble.subscribe(legacy_ctrl_uuid)
     sleep(1)
 
-    mtu = cobble.plugin.cobble_max_writesize_get(False)
+    # The size from the latest mtuchanged event, falling back to asking the library if none has arrived
+    mtu = cobble.mtu[2] if cobble.mtu else cobble.plugin.cobble_max_writesize_get(False)
     print(f"Maximum packet size determined to be {mtu}")
     
     print("Initialising Legacy DFU...")
@@ -354,10 +338,7 @@ def do_buttonless_entry(identifier):
 
     cobble.connect(identifier)
     assert cobble.await_connection(), "Failed to connect to device in time"
-
-    sleep(1) # Characteristic discovery
-
-    assert len(cobble.characteristics) > 0, "Failed to find buttonless characteristics in time"
+    assert cobble.await_discovery(), "Failed to find buttonless characteristics in time"
 
     assert not (dfu_sv_uuid, dfu_buttonless_with_bonds_uuid) in cobble.characteristics, "Cobble does not currently support bonds"
     assert (dfu_sv_uuid, dfu_buttonless_without_bonds_uuid) in cobble.characteristics, "Missing DFU Buttonless (without bonds) characteristic"
@@ -384,7 +365,7 @@ def do_buttonless_entry(identifier):
     cobble.await_disconnection()
 
 
-def do_secure_update(fname):
+def do_secure_update(fname, connection):
 
     bin_file, dat_file = load_firmware(fname)
 
@@ -393,130 +374,40 @@ def do_secure_update(fname):
     assert (dfu_sv_uuid, dfu_ctrl_uuid) in cobble.characteristics, "Missing DFU Control characteristic"
     assert (dfu_sv_uuid, dfu_data_uuid) in cobble.characteristics, "Missing DFU Packet characteristic"
 
-    # DFU Process
-    print("Subscribing...")
-
-    # Listen for changes on the DFU Control characteristic
-    cobble.subscribe(dfu_ctrl_uuid)
-    sleep(1)
-
-    mtu = cobble.plugin.cobble_max_writesize_get(False)
-    print(f"Maximum packet size determined to be {mtu}")
-
-    print("Initialising DFU...")
-
-    # Flow as in:
+    # The library runs the process, as in:
     # https:#infocenter.nordicsemi.com/index.jsp?topic=%2Fcom.nordic.infocenter.sdk5.v14.1.0%2Flib_bootloader_dfu_process.html
+    # It checks a CRC at each Packet Receipt Notification without waiting for them, sends any object which arrived
+    # corrupted again, and carries on from where the device got to if an earlier transfer was interrupted.
+    print(f"Sending {len(dat_file)} byte init packet and {len(bin_file)} byte firmware...")
+
+    progress = tqdm(total = len(bin_file))
+    def on_progress(stage, done, total):
+        if stage == cobble.DfuStage.Firmware:
+            progress.update(done - progress.n)
 
-    # Select the init packet, see if it matches our expectations
-    set_control(bytes([NRF_DFU_OP.OBJECT_SELECT, NRF_DFU_OBJ_TYPE.COMMAND]))
-    rd = expect_response()
-    maxSize = u32le(rd[3:7])
-    offset = u32le(rd[7:11])
-    crc = u32le(rd[11:15])
-
-    # Are the values what we'd expect? If so, we're resuming a faulty transfer
-    if(crc != crc32(dat_file)) or (offset != len(dat_file)):
-
-        # Tell the DFU to expect a new init packet
-        initlen = u32tole(len(dat_file))
-        set_control(bytes([NRF_DFU_OP.OBJECT_CREATE, NRF_DFU_OBJ_TYPE.COMMAND, initlen[0], initlen[1], initlen[2], initlen[3]]))
-        rd = expect_response()
-
-        # Send the init data
-        set_data(dat_file, mtu)
-
-        # CRC it
-        set_control(bytes([NRF_DFU_OP.CRC_GET]))
-        rd = expect_response()
-        assert NRF_DFU_OP(rd[1]) == NRF_DFU_OP.CRC_GET, "Received weird response"
-        offset = u32le(rd[3:7])
-        crc = u32le(rd[7:11])
-        assert offset == len(dat_file), "Device received fewer bytes than we sent"
-        assert crc == crc32(dat_file), f"CRC check failed: Our file is {crc32(dat_file)}, but device got {crc}"
-
-        # Prevalidate (execute)
-        set_control(bytes([NRF_DFU_OP.OBJECT_EXECUTE]))
-        rd = expect_response()
-
-    # Device is now stuck in DFU mode until an update completes.
-    print("Initialised OK, now sending data...")
-
-    # Select the data packet
-    set_control(bytes([NRF_DFU_OP.OBJECT_SELECT, NRF_DFU_OBJ_TYPE.DATA]))
-    rd = expect_response()
-    maxSize = u32le(rd[3:7])
-    offset = u32le(rd[7:11])
-    crc = u32le(rd[11:15])
-
-    assert offset==0, "Resuming not supported!"
-
-    # The device can't accept the entire firmware in one transfer, it needs chunks (in the case of nRF52832, 4096 bytes max)
-    # Smaller chunks also gives us more opportunities to catch issues with the CRC and retry without needing to
-    # re-send the whole image.
-    num_data_objects = ((len(bin_file) + maxSize - 1) // maxSize)
-    print(f"We will send {num_data_objects} data objects of size {maxSize} to transfer the needed {len(bin_file)} bytes")
-
-    bytes_remaining = len(bin_file)
-    progress = tqdm(total = bytes_remaining)
-    while(bytes_remaining):
-
-        # TODO: Can we CRC this block without writing, to save time if resuming a disrupted upload?
-        
-        transfer_size = min(bytes_remaining, maxSize)
-        data_start_idx = len(bin_file) - bytes_remaining
-        data_end_idx = data_start_idx + transfer_size
-        chunk = bin_file[data_start_idx : data_end_idx]
-
-        # Create data object
-        datalen = u32tole(transfer_size)
-        set_control(bytes([NRF_DFU_OP.OBJECT_CREATE, NRF_DFU_OBJ_TYPE.DATA, datalen[0], datalen[1], datalen[2], datalen[3]]))
-        rd = expect_response()
-
-        # Transfer firmware data
-        set_data(chunk, mtu)
-
-        # CRC
-        set_control(bytes([NRF_DFU_OP.CRC_GET]))
-        rd = expect_response()
-        assert NRF_DFU_OP(rd[1]) == NRF_DFU_OP.CRC_GET, "Received weird response"
-        offset = u32le(rd[3:7])
-        crc = u32le(rd[7:11])
-        expected_offset = len(bin_file) - bytes_remaining + transfer_size
-        expected_crc = crc32(bin_file[:data_end_idx])
-        assert offset == expected_offset, f"Device thinks offset is {offset}, we think {expected_offset}"
-
-        # Execute
-        set_control(bytes([NRF_DFU_OP.OBJECT_EXECUTE]))
-        rd = expect_response()
-
-        # Update progress
-        progress.update(transfer_size)
-        bytes_remaining -= transfer_size
+    result = cobble.dfu_start(connection, dat_file, bin_file, on_progress)
 
     # Postvalidate and boot happens automatically on completion
 
     # Progress bar needs closing
     progress.close()
 
+    assert result is not None, "Timed out updating the firmware"
+    stage, confirmed = result
+    assert stage == cobble.DfuStage.Complete, f"Update failed after {confirmed} of {len(bin_file)} bytes"
+
 
 
 def do_update(fname, identifier):
 
-    cobble.connect(identifier)
+    connection = cobble.connect(identifier)
     assert cobble.await_connection(), "Failed to connect to device within timeout period"
 
-    # After connection, give it a short while to discover characteristics
-    starttime = datetime.now()
-    while((datetime.now() - starttime) < timedelta(seconds=10)):
-        if (dfu_sv_uuid, dfu_ctrl_uuid) in cobble.characteristics or (legacy_sv_uuid, legacy_ctrl_uuid) in cobble.characteristics:
-            break
-
-    assert len(cobble.characteristics) > 0, "Failed to find DFU characteristics in time"
+    assert cobble.await_discovery(timeout=10), "Failed to find DFU characteristics in time"
 
     if (dfu_sv_uuid, dfu_ctrl_uuid) in cobble.characteristics:
         # Secure DFU
-        do_secure_update(fname)
+        do_secure_update(fname, connection)
     elif (legacy_sv_uuid, legacy_ctrl_uuid) in cobble.characteristics:
         # Legacy DFU
         do_legacy_update(fname)
@@ -29,8 +29,7 @@ def main():
 
         sleep(0.01)
 
-    # TODO: Await connection event rather than just sleeping
-    sleep(3)
+    cobble.await_discovery(timeout=3)
 
     print("Characteristics: ")
     print(repr(cobble.characteristics)) # Consists of all discovered (service, characteristic) pairs as strings
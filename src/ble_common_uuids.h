@@ -1,44 +1,51 @@
 //Standard BLE GATT Service UUIDs
+// These are binary constants, which can be compared directly with cobble_uuid_equal()
+#ifndef BLE_COMMON_UUIDS_H
+#define BLE_COMMON_UUIDS_H
 
-#define gatt_generic_access "1800"
-#define gatt_alert_notification "1811"
-#define gatt_automation_io "1815"
-#define gatt_battery_service "180F"
-#define gatt_binary_sensor "183B"
-#define gatt_blood_pressure "1810"
-#define gatt_body_composition "181B"
-#define gatt_bond_management "181E"
-#define gatt_continuous_glucose_monitoring "181F"
-#define gatt_current_time "1805"
-#define gatt_cycling_power "1818"
-#define gatt_cycling_speed_and_cadence "1816"
-#define gatt_device_information "180A"
-#define gatt_emergency_configuration "183C"
-#define gatt_environmental_sensing "181A"
-#define gatt_fitness_machine "1826"
-#define gatt_generic_attribute "1801"
-#define gatt_glucose "1808"
-#define gatt_health_thermometer "1809"
-#define gatt_heart_rate "180D"
-#define gatt_http_proxy "1823"
-#define gatt_human_interface_device "1812"
-#define gatt_immediate_alert "1802"
-#define gatt_indoor_positioning "1821"
-#define gatt_insulin_delivery "183A"
-#define gatt_internet_protocol_support "1820"
-#define gatt_link_loss "1803"
-#define gatt_location_and_navigation "1819"
-#define gatt_mesh_provisioning "1827"
-#define gatt_mesh_proxy "1828"
-#define gatt_next_dst_change "1807"
-#define gatt_object_transfer "1825"
-#define gatt_phone_alert_status "180E"
-#define gatt_pulse_oximeter "1822"
-#define gatt_reconnection_configuration "1829"
-#define gatt_reference_time_update "1806"
-#define gatt_running_speed_and_cadence "1814"
-#define gatt_scan_parameters "1813"
-#define gatt_transport_discovery "1824"
-#define gatt_tx_power "1804"
-#define gatt_user_data "181C"
-#define gatt_weight_scale "181D"
\ No newline at end of file
+#include "cobble_uuid.h"
+
+COBBLE_UUID_CONSTANT gatt_generic_access = COBBLE_UUID16(0x1800);
+COBBLE_UUID_CONSTANT gatt_alert_notification = COBBLE_UUID16(0x1811);
+COBBLE_UUID_CONSTANT gatt_automation_io = COBBLE_UUID16(0x1815);
+COBBLE_UUID_CONSTANT gatt_battery_service = COBBLE_UUID16(0x180F);
+COBBLE_UUID_CONSTANT gatt_binary_sensor = COBBLE_UUID16(0x183B);
+COBBLE_UUID_CONSTANT gatt_blood_pressure = COBBLE_UUID16(0x1810);
+COBBLE_UUID_CONSTANT gatt_body_composition = COBBLE_UUID16(0x181B);
+COBBLE_UUID_CONSTANT gatt_bond_management = COBBLE_UUID16(0x181E);
+COBBLE_UUID_CONSTANT gatt_continuous_glucose_monitoring = COBBLE_UUID16(0x181F);
+COBBLE_UUID_CONSTANT gatt_current_time = COBBLE_UUID16(0x1805);
+COBBLE_UUID_CONSTANT gatt_cycling_power = COBBLE_UUID16(0x1818);
+COBBLE_UUID_CONSTANT gatt_cycling_speed_and_cadence = COBBLE_UUID16(0x1816);
+COBBLE_UUID_CONSTANT gatt_device_information = COBBLE_UUID16(0x180A);
+COBBLE_UUID_CONSTANT gatt_emergency_configuration = COBBLE_UUID16(0x183C);
+COBBLE_UUID_CONSTANT gatt_environmental_sensing = COBBLE_UUID16(0x181A);
+COBBLE_UUID_CONSTANT gatt_fitness_machine = COBBLE_UUID16(0x1826);
+COBBLE_UUID_CONSTANT gatt_generic_attribute = COBBLE_UUID16(0x1801);
+COBBLE_UUID_CONSTANT gatt_glucose = COBBLE_UUID16(0x1808);
+COBBLE_UUID_CONSTANT gatt_health_thermometer = COBBLE_UUID16(0x1809);
+COBBLE_UUID_CONSTANT gatt_heart_rate = COBBLE_UUID16(0x180D);
+COBBLE_UUID_CONSTANT gatt_http_proxy = COBBLE_UUID16(0x1823);
+COBBLE_UUID_CONSTANT gatt_human_interface_device = COBBLE_UUID16(0x1812);
+COBBLE_UUID_CONSTANT gatt_immediate_alert = COBBLE_UUID16(0x1802);
+COBBLE_UUID_CONSTANT gatt_indoor_positioning = COBBLE_UUID16(0x1821);
+COBBLE_UUID_CONSTANT gatt_insulin_delivery = COBBLE_UUID16(0x183A);
+COBBLE_UUID_CONSTANT gatt_internet_protocol_support = COBBLE_UUID16(0x1820);
+COBBLE_UUID_CONSTANT gatt_link_loss = COBBLE_UUID16(0x1803);
+COBBLE_UUID_CONSTANT gatt_location_and_navigation = COBBLE_UUID16(0x1819);
+COBBLE_UUID_CONSTANT gatt_mesh_provisioning = COBBLE_UUID16(0x1827);
+COBBLE_UUID_CONSTANT gatt_mesh_proxy = COBBLE_UUID16(0x1828);
+COBBLE_UUID_CONSTANT gatt_next_dst_change = COBBLE_UUID16(0x1807);
+COBBLE_UUID_CONSTANT gatt_object_transfer = COBBLE_UUID16(0x1825);
+COBBLE_UUID_CONSTANT gatt_phone_alert_status = COBBLE_UUID16(0x180E);
+COBBLE_UUID_CONSTANT gatt_pulse_oximeter = COBBLE_UUID16(0x1822);
+COBBLE_UUID_CONSTANT gatt_reconnection_configuration = COBBLE_UUID16(0x1829);
+COBBLE_UUID_CONSTANT gatt_reference_time_update = COBBLE_UUID16(0x1806);
+COBBLE_UUID_CONSTANT gatt_running_speed_and_cadence = COBBLE_UUID16(0x1814);
+COBBLE_UUID_CONSTANT gatt_scan_parameters = COBBLE_UUID16(0x1813);
+COBBLE_UUID_CONSTANT gatt_transport_discovery = COBBLE_UUID16(0x1824);
+COBBLE_UUID_CONSTANT gatt_tx_power = COBBLE_UUID16(0x1804);
+COBBLE_UUID_CONSTANT gatt_user_data = COBBLE_UUID16(0x181C);
+COBBLE_UUID_CONSTANT gatt_weight_scale = COBBLE_UUID16(0x181D);
+
+#endif
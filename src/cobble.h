@@ -1,4 +1,7 @@
 // Common Bindings for Bluetooth LE
+#ifndef COBBLE_H
+#define COBBLE_H
+
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -32,7 +35,39 @@ EXPORTED void cobble_scan_stop(void);
 
 EXPORTED void cobble_loop(void);
 
-EXPORTED void cobble_connect(const char* identifier);
+// Several devices may be connected at once. Each connection is identified by a small integer handle, which
+// cobble_connect() returns and which the events about it carry (see the *_c callbacks in cobble_events.h).
+// Zero is never a valid handle.
+typedef uint16_t cobble_conn_handle;
+
+// Returns the handle of the new connection, or 0 if one could not be started (eg too many devices are connected).
+// The connection can be used once a DidConnect event arrives for it.
+EXPORTED cobble_conn_handle cobble_connect(const char* identifier);
+
+// Flags for cobble_connect_ex()
+typedef enum {
+    ConnectFlag_None = 0,
+    ConnectFlag_NoDiscovery = 1 << 0, // Discover nothing until cobble_discover_service() asks, and send no discoverycomplete until then
+    ConnectFlag_Uncached = 1 << 1,    // Discover the device afresh, rather than from the GATT cache (see cobble_gatt_cache.h)
+} CobbleConnectFlags;
+
+// The most services cobble_connect_ex() can be given
+#define COBBLE_MAX_CONNECT_SERVICES 16
+
+// As cobble_connect(), but only the services in service_uuids (a service UUID, or comma-separated list of them) are
+// discovered, and only their characteristics are reported and can be used. NULL or an empty list discovers every service,
+// as cobble_connect() does. discoverycomplete counts the services found, which may be fewer than were asked for.
+// Looking up a few services by UUID saves a round trip for every service and characteristic skipped, which adds up on
+// devices with many services. Android and BlueZ always discover every service themselves, so there it saves no time, but
+// only the services asked for are reported.
+EXPORTED cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags);
+
+// Discover one more service after connecting. Its characteristics are reported as discovery's are, followed by a
+// discoverycomplete event for that service alone, with a service count of 0 if the device doesn't have it. A service
+// asked for while the first discovery is still going on may be reported with it rather than on its own, and Windows
+// refuses requests until the device has been opened. Returns false if the request could not be made.
+EXPORTED bool cobble_discover_service(const char* service_uuid);
+// Disconnects every device
 EXPORTED void cobble_disconnect(void);
 
 EXPORTED void cobble_characteristics_get(void);
@@ -51,8 +86,68 @@ EXPORTED void cobble_subscribe(const char* char_uuid);
 EXPORTED void cobble_read(const char* char_uuid);
 EXPORTED void cobble_write(const char* char_uid, uint8_t* data, int len);
 
+// Characteristics can also be referred to by handle, which avoids looking up the UUID string on every operation.
+// A UUID always resolves to the same handle for the lifetime of the library, so this can be done once, even before the
+// characteristic has been discovered. Zero is never a valid handle.
+typedef uint16_t cobble_char_handle;
+
+EXPORTED cobble_char_handle cobble_characteristic_handle(const char* char_uuid);
+EXPORTED const char* cobble_characteristic_uuid_get(cobble_char_handle characteristic);
+
+EXPORTED void cobble_subscribe_h(cobble_char_handle characteristic);
+EXPORTED void cobble_read_h(cobble_char_handle characteristic);
+EXPORTED void cobble_write_h(cobble_char_handle characteristic, uint8_t* data, int len);
+
+// A characteristic's values can go to a callback of its own, with a context pointer for the application, instead of to
+// register_updatevalue_cb() and the other value callbacks. The core finds it by connection and handle, so nothing
+// compares UUIDs for each value. Each connection has its own, so the same characteristic on two devices can have a
+// context for each; cobble_characteristic_cb_set() sets it for the connection most recently started with cobble_connect().
+// Values read with cobble_read_h() go to it too. A NULL callback sends the characteristic's values to the shared callbacks
+// again. Once these return, the old callback is no longer running with the old context and won't be called again, so the
+// context can be freed - unless they were called from that callback, which is still running until it returns. They wait
+// for the callback to return, so it mustn't wait for another thread which is changing a callback itself.
+typedef void (*cobble_value_cb)(void* ctx, cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len);
+EXPORTED void cobble_characteristic_cb_set(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx);
+EXPORTED void cobble_characteristic_cb_set_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx);
+
+// Sets the characteristic's callback, then subscribes to it
+EXPORTED void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx);
+
 EXPORTED int cobble_max_writesize_get(bool withResponse);
 
+// The largest ATT MTU the Bluetooth specification allows
+#define COBBLE_MAX_ATT_MTU 517
+
+// Ask for a different ATT MTU. Every backend asks for the largest it can as soon as it connects, so this is only needed
+// to ask for something smaller, or to ask again. If the MTU changes, an mtuchanged event (see cobble_events.h) follows
+// with the new maximum write sizes. Returns false if the request could not be made, including on platforms where the
+// operating system negotiates the MTU itself (Apple platforms, Windows and Linux); they still send mtuchanged.
+EXPORTED bool cobble_mtu_request(int mtu);
+
+// Write a block of any length, as a stream of writes of up to cobble_max_writesize_get() bytes each.
+// Where the characteristic allows, these are writes without response, kept in flight for as long as the platform's flow
+// control accepts more, so the link stays busy without the application having to pace them. Otherwise each write waits
+// for the response to the one before.
+// The data is copied, so the buffer may be reused as soon as this returns. One stream can be in progress on each
+// connection at a time. A single writecomplete event (see cobble_events.h) reports when the whole block has been sent,
+// or why it stopped. Returns false, with no event to follow, if the stream could not be started at all.
+EXPORTED bool cobble_write_stream(const char* char_uuid, const uint8_t* data, int len);
+EXPORTED bool cobble_write_stream_h(cobble_char_handle characteristic, const uint8_t* data, int len);
+
+// Operations on a particular connection. The versions above, without a connection handle, act on the connection most
+// recently started with cobble_connect().
+// Linux (BlueZ) and the simulator support many connections at once. Other platforms support one at a time.
+EXPORTED void cobble_disconnect_c(cobble_conn_handle connection);
+EXPORTED void cobble_characteristics_get_c(cobble_conn_handle connection);
+EXPORTED void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic);
+EXPORTED void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx);
+EXPORTED void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic);
+EXPORTED void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t* data, int len);
+EXPORTED int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse);
+EXPORTED bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu);
+EXPORTED bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid);
+EXPORTED bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len);
+
 typedef enum {
     Uninitialised = 0,
     Initialised,
@@ -75,6 +170,11 @@ typedef enum {
 
 EXPORTED CobbleErrorCode cobble_error_get(void);
 
+// Sleeps until the status is the one given or CobbleError, or the timeout passes (-1 waits indefinitely), and returns the
+// status then. Use it in place of polling cobble_status(), eg to wait for cobble_init() to reach Initialised.
+// Applications which take events can use register_statuschanged_cb() instead.
+EXPORTED CobbleStatus cobble_status_wait(CobbleStatus status, int timeoutMs);
+
 
 //Threading and delegate handling
 void cobble_shutdown(void);
@@ -84,6 +184,74 @@ void cobble_loop(void);
 //This is used on Windows with Unity (otherwise we see lockups and crashes)
 EXPORTED void cobble_queue_process(void);
 
+// Like cobble_queue_process(), but returns once maxEvents events have been delivered or maxTimeUs microseconds have
+// passed (0 for no limit on either), leaving the rest for the next call, eg to bound the time taken from a game's frame.
+// The time is checked between events, so a slow callback can overrun it. Returns the number of events delivered.
+EXPORTED int cobble_queue_process_bounded(int maxEvents, int maxTimeUs);
+
+// Events are delivered in the order they were queued. With QueueOrder_ControlFirst, status changes, connection events,
+// discovery, MTU changes and write completions go ahead of scan results, advertisements and value updates which are
+// still waiting, so that a backlog of data can't hold them up. Neither is ever reordered among itself.
+typedef enum {
+    QueueOrder_Sequential = 0,
+    QueueOrder_ControlFirst,
+} CobbleQueueOrder;
+
+EXPORTED void cobble_queue_order_set(CobbleQueueOrder order);
+
+// The sequence number of the event being delivered, during a callback from cobble_queue_process(). Each event queued
+// takes the next number, so a gap means events were dropped (or taken by cobble_events_drain()). 0 with the realtime core.
+EXPORTED uint64_t cobble_event_sequence(void);
+
+// Sends events from a pool of threads instead of cobble_queue_process(), so that neither the Bluetooth stack nor one
+// application thread waits on slow callbacks. The events for a connection (and so the values of each of its
+// characteristics) are sent one at a time, in order, on one thread at a time, while different connections are sent in
+// parallel; scan results and advertisements are in order among themselves, as are status changes, but not against
+// connections. threads is the number of threads (0 for one per CPU), and cpus, if not NULL, gives a CPU to pin each to
+// (-1 for none), where the platform allows it. Callbacks, including register_batch_cb(), may then be called from several
+// threads at once, and cobble_queue_process() and cobble_events_drain() do nothing. Returns false if the dispatcher is
+// already running, cobble_events_drain() has been used, or with the realtime core (Apple platforms and Android).
+// The realtime core has no dispatcher: its callbacks are still made on the main queue, where CoreBluetooth calls back,
+// or on the thread which called in from Java, and hold it up for as long as they take. Applications there have to hand
+// slow work to threads of their own.
+EXPORTED bool cobble_dispatch_start(int threads, const int* cpus);
+
+// Sends whatever the threads have been given and stops them, leaving anything else queued for cobble_queue_process().
+// Not from a callback sent by the dispatcher.
+EXPORTED void cobble_dispatch_stop(void);
+
+// Sleeps until events are waiting for cobble_queue_process() (or cobble_events_drain()), the timeout passes (-1 waits
+// indefinitely), or cobble_queue_wake() is called, and returns whether events are waiting. Call cobble_queue_process()
+// after each wait, which is what makes the next wait sleep again.
+// Events are never waiting with the realtime core (Apple platforms and Android), so there this only sleeps.
+EXPORTED bool cobble_queue_wait(int timeoutMs);
+
+// Ends a cobble_queue_wait() early, eg for the application to do something on the thread that waits
+EXPORTED void cobble_queue_wake(void);
+
+// A file descriptor which is readable while events are waiting, for applications which sleep in epoll(), select() or an
+// asyncio loop rather than cobble_queue_wait(). Only poll it for reading, as cobble_queue_process() and
+// cobble_events_drain() clear it. It is -1 on Windows (use cobble_queue_wait()) and with the realtime core.
+EXPORTED int cobble_event_fd(void);
+
+// Deferred events are held in fixed-size queues. If the application does not call cobble_queue_process() often enough, the queues fill up.
+// By default the newest events are then dropped, preserving the backlog. Streaming applications may prefer to keep the most recent data instead.
+typedef enum {
+    QueuePolicy_DropNewest = 0,
+    QueuePolicy_DropOldest,
+} CobbleQueuePolicy;
+
+EXPORTED void cobble_queue_policy_set(CobbleQueuePolicy policy);
+
+// Number of events discarded so far because a queue was full, and of value updates for a characteristic which couldn't be
+// given a handle
+EXPORTED uint64_t cobble_queue_dropped_get(void);
+
+// Number of value updates cut to 512 bytes to fit a queue entry. Only the first is logged.
+EXPORTED uint64_t cobble_queue_truncated_get(void);
+
 #ifdef __cplusplus
 }
 #endif
+
+#endif
@@ -0,0 +1,234 @@
+#include "cobble_ad.h"
+
+#include <string.h>
+
+// The view is handed out as const, as its bytes are, but the index is filled in on first use
+static void index_structures(const cobble_ad_view* view) {
+
+    cobble_ad_view* v = (cobble_ad_view*)view;
+    int count = 0;
+
+    for (int i = 0; i < v->length && count < COBBLE_AD_MAX_STRUCTURES;) {
+        int len = v->data[i];
+        if (len == 0 || i + 1 + len > v->length)
+            break;
+        v->offsets[count++] = (uint8_t)i;
+        i += 1 + len;
+    }
+
+    v->count = count;
+}
+
+static inline void ensure_index(const cobble_ad_view* view) {
+    if (view->count < 0)
+        index_structures(view);
+}
+
+EXPORTED int cobble_ad_count(const cobble_ad_view* view) {
+    ensure_index(view);
+    return view->count;
+}
+
+EXPORTED bool cobble_ad_get(const cobble_ad_view* view, int index, int* type, const uint8_t** data, int* len) {
+
+    ensure_index(view);
+    if (index < 0 || index >= view->count)
+        return false;
+
+    const uint8_t* s = view->data + view->offsets[index];
+    *type = s[1];
+    *data = s + 2;
+    *len = s[0] - 1;
+    return true;
+}
+
+EXPORTED bool cobble_ad_find(const cobble_ad_view* view, int type, const uint8_t** data, int* len) {
+
+    ensure_index(view);
+    for (int i = 0; i < view->count; i++) {
+        const uint8_t* s = view->data + view->offsets[i];
+        if (s[1] == type) {
+            *data = s + 2;
+            *len = s[0] - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+EXPORTED bool cobble_ad_manufacturer_data(const cobble_ad_view* view, int* company, const uint8_t** data, int* len) {
+
+    const uint8_t* d;
+    int l;
+    if (!cobble_ad_find(view, AdType_ManufacturerData, &d, &l) || l < 2)
+        return false;
+
+    // Little-endian, as everything in an advertisement is
+    *company = d[0] | (d[1] << 8);
+    *data = d + 2;
+    *len = l - 2;
+    return true;
+}
+
+// UUIDs are sent least significant byte first
+static bool uuid_from_ad(const uint8_t* data, int len, cobble_uuid* out) {
+    uint8_t reversed[16];
+    for (int i = 0; i < len; i++)
+        reversed[i] = data[len - 1 - i];
+    return cobble_uuid_from_bytes(reversed, (size_t)len, out);
+}
+
+static int uuid_size(int type) {
+    switch (type) {
+    case AdType_Services16Incomplete:
+    case AdType_Services16:
+    case AdType_ServiceData16:
+        return 2;
+    case AdType_Services32Incomplete:
+    case AdType_Services32:
+    case AdType_ServiceData32:
+        return 4;
+    case AdType_Services128Incomplete:
+    case AdType_Services128:
+    case AdType_ServiceData128:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+EXPORTED bool cobble_ad_service_data(const cobble_ad_view* view, const cobble_uuid* service, const uint8_t** data, int* len) {
+
+    ensure_index(view);
+    for (int i = 0; i < view->count; i++) {
+        const uint8_t* s = view->data + view->offsets[i];
+        int type = s[1];
+        if (type != AdType_ServiceData16 && type != AdType_ServiceData32 && type != AdType_ServiceData128)
+            continue;
+
+        int size = uuid_size(type);
+        cobble_uuid uuid;
+        if (s[0] - 1 < size || !uuid_from_ad(s + 2, size, &uuid) || !cobble_uuid_equal(&uuid, service))
+            continue;
+
+        *data = s + 2 + size;
+        *len = s[0] - 1 - size;
+        return true;
+    }
+    return false;
+}
+
+EXPORTED int cobble_ad_services(const cobble_ad_view* view, cobble_uuid* out, int max) {
+
+    ensure_index(view);
+    int count = 0;
+    for (int i = 0; i < view->count; i++) {
+        const uint8_t* s = view->data + view->offsets[i];
+        int type = s[1];
+        if (type < AdType_Services16Incomplete || type > AdType_Services128)
+            continue;
+
+        int size = uuid_size(type);
+        for (int j = 0; j + size <= s[0] - 1; j += size) {
+            if (count < max)
+                uuid_from_ad(s + 2 + j, size, &out[count]);
+            count++;
+        }
+    }
+    return count;
+}
+
+EXPORTED bool cobble_ad_tx_power(const cobble_ad_view* view, int* dbm) {
+
+    const uint8_t* d;
+    int l;
+    if (!cobble_ad_find(view, AdType_TxPower, &d, &l) || l < 1)
+        return false;
+
+    *dbm = (int8_t)d[0];
+    return true;
+}
+
+int cobble_ad_append(uint8_t* buffer, int len, int type, const uint8_t* data, int dataLen) {
+
+    if (dataLen < 0 || dataLen > 254 || len + 2 + dataLen > COBBLE_AD_MAX_LENGTH)
+        return len;
+
+    buffer[len] = (uint8_t)(dataLen + 1);
+    buffer[len + 1] = (uint8_t)type;
+    if (dataLen > 0)
+        memcpy(buffer + len + 2, data, (size_t)dataLen);
+    return len + 2 + dataLen;
+}
+
+int cobble_ad_append_manufacturer_data(uint8_t* buffer, int len, int company, const uint8_t* data, int dataLen) {
+
+    uint8_t m[COBBLE_AD_MAX_LENGTH];
+    if (dataLen < 0 || dataLen > COBBLE_AD_MAX_LENGTH - 4)
+        return len;
+
+    m[0] = (uint8_t)company;
+    m[1] = (uint8_t)(company >> 8);
+    if (dataLen > 0)
+        memcpy(m + 2, data, (size_t)dataLen);
+    return cobble_ad_append(buffer, len, AdType_ManufacturerData, m, 2 + dataLen);
+}
+
+// UUIDs based on the Bluetooth Base UUID have a 16-bit form, which is sent least significant byte first as the 128-bit
+// form is
+static bool short_uuid(const cobble_uuid* uuid, uint8_t* out) {
+    const cobble_uuid base = COBBLE_UUID16(0);
+    if (uuid->bytes[0] != 0 || uuid->bytes[1] != 0 || memcmp(uuid->bytes + 4, base.bytes + 4, 12) != 0)
+        return false;
+    out[0] = uuid->bytes[3];
+    out[1] = uuid->bytes[2];
+    return true;
+}
+
+static void long_uuid(const cobble_uuid* uuid, uint8_t* out) {
+    for (int i = 0; i < 16; i++)
+        out[i] = uuid->bytes[15 - i];
+}
+
+int cobble_ad_append_service_data(uint8_t* buffer, int len, const cobble_uuid* service, const uint8_t* data, int dataLen) {
+
+    uint8_t sd[COBBLE_AD_MAX_LENGTH];
+    if (dataLen < 0 || dataLen > COBBLE_AD_MAX_LENGTH - 18)
+        return len;
+
+    int uuidLength = 2;
+    if (!short_uuid(service, sd)) {
+        long_uuid(service, sd);
+        uuidLength = 16;
+    }
+    if (dataLen > 0)
+        memcpy(sd + uuidLength, data, (size_t)dataLen);
+    return cobble_ad_append(buffer, len, uuidLength == 2 ? AdType_ServiceData16 : AdType_ServiceData128, sd, uuidLength + dataLen);
+}
+
+int cobble_ad_append_services(uint8_t* buffer, int len, const cobble_uuid* services, int count) {
+
+    uint8_t shortUuids[COBBLE_AD_MAX_LENGTH];
+    uint8_t longUuids[COBBLE_AD_MAX_LENGTH];
+    int shortLength = 0;
+    int longLength = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint8_t u[2];
+        if (short_uuid(&services[i], u)) {
+            if (shortLength + 2 <= COBBLE_AD_MAX_LENGTH) {
+                memcpy(shortUuids + shortLength, u, 2);
+                shortLength += 2;
+            }
+        } else if (longLength + 16 <= COBBLE_AD_MAX_LENGTH) {
+            long_uuid(&services[i], longUuids + longLength);
+            longLength += 16;
+        }
+    }
+
+    if (shortLength > 0)
+        len = cobble_ad_append(buffer, len, AdType_Services16, shortUuids, shortLength);
+    if (longLength > 0)
+        len = cobble_ad_append(buffer, len, AdType_Services128, longUuids, longLength);
+    return len;
+}
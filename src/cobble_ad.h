@@ -0,0 +1,108 @@
+// Read-only access to the raw bytes of an advertisement, for devices which broadcast readings without being connected to
+//
+// An advertisement (and its scan response) is a run of AD structures: a length byte, a type byte, then length - 1 bytes
+// of data. register_advertisement_cb() (in cobble_events.h) is sent a view of those bytes as received, with the device's
+// identifier and the RSSI. The structures are found the first time one is asked for, by recording where each starts, so
+// nothing is parsed for advertisements the application doesn't look into, and nothing is copied out of the view.
+//
+// Every advertisement which passes the scan filter (see cobble_scan_filter.h) is delivered, without the coalescing of
+// scan results. Not every platform hands over the bytes as they came over the air:
+// * Android gives the advertisement and scan response together, as received
+// * Windows gives the advertisement and the scan response separately, each as received
+// * BlueZ and CoreBluetooth only give what they have parsed from them, so the view is rebuilt from that: the name,
+//   manufacturer data, service data, service UUIDs and TX power, in that order. Other types are lost, and each
+//   advertisement carries everything the OS has seen from the device so far.
+#ifndef COBBLE_AD_H
+#define COBBLE_AD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+#include "cobble_uuid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Advertisements are truncated to this (an extended advertisement can be longer, but no platform gives more in one go)
+#define COBBLE_AD_MAX_LENGTH 255
+
+// Structures found in one advertisement. A legacy advertisement and scan response have room for 31 of the smallest.
+#define COBBLE_AD_MAX_STRUCTURES 32
+
+// Types from the Bluetooth Assigned Numbers
+typedef enum {
+    AdType_Flags = 0x01,
+    AdType_Services16Incomplete = 0x02,
+    AdType_Services16 = 0x03,
+    AdType_Services32Incomplete = 0x04,
+    AdType_Services32 = 0x05,
+    AdType_Services128Incomplete = 0x06,
+    AdType_Services128 = 0x07,
+    AdType_ShortName = 0x08,
+    AdType_Name = 0x09,
+    AdType_TxPower = 0x0A,
+    AdType_ServiceData16 = 0x16,
+    AdType_Appearance = 0x19,
+    AdType_ServiceData32 = 0x20,
+    AdType_ServiceData128 = 0x21,
+    AdType_ManufacturerData = 0xFF,
+} CobbleAdType;
+
+typedef struct {
+    const uint8_t* data;
+    int length;
+
+    // Where each structure starts, filled in when first needed. count is -1 until then.
+    int count;
+    uint8_t offsets[COBBLE_AD_MAX_STRUCTURES];
+} cobble_ad_view;
+
+// The number of AD structures. Parsing stops at a zero length byte (the padding some platforms add), at a structure
+// which runs past the end, or after COBBLE_AD_MAX_STRUCTURES.
+EXPORTED int cobble_ad_count(const cobble_ad_view* view);
+
+// A structure's type and data (after the type byte). Returns false if there aren't that many.
+EXPORTED bool cobble_ad_get(const cobble_ad_view* view, int index, int* type, const uint8_t** data, int* len);
+
+// The data of the first structure of a type. Returns false if there is none.
+EXPORTED bool cobble_ad_find(const cobble_ad_view* view, int type, const uint8_t** data, int* len);
+
+// Manufacturer data: the company identifier, then the data after it. Returns false if there is none.
+EXPORTED bool cobble_ad_manufacturer_data(const cobble_ad_view* view, int* company, const uint8_t** data, int* len);
+
+// The data a service has put in the advertisement, whichever size of UUID it was sent with. Returns false if there is none.
+EXPORTED bool cobble_ad_service_data(const cobble_ad_view* view, const cobble_uuid* service, const uint8_t** data, int* len);
+
+// Fills in at most max of the service UUIDs advertised, of all sizes, and returns how many there were
+EXPORTED int cobble_ad_services(const cobble_ad_view* view, cobble_uuid* out, int max);
+
+// The TX power level in dBm. Returns false if it isn't advertised.
+EXPORTED bool cobble_ad_tx_power(const cobble_ad_view* view, int* dbm);
+
+// For the backends, which build views around whatever buffer they have the bytes in
+static inline void cobble_ad_view_init(cobble_ad_view* view, const uint8_t* data, int len) {
+    view->data = data;
+    view->length = (len < COBBLE_AD_MAX_LENGTH) ? len : COBBLE_AD_MAX_LENGTH;
+    view->count = -1;
+}
+
+// For the backends which rebuild an advertisement from what the OS has parsed. Appends a structure, returning the new
+// length, or len unchanged if it doesn't fit in COBBLE_AD_MAX_LENGTH.
+int cobble_ad_append(uint8_t* buffer, int len, int type, const uint8_t* data, int dataLen);
+
+// Appends manufacturer data for a company
+int cobble_ad_append_manufacturer_data(uint8_t* buffer, int len, int company, const uint8_t* data, int dataLen);
+
+// Appends service data, with the UUID in its 16-bit form if it has one
+int cobble_ad_append_service_data(uint8_t* buffer, int len, const cobble_uuid* service, const uint8_t* data, int dataLen);
+
+// Appends lists of services, those with a 16-bit form in one and the rest in another. A list that doesn't fit is left out.
+int cobble_ad_append_services(uint8_t* buffer, int len, const cobble_uuid* services, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+// Minimal atomic operations for the platform-neutral core
+// These are plain functions on plain integers so that they can be used from C, C++ and Objective-C alike,
+// and so that structures containing atomics can be shared between C and C++ translation units.
+// GCC and Clang use the __atomic builtins, MSVC uses the Interlocked intrinsics.
+#ifndef COBBLE_ATOMIC_H
+#define COBBLE_ATOMIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Keep frequently-written counters on separate cache lines to avoid false sharing between producers and the consumer
+#define COBBLE_CACHE_LINE 64
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+#define COBBLE_ATOMIC_INLINE static __inline
+
+COBBLE_ATOMIC_INLINE bool cobble_atomic_cas_u64(volatile uint64_t* p, uint64_t* expected, uint64_t desired) {
+    uint64_t prev = (uint64_t)_InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)*expected);
+    if (prev == *expected)
+        return true;
+    *expected = prev;
+    return false;
+}
+
+COBBLE_ATOMIC_INLINE uint64_t cobble_atomic_load_u64(volatile uint64_t* p) {
+#if defined(_M_X64)
+    // Aligned 64-bit loads are atomic on x64, and x64 does not reorder loads with other loads
+    uint64_t v = *p;
+    _ReadWriteBarrier();
+    return v;
+#else
+    // 32-bit x86 and ARM64 (which defaults to /volatile:iso) need a locked operation
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64*)p, 0, 0);
+#endif
+}
+
+COBBLE_ATOMIC_INLINE void cobble_atomic_store_u64(volatile uint64_t* p, uint64_t v) {
+#if defined(_M_X64)
+    _ReadWriteBarrier();
+    *p = v;
+#else
+    uint64_t expected = cobble_atomic_load_u64(p);
+    while (!cobble_atomic_cas_u64(p, &expected, v))
+        ;
+#endif
+}
+
+COBBLE_ATOMIC_INLINE uint64_t cobble_atomic_fetch_add_u64(volatile uint64_t* p, uint64_t v) {
+    uint64_t expected = cobble_atomic_load_u64(p);
+    while (!cobble_atomic_cas_u64(p, &expected, expected + v))
+        ;
+    return expected;
+}
+
+COBBLE_ATOMIC_INLINE uint32_t cobble_atomic_load_u32(volatile uint32_t* p) {
+    return (uint32_t)_InterlockedCompareExchange((volatile long*)p, 0, 0);
+}
+
+COBBLE_ATOMIC_INLINE bool cobble_atomic_cas_u32(volatile uint32_t* p, uint32_t* expected, uint32_t desired) {
+    uint32_t prev = (uint32_t)_InterlockedCompareExchange((volatile long*)p, (long)desired, (long)*expected);
+    if (prev == *expected)
+        return true;
+    *expected = prev;
+    return false;
+}
+
+COBBLE_ATOMIC_INLINE void cobble_atomic_store_u32(volatile uint32_t* p, uint32_t v) {
+    _InterlockedExchange((volatile long*)p, (long)v);
+}
+
+COBBLE_ATOMIC_INLINE uint32_t cobble_atomic_exchange_u32(volatile uint32_t* p, uint32_t v) {
+    return (uint32_t)_InterlockedExchange((volatile long*)p, (long)v);
+}
+
+#else
+
+#define COBBLE_ATOMIC_INLINE static inline
+
+COBBLE_ATOMIC_INLINE bool cobble_atomic_cas_u64(volatile uint64_t* p, uint64_t* expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+COBBLE_ATOMIC_INLINE uint64_t cobble_atomic_load_u64(volatile uint64_t* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+COBBLE_ATOMIC_INLINE void cobble_atomic_store_u64(volatile uint64_t* p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+COBBLE_ATOMIC_INLINE uint64_t cobble_atomic_fetch_add_u64(volatile uint64_t* p, uint64_t v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+COBBLE_ATOMIC_INLINE uint32_t cobble_atomic_load_u32(volatile uint32_t* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+COBBLE_ATOMIC_INLINE bool cobble_atomic_cas_u32(volatile uint32_t* p, uint32_t* expected, uint32_t desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+COBBLE_ATOMIC_INLINE void cobble_atomic_store_u32(volatile uint32_t* p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+COBBLE_ATOMIC_INLINE uint32_t cobble_atomic_exchange_u32(volatile uint32_t* p, uint32_t v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+#endif
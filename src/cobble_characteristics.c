@@ -0,0 +1,196 @@
+#include "cobble.h"
+#include "cobble_atomic.h"
+#include "cobble_characteristics.h"
+#include "cobble_connections.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <sched.h>
+#define THREAD_LOCAL __thread
+#endif
+
+// Slot states
+#define SLOT_EMPTY 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+
+// Open-addressed hash table, handle = slot index + 1
+static volatile uint32_t slotState[COBBLE_MAX_CHARACTERISTICS];
+static cobble_uuid slotUuid[COBBLE_MAX_CHARACTERISTICS];
+static char slotString[COBBLE_MAX_CHARACTERISTICS][COBBLE_UUID_STRING_LENGTH];
+
+// Each connection's own value callback for a characteristic, and its context, by [connection slot][slot]. The state counts
+// the callbacks running in steps of ROUTE_CALLING, and has ROUTE_CHANGING set while the route is being changed, which
+// stops any more starting. The connection is the handle the route was set for, so one which takes over its slot later
+// doesn't inherit it.
+#define ROUTE_CHANGING 1u
+#define ROUTE_CALLING 2u
+
+static volatile uint32_t routeState[COBBLE_MAX_CONNECTIONS][COBBLE_MAX_CHARACTERISTICS];
+static volatile uint32_t routeConnection[COBBLE_MAX_CONNECTIONS][COBBLE_MAX_CHARACTERISTICS];
+static volatile uint64_t routeCallback[COBBLE_MAX_CONNECTIONS][COBBLE_MAX_CHARACTERISTICS];
+static volatile uint64_t routeContext[COBBLE_MAX_CONNECTIONS][COBBLE_MAX_CHARACTERISTICS];
+
+// The route whose callback this thread is running, 0 for none, so the callback can change its own route
+#define ROUTE_ID(slot, index) ((slot) * COBBLE_MAX_CHARACTERISTICS + (index) + 1)
+static THREAD_LOCAL uint32_t routeCalling = 0;
+
+// Changes and callbacks are short, so whoever waits for one gives up the processor rather than sleeping
+static void wait_turn(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+uint16_t cobble_characteristic_intern(const char* uuid) {
+
+    cobble_uuid u;
+    if (!cobble_uuid_parse(uuid, &u))
+        return COBBLE_CHARACTERISTIC_NONE;
+
+    return cobble_characteristic_intern_uuid(&u);
+}
+
+uint16_t cobble_characteristic_intern_uuid(const cobble_uuid* uuid) {
+
+    uint32_t index = cobble_uuid_hash(uuid) & (COBBLE_MAX_CHARACTERISTICS - 1);
+
+    for (uint32_t probes = 0; probes < COBBLE_MAX_CHARACTERISTICS; probes++) {
+
+        uint32_t state = cobble_atomic_load_u32(&slotState[index]);
+
+        if (state == SLOT_EMPTY) {
+            // Claim the slot, then publish the UUID (and its string form, so it never needs formatting again)
+            if (cobble_atomic_cas_u32(&slotState[index], &state, SLOT_WRITING)) {
+                slotUuid[index] = *uuid;
+                cobble_uuid_format(uuid, slotString[index]);
+                cobble_atomic_store_u32(&slotState[index], SLOT_READY);
+                return (uint16_t)(index + 1);
+            }
+        }
+
+        // Another thread is adding an entry here - it may be the same UUID, so wait for it
+        while (state == SLOT_WRITING)
+            state = cobble_atomic_load_u32(&slotState[index]);
+
+        if (cobble_uuid_equal(&slotUuid[index], uuid))
+            return (uint16_t)(index + 1);
+
+        index = (index + 1) & (COBBLE_MAX_CHARACTERISTICS - 1);
+    }
+
+    return COBBLE_CHARACTERISTIC_NONE;
+}
+
+const char* cobble_characteristic_uuid(uint16_t handle) {
+
+    if (handle == COBBLE_CHARACTERISTIC_NONE || handle > COBBLE_MAX_CHARACTERISTICS)
+        return NULL;
+
+    if (cobble_atomic_load_u32(&slotState[handle - 1]) != SLOT_READY)
+        return NULL;
+
+    return slotString[handle - 1];
+}
+
+EXPORTED cobble_char_handle cobble_characteristic_handle(const char* char_uuid) {
+    return cobble_characteristic_intern(char_uuid);
+}
+
+EXPORTED const char* cobble_characteristic_uuid_get(cobble_char_handle characteristic) {
+    return cobble_characteristic_uuid(characteristic);
+}
+
+EXPORTED void cobble_characteristic_cb_set(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_characteristic_cb_set_c(cobble_connection_latest(), characteristic, cb, ctx);
+}
+
+EXPORTED void cobble_characteristic_cb_set_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+
+    if (characteristic == COBBLE_CHARACTERISTIC_NONE || characteristic > COBBLE_MAX_CHARACTERISTICS)
+        return;
+
+    // A closed connection's slot may belong to another by now
+    if (cb != NULL && !cobble_connection_valid(connection)) {
+        printf("No connection %u to set the callback of characteristic %s for\n", (unsigned)connection, cobble_characteristic_uuid(characteristic));
+        return;
+    }
+
+    uint32_t slot = cobble_connection_index(connection);
+    uint32_t index = characteristic - 1;
+    volatile uint32_t* state = &routeState[slot][index];
+
+    // Stop any more callbacks starting, waiting out anyone else changing it
+    uint32_t current = cobble_atomic_load_u32(state);
+    for (;;) {
+        if (current & ROUTE_CHANGING) {
+            wait_turn();
+            current = cobble_atomic_load_u32(state);
+        } else if (cobble_atomic_cas_u32(state, &current, current | ROUTE_CHANGING)) {
+            break;
+        }
+    }
+
+    // Then wait for those already running to return, except this thread's own if the callback is changing its route
+    uint32_t own = (routeCalling == ROUTE_ID(slot, index)) ? ROUTE_CALLING : 0;
+    while ((cobble_atomic_load_u32(state) & ~ROUTE_CHANGING) > own)
+        wait_turn();
+
+    // Clearing another connection's route would take it from the connection which now has the slot
+    if (cb != NULL || cobble_atomic_load_u32(&routeConnection[slot][index]) == connection) {
+        cobble_atomic_store_u64(&routeContext[slot][index], (uint64_t)(uintptr_t)ctx);
+        cobble_atomic_store_u64(&routeCallback[slot][index], (uint64_t)(uintptr_t)cb);
+        cobble_atomic_store_u32(&routeConnection[slot][index], connection);
+    }
+
+    // Nothing else changes the state while ROUTE_CHANGING is set
+    cobble_atomic_store_u32(state, own);
+}
+
+bool cobble_characteristic_route(cobble_conn_handle connection, uint16_t handle, const uint8_t* data, int len) {
+
+    if (handle == COBBLE_CHARACTERISTIC_NONE || handle > COBBLE_MAX_CHARACTERISTICS)
+        return false;
+
+    uint32_t slot = cobble_connection_index(connection);
+    uint32_t index = handle - 1;
+    volatile uint32_t* state = &routeState[slot][index];
+
+    // Most characteristics never have one
+    if (cobble_atomic_load_u64(&routeCallback[slot][index]) == 0)
+        return false;
+
+    uint32_t current = cobble_atomic_load_u32(state);
+    for (;;) {
+        if (current & ROUTE_CHANGING) {
+            wait_turn();
+            current = cobble_atomic_load_u32(state);
+        } else if (cobble_atomic_cas_u32(state, &current, current + ROUTE_CALLING)) {
+            break;
+        }
+    }
+
+    uint64_t cb = cobble_atomic_load_u64(&routeCallback[slot][index]);
+    uint64_t ctx = cobble_atomic_load_u64(&routeContext[slot][index]);
+    bool routed = cb != 0 && cobble_atomic_load_u32(&routeConnection[slot][index]) == connection;
+
+    if (routed) {
+        uint32_t outer = routeCalling;
+        routeCalling = ROUTE_ID(slot, index);
+        ((cobble_value_cb)(uintptr_t)cb)((void*)(uintptr_t)ctx, connection, handle, data, len);
+        routeCalling = outer;
+    }
+
+    // Still counted if the callback changed its own route
+    current = cobble_atomic_load_u32(state);
+    while (!cobble_atomic_cas_u32(state, &current, current - ROUTE_CALLING))
+        ;
+
+    return routed;
+}
@@ -0,0 +1,41 @@
+// Table of the characteristic UUIDs seen by the library, each identified by a small integer handle
+// The event queues refer to characteristics by handle so that the notification path never allocates or copies strings.
+// UUIDs are keyed in binary form, so "180F", "0000180f-..." and "0000180F-..." all share a handle.
+// Entries are added lock-free from any thread and are never removed, so a handle and the UUID string it refers to
+// remain valid for the lifetime of the library. Each can also have a value callback of its own on each connection, looked up
+// by connection and handle.
+#ifndef COBBLE_CHARACTERISTICS_H
+#define COBBLE_CHARACTERISTICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+#include "cobble_uuid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be a power of two
+#define COBBLE_MAX_CHARACTERISTICS 1024
+
+#define COBBLE_CHARACTERISTIC_NONE 0
+
+// Returns the handle for the given UUID, adding it to the table if required.
+// Returns COBBLE_CHARACTERISTIC_NONE if the UUID is invalid or the table is full.
+uint16_t cobble_characteristic_intern(const char* uuid);
+uint16_t cobble_characteristic_intern_uuid(const cobble_uuid* uuid);
+
+// Returns the canonical (upper-case, hyphenated) UUID string for a handle, or NULL for an unknown handle
+const char* cobble_characteristic_uuid(uint16_t handle);
+
+// Sends a value to the characteristic's own callback on the connection (see cobble_characteristic_cb_set_c()), if it has
+// one. Returns false, having sent nothing, if it hasn't. Waits while the callback is being changed.
+bool cobble_characteristic_route(cobble_conn_handle connection, uint16_t handle, const uint8_t* data, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
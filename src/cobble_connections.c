@@ -0,0 +1,118 @@
+#include "cobble_atomic.h"
+#include "cobble_connections.h"
+
+#include <stddef.h>
+
+#define INDEX_BITS 5
+#define GENERATIONS (1u << (16 - INDEX_BITS))
+
+// Zero if the slot is free, otherwise the handle it is in use as
+static volatile uint32_t slotHandle[COBBLE_MAX_CONNECTIONS];
+static volatile uint64_t slotAddress[COBBLE_MAX_CONNECTIONS];
+static uint32_t slotGeneration[COBBLE_MAX_CONNECTIONS];
+
+static volatile uint32_t latest = COBBLE_CONNECTION_NONE;
+
+cobble_conn_handle cobble_connection_open(uint64_t address) {
+
+    // Two threads connecting to the same device at the same moment could both get past this, but then the backend will
+    // refuse one of them
+    if (address != COBBLE_ADDRESS_NONE && cobble_connection_find(address) != COBBLE_CONNECTION_NONE)
+        return COBBLE_CONNECTION_NONE;
+
+    for (uint32_t i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+
+        uint32_t expected = 0;
+        if (cobble_atomic_load_u32(&slotHandle[i]) != 0)
+            continue;
+
+        // Generations start from 1, so a handle is never zero
+        uint32_t generation = (slotGeneration[i] + 1) % GENERATIONS;
+        if (generation == 0)
+            generation = 1;
+        uint32_t handle = (generation << INDEX_BITS) | i;
+
+        if (cobble_atomic_cas_u32(&slotHandle[i], &expected, handle)) {
+            slotGeneration[i] = generation;
+            cobble_atomic_store_u64(&slotAddress[i], address);
+            cobble_atomic_store_u32(&latest, handle);
+            return (cobble_conn_handle)handle;
+        }
+    }
+
+    return COBBLE_CONNECTION_NONE;
+}
+
+void cobble_connection_close(cobble_conn_handle connection) {
+    uint32_t expected = connection;
+    if (connection != COBBLE_CONNECTION_NONE)
+        cobble_atomic_cas_u32(&slotHandle[cobble_connection_index(connection)], &expected, 0);
+}
+
+bool cobble_connection_valid(cobble_conn_handle connection) {
+    return connection != COBBLE_CONNECTION_NONE && cobble_atomic_load_u32(&slotHandle[cobble_connection_index(connection)]) == connection;
+}
+
+uint64_t cobble_connection_address(cobble_conn_handle connection) {
+    if (!cobble_connection_valid(connection))
+        return COBBLE_ADDRESS_NONE;
+    return cobble_atomic_load_u64(&slotAddress[cobble_connection_index(connection)]);
+}
+
+cobble_conn_handle cobble_connection_find(uint64_t address) {
+
+    for (uint32_t i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        uint32_t handle = cobble_atomic_load_u32(&slotHandle[i]);
+        if (handle != 0 && cobble_atomic_load_u64(&slotAddress[i]) == address)
+            return (cobble_conn_handle)handle;
+    }
+
+    return COBBLE_CONNECTION_NONE;
+}
+
+cobble_conn_handle cobble_connection_latest(void) {
+    return (cobble_conn_handle)cobble_atomic_load_u32(&latest);
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool cobble_address_parse(const char* str, uint64_t* out) {
+
+    uint64_t address = 0;
+
+    if (str == NULL)
+        return false;
+
+    for (int i = 0; i < 6; i++) {
+        const char* byte = str + i * 3;
+        int high = hex_digit(byte[0]);
+        int low = (high >= 0) ? hex_digit(byte[1]) : -1;
+        char separator = (low >= 0) ? byte[2] : '\0';
+        if (low < 0 || separator != ((i < 5) ? ':' : '\0'))
+            return false;
+        address = (address << 8) | (uint64_t)(high << 4 | low);
+    }
+
+    *out = address;
+    return true;
+}
+
+void cobble_address_format(uint64_t address, char* out) {
+
+    static const char digits[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+    for (int i = 0; i < 6; i++) {
+        uint8_t byte = (uint8_t)(address >> (8 * (5 - i)));
+        out[i * 3] = digits[byte >> 4];
+        out[i * 3 + 1] = digits[byte & 0x0F];
+        out[i * 3 + 2] = (i < 5) ? ':' : '\0';
+    }
+}
@@ -0,0 +1,54 @@
+// Table of open connections, each identified by a small integer handle
+// Handles are allocated by cobble_connect() on the application's thread, so that it can return one straight away, and
+// released by the backend when the connection ends. The low bits of a handle pick a slot in the table and the rest
+// count how often that slot has been used, so an event still queued for a closed connection can't be mistaken for a
+// newer connection which has taken over its slot.
+#ifndef COBBLE_CONNECTIONS_H
+#define COBBLE_CONNECTIONS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be a power of two
+#define COBBLE_MAX_CONNECTIONS 32
+
+#define COBBLE_CONNECTION_NONE 0
+
+// Device addresses are held as 48-bit integers, eg AA:BB:CC:DD:EE:FF is 0xAABBCCDDEEFF.
+// Platforms which identify devices some other way (eg CoreBluetooth's UUIDs) use COBBLE_ADDRESS_NONE.
+#define COBBLE_ADDRESS_NONE 0
+#define COBBLE_ADDRESS_STRING_LENGTH 18
+
+// The slot a handle refers to, from 0 to COBBLE_MAX_CONNECTIONS - 1, for backends to index their own per-connection state
+#define cobble_connection_index(connection) ((connection) & (COBBLE_MAX_CONNECTIONS - 1))
+
+// Returns a new handle, or COBBLE_CONNECTION_NONE if the table is full or there is already a connection to the address
+cobble_conn_handle cobble_connection_open(uint64_t address);
+void cobble_connection_close(cobble_conn_handle connection);
+
+// True from cobble_connection_open() until cobble_connection_close()
+bool cobble_connection_valid(cobble_conn_handle connection);
+
+uint64_t cobble_connection_address(cobble_conn_handle connection);
+cobble_conn_handle cobble_connection_find(uint64_t address);
+
+// The handle most recently returned by cobble_connection_open(), which calls without a handle act on.
+// It may since have been closed.
+cobble_conn_handle cobble_connection_latest(void);
+
+// Parse AA:BB:CC:DD:EE:FF (upper or lower case). Returns false if the string is not an address.
+bool cobble_address_parse(const char* str, uint64_t* out);
+// Write the upper-case form into a buffer of at least COBBLE_ADDRESS_STRING_LENGTH characters
+void cobble_address_format(uint64_t address, char* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#include "cobble_atomic.h"
+#include "cobble_crc32.h"
+
+// Reflected form of the polynomial 0x04C11DB7
+#define POLYNOMIAL 0xEDB88320u
+
+// Slicing by 8: tables[k][b] is the CRC of byte b followed by k zero bytes, so eight bytes can be folded in with eight
+// independent lookups rather than eight dependent ones. This runs several times faster than a byte at a time, and
+// needs nothing from the instruction set, so it is the same on every platform Cobble builds for.
+static uint32_t tables[8][256];
+
+typedef enum {
+    Tables_Empty,
+    Tables_Building,
+    Tables_Ready,
+} TablesState;
+
+static volatile uint32_t tablesState = Tables_Empty;
+
+// Built on first use, by whichever thread gets there first. 8 KB is not worth keeping in the binary.
+static void build_tables(void) {
+
+    uint32_t expected = Tables_Empty;
+
+    if (cobble_atomic_load_u32(&tablesState) == Tables_Ready)
+        return;
+
+    if (!cobble_atomic_cas_u32(&tablesState, &expected, Tables_Building)) {
+        while (cobble_atomic_load_u32(&tablesState) != Tables_Ready)
+            ;
+        return;
+    }
+
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+        tables[0][b] = crc;
+    }
+
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t b = 0; b < 256; b++)
+            tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xFF];
+    }
+
+    cobble_atomic_store_u32(&tablesState, Tables_Ready);
+}
+
+uint32_t cobble_crc32(uint32_t crc, const uint8_t* data, size_t len) {
+
+    build_tables();
+
+    crc = ~crc;
+
+    // Bytes are assembled one at a time, so the data needn't be aligned and the result doesn't depend on byte order
+    while (len >= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t high = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+            ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+
+        data += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0)
+        crc = tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
@@ -0,0 +1,24 @@
+// CRC-32 (ISO-HDLC, as used by zlib and by Nordic's DFU bootloaders)
+// The CRC can be carried on from one block to the next, so a long image can be checked a piece at a time as it is sent,
+// rather than recomputing the CRC of everything sent so far each time the peripheral reports one.
+#ifndef COBBLE_CRC32_H
+#define COBBLE_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns the CRC of the data following the data which had the given CRC, so that
+// cobble_crc32(cobble_crc32(0, a, n), a + n, m) == cobble_crc32(0, a, n + m). Start with 0.
+EXPORTED uint32_t cobble_crc32(uint32_t crc, const uint8_t* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cobble.h"
+#include "cobble_events.h"
+#include "cobble_characteristics.h"
+#include "cobble_connections.h"
+#include "cobble_crc32.h"
+#include "cobble_dfu.h"
+
+// Control Point opcodes, object types and result codes, from the nRF5 SDK's nrf_dfu_req_handler.h
+#define OP_CREATE 0x01
+#define OP_RECEIPT_NOTIF_SET 0x02
+#define OP_CRC_GET 0x03
+#define OP_EXECUTE 0x04
+#define OP_SELECT 0x06
+#define OP_RESPONSE 0x60
+
+#define OBJECT_COMMAND 0x01
+#define OBJECT_DATA 0x02
+
+#define RESULT_SUCCESS 0x01
+#define RESULT_OPERATION_NOT_PERMITTED 0x08
+#define RESULT_EXT_ERROR 0x0B
+
+// Times an object is sent again after arriving corrupted, before giving up
+#define MAX_RETRIES 3
+
+#define DEFAULT_RECEIPT_PACKETS 12
+#define DEFAULT_WINDOW 4
+#define MAX_WINDOW 32
+
+typedef enum {
+    Step_Idle,
+    Step_SetReceipts,
+    Step_SelectCommand,
+    Step_CreateCommand,
+    Step_SendCommand,
+    Step_CrcCommand,
+    Step_ExecuteCommand,
+    Step_SelectData,
+    Step_CreateData,
+    Step_SendData,
+    Step_CrcData,
+    Step_ExecuteData,
+} Step;
+
+// Where a receipt is expected, and the CRC it should have
+typedef struct {
+    uint32_t offset;
+    uint32_t crc;
+} checkpoint;
+
+typedef struct {
+    Step step;
+    cobble_conn_handle connection;
+
+    uint8_t* init;
+    uint32_t initLength;
+    uint8_t* firmware;
+    uint32_t firmwareLength;
+
+    int receiptPackets;
+    int window;
+    int packetSize;
+    uint32_t maxObjectSize;
+
+    // The data object being sent, as a range of the firmware
+    uint32_t objectStart;
+    uint32_t objectEnd;
+    uint32_t objectStartCrc;
+    uint32_t sent; // Bytes given to write streams
+    uint32_t crc; // Of the firmware up to sent
+    uint32_t confirmed; // Bytes the device has reported with the right CRC
+    int retries;
+    bool receipts; // False when resuming part way through an object, as the device's count of packets is unknown
+    bool resend; // A receipt was wrong, so the object is sent again once the current stream ends
+    bool resumed; // The object being executed may already have been, before the transfer was interrupted
+
+    // Set while a stream the engine started is in progress, even after the update has ended, so its end isn't passed on
+    bool streaming;
+
+    checkpoint pending[MAX_WINDOW];
+    int pendingHead;
+    int pendingCount;
+} dfu_session;
+
+static dfu_session sessions[COBBLE_MAX_CONNECTIONS];
+
+static int receiptPackets = DEFAULT_RECEIPT_PACKETS;
+static int window = DEFAULT_WINDOW;
+
+static cobble_char_handle controlPoint = COBBLE_CHARACTERISTIC_NONE;
+static cobble_char_handle packet = COBBLE_CHARACTERISTIC_NONE;
+
+static dfuprogress_funcptr dfuprogress_cb = NULL;
+
+EXPORTED void register_dfuprogress_cb(dfuprogress_funcptr p) {
+    dfuprogress_cb = p;
+}
+
+static const char* stage_name(int stage) {
+    switch (stage) {
+    case DfuStage_Init:
+        return "init packet";
+    case DfuStage_Firmware:
+        return "firmware";
+    case DfuStage_Complete:
+        return "complete";
+    default:
+        return "failed";
+    }
+}
+
+static void progress(dfu_session* s, int stage, int done, int total) {
+
+    if (dfuprogress_cb != NULL) {
+        dfuprogress_cb(s->connection, stage, done, total);
+        return;
+    }
+
+    printf("Default handler for DFU progress: %s, %i of %i bytes\n", stage_name(stage), done, total);
+}
+
+static dfu_session* find_session(cobble_conn_handle connection) {
+    dfu_session* s = &sessions[cobble_connection_index(connection)];
+    return (connection != COBBLE_CONNECTION_NONE && s->connection == connection) ? s : NULL;
+}
+
+static void end_session(dfu_session* s, int stage) {
+
+    if (stage == DfuStage_Complete)
+        progress(s, stage, (int)s->firmwareLength, (int)s->firmwareLength);
+    else
+        progress(s, stage, (int)s->confirmed, (int)s->firmwareLength);
+
+    free(s->init);
+    free(s->firmware);
+    s->init = NULL;
+    s->firmware = NULL;
+    s->step = Step_Idle;
+}
+
+static void fail(dfu_session* s, const char* reason) {
+    printf("DFU failed after %u of %u bytes: %s\n", s->confirmed, s->firmwareLength, reason);
+    end_session(s, DfuStage_Failed);
+}
+
+/*
+ * Requests
+ */
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void request(dfu_session* s, Step step, uint8_t* data, int len) {
+    s->step = step;
+    cobble_write_c(s->connection, controlPoint, data, len);
+}
+
+static void request_select(dfu_session* s, Step step, uint8_t type) {
+    uint8_t r[] = { OP_SELECT, type };
+    request(s, step, r, sizeof(r));
+}
+
+static void request_create(dfu_session* s, Step step, uint8_t type, uint32_t size) {
+    uint8_t r[6] = { OP_CREATE, type };
+    put_u32(r + 2, size);
+    request(s, step, r, sizeof(r));
+}
+
+static void request_crc(dfu_session* s, Step step) {
+    uint8_t r[] = { OP_CRC_GET };
+    request(s, step, r, sizeof(r));
+}
+
+static void request_execute(dfu_session* s, Step step) {
+    uint8_t r[] = { OP_EXECUTE };
+    request(s, step, r, sizeof(r));
+}
+
+static bool send_stream(dfu_session* s, const uint8_t* data, uint32_t len) {
+
+    if (!cobble_write_stream_c(s->connection, packet, data, (int)len)) {
+        fail(s, "could not write to the DFU Packet characteristic");
+        return false;
+    }
+
+    s->streaming = true;
+    return true;
+}
+
+/*
+ * Data objects
+ */
+
+static void create_object(dfu_session* s) {
+
+    s->objectEnd = s->objectStart + s->maxObjectSize;
+    if (s->objectEnd > s->firmwareLength)
+        s->objectEnd = s->firmwareLength;
+
+    s->sent = s->objectStart;
+    s->crc = s->objectStartCrc;
+    s->receipts = s->receiptPackets > 0;
+    s->resend = false;
+    s->resumed = false;
+    s->pendingCount = 0;
+
+    // Creating the object again, after a failure, discards what the device has of it
+    request_create(s, Step_CreateData, OBJECT_DATA, s->objectEnd - s->objectStart);
+}
+
+static void retry_object(dfu_session* s, const char* reason) {
+
+    if (++s->retries > MAX_RETRIES) {
+        fail(s, reason);
+        return;
+    }
+
+    printf("DFU: %s at offset %u, sending the object again\n", reason, s->objectStart);
+    create_object(s);
+}
+
+// Send the next group of packets, unless the window is full, or check the object once all of it has been sent
+static void pump(dfu_session* s) {
+
+    if (s->streaming || s->step != Step_SendData)
+        return;
+
+    if (s->resend) {
+        retry_object(s, "a receipt had the wrong CRC");
+        return;
+    }
+
+    if (s->sent == s->objectEnd) {
+        request_crc(s, Step_CrcData);
+        return;
+    }
+
+    if (s->receipts && s->pendingCount == s->window)
+        return;
+
+    // Without receipts, the rest of the object goes as one stream
+    uint32_t group = s->receipts ? (uint32_t)(s->receiptPackets * s->packetSize) : s->objectEnd - s->sent;
+    uint32_t len = (s->objectEnd - s->sent < group) ? s->objectEnd - s->sent : group;
+    const uint8_t* data = s->firmware + s->sent;
+
+    s->crc = cobble_crc32(s->crc, data, len);
+    s->sent += len;
+
+    // The device sends a receipt after every receiptPackets packets since the object was created, so none is due
+    // after a shorter group at the end
+    if (s->receipts && len == group) {
+        checkpoint* p = &s->pending[(s->pendingHead + s->pendingCount++) % MAX_WINDOW];
+        p->offset = s->sent;
+        p->crc = s->crc;
+    }
+
+    send_stream(s, data, len);
+}
+
+static void on_receipt(dfu_session* s, uint32_t offset, uint32_t crc) {
+
+    // Receipts come in order, so any before this one were lost
+    while (s->pendingCount > 0 && s->pending[s->pendingHead].offset < offset) {
+        s->pendingHead = (s->pendingHead + 1) % MAX_WINDOW;
+        s->pendingCount--;
+    }
+
+    if (s->pendingCount == 0 || s->pending[s->pendingHead].offset != offset)
+        return;
+
+    if (s->pending[s->pendingHead].crc != crc) {
+        s->resend = true;
+    } else {
+        s->confirmed = offset;
+        progress(s, DfuStage_Firmware, (int)s->confirmed, (int)s->firmwareLength);
+    }
+
+    s->pendingHead = (s->pendingHead + 1) % MAX_WINDOW;
+    s->pendingCount--;
+
+    pump(s);
+}
+
+// Carry on from where the device got to, in the object it had reached
+static void resume_data(dfu_session* s, uint32_t offset, uint32_t crc) {
+
+    uint32_t partial = offset % s->maxObjectSize;
+
+    if (offset > s->firmwareLength) {
+        fail(s, "the device holds more data than the firmware image");
+        return;
+    }
+
+    if (crc != cobble_crc32(0, s->firmware, offset)) {
+        if (partial == 0) {
+            fail(s, "the device holds data from a different image");
+            return;
+        }
+        // Creating the object again makes the device discard its part of it
+        s->objectStart = offset - partial;
+        s->objectStartCrc = cobble_crc32(0, s->firmware, s->objectStart);
+        create_object(s);
+        return;
+    }
+
+    s->confirmed = offset;
+
+    if (partial == 0 || offset == s->firmwareLength) {
+        // The last object arrived whole, but may not have been executed
+        s->objectStart = (partial == 0) ? offset - s->maxObjectSize : offset - partial;
+        s->objectEnd = offset;
+        s->crc = crc;
+        s->resumed = true;
+        request_execute(s, Step_ExecuteData);
+        return;
+    }
+
+    s->objectStart = offset - partial;
+    s->objectStartCrc = cobble_crc32(0, s->firmware, s->objectStart);
+    s->objectEnd = s->objectStart + s->maxObjectSize;
+    if (s->objectEnd > s->firmwareLength)
+        s->objectEnd = s->firmwareLength;
+    s->sent = offset;
+    s->crc = crc;
+    s->receipts = false;
+    s->resend = false;
+    s->pendingCount = 0;
+    s->step = Step_SendData;
+    pump(s);
+}
+
+static void object_executed(dfu_session* s) {
+
+    s->confirmed = s->objectEnd;
+    s->objectStart = s->objectEnd;
+    s->objectStartCrc = s->crc;
+    s->retries = 0;
+    progress(s, DfuStage_Firmware, (int)s->confirmed, (int)s->firmwareLength);
+
+    // The device checks the whole image and resets into it once the last object is executed
+    if (s->objectStart == s->firmwareLength)
+        end_session(s, DfuStage_Complete);
+    else
+        create_object(s);
+}
+
+/*
+ * Responses on the Control Point
+ */
+
+static void on_response(dfu_session* s, const uint8_t* data, int len) {
+
+    uint8_t op = data[1];
+    uint8_t result = data[2];
+
+    // A CRC which isn't an answer to CRC_GET is a receipt, or a late copy of one
+    if (op == OP_CRC_GET && result == RESULT_SUCCESS && len >= 11 && s->step != Step_CrcCommand) {
+        uint32_t offset = get_u32(data + 3);
+        uint32_t crc = get_u32(data + 7);
+        if (s->step == Step_CrcData && offset == s->objectEnd) {
+            if (crc == s->crc)
+                request_execute(s, Step_ExecuteData);
+            else
+                retry_object(s, "the object had the wrong CRC");
+        } else if (s->step == Step_SendData || s->step == Step_CrcData) {
+            on_receipt(s, offset, crc);
+        }
+        return;
+    }
+
+    // Executing an object twice is refused, which is expected when resuming
+    if (op == OP_EXECUTE && result == RESULT_OPERATION_NOT_PERMITTED && s->resumed)
+        result = RESULT_SUCCESS;
+
+    if (result != RESULT_SUCCESS) {
+        char reason[64];
+        if (result == RESULT_EXT_ERROR && len >= 4)
+            snprintf(reason, sizeof(reason), "opcode 0x%02x failed with extended error 0x%02x", op, data[3]);
+        else
+            snprintf(reason, sizeof(reason), "opcode 0x%02x failed with result 0x%02x", op, result);
+        fail(s, reason);
+        return;
+    }
+
+    switch (s->step) {
+    case Step_SetReceipts:
+        if (op == OP_RECEIPT_NOTIF_SET)
+            request_select(s, Step_SelectCommand, OBJECT_COMMAND);
+        break;
+
+    case Step_SelectCommand:
+        if (op != OP_SELECT || len < 15)
+            break;
+        // An init packet the device already has only needs executing
+        if (get_u32(data + 7) == s->initLength && get_u32(data + 11) == cobble_crc32(0, s->init, s->initLength)) {
+            s->resumed = true;
+            request_execute(s, Step_ExecuteCommand);
+        } else if (s->initLength > get_u32(data + 3)) {
+            fail(s, "the init packet is larger than the device accepts");
+        } else {
+            request_create(s, Step_CreateCommand, OBJECT_COMMAND, s->initLength);
+        }
+        break;
+
+    case Step_CreateCommand:
+        if (op == OP_CREATE && send_stream(s, s->init, s->initLength))
+            s->step = Step_SendCommand;
+        break;
+
+    case Step_CrcCommand:
+        if (op != OP_CRC_GET || len < 11)
+            break;
+        if (get_u32(data + 3) == s->initLength && get_u32(data + 7) == cobble_crc32(0, s->init, s->initLength))
+            request_execute(s, Step_ExecuteCommand);
+        else if (++s->retries > MAX_RETRIES)
+            fail(s, "the init packet had the wrong CRC");
+        else
+            request_create(s, Step_CreateCommand, OBJECT_COMMAND, s->initLength);
+        break;
+
+    case Step_ExecuteCommand:
+        if (op != OP_EXECUTE)
+            break;
+        s->retries = 0;
+        s->resumed = false;
+        progress(s, DfuStage_Init, (int)s->initLength, (int)s->initLength);
+        request_select(s, Step_SelectData, OBJECT_DATA);
+        break;
+
+    case Step_SelectData:
+        if (op != OP_SELECT || len < 15)
+            break;
+        s->maxObjectSize = get_u32(data + 3);
+        if (s->maxObjectSize == 0) {
+            fail(s, "the device accepts no data");
+            break;
+        }
+        if (get_u32(data + 7) == 0) {
+            s->objectStart = 0;
+            s->objectStartCrc = 0;
+            create_object(s);
+        } else {
+            resume_data(s, get_u32(data + 7), get_u32(data + 11));
+        }
+        break;
+
+    case Step_CreateData:
+        if (op != OP_CREATE)
+            break;
+        s->step = Step_SendData;
+        pump(s);
+        break;
+
+    case Step_ExecuteData:
+        if (op == OP_EXECUTE)
+            object_executed(s);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * Hooks, called by the event core as events are delivered. Each returns true if the event belonged to an update.
+ */
+
+static bool on_updatevalue(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    dfu_session* s;
+
+    if (characteristic != controlPoint || characteristic == COBBLE_CHARACTERISTIC_NONE)
+        return false;
+    if ((s = find_session(connection)) == NULL || s->step == Step_Idle)
+        return false;
+
+    if (len >= 3 && data[0] == OP_RESPONSE)
+        on_response(s, data, len);
+    return true;
+}
+
+static bool on_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status) {
+
+    dfu_session* s;
+
+    if (characteristic != packet || characteristic == COBBLE_CHARACTERISTIC_NONE)
+        return false;
+    if ((s = find_session(connection)) == NULL || !s->streaming)
+        return false;
+
+    s->streaming = false;
+
+    if (s->step == Step_Idle)
+        return true;
+
+    if (status != WriteStatus_Complete) {
+        fail(s, (status == WriteStatus_Busy) ? "another write stream was in progress" : "a write to the DFU Packet characteristic failed");
+        return true;
+    }
+
+    if (s->step == Step_SendCommand) {
+        progress(s, DfuStage_Init, written, (int)s->initLength);
+        request_crc(s, Step_CrcCommand);
+    } else {
+        pump(s);
+    }
+    return true;
+}
+
+static void on_connectionstatus(cobble_conn_handle connection, int status) {
+
+    dfu_session* s = find_session(connection);
+
+    if (s == NULL || status == ConnectionStatus_DidConnect)
+        return;
+
+    // The device resets as soon as it has executed the last object, and the disconnection may be delivered before the
+    // response which said so
+    if (s->step == Step_ExecuteData && s->objectEnd == s->firmwareLength)
+        end_session(s, DfuStage_Complete);
+    else if (s->step != Step_Idle)
+        fail(s, "the device disconnected");
+
+    // No event will come for a stream that was in progress
+    s->streaming = false;
+    s->connection = COBBLE_CONNECTION_NONE;
+}
+
+static const cobble_event_hooks hooks = { on_updatevalue, on_writecomplete, on_connectionstatus };
+
+/*
+ * Public API
+ */
+
+EXPORTED bool cobble_dfu_start(cobble_conn_handle connection, const uint8_t* init_packet, int init_len, const uint8_t* firmware, int firmware_len) {
+
+    dfu_session* s = &sessions[cobble_connection_index(connection)];
+
+    if (!cobble_connection_valid(connection)) {
+        printf("No connection has handle %u\n", connection);
+        return false;
+    }
+    if (init_len <= 0 || firmware_len <= 0) {
+        printf("DFU needs an init packet and a firmware image\n");
+        return false;
+    }
+    if (s->connection == connection && (s->step != Step_Idle || s->streaming)) {
+        printf("An update is already in progress on this connection\n");
+        return false;
+    }
+
+    // The events of an update are only looked at once there has been one
+    cobble_event_hooks_set(&hooks);
+
+    controlPoint = cobble_characteristic_intern(COBBLE_DFU_CONTROL_POINT);
+    packet = cobble_characteristic_intern(COBBLE_DFU_PACKET);
+
+    memset(s, 0, sizeof(*s));
+    s->connection = connection;
+    s->receiptPackets = receiptPackets;
+    s->window = window;
+    s->packetSize = cobble_max_writesize_get_c(connection, false);
+    s->init = (uint8_t*)malloc(init_len);
+    s->firmware = (uint8_t*)malloc(firmware_len);
+
+    if (s->packetSize <= 0 || s->init == NULL || s->firmware == NULL) {
+        free(s->init);
+        free(s->firmware);
+        s->connection = COBBLE_CONNECTION_NONE;
+        return false;
+    }
+
+    memcpy(s->init, init_packet, init_len);
+    memcpy(s->firmware, firmware, firmware_len);
+    s->initLength = (uint32_t)init_len;
+    s->firmwareLength = (uint32_t)firmware_len;
+
+    // Responses come back as notifications, which must be on before the first request
+    cobble_subscribe_c(connection, controlPoint);
+
+    uint8_t r[3] = { OP_RECEIPT_NOTIF_SET, (uint8_t)s->receiptPackets, (uint8_t)(s->receiptPackets >> 8) };
+    progress(s, DfuStage_Init, 0, init_len);
+    request(s, Step_SetReceipts, r, sizeof(r));
+    return true;
+}
+
+EXPORTED void cobble_dfu_abort(cobble_conn_handle connection) {
+
+    dfu_session* s = find_session(connection);
+
+    if (s != NULL && s->step != Step_Idle)
+        fail(s, "aborted");
+}
+
+EXPORTED void cobble_dfu_receipts_set(int packets, int groups) {
+    receiptPackets = (packets < 0) ? 0 : (packets > 0xFFFF) ? 0xFFFF : packets;
+    window = (groups < 1) ? 1 : (groups > MAX_WINDOW) ? MAX_WINDOW : groups;
+}
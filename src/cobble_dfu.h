@@ -0,0 +1,60 @@
+// Nordic Secure DFU (nRF5 SDK bootloaders from SDK 12 onwards), over a connection to a device already in its bootloader
+//
+// The engine is driven by the events it gets back from the device: each response on the DFU Control Point sends the
+// next request, and firmware goes to the DFU Packet characteristic with cobble_write_stream_c(), a group of packets at a
+// time. The bootloader reports the offset and CRC of what it has received after each group (a Packet Receipt
+// Notification), and the next groups are sent without waiting for it, up to a window, so the link is never left idle.
+// Each receipt is checked against a CRC carried on as the firmware is sent, and an object which arrived corrupted is
+// sent again. A transfer that was interrupted carries on from where the device got to.
+//
+// Everything happens while events are being delivered: on the thread calling cobble_queue_process() on Linux, Windows
+// and the simulator (or the dispatcher thread sending the connection's events, after cobble_dispatch_start()), or on the
+// platform's Bluetooth thread on Apple platforms and Android. cobble_dfu_start() and cobble_dfu_abort() must be called
+// from that same thread (eg from within a callback for the connection, or between calls to cobble_queue_process()).
+// The DFU characteristics' notifications and write streams are used by the engine, and are not passed on to the
+// application while an update is in progress.
+#ifndef COBBLE_DFU_H
+#define COBBLE_DFU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COBBLE_DFU_SERVICE "FE59"
+#define COBBLE_DFU_CONTROL_POINT "8EC90001-F315-4F60-9FB8-838830DAEA50"
+#define COBBLE_DFU_PACKET "8EC90002-F315-4F60-9FB8-838830DAEA50"
+
+typedef enum {
+    DfuStage_Init,          // Sending the init packet. Progress is in bytes of the init packet.
+    DfuStage_Firmware,      // Sending the firmware. Progress is in bytes the device has confirmed with a matching CRC.
+    DfuStage_Complete,      // The last object has been executed, and the device will now reset into the new firmware
+    DfuStage_Failed,        // The update stopped. The reason is logged, and progress is what the device had confirmed.
+} DfuStage;
+
+// Sent as the update moves on, and once with DfuStage_Complete or DfuStage_Failed at the end
+typedef void (*dfuprogress_funcptr)(cobble_conn_handle, int, int, int);
+EXPORTED void register_dfuprogress_cb(dfuprogress_funcptr p);
+
+// Start an update, with the init packet (the .dat file) and firmware image (the .bin file) from a DFU package's zip.
+// Both are copied. The device's DFU characteristics must have been discovered. One update can run on each connection.
+// Returns false, with no event to follow, if the update could not be started.
+EXPORTED bool cobble_dfu_start(cobble_conn_handle connection, const uint8_t* init_packet, int init_len, const uint8_t* firmware, int firmware_len);
+
+// Stop an update, reporting DfuStage_Failed. The device keeps what it has been sent, so a later update can resume.
+EXPORTED void cobble_dfu_abort(cobble_conn_handle connection);
+
+// Packets between receipts (0 for none, leaving each object to be checked only once it has all been sent), and how many
+// groups of packets may be waiting for their receipt before sending stops (1 waits for each receipt in turn).
+// Applies to updates started afterwards. The defaults are 12 packets and a window of 4.
+EXPORTED void cobble_dfu_receipts_set(int packets, int window);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
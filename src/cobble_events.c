@@ -9,24 +9,46 @@
 //If doing so, you would need to be careful about being thread-safe in the calling app.
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cobble.h"
+#include "cobble_atomic.h"
 #include "cobble_events.h"
+#include "cobble_characteristics.h"
+#include "cobble_connections.h"
+#include "cobble_scan_table.h"
+
+#include <pthread.h>
+#include <time.h>
 
 /*
  * Callback function pointers and registration functions
  */
 
 scanresult_funcptr scanresult_cb = NULL;
+advertisement_funcptr advertisement_cb = NULL;
 characteristicdiscovered_funcptr characteristicdiscovered_cb = NULL;
 updatevalue_funcptr updatevalue_cb = NULL;
+updatevalue_h_funcptr updatevalue_h_cb = NULL;
 connectionstatus_funcptr connectionstatus_cb = NULL;
+connectionstatus_c_funcptr connectionstatus_c_cb = NULL;
+characteristicdiscovered_c_funcptr characteristicdiscovered_c_cb = NULL;
+updatevalue_c_funcptr updatevalue_c_cb = NULL;
+batch_funcptr batch_cb = NULL;
+writecomplete_funcptr writecomplete_cb = NULL;
+mtuchanged_funcptr mtuchanged_cb = NULL;
+discoverycomplete_funcptr discoverycomplete_cb = NULL;
+statuschanged_funcptr statuschanged_cb = NULL;
 
 EXPORTED void register_scanresult_cb(scanresult_funcptr p) {
     scanresult_cb = p;
 }
 
+EXPORTED void register_advertisement_cb(advertisement_funcptr p) {
+    advertisement_cb = p;
+}
+
 EXPORTED void register_characteristicdiscovered_cb(characteristicdiscovered_funcptr p) {
     characteristicdiscovered_cb = p;
 }
@@ -35,16 +57,65 @@ EXPORTED void register_updatevalue_cb(updatevalue_funcptr p) {
     updatevalue_cb = p;
 }
 
+EXPORTED void register_updatevalue_h_cb(updatevalue_h_funcptr p) {
+    updatevalue_h_cb = p;
+}
+
 EXPORTED void register_connectionstatus_cb(connectionstatus_funcptr p) {
     connectionstatus_cb = p;
 }
 
+EXPORTED void register_connectionstatus_c_cb(connectionstatus_c_funcptr p) {
+    connectionstatus_c_cb = p;
+}
+
+EXPORTED void register_characteristicdiscovered_c_cb(characteristicdiscovered_c_funcptr p) {
+    characteristicdiscovered_c_cb = p;
+}
+
+EXPORTED void register_updatevalue_c_cb(updatevalue_c_funcptr p) {
+    updatevalue_c_cb = p;
+}
+
+EXPORTED void register_batch_cb(batch_funcptr p) {
+    batch_cb = p;
+}
+
+EXPORTED void register_writecomplete_cb(writecomplete_funcptr p) {
+    writecomplete_cb = p;
+}
+
+EXPORTED void register_mtuchanged_cb(mtuchanged_funcptr p) {
+    mtuchanged_cb = p;
+}
+
+EXPORTED void register_discoverycomplete_cb(discoverycomplete_funcptr p) {
+    discoverycomplete_cb = p;
+}
+
+EXPORTED void register_statuschanged_cb(statuschanged_funcptr p) {
+    statuschanged_cb = p;
+}
+
+static const cobble_event_hooks* hooks = NULL;
+
+void cobble_event_hooks_set(const cobble_event_hooks* h) {
+    hooks = h;
+}
+
 /*
  * Function handlers including default behaviour
  */
 
 void cobble_event_scanresult(const char* name, int rssi, const char* identifier) {
 
+    // Repeated advertisements from a device are merged until it is due to be reported again
+    cobble_scan_report report;
+    if (!cobble_scan_table_update(name, rssi, identifier, &report))
+        return;
+    name = report.name;
+    rssi = report.rssi;
+
     if(scanresult_cb != NULL) {
         scanresult_cb(name, rssi, identifier);
         return;
@@ -54,14 +125,41 @@ void cobble_event_scanresult(const char* name, int rssi, const char* identifier)
     
 }
 
+bool cobble_event_advertisement_wanted(void) {
+    return advertisement_cb != NULL;
+}
+
+// The view is of the backend's own buffer, so nothing is copied
+void cobble_event_advertisement(const char* identifier, int rssi, const uint8_t* data, int len) {
+
+    if(advertisement_cb == NULL)
+        return;
+
+    cobble_ad_view view;
+    cobble_ad_view_init(&view, data, len < 0 ? 0 : len);
+    advertisement_cb(identifier, rssi, &view);
+}
+
 
 void cobble_event_connectionstatus(const char* identifier, int status) {
 
+    cobble_conn_handle connection = cobble_connection_latest();
+
+    if(hooks != NULL)
+        hooks->connectionstatus(connection, status);
+
+    if(connectionstatus_c_cb != NULL) {
+        connectionstatus_c_cb(connection, identifier, status);
+    }
+
     if(connectionstatus_cb != NULL) {
         connectionstatus_cb(identifier, status);
         return;
     }
 
+    if(connectionstatus_c_cb != NULL)
+        return;
+
     switch(status) {
         case ConnectionStatus_DidConnect:
         printf("Did connect!\n");
@@ -76,27 +174,246 @@ void cobble_event_connectionstatus(const char* identifier, int status) {
     }
 }
 
+void cobble_event_connectionstatus_c(cobble_conn_handle connection, int status) {
+
+    char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+    cobble_address_format(cobble_connection_address(connection), identifier);
+
+    if(hooks != NULL)
+        hooks->connectionstatus(connection, status);
+
+    if(connectionstatus_c_cb != NULL) {
+        connectionstatus_c_cb(connection, identifier, status);
+    }
+
+    if(connectionstatus_cb != NULL) {
+        connectionstatus_cb(identifier, status);
+    }
+}
+
 void cobble_event_servicediscovered(const char* uuid) {
     printf("Found service %s\n", uuid);
 }
 
 void cobble_event_characteristicdiscovered(const char* svc_uuid, const char* char_uuid) {
+    cobble_event_characteristicdiscovered_c(cobble_connection_latest(), svc_uuid, char_uuid);
+}
+
+void cobble_event_characteristicdiscovered_c(cobble_conn_handle connection, const char* svc_uuid, const char* char_uuid) {
+
+    if(characteristicdiscovered_c_cb != NULL) {
+        characteristicdiscovered_c_cb(connection, svc_uuid, char_uuid);
+    }
 
     if(characteristicdiscovered_cb != NULL) {
         characteristicdiscovered_cb(svc_uuid, char_uuid);
         return;
     } 
 
+    if(characteristicdiscovered_c_cb != NULL)
+        return;
+
     printf("Default handler for characteristic discovery: Service %s, characteristic %s\n", svc_uuid, char_uuid);
 
 }
 
 void cobble_event_updatevalue(const char* characteristic_uuid, const uint8_t* data, int len) {
+    cobble_event_updatevalue_h(cobble_characteristic_intern(characteristic_uuid), data, len);
+}
+
+void cobble_event_updatevalue_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    cobble_event_updatevalue_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+// Values whose characteristic couldn't be given a handle, as the table was full or the UUID invalid
+static volatile uint64_t valueUpdatesDropped = 0;
+
+void cobble_event_updatevalue_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    // Nothing could tell the application which characteristic it came from
+    if(characteristic == COBBLE_CHARACTERISTIC_NONE) {
+        cobble_atomic_fetch_add_u64(&valueUpdatesDropped, 1);
+        return;
+    }
+
+    // Responses to a firmware update are handled by the update
+    if(hooks != NULL && hooks->updatevalue(connection, characteristic, data, len))
+        return;
+
+    // A characteristic with a callback of its own takes its values from the rest
+    if(cobble_characteristic_route(connection, characteristic, data, len))
+        return;
+
+    if(updatevalue_c_cb != NULL) {
+        updatevalue_c_cb(connection, characteristic, data, len);
+    }
+
+    if(updatevalue_h_cb != NULL) {
+        updatevalue_h_cb(characteristic, data, len);
+    }
+
+    // Nothing is waiting to be batched with it
+    if(batch_cb != NULL) {
+        cobble_value_record record = { connection, characteristic, 0, (uint32_t)(len > 0 ? len : 0) };
+        batch_cb(&record, 1, data);
+    }
 
     if(updatevalue_cb != NULL) {
-        updatevalue_cb(characteristic_uuid, data, len);
+        updatevalue_cb(cobble_characteristic_uuid(characteristic), data, len);
+        return;
+    }
+
+    if(updatevalue_h_cb != NULL || updatevalue_c_cb != NULL || batch_cb != NULL)
+        return;
+
+    printf("Default handler for updated charactistic %s with %i bytes of data, first byte is 0x%02x\n", cobble_characteristic_uuid(characteristic), len, data[0]);
+}
+
+void cobble_event_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status) {
+
+    if(hooks != NULL && hooks->writecomplete(connection, characteristic, written, status))
+        return;
+
+    if(writecomplete_cb != NULL) {
+        writecomplete_cb(connection, characteristic, written, status);
         return;
     }
 
-    printf("Default handler for updated charactistic %s with %i bytes of data, first byte is 0x%02x\n", characteristic_uuid, len, data[0]);
-}
\ No newline at end of file
+    printf("Default handler for write stream to %s: %i bytes written, status %i\n", cobble_characteristic_uuid(characteristic), written, status);
+}
+
+void cobble_event_mtuchanged(cobble_conn_handle connection, int mtu, int maxWrite, int maxWriteWithoutResponse) {
+
+    if(mtuchanged_cb != NULL) {
+        mtuchanged_cb(connection, mtu, maxWrite, maxWriteWithoutResponse);
+        return;
+    }
+
+    printf("Default handler for MTU change on connection %u: ATT MTU %i, writes of up to %i bytes (%i without response)\n", connection, mtu, maxWrite, maxWriteWithoutResponse);
+}
+
+void cobble_event_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+
+    if(discoverycomplete_cb != NULL) {
+        discoverycomplete_cb(connection, services, characteristics, elapsedMs);
+        return;
+    }
+
+    printf("Default handler for discovery complete on connection %u: %i services, %i characteristics in %i ms\n", connection, services, characteristics, elapsedMs);
+}
+
+void cobble_event_statuschanged(int status, int error) {
+
+    if(statuschanged_cb != NULL) {
+        statuschanged_cb(status, error);
+        return;
+    }
+
+    printf("Default handler for status change to %i (error %i)\n", status, error);
+}
+
+// Nothing is queued here, so a reserved value is held in a temporary buffer until it is delivered
+bool cobble_event_updatevalue_reserve(cobble_value_slot* slot, int capacity) {
+    slot->data = (uint8_t*)malloc(capacity > 0 ? capacity : 1);
+    slot->capacity = capacity;
+    slot->block = 0;
+    return slot->data != NULL;
+}
+
+void cobble_event_updatevalue_commit(cobble_value_slot* slot, cobble_conn_handle connection, cobble_char_handle characteristic, int len) {
+    cobble_event_updatevalue_c(connection, characteristic, slot->data, len < slot->capacity ? len : slot->capacity);
+    cobble_event_updatevalue_cancel(slot);
+}
+
+void cobble_event_updatevalue_cancel(cobble_value_slot* slot) {
+    free(slot->data);
+    slot->data = NULL;
+}
+
+/*
+ * Events are delivered immediately, so nothing is ever queued, and only values without a characteristic are dropped
+ */
+
+EXPORTED int cobble_events_drain(cobble_value_record* records, int maxRecords, uint8_t* payload, int payloadCapacity) {
+    (void)records;
+    (void)maxRecords;
+    (void)payload;
+    (void)payloadCapacity;
+    return 0;
+}
+
+// With nothing to wait for, a wait lasts until the timeout or cobble_queue_wake()
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitCond = PTHREAD_COND_INITIALIZER;
+static bool woken = false;
+
+EXPORTED bool cobble_queue_wait(int timeoutMs) {
+
+    pthread_mutex_lock(&waitLock);
+    if(timeoutMs < 0) {
+        while(!woken)
+            pthread_cond_wait(&waitCond, &waitLock);
+    } else {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeoutMs / 1000;
+        until.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+        if(until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while(!woken && pthread_cond_timedwait(&waitCond, &waitLock, &until) == 0)
+            ;
+    }
+    woken = false;
+    pthread_mutex_unlock(&waitLock);
+    return false;
+}
+
+EXPORTED void cobble_queue_wake(void) {
+    pthread_mutex_lock(&waitLock);
+    woken = true;
+    pthread_cond_signal(&waitCond);
+    pthread_mutex_unlock(&waitLock);
+}
+
+EXPORTED int cobble_event_fd(void) {
+    return -1;
+}
+
+EXPORTED void cobble_queue_policy_set(CobbleQueuePolicy policy) {
+    (void)policy;
+}
+
+EXPORTED uint64_t cobble_queue_dropped_get(void) {
+    return cobble_atomic_load_u64(&valueUpdatesDropped);
+}
+
+EXPORTED uint64_t cobble_queue_truncated_get(void) {
+    return 0;
+}
+
+EXPORTED int cobble_queue_process_bounded(int maxEvents, int maxTimeUs) {
+    (void)maxEvents;
+    (void)maxTimeUs;
+    return 0;
+}
+
+EXPORTED void cobble_queue_order_set(CobbleQueueOrder order) {
+    (void)order;
+}
+
+EXPORTED uint64_t cobble_event_sequence(void) {
+    return 0;
+}
+
+// Events are sent as they happen, on the platform's own threads. There is no dispatcher here, so slow callbacks still
+// hold up the main queue on Apple platforms or the JNI thread on Android (see cobble.h).
+EXPORTED bool cobble_dispatch_start(int threads, const int* cpus) {
+    (void)threads;
+    (void)cpus;
+    return false;
+}
+
+EXPORTED void cobble_dispatch_stop(void) {
+}
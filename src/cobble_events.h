@@ -1,10 +1,16 @@
 
+#ifndef COBBLE_EVENTS_H
+#define COBBLE_EVENTS_H
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include <stdint.h>
 
+#include "cobble.h"
+#include "cobble_ad.h"
+
 // Compatibility with Windows
 #if defined(_WIN32) || defined(_WIN64)
 #define EXPORTED __declspec(dllexport)
@@ -16,28 +22,147 @@ extern "C" {
 typedef void (*scanresult_funcptr)(const char*, int, const char*);
 EXPORTED void register_scanresult_cb(scanresult_funcptr p);
 
+// Sent for every advertisement received while scanning, with the device's identifier, the RSSI and the advertisement's
+// bytes (see cobble_ad.h). The view only lasts until the callback returns. Scan results are sent as well.
+typedef void (*advertisement_funcptr)(const char*, int, const cobble_ad_view*);
+EXPORTED void register_advertisement_cb(advertisement_funcptr p);
+
 typedef void (*characteristicdiscovered_funcptr)(const char*, const char*);
 EXPORTED void register_characteristicdiscovered_cb(characteristicdiscovered_funcptr p);
 
 typedef void (*updatevalue_funcptr)(const char*, const uint8_t*, int);
 EXPORTED void register_updatevalue_cb(updatevalue_funcptr p);
 
+// As above, but identifying the characteristic by handle rather than UUID string
+typedef void (*updatevalue_h_funcptr)(cobble_char_handle, const uint8_t*, int);
+EXPORTED void register_updatevalue_h_cb(updatevalue_h_funcptr p);
+
 typedef void (*connectionstatus_funcptr)(const char*, int);
 EXPORTED void register_connectionstatus_cb(connectionstatus_funcptr p);
 
+// As above, but also identifying the connection each event belongs to (see cobble_connect())
+typedef void (*connectionstatus_c_funcptr)(cobble_conn_handle, const char*, int);
+EXPORTED void register_connectionstatus_c_cb(connectionstatus_c_funcptr p);
+
+typedef void (*characteristicdiscovered_c_funcptr)(cobble_conn_handle, const char*, const char*);
+EXPORTED void register_characteristicdiscovered_c_cb(characteristicdiscovered_c_funcptr p);
+
+typedef void (*updatevalue_c_funcptr)(cobble_conn_handle, cobble_char_handle, const uint8_t*, int);
+EXPORTED void register_updatevalue_c_cb(updatevalue_c_funcptr p);
+
+// Value updates can also be taken many at a time, for bindings (Python, C#) where each call across the language boundary
+// costs far more than handling the value. A batch is an array of these records and one region of memory holding the
+// values, each record saying where its value is in the region. Both are plain data, so can be copied or mapped as is.
+typedef struct {
+    cobble_conn_handle connection;
+    cobble_char_handle characteristic;
+    uint32_t offset;
+    uint32_t length;
+} cobble_value_record;
+
+// Sent the value updates waiting in cobble_queue_process(), up to 1024 at a time, in the order they arrived. The region
+// is the queue's own memory, so the values are only valid until the callback returns. With the realtime core (Apple
+// platforms and Android) each value is sent as a batch of one.
+typedef void (*batch_funcptr)(const cobble_value_record*, int, const uint8_t*);
+EXPORTED void register_batch_cb(batch_funcptr p);
+
+// Copies up to maxRecords waiting value updates, and their values, into the caller's memory and returns how many there
+// were, without any callback; values for a characteristic with a callback of its own (see cobble_characteristic_cb_set_c())
+// are sent to it instead of being copied. Stops early at a value which doesn't fit in what is left of the payload, which is kept for
+// the next call; a value too large for the whole payload (which must be at least 512 bytes) is dropped.
+// Call it from the thread which calls cobble_queue_process(). Once it has been called, cobble_queue_process() leaves
+// value updates for it instead of sending them to the callbacks. Returns 0 with the realtime core, where nothing is queued.
+EXPORTED int cobble_events_drain(cobble_value_record* records, int maxRecords, uint8_t* payload, int payloadCapacity);
+
 typedef enum {
     ConnectionStatus_DidDisconnect,
     ConnectionStatus_DidConnect,
     ConnectionStatus_DidConnectFailed,
 } ConnectionStatus;
 
+// Sent once for each cobble_write_stream(), with the number of bytes written and how the stream ended
+typedef void (*writecomplete_funcptr)(cobble_conn_handle, cobble_char_handle, int, int);
+EXPORTED void register_writecomplete_cb(writecomplete_funcptr p);
+
+// Sent when a connection's ATT MTU is first known, and whenever it changes, with the MTU and the largest values that can
+// now be written with and without response (as cobble_max_writesize_get_c() would return)
+typedef void (*mtuchanged_funcptr)(cobble_conn_handle, int, int, int);
+EXPORTED void register_mtuchanged_cb(mtuchanged_funcptr p);
+
+// Sent once every service of a connection and all of their characteristics have been discovered, with how many services
+// and characteristics there were and how long discovery took in milliseconds. Characteristics can be used from then on.
+typedef void (*discoverycomplete_funcptr)(cobble_conn_handle, int, int, int);
+EXPORTED void register_discoverycomplete_cb(discoverycomplete_funcptr p);
+
+// Sent whenever cobble_status() changes, with the new status and, for CobbleError, the reason (a CobbleErrorCode)
+typedef void (*statuschanged_funcptr)(int, int);
+EXPORTED void register_statuschanged_cb(statuschanged_funcptr p);
+
+typedef enum {
+    WriteStatus_Complete,
+    WriteStatus_Failed,     // The characteristic can't be written, a write was rejected, or the device disconnected
+    WriteStatus_Busy,       // Another stream was already in progress on the connection, so nothing was written
+} WriteStatus;
+
 //Called by the platform-specific implementations
 void cobble_event_scanresult(const char* name, int rssi, const char* identifier);
 void cobble_event_characteristicdiscovered(const char* svc_uuid, const char* char_uuid);
+
+// Whether anything is listening for advertisements, so that backends which have to rebuild them can skip doing so
+bool cobble_event_advertisement_wanted(void);
+// An advertisement's AD structures, which are not kept after this returns. Backends send this as well as the scan result.
+void cobble_event_advertisement(const char* identifier, int rssi, const uint8_t* data, int len);
 void cobble_event_connectionstatus(const char* identifier, int status);
 void cobble_event_servicediscovered(const char* uuid);
 void cobble_event_updatevalue(const char* characteristic_uuid, const uint8_t* data, int len);
+void cobble_event_updatevalue_h(cobble_char_handle characteristic, const uint8_t* data, int len);
+
+// Backends which support several connections say which one each event is for. The versions above are taken to be for
+// the most recent connection. The identifier reported with a connection status is the connection's address, so the
+// status must be sent before the connection is closed.
+void cobble_event_connectionstatus_c(cobble_conn_handle connection, int status);
+void cobble_event_characteristicdiscovered_c(cobble_conn_handle connection, const char* svc_uuid, const char* char_uuid);
+void cobble_event_updatevalue_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len);
+
+// The end of a stream started with cobble_write_stream_c(), however it ended
+void cobble_event_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status);
+
+// A connection's ATT MTU has been negotiated or has changed. Backends should only send this when the value changes.
+void cobble_event_mtuchanged(cobble_conn_handle connection, int mtu, int maxWrite, int maxWriteWithoutResponse);
+
+// Discovery of a connection has finished. Backends send this after the last characteristicdiscovered event for it.
+void cobble_event_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs);
+
+// The status has changed. Sent by cobble_status.c, so backends change it with cobble_status_set() and the like instead.
+void cobble_event_statuschanged(int status, int error);
+
+// Backends which can receive a value directly into memory they are given (eg with recv()) can skip a copy by reserving
+// space in the event queue for the largest value expected, filling it in place, then committing it with the actual length.
+typedef struct {
+    uint8_t* data;
+    int capacity;
+    uint32_t block;
+} cobble_value_slot;
+
+// Returns false, and counts the value as dropped, if there is no room for it. The backend should still consume the value.
+bool cobble_event_updatevalue_reserve(cobble_value_slot* slot, int capacity);
+void cobble_event_updatevalue_commit(cobble_value_slot* slot, cobble_conn_handle connection, cobble_char_handle characteristic, int len);
+// Give back a reserved slot without delivering anything
+void cobble_event_updatevalue_cancel(cobble_value_slot* slot);
+
+// Lets a part of Cobble built on the events (such as the DFU engine in cobble_dfu.c) see them before the application.
+// The hooks returning bool say whether the event was theirs, in which case it is not passed on. They are called where
+// events are delivered, so must be set from that same thread; they can't be removed once set.
+typedef struct {
+    bool (*updatevalue)(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len);
+    bool (*writecomplete)(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status);
+    void (*connectionstatus)(cobble_conn_handle connection, int status);
+} cobble_event_hooks;
+
+void cobble_event_hooks_set(const cobble_event_hooks* hooks);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif
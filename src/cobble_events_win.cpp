@@ -9,17 +9,72 @@
 //If doing so, you would need to be careful about being thread-safe in the calling app.
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cobble.h"
 #include "cobble_events.h"
 
-#include <queue>
-#include <string>
+#include "cobble_ring.h"
+#include "cobble_pool.h"
+#include "cobble_characteristics.h"
+#include "cobble_connections.h"
+#include "cobble_scan_table.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 using namespace std;
 
-// The maximum size of a Bluetooth LE characteristic value update
-#define MAX_LENGTH 256
+// The maximum size of a Bluetooth LE characteristic value (the ATT specification maximum)
+#define MAX_LENGTH 512
+
+// Scan result names and identifiers are truncated to fit a fixed-size queue entry
+// Identifiers are MAC addresses (17 characters) or UUIDs (36 characters), names are limited by the advertising payload size
+#define MAX_NAME_LENGTH 248
+#define MAX_IDENTIFIER_LENGTH 40
+
+// Number of entries preallocated for each queue. If the application falls behind, events are dropped according to the queue policy.
+#define SCAN_QUEUE_LENGTH 256
+#define ADVERTISEMENT_QUEUE_LENGTH 1024
+#define CONNECTION_STATUS_QUEUE_LENGTH 32
+#define CHARACTERISTIC_DISCOVERY_QUEUE_LENGTH 256
+#define VALUE_UPDATE_QUEUE_LENGTH 4096
+#define WRITE_COMPLETE_QUEUE_LENGTH 32
+#define MTU_CHANGED_QUEUE_LENGTH 32
+#define DISCOVERY_COMPLETE_QUEUE_LENGTH 32
+#define STATUS_CHANGED_QUEUE_LENGTH 32
+
+// Value update payloads live in pooled blocks sized to the value, so that queueing a notification does not allocate or copy
+// This is the total memory available to queued payloads - small values are cheap, large ones take a bigger share
+#define VALUE_UPDATE_BUDGET (256 * 1024)
+
+// Value updates passed to register_batch_cb() in one call
+#define BATCH_LENGTH 1024
+
+// Advertisement bytes are pooled in the same way, separately so that a busy scan can't starve notifications
+#define ADVERTISEMENT_BUDGET (64 * 1024)
 
 // Cobble can either call back instantly when an event occurs, or queue and defer until cobble_queue_process() is called
 // This queued approach allows events to be handled on a specific thread - this seems to be required when interacting with Unity
@@ -31,15 +86,29 @@ using namespace std;
  * Callback function pointers and registration functions
  */
 scanresult_funcptr scanresult_cb = NULL;
+advertisement_funcptr advertisement_cb = NULL;
 characteristicdiscovered_funcptr characteristicdiscovered_cb = NULL;
 updatevalue_funcptr updatevalue_cb = NULL;
+updatevalue_h_funcptr updatevalue_h_cb = NULL;
 connectionstatus_funcptr connectionstatus_cb = NULL;
+connectionstatus_c_funcptr connectionstatus_c_cb = NULL;
+characteristicdiscovered_c_funcptr characteristicdiscovered_c_cb = NULL;
+updatevalue_c_funcptr updatevalue_c_cb = NULL;
+batch_funcptr batch_cb = NULL;
+writecomplete_funcptr writecomplete_cb = NULL;
+mtuchanged_funcptr mtuchanged_cb = NULL;
+discoverycomplete_funcptr discoverycomplete_cb = NULL;
+statuschanged_funcptr statuschanged_cb = NULL;
 
 
 EXPORTED void register_scanresult_cb(scanresult_funcptr p) {
     scanresult_cb = p;
 }
 
+EXPORTED void register_advertisement_cb(advertisement_funcptr p) {
+    advertisement_cb = p;
+}
+
 EXPORTED void register_characteristicdiscovered_cb(characteristicdiscovered_funcptr p) {
     characteristicdiscovered_cb = p;
 }
@@ -48,45 +117,327 @@ EXPORTED void register_updatevalue_cb(updatevalue_funcptr p) {
     updatevalue_cb = p;
 }
 
+EXPORTED void register_updatevalue_h_cb(updatevalue_h_funcptr p) {
+    updatevalue_h_cb = p;
+}
+
 EXPORTED void register_connectionstatus_cb(connectionstatus_funcptr p) {
     connectionstatus_cb = p;
 }
 
+EXPORTED void register_connectionstatus_c_cb(connectionstatus_c_funcptr p) {
+    connectionstatus_c_cb = p;
+}
+
+EXPORTED void register_characteristicdiscovered_c_cb(characteristicdiscovered_c_funcptr p) {
+    characteristicdiscovered_c_cb = p;
+}
+
+EXPORTED void register_updatevalue_c_cb(updatevalue_c_funcptr p) {
+    updatevalue_c_cb = p;
+}
+
+EXPORTED void register_batch_cb(batch_funcptr p) {
+    batch_cb = p;
+}
+
+EXPORTED void register_writecomplete_cb(writecomplete_funcptr p) {
+    writecomplete_cb = p;
+}
+
+EXPORTED void register_mtuchanged_cb(mtuchanged_funcptr p) {
+    mtuchanged_cb = p;
+}
+
+EXPORTED void register_discoverycomplete_cb(discoverycomplete_funcptr p) {
+    discoverycomplete_cb = p;
+}
+
+EXPORTED void register_statuschanged_cb(statuschanged_funcptr p) {
+    statuschanged_cb = p;
+}
+
+static const cobble_event_hooks* hooks = nullptr;
+
+void cobble_event_hooks_set(const cobble_event_hooks* h) {
+    hooks = h;
+}
+
 #if defined(COBBLE_CALLBACK_DEFERRED)
 
-class scandata {
-public:
-    string name;
+// Queue entries are copied into preallocated ring slots, so they must be plain data (no std::string)
+// Each starts with its sequence number, which is where the queues are merged back into one stream
+struct scandata {
+    uint64_t sequence;
+    char name[MAX_NAME_LENGTH];
     int rssi;
-    string mac;
+    char mac[MAX_IDENTIFIER_LENGTH];
 };
 
-queue<scandata>scanQueue;
+struct advertisement {
+    uint64_t sequence;
+    char identifier[MAX_IDENTIFIER_LENGTH];
+    int rssi;
+    uint32_t block;
+    int length;
+};
 
-class connectionstatus {
-public:
-    string identifier;
+struct connectionstatus {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    char identifier[MAX_IDENTIFIER_LENGTH];
     int status;
 };
 
-queue<connectionstatus> connectionStatusQueue;
+struct characteristicdiscovery {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    char service[MAX_IDENTIFIER_LENGTH];
+    char characteristic[MAX_IDENTIFIER_LENGTH];
+};
+
+// Refers to the payload block rather than containing it, so queueing and delivery only move a few bytes
+struct valueupdate {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    cobble_char_handle characteristic;
+    uint32_t block;
+    int length;
+};
+
+struct writecomplete {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    cobble_char_handle characteristic;
+    int written;
+    int status;
+};
 
-class characteristicdiscovery {
-public:
-    string service;
-    string characteristic;
+struct mtuchanged {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    int mtu;
+    int maxWrite;
+    int maxWriteWithoutResponse;
 };
 
-queue<characteristicdiscovery> characteristicDiscoveryQueue;
+struct discoverycomplete {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+    int services;
+    int characteristics;
+    int elapsedMs;
+};
 
-class valueupdate {
-public:
-    string characteristic;
-    uint8_t data[MAX_LENGTH];
-    int length;
+struct statuschanged {
+    uint64_t sequence;
+    int status;
+    int error;
 };
 
-queue<valueupdate> valueUpdateQueue;
+// What every queued event starts with, and those for a connection continue with
+struct eventHeader {
+    uint64_t sequence;
+    cobble_conn_handle connection;
+};
+
+// Room for an event taken from any of the queues
+union queuedEvent {
+    eventHeader header;
+    scandata scan;
+    advertisement advert;
+    connectionstatus connectionStatus;
+    characteristicdiscovery discovery;
+    valueupdate value;
+    writecomplete writeComplete;
+    mtuchanged mtu;
+    discoverycomplete discoveryComplete;
+    statuschanged status;
+};
+
+// Events are pushed from the Bluetooth stack's threads and popped by whichever thread calls cobble_queue_process(), or by
+// the dispatcher's feeder thread
+cobble_ring scanQueue;
+cobble_ring advertisementQueue;
+cobble_ring connectionStatusQueue;
+cobble_ring characteristicDiscoveryQueue;
+cobble_ring valueUpdateQueue;
+cobble_ring writeCompleteQueue;
+cobble_ring mtuChangedQueue;
+cobble_ring discoveryCompleteQueue;
+cobble_ring statusChangedQueue;
+
+cobble_pool valueUpdatePool;
+cobble_pool advertisementPool;
+
+// Value updates and advertisements which could not get a payload block
+volatile uint64_t valueUpdatesDropped = 0;
+volatile uint64_t advertisementsDropped = 0;
+
+// Value updates cut to MAX_LENGTH. Only the first is reported, so the backend's thread isn't held up writing to stdout.
+volatile uint64_t valueUpdatesTruncated = 0;
+
+// A batch being gathered for register_batch_cb(), with the blocks its values are in, which are released once it is sent.
+// cobble_queue_process() has one, and each dispatcher thread its own.
+struct valueBatch {
+    cobble_value_record records[BATCH_LENGTH];
+    uint32_t blocks[BATCH_LENGTH];
+    int count;
+};
+
+static valueBatch processBatch;
+
+// Set by the first cobble_events_drain(), after which value updates are only taken from the queue by it. A value which
+// didn't fit in the caller's payload is held here for the next call.
+static bool valuesDrained = false;
+static valueupdate drainHeld;
+static bool drainHasHeld = false;
+
+// The next event's sequence number, and the one being delivered on this thread (the dispatcher delivers on several)
+static volatile uint64_t eventSequence = 1;
+static thread_local uint64_t deliveringSequence = 0;
+
+// How control events are ordered against bulk data, a CobbleQueueOrder
+static volatile uint32_t queueOrder = QueueOrder_Sequential;
+
+// Set by the first event queued since cobble_queue_process() last looked, which is the only one to make a system call to
+// wake the application. Waiting is on an event object on Windows, an eventfd on Linux, and a pipe elsewhere.
+static volatile uint32_t eventsSignalled = 0;
+#if defined(_WIN32) || defined(_WIN64)
+static HANDLE eventsReady = NULL;
+#else
+static int eventsReadFd = -1;
+static int eventsWriteFd = -1;
+#endif
+
+// Return the payload block of a value update which is discarded from the queue without being delivered
+static void discard_valueupdate(void* ctx, void* elem) {
+    cobble_pool_release((cobble_pool*)ctx, ((valueupdate*)elem)->block);
+}
+
+static void discard_advertisement(void* ctx, void* elem) {
+    cobble_pool_release((cobble_pool*)ctx, ((advertisement*)elem)->block);
+}
+
+// Allocate all queue storage once, when the library is loaded
+static struct queueStorage {
+    queueStorage() {
+        cobble_ring_init(&scanQueue, SCAN_QUEUE_LENGTH, sizeof(scandata), RingPolicy_DropNewest);
+        cobble_ring_init(&advertisementQueue, ADVERTISEMENT_QUEUE_LENGTH, sizeof(advertisement), RingPolicy_DropNewest);
+        cobble_ring_set_discard(&advertisementQueue, discard_advertisement, &advertisementPool);
+        cobble_ring_init(&connectionStatusQueue, CONNECTION_STATUS_QUEUE_LENGTH, sizeof(connectionstatus), RingPolicy_DropNewest);
+        cobble_ring_init(&characteristicDiscoveryQueue, CHARACTERISTIC_DISCOVERY_QUEUE_LENGTH, sizeof(characteristicdiscovery), RingPolicy_DropNewest);
+        cobble_ring_init(&valueUpdateQueue, VALUE_UPDATE_QUEUE_LENGTH, sizeof(valueupdate), RingPolicy_DropNewest);
+        cobble_ring_set_discard(&valueUpdateQueue, discard_valueupdate, &valueUpdatePool);
+        cobble_ring_init(&writeCompleteQueue, WRITE_COMPLETE_QUEUE_LENGTH, sizeof(writecomplete), RingPolicy_DropNewest);
+        cobble_ring_init(&mtuChangedQueue, MTU_CHANGED_QUEUE_LENGTH, sizeof(mtuchanged), RingPolicy_DropNewest);
+        cobble_ring_init(&discoveryCompleteQueue, DISCOVERY_COMPLETE_QUEUE_LENGTH, sizeof(discoverycomplete), RingPolicy_DropNewest);
+        cobble_ring_init(&statusChangedQueue, STATUS_CHANGED_QUEUE_LENGTH, sizeof(statuschanged), RingPolicy_DropNewest);
+        cobble_pool_init(&valueUpdatePool, VALUE_UPDATE_BUDGET);
+        cobble_pool_init(&advertisementPool, ADVERTISEMENT_BUDGET);
+
+#if defined(_WIN32) || defined(_WIN64)
+        eventsReady = CreateEvent(NULL, TRUE, FALSE, NULL);
+#elif defined(__linux__)
+        eventsReadFd = eventsWriteFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        int fds[2];
+        if (pipe(fds) == 0) {
+            for (int i = 0; i < 2; i++) {
+                fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+            }
+            eventsReadFd = fds[0];
+            eventsWriteFd = fds[1];
+        }
+#endif
+    }
+    ~queueStorage() {
+        cobble_ring_free(&scanQueue);
+        cobble_ring_free(&advertisementQueue);
+        cobble_ring_free(&connectionStatusQueue);
+        cobble_ring_free(&characteristicDiscoveryQueue);
+        cobble_ring_free(&valueUpdateQueue);
+        cobble_ring_free(&writeCompleteQueue);
+        cobble_ring_free(&mtuChangedQueue);
+        cobble_ring_free(&discoveryCompleteQueue);
+        cobble_ring_free(&statusChangedQueue);
+        cobble_pool_free(&valueUpdatePool);
+        cobble_pool_free(&advertisementPool);
+
+#if defined(_WIN32) || defined(_WIN64)
+        if (eventsReady != NULL)
+            CloseHandle(eventsReady);
+#else
+        if (eventsWriteFd >= 0 && eventsWriteFd != eventsReadFd)
+            close(eventsWriteFd);
+        if (eventsReadFd >= 0)
+            close(eventsReadFd);
+#endif
+    }
+} storage;
+
+// Copy a possibly-NULL C string into a fixed-size buffer, truncating if required
+static void copy_string(char* dest, size_t size, const char* src) {
+    if (src == NULL) {
+        dest[0] = '\0';
+        return;
+    }
+    size_t len = min(strlen(src), size - 1);
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+static void events_wake(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    SetEvent(eventsReady);
+#elif defined(__linux__)
+    uint64_t one = 1;
+    if (write(eventsWriteFd, &one, sizeof(one)) < 0) {
+        // Only fails if the counter is about to overflow, in which case it is readable anyway
+    }
+#else
+    uint8_t one = 1;
+    if (write(eventsWriteFd, &one, sizeof(one)) < 0) {
+        // The pipe is full, so already readable
+    }
+#endif
+}
+
+// Called before the queues are emptied, so that an event queued after they have been looked at always wakes the
+// application again. The wake is taken before the flag is cleared, or one sent in between would be taken too and leave
+// the flag set with nothing to wake the application. An event queued in between finds the flag set and sends no wake,
+// but it was queued before the queues are looked at, so it is taken with the rest.
+static void events_clear(void) {
+    if (cobble_atomic_load_u32(&eventsSignalled) == 0)
+        return;
+#if defined(_WIN32) || defined(_WIN64)
+    ResetEvent(eventsReady);
+#else
+    uint8_t buffer[64];
+    while (read(eventsReadFd, buffer, sizeof(buffer)) > 0)
+        ;
+#endif
+    cobble_atomic_store_u32(&eventsSignalled, 0);
+}
+
+// Numbered as they are queued, so a number taken by an event which was then dropped leaves a gap
+template <typename T>
+static bool queue_push(cobble_ring* r, T* elem) {
+    elem->sequence = cobble_atomic_fetch_add_u64(&eventSequence, 1);
+    bool pushed = cobble_ring_push(r, elem);
+    if (cobble_atomic_exchange_u32(&eventsSignalled, 1) == 0)
+        events_wake();
+    return pushed;
+}
+
+// Whether anything is waiting to be taken by cobble_queue_process() or cobble_events_drain()
+static bool events_pending(void) {
+    return cobble_ring_count(&scanQueue) + cobble_ring_count(&advertisementQueue) + cobble_ring_count(&connectionStatusQueue)
+        + cobble_ring_count(&characteristicDiscoveryQueue) + cobble_ring_count(&valueUpdateQueue)
+        + cobble_ring_count(&writeCompleteQueue) + cobble_ring_count(&mtuChangedQueue)
+        + cobble_ring_count(&discoveryCompleteQueue) + cobble_ring_count(&statusChangedQueue) > 0 || drainHasHeld;
+}
 
 #endif
 
@@ -96,6 +447,13 @@ queue<valueupdate> valueUpdateQueue;
 
 void cobble_event_scanresult(const char* name, int rssi, const char* identifier) {
 
+    // Repeated advertisements from a device are merged until it is due to be reported again
+    cobble_scan_report report;
+    if (!cobble_scan_table_update(name, rssi, identifier, &report))
+        return;
+    name = report.name;
+    rssi = report.rssi;
+
 #if defined(COBBLE_CALLBACK_REALTIME)
 
     if(scanresult_cb != NULL) {
@@ -106,11 +464,11 @@ void cobble_event_scanresult(const char* name, int rssi, const char* identifier)
 #elif defined(COBBLE_CALLBACK_DEFERRED)
 
     scandata d;
-    d.name = string(name);
+    copy_string(d.name, sizeof(d.name), name);
     d.rssi = rssi;
-    d.mac = string(identifier);
+    copy_string(d.mac, sizeof(d.mac), identifier);
 
-    scanQueue.push(d);
+    queue_push(&scanQueue, &d);
 
 #else
 
@@ -120,11 +478,58 @@ void cobble_event_scanresult(const char* name, int rssi, const char* identifier)
 
 }
 
+bool cobble_event_advertisement_wanted(void) {
+    return advertisement_cb != NULL;
+}
+
+// Not coalesced: whoever asked for advertisements wants each one
+void cobble_event_advertisement(const char* identifier, int rssi, const uint8_t* data, int len) {
 
-void cobble_event_connectionstatus(const char* identifier, int status) {
+    if (advertisement_cb == NULL)
+        return;
+
+    len = max(0, min(COBBLE_AD_MAX_LENGTH, len));
+
+#if defined(COBBLE_CALLBACK_REALTIME)
+
+    cobble_ad_view view;
+    cobble_ad_view_init(&view, data, len);
+    advertisement_cb(identifier, rssi, &view);
+
+#elif defined(COBBLE_CALLBACK_DEFERRED)
+
+    // Unlike value updates, the oldest advertisements aren't discarded to make room: there will be more
+    advertisement a;
+    a.block = cobble_pool_alloc(&advertisementPool, len);
+    if (a.block == COBBLE_POOL_NONE) {
+        cobble_atomic_fetch_add_u64(&advertisementsDropped, 1);
+        return;
+    }
+    memcpy(cobble_pool_block(&advertisementPool, a.block), data, len);
+    copy_string(a.identifier, sizeof(a.identifier), identifier);
+    a.rssi = rssi;
+    a.length = len;
+
+    if (!queue_push(&advertisementQueue, &a)) {
+        cobble_pool_release(&advertisementPool, a.block);
+    }
+
+#else
+
+    printf("No handler for advertisement from %s with RSSI %i, %i bytes\n", identifier, rssi, len);
+
+#endif
+
+}
+
+static void connectionstatus_event(cobble_conn_handle connection, const char* identifier, int status) {
 
 #if defined(COBBLE_CALLBACK_REALTIME)
 
+    if(connectionstatus_c_cb != NULL) {
+        connectionstatus_c_cb(connection, identifier, status);
+    }
+
     if(connectionstatus_cb != NULL) {
         connectionstatus_cb(identifier, status);
         return;
@@ -133,10 +538,11 @@ void cobble_event_connectionstatus(const char* identifier, int status) {
 #elif defined(COBBLE_CALLBACK_DEFERRED)
 
     connectionstatus st;
-    st.identifier = string(identifier);
+    st.connection = connection;
+    copy_string(st.identifier, sizeof(st.identifier), identifier);
     st.status = status;
 
-    connectionStatusQueue.push(st);
+    queue_push(&connectionStatusQueue, &st);
 
 #else
 
@@ -151,14 +557,32 @@ void cobble_event_connectionstatus(const char* identifier, int status) {
 
 }
 
+void cobble_event_connectionstatus(const char* identifier, int status) {
+    connectionstatus_event(cobble_connection_latest(), identifier, status);
+}
+
+void cobble_event_connectionstatus_c(cobble_conn_handle connection, int status) {
+    char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+    cobble_address_format(cobble_connection_address(connection), identifier);
+    connectionstatus_event(connection, identifier, status);
+}
+
 void cobble_event_servicediscovered(const char* uuid) {
     printf("Found service %s\n", uuid);
 }
 
 void cobble_event_characteristicdiscovered(const char* svc_uuid, const char* char_uuid) {
+    cobble_event_characteristicdiscovered_c(cobble_connection_latest(), svc_uuid, char_uuid);
+}
+
+void cobble_event_characteristicdiscovered_c(cobble_conn_handle connection, const char* svc_uuid, const char* char_uuid) {
 
 #if defined(COBBLE_CALLBACK_REALTIME)
 
+    if(characteristicdiscovered_c_cb != NULL) {
+        characteristicdiscovered_c_cb(connection, svc_uuid, char_uuid);
+    }
+
     if(characteristicdiscovered_cb != NULL) {
         characteristicdiscovered_cb(svc_uuid, char_uuid);
         return;
@@ -167,10 +591,11 @@ void cobble_event_characteristicdiscovered(const char* svc_uuid, const char* cha
 #elif defined(COBBLE_CALLBACK_DEFERRED)
 
     characteristicdiscovery d;
-    d.service = string(svc_uuid);
-    d.characteristic = string(char_uuid);
+    d.connection = connection;
+    copy_string(d.service, sizeof(d.service), svc_uuid);
+    copy_string(d.characteristic, sizeof(d.characteristic), char_uuid);
 
-    characteristicDiscoveryQueue.push(d);
+    queue_push(&characteristicDiscoveryQueue, &d);
 
 #else
 
@@ -180,74 +605,1044 @@ void cobble_event_characteristicdiscovered(const char* svc_uuid, const char* cha
 }
 
 void cobble_event_updatevalue(const char* characteristic_uuid, const uint8_t* data, int len) {
+    cobble_event_updatevalue_h(cobble_characteristic_intern(characteristic_uuid), data, len);
+}
+
+void cobble_event_updatevalue_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    cobble_event_updatevalue_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+void cobble_event_updatevalue_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
 
 #if defined(COBBLE_CALLBACK_REALTIME)
 
+    if(updatevalue_c_cb != NULL) {
+        updatevalue_c_cb(connection, characteristic, data, len);
+    }
+
+    if(updatevalue_h_cb != NULL) {
+        updatevalue_h_cb(characteristic, data, len);
+    }
+
     if(updatevalue_cb != NULL) {
-        updatevalue_cb(characteristic_uuid, data, len);
+        updatevalue_cb(cobble_characteristic_uuid(characteristic), data, len);
         return;
     }
 
 #elif defined(COBBLE_CALLBACK_DEFERRED)
 
-    if (len > MAX_LENGTH) {
-        printf("Warning: Data length %i is larger than the maximum allowed by cobble (%i) - data will be truncated", len, MAX_LENGTH);
+    if (characteristic == COBBLE_CHARACTERISTIC_NONE) {
+        cobble_atomic_fetch_add_u64(&valueUpdatesDropped, 1);
+        return;
     }
 
-    valueupdate v;
-    v.characteristic = string(characteristic_uuid);
-    v.length = min(MAX_LENGTH, len);
+    cobble_value_slot slot;
+    if (!cobble_event_updatevalue_reserve(&slot, len))
+        return;
+
+    memcpy(slot.data, data, slot.capacity);
+    cobble_event_updatevalue_commit(&slot, connection, characteristic, slot.capacity);
+
+#else
+
+    printf("Default handler for updated charactistic %s with %i bytes of data, first byte is 0x%02x\n", cobble_characteristic_uuid(characteristic), len, data[0]);
+
+#endif
 
-    for (int i = 0; i < v.length; i++) {
-        v.data[i] = data[i];
+}
+
+void cobble_event_writecomplete(cobble_conn_handle connection, cobble_char_handle characteristic, int written, int status) {
+
+#if defined(COBBLE_CALLBACK_REALTIME)
+
+    if(writecomplete_cb != NULL) {
+        writecomplete_cb(connection, characteristic, written, status);
+        return;
     }
 
-    valueUpdateQueue.push(v);
+#elif defined(COBBLE_CALLBACK_DEFERRED)
+
+    writecomplete w;
+    w.connection = connection;
+    w.characteristic = characteristic;
+    w.written = written;
+    w.status = status;
+
+    queue_push(&writeCompleteQueue, &w);
 
 #else
 
-    printf("Default handler for updated charactistic %s with %i bytes of data, first byte is 0x%02x\n", characteristic_uuid, len, data[0]);
+    printf("No handler for write stream to %s: %i bytes written, status %i\n", cobble_characteristic_uuid(characteristic), written, status);
 
 #endif
 
 }
 
-EXPORTED void cobble_queue_process(void) {
+void cobble_event_mtuchanged(cobble_conn_handle connection, int mtu, int maxWrite, int maxWriteWithoutResponse) {
+
+#if defined(COBBLE_CALLBACK_REALTIME)
+
+    if (mtuchanged_cb != NULL) {
+        mtuchanged_cb(connection, mtu, maxWrite, maxWriteWithoutResponse);
+        return;
+    }
+
+#elif defined(COBBLE_CALLBACK_DEFERRED)
+
+    mtuchanged m;
+    m.connection = connection;
+    m.mtu = mtu;
+    m.maxWrite = maxWrite;
+    m.maxWriteWithoutResponse = maxWriteWithoutResponse;
+
+    queue_push(&mtuChangedQueue, &m);
+
+#else
+
+    printf("No handler for MTU change on connection %u: ATT MTU %i, writes of up to %i bytes (%i without response)\n", connection, mtu, maxWrite, maxWriteWithoutResponse);
+
+#endif
+
+}
+
+void cobble_event_discoverycomplete(cobble_conn_handle connection, int services, int characteristics, int elapsedMs) {
+
+#if defined(COBBLE_CALLBACK_REALTIME)
+
+    if (discoverycomplete_cb != NULL) {
+        discoverycomplete_cb(connection, services, characteristics, elapsedMs);
+        return;
+    }
+
+#elif defined(COBBLE_CALLBACK_DEFERRED)
+
+    discoverycomplete dc;
+    dc.connection = connection;
+    dc.services = services;
+    dc.characteristics = characteristics;
+    dc.elapsedMs = elapsedMs;
+
+    queue_push(&discoveryCompleteQueue, &dc);
+
+#else
+
+    printf("No handler for discovery complete on connection %u: %i services, %i characteristics in %i ms\n", connection, services, characteristics, elapsedMs);
+
+#endif
+
+}
+
+void cobble_event_statuschanged(int status, int error) {
+
+#if defined(COBBLE_CALLBACK_REALTIME)
+
+    if (statuschanged_cb != NULL) {
+        statuschanged_cb(status, error);
+        return;
+    }
+
+#elif defined(COBBLE_CALLBACK_DEFERRED)
+
+    statuschanged sc;
+    sc.status = status;
+    sc.error = error;
+
+    queue_push(&statusChangedQueue, &sc);
+
+#else
+
+    printf("No handler for status change to %i (error %i)\n", status, error);
+
+#endif
+
+}
 
 #if defined(COBBLE_CALLBACK_DEFERRED)
 
-    while (!scanQueue.empty()) {
-        auto r = scanQueue.front();
-        scanQueue.pop();
-        if (scanresult_cb != nullptr) {
-            scanresult_cb(r.name.c_str(), r.rssi, r.mac.c_str());
+bool cobble_event_updatevalue_reserve(cobble_value_slot* slot, int capacity) {
+
+    slot->capacity = max(0, min(MAX_LENGTH, capacity));
+    if (capacity > MAX_LENGTH && cobble_atomic_fetch_add_u64(&valueUpdatesTruncated, 1) == 0) {
+        printf("Warning: Data length %i is larger than the maximum allowed by cobble (%i) - data will be truncated\n", capacity, MAX_LENGTH);
+    }
+
+    // The budget is taken up by queued values. If we're keeping the newest data, make room by discarding the oldest.
+    slot->block = cobble_pool_alloc(&valueUpdatePool, slot->capacity);
+    while (slot->block == COBBLE_POOL_NONE) {
+        if (cobble_atomic_load_u32(&valueUpdateQueue.policy) != RingPolicy_DropOldest || !cobble_ring_discard_oldest(&valueUpdateQueue)) {
+            cobble_atomic_fetch_add_u64(&valueUpdatesDropped, 1);
+            return false;
         }
+        slot->block = cobble_pool_alloc(&valueUpdatePool, slot->capacity);
+    }
+
+    slot->data = cobble_pool_block(&valueUpdatePool, slot->block);
+    return true;
+}
+
+void cobble_event_updatevalue_commit(cobble_value_slot* slot, cobble_conn_handle connection, cobble_char_handle characteristic, int len) {
+
+    valueupdate v;
+    v.connection = connection;
+    v.characteristic = characteristic;
+    v.block = slot->block;
+    v.length = max(0, min(slot->capacity, len));
+
+    if (characteristic == COBBLE_CHARACTERISTIC_NONE) {
+        cobble_atomic_fetch_add_u64(&valueUpdatesDropped, 1);
+        cobble_pool_release(&valueUpdatePool, v.block);
+        return;
+    }
+
+    if (!queue_push(&valueUpdateQueue, &v)) {
+        cobble_pool_release(&valueUpdatePool, v.block);
+    }
+}
+
+void cobble_event_updatevalue_cancel(cobble_value_slot* slot) {
+    cobble_pool_release(&valueUpdatePool, slot->block);
+}
+
+#else
+
+// Nothing is queued, so a reserved value is held in a temporary buffer until it is delivered
+bool cobble_event_updatevalue_reserve(cobble_value_slot* slot, int capacity) {
+    slot->data = (uint8_t*)malloc(max(1, capacity));
+    slot->capacity = capacity;
+    slot->block = 0;
+    return slot->data != NULL;
+}
+
+void cobble_event_updatevalue_commit(cobble_value_slot* slot, cobble_conn_handle connection, cobble_char_handle characteristic, int len) {
+    cobble_event_updatevalue_c(connection, characteristic, slot->data, min(len, slot->capacity));
+    cobble_event_updatevalue_cancel(slot);
+}
+
+void cobble_event_updatevalue_cancel(cobble_value_slot* slot) {
+    free(slot->data);
+    slot->data = NULL;
+}
+
+#endif
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+// Values are sent in place, as offsets into the pool's memory
+static void batch_add(valueBatch* batch, const valueupdate* v) {
+    cobble_value_record* r = &batch->records[batch->count];
+    r->connection = v->connection;
+    r->characteristic = v->characteristic;
+    r->offset = (uint32_t)(cobble_pool_block(&valueUpdatePool, v->block) - valueUpdatePool.memory);
+    r->length = (uint32_t)v->length;
+    batch->blocks[batch->count++] = v->block;
+}
+
+static void batch_send(valueBatch* batch) {
+    if (batch->count == 0)
+        return;
+    batch_funcptr cb = batch_cb;
+    if (cb != nullptr)
+        cb(batch->records, batch->count, valueUpdatePool.memory);
+    for (int i = 0; i < batch->count; i++)
+        cobble_pool_release(&valueUpdatePool, batch->blocks[i]);
+    batch->count = 0;
+}
+
+// Each sends an event taken from its queue to the application, gathering values into the batch given
+
+static void send_statuschanged(const queuedEvent* e, valueBatch* batch) {
+    const statuschanged& sc = e->status;
+    (void)batch;
+    if (statuschanged_cb != nullptr) {
+        statuschanged_cb(sc.status, sc.error);
+    }
+}
+
+static void send_scanresult(const queuedEvent* e, valueBatch* batch) {
+    const scandata& r = e->scan;
+    (void)batch;
+    if (scanresult_cb != nullptr) {
+        scanresult_cb(r.name, r.rssi, r.mac);
+    }
+}
+
+// The view is of the pooled block, which goes back to the pool once the callback has returned
+static void send_advertisement(const queuedEvent* e, valueBatch* batch) {
+    const advertisement& a = e->advert;
+    (void)batch;
+    if (advertisement_cb != nullptr) {
+        cobble_ad_view view;
+        cobble_ad_view_init(&view, cobble_pool_block(&advertisementPool, a.block), a.length);
+        advertisement_cb(a.identifier, a.rssi, &view);
+    }
+    cobble_pool_release(&advertisementPool, a.block);
+}
+
+static void send_connectionstatus(const queuedEvent* e, valueBatch* batch) {
+    const connectionstatus& c = e->connectionStatus;
+    (void)batch;
+    if (hooks != nullptr)
+        hooks->connectionstatus(c.connection, c.status);
+    if (connectionstatus_c_cb != nullptr) {
+        connectionstatus_c_cb(c.connection, c.identifier, c.status);
     }
+    if (connectionstatus_cb != nullptr) {
+        connectionstatus_cb(c.identifier, c.status);
+    }
+}
+
+static void send_mtuchanged(const queuedEvent* e, valueBatch* batch) {
+    const mtuchanged& m = e->mtu;
+    (void)batch;
+    if (mtuchanged_cb != nullptr) {
+        mtuchanged_cb(m.connection, m.mtu, m.maxWrite, m.maxWriteWithoutResponse);
+    }
+}
 
-    while (!connectionStatusQueue.empty()) {
-        auto c = connectionStatusQueue.front();
-        connectionStatusQueue.pop();
-        if (connectionstatus_cb != nullptr) {
-            connectionstatus_cb(c.identifier.c_str(), c.status);
+static void send_characteristicdiscovery(const queuedEvent* e, valueBatch* batch) {
+    const characteristicdiscovery& d = e->discovery;
+    (void)batch;
+    if (characteristicdiscovered_c_cb != nullptr) {
+        characteristicdiscovered_c_cb(d.connection, d.service, d.characteristic);
+    }
+    if (characteristicdiscovered_cb != nullptr) {
+        characteristicdiscovered_cb(d.service, d.characteristic);
+    }
+}
+
+static void send_discoverycomplete(const queuedEvent* e, valueBatch* batch) {
+    const discoverycomplete& dc = e->discoveryComplete;
+    (void)batch;
+    if (discoverycomplete_cb != nullptr) {
+        discoverycomplete_cb(dc.connection, dc.services, dc.characteristics, dc.elapsedMs);
+    }
+}
+
+// Responses to a firmware update are handled by the update, which runs here on the thread delivering events
+static void send_valueupdate(const queuedEvent* e, valueBatch* batch) {
+    const valueupdate& v = e->value;
+    if (hooks != nullptr && hooks->updatevalue(v.connection, v.characteristic, cobble_pool_block(&valueUpdatePool, v.block), v.length)) {
+        cobble_pool_release(&valueUpdatePool, v.block);
+        return;
+    }
+    // A characteristic with a callback of its own takes its values from the rest
+    if (cobble_characteristic_route(v.connection, v.characteristic, cobble_pool_block(&valueUpdatePool, v.block), v.length)) {
+        cobble_pool_release(&valueUpdatePool, v.block);
+        return;
+    }
+    if (updatevalue_c_cb != nullptr) {
+        updatevalue_c_cb(v.connection, v.characteristic, cobble_pool_block(&valueUpdatePool, v.block), v.length);
+    }
+    if (updatevalue_h_cb != nullptr) {
+        updatevalue_h_cb(v.characteristic, cobble_pool_block(&valueUpdatePool, v.block), v.length);
+    }
+    if (updatevalue_cb != nullptr) {
+        updatevalue_cb(cobble_characteristic_uuid(v.characteristic), cobble_pool_block(&valueUpdatePool, v.block), v.length);
+    }
+    if (batch_cb != nullptr) {
+        batch_add(batch, &v);
+        if (batch->count == BATCH_LENGTH)
+            batch_send(batch);
+        return;
+    }
+    cobble_pool_release(&valueUpdatePool, v.block);
+}
+
+static void send_writecomplete(const queuedEvent* e, valueBatch* batch) {
+    const writecomplete& w = e->writeComplete;
+    (void)batch;
+    if (hooks != nullptr && hooks->writecomplete(w.connection, w.characteristic, w.written, w.status)) {
+        return;
+    }
+    if (writecomplete_cb != nullptr) {
+        writecomplete_cb(w.connection, w.characteristic, w.written, w.status);
+    }
+}
+
+// The dispatcher's strands (see below) for events which aren't for a connection
+#define STRAND_SCAN COBBLE_MAX_CONNECTIONS
+#define STRAND_STATUS (COBBLE_MAX_CONNECTIONS + 1)
+#define STRANDS (COBBLE_MAX_CONNECTIONS + 2)
+#define STRAND_CONNECTION (-1)
+
+// The queues are storage for one stream of events: each delivery takes whichever event at the head of a queue was
+// numbered first. Keeping a queue per type lets each have an entry sized to it, so value updates stay small.
+// Bulk data is in its own lane, which QueueOrder_ControlFirst puts behind everything else waiting.
+struct eventQueue {
+    cobble_ring* ring;
+    bool bulk;
+    int strand;
+    void (*send)(const queuedEvent* e, valueBatch* batch);
+};
+
+static const eventQueue eventQueues[] = {
+    { &statusChangedQueue, false, STRAND_STATUS, send_statuschanged },
+    { &connectionStatusQueue, false, STRAND_CONNECTION, send_connectionstatus },
+    { &mtuChangedQueue, false, STRAND_CONNECTION, send_mtuchanged },
+    { &characteristicDiscoveryQueue, false, STRAND_CONNECTION, send_characteristicdiscovery },
+    { &discoveryCompleteQueue, false, STRAND_CONNECTION, send_discoverycomplete },
+    { &writeCompleteQueue, false, STRAND_CONNECTION, send_writecomplete },
+    { &scanQueue, true, STRAND_SCAN, send_scanresult },
+    { &advertisementQueue, true, STRAND_SCAN, send_advertisement },
+    { &valueUpdateQueue, true, STRAND_CONNECTION, send_valueupdate },
+};
+
+#define EVENT_QUEUES (sizeof(eventQueues) / sizeof(eventQueues[0]))
+
+// Added to the sequence numbers of bulk data to put it behind control events. Sequence numbers never get this far.
+#define BULK_LANE (1ull << 63)
+#define NO_EVENT UINT64_MAX
+
+// The sequence number of the event at the head of a queue, moved into its lane
+static uint64_t queue_key(const eventQueue* q, uint64_t bulkLane) {
+    uint64_t key;
+    // Once cobble_events_drain() has been called, values are only taken by it
+    if (q->ring == &valueUpdateQueue && valuesDrained)
+        return NO_EVENT;
+    if (!cobble_ring_peek_key(q->ring, &key))
+        return NO_EVENT;
+    return q->bulk ? key + bulkLane : key;
+}
+
+static size_t oldest_queue(const uint64_t* keys) {
+    size_t oldest = EVENT_QUEUES;
+    for (size_t i = 0; i < EVENT_QUEUES; i++) {
+        if (keys[i] != NO_EVENT && (oldest == EVENT_QUEUES || keys[i] < keys[oldest]))
+            oldest = i;
+    }
+    return oldest;
+}
+
+// Takes the oldest event from a queue and sends it, returning false if another thread took it first (which a producer
+// discarding the oldest entry can do)
+static bool deliver(const eventQueue* q, valueBatch* batch) {
+    queuedEvent e;
+    if (!cobble_ring_pop(q->ring, &e))
+        return false;
+    deliveringSequence = e.header.sequence;
+    q->send(&e, batch);
+    return true;
+}
+
+static bool dispatch(const eventQueue* q);
+
+// The head of each queue is remembered, and only the queue an event was taken from is looked at again. That's enough
+// for events numbered before the queues were all last looked at (the horizon): anything queued before one of those was
+// queued before the look, so it was seen. A later event could have been overtaken by one queued since to a queue which
+// was empty, so reaching one means looking at every queue again.
+// The dispatcher's feeder takes events in the same order, handing them to strands rather than sending them.
+static int events_process(int maxEvents, int maxTimeUs, bool toStrands) {
+
+    events_clear();
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(max(0, maxTimeUs));
+    uint64_t bulkLane = (cobble_atomic_load_u32(&queueOrder) == QueueOrder_ControlFirst) ? BULK_LANE : 0;
+    uint64_t keys[EVENT_QUEUES];
+    uint64_t horizon = 0;
+    int delivered = 0;
+    bool more = false;
+
+    for (size_t i = 0; i < EVENT_QUEUES; i++)
+        keys[i] = NO_EVENT;
+
+    for (;;) {
+        size_t next = oldest_queue(keys);
+        if (next == EVENT_QUEUES || (keys[next] & ~BULK_LANE) >= horizon) {
+            horizon = cobble_atomic_load_u64(&eventSequence);
+            for (size_t i = 0; i < EVENT_QUEUES; i++)
+                keys[i] = queue_key(&eventQueues[i], bulkLane);
+            next = oldest_queue(keys);
+            if (next == EVENT_QUEUES)
+                break;
+            if ((keys[next] & ~BULK_LANE) >= horizon)
+                continue;
+        }
+
+        if ((maxEvents > 0 && delivered >= maxEvents) || (maxTimeUs > 0 && chrono::steady_clock::now() >= deadline)) {
+            more = true;
+            break;
+        }
+
+        const eventQueue* q = &eventQueues[next];
+        if (toStrands) {
+            if (dispatch(q))
+                delivered++;
+        } else {
+            // Values gathered for register_batch_cb() go before anything which came after them
+            if (q->ring != &valueUpdateQueue)
+                batch_send(&processBatch);
+            if (deliver(q, &processBatch))
+                delivered++;
         }
+        keys[next] = queue_key(q, bulkLane);
+    }
+    batch_send(&processBatch);
+    deliveringSequence = 0;
+
+    // What was left has to wake a waiting application again
+    if (more && cobble_atomic_exchange_u32(&eventsSignalled, 1) == 0)
+        events_wake();
+
+    return delivered;
+}
+
+/*
+ * Dispatcher threads
+ */
+
+// Started by cobble_dispatch_start(). A feeder thread takes events from the queues in order, and gives each to a strand:
+// one per connection slot, one for scan results and advertisements, and one for status changes. A strand's events are
+// sent one at a time, in order, by whichever worker has the strand, so the events for a connection (and the values of
+// each of its characteristics) are never reordered or sent at once, while different connections are sent in parallel.
+// A strand with events is in one worker's deque until that worker takes it; a worker with nothing to do takes a strand
+// from the back of another's.
+
+#define DISPATCH_MAX_THREADS 64
+
+// Events given to strands but not yet sent. While they are all in use the feeder waits, leaving events in the queues,
+// where the queue policy applies as usual.
+#define DISPATCH_TASKS 1024
+
+// The events a worker sends from a strand before letting the other strands have a turn
+#define DISPATCH_TURN 64
+
+struct dispatchTask {
+    dispatchTask* next;
+    const eventQueue* queue;
+    queuedEvent event;
+};
+
+struct dispatchStrand {
+    mutex lock;
+    dispatchTask* head;
+    dispatchTask* tail;
+    // While in a worker's deque, or being sent
+    bool scheduled;
+};
+
+struct dispatchWorker {
+    mutex lock;
+    dispatchStrand* deque[STRANDS];
+    size_t first;
+    size_t count;
+    int cpu;
+    thread worker;
+    valueBatch batch;
+};
+
+// Held by cobble_dispatch_start() and cobble_dispatch_stop()
+static mutex dispatchControl;
+static thread feeder;
+static volatile uint32_t dispatching = 0;
+static dispatchWorker* workers = nullptr;
+static int workerCount = 0;
+static bool workersRunning = false;
+static dispatchStrand strands[STRANDS];
+
+// Set on the dispatcher's own threads, which can't stop the dispatcher
+static thread_local bool dispatchThread = false;
+
+static dispatchTask* tasks = nullptr;
+static dispatchTask* freeTasks = nullptr;
+static mutex taskLock;
+static condition_variable taskFreed;
+
+// A strand given to a worker only wakes a worker if one is asleep, which the counts (both sequentially consistent) tell
+// without taking the lock
+static mutex sleepLock;
+static condition_variable wakeWorkers;
+static atomic<int> readyStrands(0);
+static atomic<int> sleepingWorkers(0);
+
+static dispatchTask* task_take(void) {
+    unique_lock<mutex> l(taskLock);
+    while (freeTasks == nullptr)
+        taskFreed.wait(l);
+    dispatchTask* t = freeTasks;
+    freeTasks = t->next;
+    return t;
+}
+
+static void task_release(dispatchTask* first, dispatchTask* last) {
+    {
+        lock_guard<mutex> l(taskLock);
+        last->next = freeTasks;
+        freeTasks = first;
+    }
+    taskFreed.notify_one();
+}
+
+static void worker_give(dispatchWorker* w, dispatchStrand* s) {
+    {
+        lock_guard<mutex> l(w->lock);
+        w->deque[(w->first + w->count++) % STRANDS] = s;
     }
+    readyStrands++;
+    if (sleepingWorkers > 0) {
+        lock_guard<mutex> l(sleepLock);
+        wakeWorkers.notify_one();
+    }
+}
 
-    while (!characteristicDiscoveryQueue.empty()) {
-        auto d = characteristicDiscoveryQueue.front();
-        characteristicDiscoveryQueue.pop();
-        if (characteristicdiscovered_cb != nullptr) {
-            characteristicdiscovered_cb(d.service.c_str(), d.characteristic.c_str());
+// The worker's own strands are taken from the front, in the order they were given, and others' from the back
+static dispatchStrand* worker_take(dispatchWorker* w) {
+    dispatchStrand* s = nullptr;
+    {
+        lock_guard<mutex> l(w->lock);
+        if (w->count > 0) {
+            s = w->deque[w->first];
+            w->first = (w->first + 1) % STRANDS;
+            w->count--;
         }
     }
+    for (int i = 1; s == nullptr && i < workerCount; i++) {
+        dispatchWorker* victim = &workers[(w - workers + i) % workerCount];
+        lock_guard<mutex> l(victim->lock);
+        if (victim->count > 0)
+            s = victim->deque[(victim->first + --victim->count) % STRANDS];
+    }
+    if (s != nullptr)
+        readyStrands--;
+    return s;
+}
+
+// Sends a turn's worth of the strand's events, then gives the strand back to this worker if it has more. Values gathered
+// for register_batch_cb() are sent before the strand can move to another worker.
+static void strand_send(dispatchWorker* w, dispatchStrand* s) {
+
+    dispatchTask* first;
+    dispatchTask* last;
+    {
+        lock_guard<mutex> l(s->lock);
+        first = last = s->head;
+        for (int n = 1; n < DISPATCH_TURN && last->next != nullptr; n++)
+            last = last->next;
+        s->head = last->next;
+        if (s->head == nullptr)
+            s->tail = nullptr;
+    }
 
-    while (!valueUpdateQueue.empty()) {
-        auto v = valueUpdateQueue.front();
-        valueUpdateQueue.pop();
-        if (updatevalue_cb != nullptr) {
-            updatevalue_cb(v.characteristic.c_str(), v.data, v.length);
+    for (dispatchTask* t = first;; t = t->next) {
+        if (t->queue->ring != &valueUpdateQueue)
+            batch_send(&w->batch);
+        deliveringSequence = t->event.header.sequence;
+        t->queue->send(&t->event, &w->batch);
+        if (t == last)
+            break;
+    }
+    batch_send(&w->batch);
+    deliveringSequence = 0;
+    task_release(first, last);
+
+    bool more;
+    {
+        lock_guard<mutex> l(s->lock);
+        more = (s->head != nullptr);
+        s->scheduled = more;
+    }
+    if (more)
+        worker_give(w, s);
+}
+
+// Pinned threads are asked for where the platform allows it
+static void pin_thread(int cpu) {
+
+    if (cpu < 0)
+        return;
+
+#if defined(_WIN32) || defined(_WIN64)
+    if (cpu < (int)(sizeof(DWORD_PTR) * 8) && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0)
+        return;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == 0)
+            return;
+    }
+#endif
+
+    printf("Could not pin a dispatcher thread to CPU %i\n", cpu);
+}
+
+static void worker_run(dispatchWorker* w) {
+
+    dispatchThread = true;
+    pin_thread(w->cpu);
+
+    for (;;) {
+        dispatchStrand* s = worker_take(w);
+        if (s != nullptr) {
+            strand_send(w, s);
+            continue;
         }
+
+        unique_lock<mutex> l(sleepLock);
+        sleepingWorkers++;
+        while (readyStrands == 0 && workersRunning)
+            wakeWorkers.wait(l);
+        sleepingWorkers--;
+        if (readyStrands == 0 && !workersRunning)
+            return;
     }
+}
+
+// Waits for a task when they are all in use, which the workers will free
+static bool dispatch(const eventQueue* q) {
+
+    dispatchTask* t = task_take();
+    if (!cobble_ring_pop(q->ring, &t->event)) {
+        task_release(t, t);
+        return false;
+    }
+    t->queue = q;
+    t->next = nullptr;
+
+    size_t index = (q->strand == STRAND_CONNECTION) ? cobble_connection_index(t->event.header.connection) : (size_t)q->strand;
+    dispatchStrand* s = &strands[index];
+    bool give;
+    {
+        lock_guard<mutex> l(s->lock);
+        if (s->tail != nullptr)
+            s->tail->next = t;
+        else
+            s->head = t;
+        s->tail = t;
+        give = !s->scheduled;
+        s->scheduled = true;
+    }
+    if (give)
+        worker_give(&workers[index % workerCount], s);
+    return true;
+}
+
+static void feeder_run(void) {
+    dispatchThread = true;
+    while (cobble_atomic_load_u32(&dispatching)) {
+        cobble_queue_wait(-1);
+        events_process(0, 0, true);
+    }
+}
+
+
+#endif
+
+EXPORTED void cobble_queue_process(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (cobble_atomic_load_u32(&dispatching))
+        return;
+
+    events_process(0, 0, false);
+
+#endif
+
+}
+
+EXPORTED int cobble_queue_process_bounded(int maxEvents, int maxTimeUs) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (cobble_atomic_load_u32(&dispatching))
+        return 0;
+
+    return events_process(maxEvents, maxTimeUs, false);
+
+#else
+
+    (void)maxEvents;
+    (void)maxTimeUs;
+    return 0;
 
 #endif
 
-}
\ No newline at end of file
+}
+
+EXPORTED bool cobble_dispatch_start(int threads, const int* cpus) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    lock_guard<mutex> l(dispatchControl);
+
+    if (workers != nullptr || valuesDrained)
+        return false;
+
+    if (threads <= 0)
+        threads = (int)thread::hardware_concurrency();
+    threads = max(1, min(DISPATCH_MAX_THREADS, threads));
+
+    tasks = new dispatchTask[DISPATCH_TASKS];
+    for (int i = 0; i < DISPATCH_TASKS; i++)
+        tasks[i].next = (i + 1 < DISPATCH_TASKS) ? &tasks[i + 1] : nullptr;
+    freeTasks = tasks;
+
+    for (size_t i = 0; i < STRANDS; i++) {
+        strands[i].head = strands[i].tail = nullptr;
+        strands[i].scheduled = false;
+    }
+
+    workers = new dispatchWorker[threads];
+    workerCount = threads;
+    workersRunning = true;
+    for (int i = 0; i < threads; i++) {
+        workers[i].first = workers[i].count = 0;
+        workers[i].cpu = (cpus != nullptr) ? cpus[i] : -1;
+        workers[i].batch.count = 0;
+    }
+    for (int i = 0; i < threads; i++)
+        workers[i].worker = thread(worker_run, &workers[i]);
+
+    cobble_atomic_store_u32(&dispatching, 1);
+    feeder = thread(feeder_run);
+    return true;
+
+#else
+
+    (void)threads;
+    (void)cpus;
+    return false;
+
+#endif
+
+}
+
+EXPORTED void cobble_dispatch_stop(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (dispatchThread) {
+        printf("cobble_dispatch_stop() can't be called from a callback sent by the dispatcher\n");
+        return;
+    }
+
+    lock_guard<mutex> l(dispatchControl);
+
+    if (workers == nullptr)
+        return;
+
+    // The feeder stops taking events, then the workers send what they were given before they finish. It is woken whatever
+    // the flag says, so that stopping never depends on the flag and the wake agreeing; the flag is set so that the next
+    // cobble_queue_process() takes the wake again.
+    cobble_atomic_store_u32(&dispatching, 0);
+    cobble_atomic_store_u32(&eventsSignalled, 1);
+    events_wake();
+    feeder.join();
+    {
+        lock_guard<mutex> s(sleepLock);
+        workersRunning = false;
+    }
+    wakeWorkers.notify_all();
+    for (int i = 0; i < workerCount; i++)
+        workers[i].worker.join();
+
+    delete[] workers;
+    workers = nullptr;
+    workerCount = 0;
+    delete[] tasks;
+    tasks = freeTasks = nullptr;
+
+    // Anything queued since is left for cobble_queue_process()
+    if (events_pending())
+        cobble_queue_wake();
+
+#endif
+
+}
+
+EXPORTED void cobble_queue_order_set(CobbleQueueOrder order) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    cobble_atomic_store_u32(&queueOrder, (uint32_t)order);
+
+#else
+
+    (void)order;
+
+#endif
+
+}
+
+EXPORTED uint64_t cobble_event_sequence(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    return deliveringSequence;
+
+#else
+
+    return 0;
+
+#endif
+
+}
+
+EXPORTED bool cobble_queue_wait(int timeoutMs) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (events_pending())
+        return true;
+
+#if defined(_WIN32) || defined(_WIN64)
+    WaitForSingleObject(eventsReady, timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
+#else
+    struct pollfd p;
+    p.fd = eventsReadFd;
+    p.events = POLLIN;
+    p.revents = 0;
+    poll(&p, 1, timeoutMs < 0 ? -1 : timeoutMs);
+#endif
+
+    return events_pending();
+
+#else
+
+    return false;
+
+#endif
+
+}
+
+EXPORTED void cobble_queue_wake(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (cobble_atomic_exchange_u32(&eventsSignalled, 1) == 0)
+        events_wake();
+
+#endif
+
+}
+
+EXPORTED int cobble_event_fd(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED) && !defined(_WIN32) && !defined(_WIN64)
+
+    return eventsReadFd;
+
+#else
+
+    return -1;
+
+#endif
+
+}
+
+EXPORTED int cobble_events_drain(cobble_value_record* records, int maxRecords, uint8_t* payload, int payloadCapacity) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    if (cobble_atomic_load_u32(&dispatching))
+        return 0;
+
+    valuesDrained = true;
+    events_clear();
+
+    int count = 0;
+    int used = 0;
+    valueupdate v;
+    while (count < maxRecords) {
+        if (drainHasHeld) {
+            v = drainHeld;
+            drainHasHeld = false;
+        } else if (!cobble_ring_pop(&valueUpdateQueue, &v)) {
+            break;
+        }
+
+        if (used + v.length > payloadCapacity) {
+            if (count > 0) {
+                drainHeld = v;
+                drainHasHeld = true;
+                break;
+            }
+            cobble_atomic_fetch_add_u64(&valueUpdatesDropped, 1);
+            cobble_pool_release(&valueUpdatePool, v.block);
+            continue;
+        }
+
+        const uint8_t* data = cobble_pool_block(&valueUpdatePool, v.block);
+        bool taken = (hooks != nullptr && hooks->updatevalue(v.connection, v.characteristic, data, v.length))
+            || cobble_characteristic_route(v.connection, v.characteristic, data, v.length);
+        if (!taken) {
+            memcpy(payload + used, data, v.length);
+            records[count].connection = v.connection;
+            records[count].characteristic = v.characteristic;
+            records[count].offset = (uint32_t)used;
+            records[count].length = (uint32_t)v.length;
+            used += v.length;
+            count++;
+        }
+        cobble_pool_release(&valueUpdatePool, v.block);
+    }
+
+    // What was left, whether values which didn't fit or other events, has to wake a waiting application again
+    if (events_pending() && cobble_atomic_exchange_u32(&eventsSignalled, 1) == 0)
+        events_wake();
+
+    return count;
+
+#else
+
+    (void)records;
+    (void)maxRecords;
+    (void)payload;
+    (void)payloadCapacity;
+    return 0;
+
+#endif
+
+}
+
+EXPORTED void cobble_queue_policy_set(CobbleQueuePolicy policy) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    CobbleRingPolicy p = (policy == QueuePolicy_DropOldest) ? RingPolicy_DropOldest : RingPolicy_DropNewest;
+    cobble_ring_set_policy(&scanQueue, p);
+    cobble_ring_set_policy(&advertisementQueue, p);
+    cobble_ring_set_policy(&connectionStatusQueue, p);
+    cobble_ring_set_policy(&characteristicDiscoveryQueue, p);
+    cobble_ring_set_policy(&valueUpdateQueue, p);
+    cobble_ring_set_policy(&writeCompleteQueue, p);
+    cobble_ring_set_policy(&mtuChangedQueue, p);
+    cobble_ring_set_policy(&discoveryCompleteQueue, p);
+    cobble_ring_set_policy(&statusChangedQueue, p);
+
+#endif
+
+}
+
+EXPORTED uint64_t cobble_queue_dropped_get(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    return cobble_ring_dropped(&scanQueue) + cobble_ring_dropped(&advertisementQueue) + cobble_ring_dropped(&connectionStatusQueue)
+        + cobble_ring_dropped(&characteristicDiscoveryQueue) + cobble_ring_dropped(&valueUpdateQueue)
+        + cobble_ring_dropped(&writeCompleteQueue) + cobble_ring_dropped(&mtuChangedQueue)
+        + cobble_ring_dropped(&discoveryCompleteQueue) + cobble_ring_dropped(&statusChangedQueue)
+        + cobble_atomic_load_u64(&valueUpdatesDropped) + cobble_atomic_load_u64(&advertisementsDropped);
+
+#else
+
+    return 0;
+
+#endif
+
+}
+
+EXPORTED uint64_t cobble_queue_truncated_get(void) {
+
+#if defined(COBBLE_CALLBACK_DEFERRED)
+
+    return cobble_atomic_load_u64(&valueUpdatesTruncated);
+
+#else
+
+    return 0;
+
+#endif
+
+}
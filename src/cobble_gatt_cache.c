@@ -0,0 +1,191 @@
+#include "cobble_gatt_cache.h"
+#include "cobble_connections.h"
+#include "cobble_crc32.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#endif
+
+#define MAX_PATH_LENGTH 1024
+
+// Each table is a header, its entries, then the CRC-32 of everything before it, all little-endian:
+//   "CGAT", version, flags (bit 0: hash present), service count (2 bytes), entry count (2 bytes), hash (16 bytes)
+//   then per entry: service UUID (16 bytes), characteristic UUID (16 bytes), properties (1 byte)
+#define MAGIC "CGAT"
+#define VERSION 1
+#define FLAG_HASH 0x01
+#define HEADER_LENGTH (4 + 1 + 1 + 2 + 2 + COBBLE_GATT_HASH_LENGTH)
+#define ENTRY_LENGTH (16 + 16 + 1)
+#define MAX_FILE_LENGTH (HEADER_LENGTH + COBBLE_GATT_CACHE_MAX_CHARACTERISTICS * ENTRY_LENGTH + 4)
+
+// Empty when the cache is not enabled. Set by the application before it connects, and only read after that.
+static char cacheDirectory[MAX_PATH_LENGTH] = "";
+
+static bool table_path(uint64_t address, char* path, size_t size) {
+
+    if (cacheDirectory[0] == '\0')
+        return false;
+
+    int written = snprintf(path, size, "%s/%012llX.gatt", cacheDirectory, (unsigned long long)address);
+    return written > 0 && (size_t)written < size;
+}
+
+static void put_u16(uint8_t* p, int value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static int get_u16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+EXPORTED bool cobble_gatt_cache_enable(const char* directory) {
+
+    if (directory == NULL) {
+        cacheDirectory[0] = '\0';
+        return true;
+    }
+
+    struct stat st;
+    if (stat(directory, &st) != 0 || (st.st_mode & S_IFMT) != S_IFDIR) {
+        printf("GATT cache directory %s does not exist\n", directory);
+        return false;
+    }
+    if (strlen(directory) + 32 >= sizeof(cacheDirectory)) {
+        printf("GATT cache directory %s is too long a path\n", directory);
+        return false;
+    }
+
+    snprintf(cacheDirectory, sizeof(cacheDirectory), "%s", directory);
+    return true;
+}
+
+EXPORTED void cobble_gatt_cache_forget(const char* identifier) {
+
+    uint64_t address;
+
+    if (!cobble_address_parse(identifier, &address)) {
+        printf("Identifier %s does not look like a MAC address\n", identifier);
+        return;
+    }
+    cobble_gatt_cache_invalidate(address);
+}
+
+bool cobble_gatt_cache_enabled(void) {
+    return cacheDirectory[0] != '\0';
+}
+
+bool cobble_gatt_cache_load(uint64_t address, cobble_gatt_table* table) {
+
+    // On the stack, as a load can run while another device's table is stored from one of the platform's threads
+    uint8_t buffer[MAX_FILE_LENGTH + 1];
+    char path[MAX_PATH_LENGTH];
+
+    if (!table_path(address, path, sizeof(path)))
+        return false;
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+    size_t length = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+
+    // Anything which doesn't add up is treated as no table at all, and replaced once the device has been discovered
+    if (length < HEADER_LENGTH + 4 || length > MAX_FILE_LENGTH || memcmp(buffer, MAGIC, 4) != 0 || buffer[4] != VERSION
+            || get_u32(buffer + length - 4) != cobble_crc32(0, buffer, length - 4)) {
+        printf("GATT cache file %s is damaged or from another version, ignoring it\n", path);
+        return false;
+    }
+
+    int count = get_u16(buffer + 8);
+    if (count > COBBLE_GATT_CACHE_MAX_CHARACTERISTICS || length != (size_t)(HEADER_LENGTH + count * ENTRY_LENGTH + 4)) {
+        printf("GATT cache file %s is damaged, ignoring it\n", path);
+        return false;
+    }
+
+    table->hasHash = (buffer[5] & FLAG_HASH) != 0;
+    table->serviceCount = get_u16(buffer + 6);
+    table->count = count;
+    memcpy(table->hash, buffer + 10, COBBLE_GATT_HASH_LENGTH);
+
+    const uint8_t* p = buffer + HEADER_LENGTH;
+    for (int i = 0; i < count; i++, p += ENTRY_LENGTH) {
+        memcpy(table->entries[i].service.bytes, p, 16);
+        memcpy(table->entries[i].characteristic.bytes, p + 16, 16);
+        table->entries[i].properties = p[32];
+    }
+
+    return true;
+}
+
+bool cobble_gatt_cache_store(uint64_t address, const cobble_gatt_table* table) {
+
+    uint8_t buffer[MAX_FILE_LENGTH];
+    char path[MAX_PATH_LENGTH];
+    char temporary[MAX_PATH_LENGTH + 4];
+
+    if (!table_path(address, path, sizeof(path)))
+        return false;
+    if (table->count < 0 || table->count > COBBLE_GATT_CACHE_MAX_CHARACTERISTICS)
+        return false;
+
+    memcpy(buffer, MAGIC, 4);
+    buffer[4] = VERSION;
+    buffer[5] = table->hasHash ? FLAG_HASH : 0;
+    put_u16(buffer + 6, table->serviceCount);
+    put_u16(buffer + 8, table->count);
+    memcpy(buffer + 10, table->hash, COBBLE_GATT_HASH_LENGTH);
+
+    uint8_t* p = buffer + HEADER_LENGTH;
+    for (int i = 0; i < table->count; i++, p += ENTRY_LENGTH) {
+        memcpy(p, table->entries[i].service.bytes, 16);
+        memcpy(p + 16, table->entries[i].characteristic.bytes, 16);
+        p[32] = table->entries[i].properties;
+    }
+    size_t length = (size_t)(p - buffer);
+    put_u32(p, cobble_crc32(0, buffer, length));
+    length += 4;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE* f = fopen(temporary, "wb");
+    if (f == NULL) {
+        printf("Could not write GATT cache file %s\n", temporary);
+        return false;
+    }
+    bool ok = fwrite(buffer, 1, length, f) == length;
+    ok = (fclose(f) == 0) && ok;
+
+#if defined(_WIN32) || defined(_WIN64)
+    // rename() won't replace an existing file on Windows, but MoveFileEx() does so in one step
+    if (!ok || !MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (!ok || rename(temporary, path) != 0) {
+#endif
+        printf("Could not write GATT cache file %s\n", path);
+        remove(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+void cobble_gatt_cache_invalidate(uint64_t address) {
+
+    char path[MAX_PATH_LENGTH];
+
+    if (table_path(address, path, sizeof(path)))
+        remove(path);
+}
@@ -0,0 +1,77 @@
+// Persistent cache of each device's GATT database, so that a reconnect can report the device's characteristics straight
+// away rather than waiting for them to be discovered again
+//
+// Each device's table is kept in a file of its own in the directory given to cobble_gatt_cache_enable(), named after
+// its address. A backend which finds a table on connecting replays it as characteristicdiscovered events, followed by
+// discoverycomplete, then checks it against the device: if the device has a Database Hash characteristic (Bluetooth
+// 5.1) the hash stored with the table must match it, and a Service Changed indication drops the table whenever it comes.
+// A table found to be out of date is removed and the device is discovered again, so its characteristics are reported
+// a second time, with another discoverycomplete.
+//
+// Used by Windows and the simulator. Windows hands out characteristics as objects of its own, so the table is reported on
+// connecting and each characteristic is only looked up, in the system's cache, when it is first used. One which isn't
+// found there drops the table. Windows doesn't give the Database Hash to applications, but keeps its cache up to date
+// from it, and enabling the cache also lets discovery use the system's cache.
+// Android, CoreBluetooth and BlueZ keep caches of their own, and only hand out characteristics through them, so don't
+// use it.
+#ifndef COBBLE_GATT_CACHE_H
+#define COBBLE_GATT_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+#include "cobble_uuid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Characteristic properties, as the Bluetooth Core specification (Vol 3, Part G, 3.3.1.1) numbers them
+#define COBBLE_GATT_PROPERTY_READ 0x02
+#define COBBLE_GATT_PROPERTY_WRITE_WITHOUT_RESPONSE 0x04
+#define COBBLE_GATT_PROPERTY_WRITE 0x08
+#define COBBLE_GATT_PROPERTY_NOTIFY 0x10
+#define COBBLE_GATT_PROPERTY_INDICATE 0x20
+
+#define COBBLE_GATT_CACHE_MAX_CHARACTERISTICS 256
+#define COBBLE_GATT_HASH_LENGTH 16
+
+typedef struct {
+    cobble_uuid service;
+    cobble_uuid characteristic;
+    uint8_t properties;
+} cobble_gatt_entry;
+
+typedef struct {
+    bool hasHash; // Whether the device has a Database Hash, and so whether hash holds anything
+    uint8_t hash[COBBLE_GATT_HASH_LENGTH];
+    int serviceCount;
+    int count;
+    cobble_gatt_entry entries[COBBLE_GATT_CACHE_MAX_CHARACTERISTICS];
+} cobble_gatt_table;
+
+// Keep tables in the given directory, which must already exist, or stop using the cache if it is NULL (the default).
+// Tables already in the directory are used. Returns false if the directory can't be used.
+EXPORTED bool cobble_gatt_cache_enable(const char* directory);
+
+// Remove the table kept for a device, given its identifier as reported in scan results
+EXPORTED void cobble_gatt_cache_forget(const char* identifier);
+
+// For the backends. These do nothing, and return false, if the cache is not enabled.
+bool cobble_gatt_cache_enabled(void);
+
+// Returns false if there is no table for the address, or it could not be read back intact
+bool cobble_gatt_cache_load(uint64_t address, cobble_gatt_table* table);
+
+// Replaces the table for the address. The file is written in full before it takes the place of the old one in a single
+// step, so a table is never left half written or missing.
+bool cobble_gatt_cache_store(uint64_t address, const cobble_gatt_table* table);
+
+void cobble_gatt_cache_invalidate(uint64_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cobble_pool.h"
+
+#define HEAD(tag, ref) (((uint64_t)(tag) << 32) | (uint64_t)(ref))
+#define REF(cls, unit) (((uint32_t)(cls) << 28) | (uint32_t)(unit))
+#define REF_UNIT(ref) ((ref) & 0x0FFFFFFFu)
+#define REF_CLASS(ref) ((ref) >> 28)
+
+bool cobble_pool_init(cobble_pool* p, size_t budget) {
+
+    memset(p, 0, sizeof(*p));
+
+    p->units = (uint32_t)((budget + COBBLE_POOL_UNIT - 1) / COBBLE_POOL_UNIT);
+
+    // The reserves are whole blocks, taken from the end of the budget
+    uint32_t reserved = 0;
+    uint32_t reserves[COBBLE_POOL_CLASSES];
+    for (int c = 0; c < COBBLE_POOL_CLASSES; c++) {
+        uint32_t blockUnits = 1u << c;
+        reserves[c] = (p->units / COBBLE_POOL_RESERVE_SHARE) & ~(blockUnits - 1);
+        if (reserves[c] < blockUnits)
+            reserves[c] = blockUnits;
+        reserved += reserves[c];
+    }
+    if (reserved > p->units)
+        p->units = reserved;
+    p->shared = p->units - reserved;
+
+    uint32_t start = p->shared;
+    for (int c = 0; c < COBBLE_POOL_CLASSES; c++) {
+        p->reserveCarved[c] = start;
+        start += reserves[c];
+        p->reserveEnd[c] = start;
+    }
+
+    p->memory = (uint8_t*)malloc((size_t)p->units * COBBLE_POOL_UNIT);
+    p->next = (volatile uint32_t*)calloc(p->units, sizeof(uint32_t));
+
+    if (p->memory == NULL || p->next == NULL) {
+        cobble_pool_free(p);
+        return false;
+    }
+
+    for (int c = 0; c < COBBLE_POOL_CLASSES; c++)
+        cobble_atomic_store_u64(&p->free[c].head, HEAD(0, COBBLE_POOL_NONE));
+
+    return true;
+}
+
+void cobble_pool_free(cobble_pool* p) {
+    free(p->memory);
+    free((void*)p->next);
+    p->memory = NULL;
+    p->next = NULL;
+}
+
+static uint32_t pop_free(cobble_pool* p, int cls) {
+
+    volatile uint64_t* headp = &p->free[cls].head;
+    uint64_t head = cobble_atomic_load_u64(headp);
+
+    for (;;) {
+        uint32_t ref = (uint32_t)head;
+        if (ref == COBBLE_POOL_NONE)
+            return COBBLE_POOL_NONE;
+
+        // If another thread takes this block first, the tag changes and the exchange fails, so a stale next value is harmless
+        uint32_t next = cobble_atomic_load_u32(&p->next[REF_UNIT(ref)]);
+        if (cobble_atomic_cas_u64(headp, &head, HEAD((head >> 32) + 1, next)))
+            return ref;
+    }
+}
+
+// Take a new block of the given class from the part of an area (up to end) not yet handed out
+static uint32_t carve_from(volatile uint32_t* carvedp, uint32_t end, int cls) {
+
+    uint32_t units = 1u << cls;
+    uint32_t carved = cobble_atomic_load_u32(carvedp);
+
+    for (;;) {
+        if (carved + units > end)
+            return COBBLE_POOL_NONE;
+        if (cobble_atomic_cas_u32(carvedp, &carved, carved + units))
+            return REF(cls, carved);
+    }
+}
+
+// The shared part of the budget is used first, so that the reserves are left for when it runs out
+static uint32_t carve(cobble_pool* p, int cls) {
+
+    uint32_t ref = carve_from(&p->carved, p->shared, cls);
+    if (ref == COBBLE_POOL_NONE)
+        ref = carve_from(&p->reserveCarved[cls], p->reserveEnd[cls], cls);
+    return ref;
+}
+
+uint32_t cobble_pool_alloc(cobble_pool* p, size_t size) {
+
+    if (size > COBBLE_POOL_MAX_BLOCK)
+        return COBBLE_POOL_NONE;
+
+    int cls = 0;
+    while (((size_t)COBBLE_POOL_UNIT << cls) < size)
+        cls++;
+
+    uint32_t ref = pop_free(p, cls);
+
+    if (ref == COBBLE_POOL_NONE)
+        ref = carve(p, cls);
+
+    for (int larger = cls + 1; ref == COBBLE_POOL_NONE && larger < COBBLE_POOL_CLASSES; larger++)
+        ref = pop_free(p, larger);
+
+    if (ref != COBBLE_POOL_NONE)
+        cobble_atomic_fetch_add_u64(&p->in_use, cobble_pool_block_size(ref));
+
+    return ref;
+}
+
+void cobble_pool_release(cobble_pool* p, uint32_t ref) {
+
+    volatile uint64_t* headp = &p->free[REF_CLASS(ref)].head;
+    uint64_t head = cobble_atomic_load_u64(headp);
+
+    cobble_atomic_fetch_add_u64(&p->in_use, (uint64_t)0 - cobble_pool_block_size(ref));
+
+    for (;;) {
+        cobble_atomic_store_u32(&p->next[REF_UNIT(ref)], (uint32_t)head);
+        if (cobble_atomic_cas_u64(headp, &head, HEAD((head >> 32) + 1, ref)))
+            return;
+    }
+}
+
+uint64_t cobble_pool_in_use(cobble_pool* p) {
+    return cobble_atomic_load_u64(&p->in_use);
+}
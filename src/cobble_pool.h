@@ -0,0 +1,82 @@
+// Preallocated pool of variable-length payload blocks with a fixed total memory budget
+// Producers take a block sized for their payload, fill it in place and pass a reference to it through an event queue.
+// The consumer hands the block straight to the application and then returns it to the pool, so payloads are never
+// copied between threads and nothing is allocated once the pool has been created.
+//
+// Blocks come in power-of-two size classes from 32 to 512 bytes. They are carved from the budget on demand and recycled
+// through a lock-free free list per class (tagged to avoid the ABA problem). Once the budget has been carved up, a
+// request which finds its own class empty borrows a larger free block rather than failing.
+//
+// Blocks are never split or merged, so a burst of small values could otherwise carve the whole budget into small blocks
+// and leave nothing for large ones. Each class therefore has a share of the budget set aside which only it can carve,
+// so every size can still be queued once the blocks holding earlier values are released.
+#ifndef COBBLE_POOL_H
+#define COBBLE_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble_atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COBBLE_POOL_NONE 0xFFFFFFFFu
+
+#define COBBLE_POOL_UNIT 32
+#define COBBLE_POOL_CLASSES 5
+#define COBBLE_POOL_MAX_BLOCK (COBBLE_POOL_UNIT << (COBBLE_POOL_CLASSES - 1))
+
+// Each class has 1/COBBLE_POOL_RESERVE_SHARE of the budget (and at least one block) set aside for it
+#define COBBLE_POOL_RESERVE_SHARE 32
+
+typedef struct {
+    volatile uint64_t head; // Tag in the upper 32 bits, first free block in the lower 32 bits
+    uint8_t pad[COBBLE_CACHE_LINE - sizeof(uint64_t)];
+} cobble_pool_freelist;
+
+typedef struct {
+    uint8_t* memory;
+    volatile uint32_t* next; // Free list links, one per unit
+    uint32_t units;
+
+    cobble_pool_freelist free[COBBLE_POOL_CLASSES];
+
+    volatile uint32_t carved; // Units handed out from the shared part of the budget so far
+    uint32_t shared;          // Units in the shared part, which comes first
+
+    // Each class's reserve, carved in the same way up to reserveEnd
+    volatile uint32_t reserveCarved[COBBLE_POOL_CLASSES];
+    uint32_t reserveEnd[COBBLE_POOL_CLASSES];
+    volatile uint64_t in_use; // Bytes currently held by producers, the queue or the consumer
+} cobble_pool;
+
+// Reserve budget bytes (rounded up to a whole number of 32-byte units), and at least a block of each class for the
+// reserves. This is the only allocation the pool makes.
+bool cobble_pool_init(cobble_pool* p, size_t budget);
+void cobble_pool_free(cobble_pool* p);
+
+// Returns a reference to a block of at least size bytes, or COBBLE_POOL_NONE if size exceeds COBBLE_POOL_MAX_BLOCK
+// or the budget is exhausted
+uint32_t cobble_pool_alloc(cobble_pool* p, size_t size);
+void cobble_pool_release(cobble_pool* p, uint32_t ref);
+
+// References hold the size class in the upper 4 bits and the offset in units in the lower 28 bits
+static inline uint8_t* cobble_pool_block(cobble_pool* p, uint32_t ref) {
+    return p->memory + (size_t)(ref & 0x0FFFFFFFu) * COBBLE_POOL_UNIT;
+}
+
+static inline size_t cobble_pool_block_size(uint32_t ref) {
+    return (size_t)COBBLE_POOL_UNIT << (ref >> 28);
+}
+
+// Bytes of the budget currently in use
+uint64_t cobble_pool_in_use(cobble_pool* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cobble_ring.h"
+
+// Each slot holds a sequence number followed by the entry itself
+#define SLOT_HEADER sizeof(uint64_t)
+
+static inline volatile uint64_t* slot_seq(cobble_ring* r, uint64_t pos) {
+    return (volatile uint64_t*)(r->slots + (size_t)(pos & r->mask) * r->slot_size);
+}
+
+static inline void* slot_data(cobble_ring* r, uint64_t pos) {
+    return r->slots + (size_t)(pos & r->mask) * r->slot_size + SLOT_HEADER;
+}
+
+bool cobble_ring_init(cobble_ring* r, size_t capacity, size_t elem_size, CobbleRingPolicy policy) {
+
+    memset(r, 0, sizeof(*r));
+
+    size_t cap = 2;
+    while (cap < capacity)
+        cap <<= 1;
+
+    r->elem_size = elem_size;
+    r->slot_size = (SLOT_HEADER + elem_size + 7) & ~(size_t)7;
+    r->mask = cap - 1;
+    r->policy = policy;
+
+    r->slots = (uint8_t*)malloc(cap * r->slot_size);
+    if (r->slots == NULL)
+        return false;
+
+    // A slot is free for the producer at position pos when its sequence number equals pos
+    for (uint64_t i = 0; i < cap; i++)
+        cobble_atomic_store_u64(slot_seq(r, i), i);
+
+    return true;
+}
+
+void cobble_ring_free(cobble_ring* r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+void cobble_ring_set_policy(cobble_ring* r, CobbleRingPolicy policy) {
+    cobble_atomic_store_u32(&r->policy, (uint32_t)policy);
+}
+
+void cobble_ring_set_discard(cobble_ring* r, cobble_ring_discard_fn fn, void* ctx) {
+    r->discard = fn;
+    r->discard_ctx = ctx;
+}
+
+// Claim the oldest entry, then either copy it out or hand it to the discard function before releasing the slot
+static bool ring_take(cobble_ring* r, void* elem) {
+
+    uint64_t pos = cobble_atomic_load_u64(&r->dequeue_pos);
+
+    for (;;) {
+        uint64_t seq = cobble_atomic_load_u64(slot_seq(r, pos));
+        int64_t diff = (int64_t)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (cobble_atomic_cas_u64(&r->dequeue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return false; // Empty
+        } else {
+            pos = cobble_atomic_load_u64(&r->dequeue_pos);
+        }
+    }
+
+    if (elem != NULL) {
+        memcpy(elem, slot_data(r, pos), r->elem_size);
+    } else {
+        cobble_atomic_fetch_add_u64(&r->dropped, 1);
+        if (r->discard != NULL)
+            r->discard(r->discard_ctx, slot_data(r, pos));
+    }
+
+    // Hand the slot back to producers for the next lap
+    cobble_atomic_store_u64(slot_seq(r, pos), pos + r->mask + 1);
+    return true;
+}
+
+bool cobble_ring_push(cobble_ring* r, const void* elem) {
+
+    uint64_t pos = cobble_atomic_load_u64(&r->enqueue_pos);
+
+    for (;;) {
+        uint64_t seq = cobble_atomic_load_u64(slot_seq(r, pos));
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (cobble_atomic_cas_u64(&r->enqueue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            // Full
+            if (cobble_atomic_load_u32(&r->policy) == RingPolicy_DropNewest) {
+                cobble_atomic_fetch_add_u64(&r->dropped, 1);
+                return false;
+            }
+            ring_take(r, NULL);
+            pos = cobble_atomic_load_u64(&r->enqueue_pos);
+        } else {
+            pos = cobble_atomic_load_u64(&r->enqueue_pos);
+        }
+    }
+
+    memcpy(slot_data(r, pos), elem, r->elem_size);
+    cobble_atomic_store_u64(slot_seq(r, pos), pos + 1);
+    cobble_atomic_fetch_add_u64(&r->pushed, 1);
+    return true;
+}
+
+bool cobble_ring_pop(cobble_ring* r, void* elem) {
+    return ring_take(r, elem);
+}
+
+// The slot's sequence number is checked again after the key is read, in case the entry was taken (and the slot
+// refilled) in the meantime
+bool cobble_ring_peek_key(cobble_ring* r, uint64_t* key) {
+
+    for (;;) {
+        uint64_t pos = cobble_atomic_load_u64(&r->dequeue_pos);
+        volatile uint64_t* seq = slot_seq(r, pos);
+        int64_t diff = (int64_t)(cobble_atomic_load_u64(seq) - (pos + 1));
+        if (diff < 0)
+            return false; // Empty, or still being filled
+        if (diff > 0)
+            continue; // Taken since dequeue_pos was read
+        uint64_t k = cobble_atomic_load_u64((volatile uint64_t*)slot_data(r, pos));
+        if (cobble_atomic_load_u64(seq) == pos + 1 && cobble_atomic_load_u64(&r->dequeue_pos) == pos) {
+            *key = k;
+            return true;
+        }
+    }
+}
+
+bool cobble_ring_discard_oldest(cobble_ring* r) {
+    return ring_take(r, NULL);
+}
+
+size_t cobble_ring_count(cobble_ring* r) {
+    uint64_t head = cobble_atomic_load_u64(&r->dequeue_pos);
+    uint64_t tail = cobble_atomic_load_u64(&r->enqueue_pos);
+    return (tail > head) ? (size_t)(tail - head) : 0;
+}
+
+uint64_t cobble_ring_pushed(cobble_ring* r) {
+    return cobble_atomic_load_u64(&r->pushed);
+}
+
+uint64_t cobble_ring_dropped(cobble_ring* r) {
+    return cobble_atomic_load_u64(&r->dropped);
+}
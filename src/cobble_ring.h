@@ -0,0 +1,83 @@
+// Bounded, preallocated, lock-free ring used to pass events from the Bluetooth stack threads to the application
+// Any number of threads may push. Popping is intended to happen on the single thread which calls cobble_queue_process(),
+// but it is safe for several threads to pop at once - this is what allows producers to discard the oldest entry when full.
+//
+// This is Dmitry Vyukov's bounded MPMC queue: every slot carries a sequence number which tells producers and consumers
+// whether the slot is free or filled for the current lap, so no locks are required and nothing is allocated after init.
+#ifndef COBBLE_RING_H
+#define COBBLE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble_atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What to do when a producer finds the ring full
+typedef enum {
+    RingPolicy_DropNewest = 0, // Discard the entry being pushed (the ring contents are preserved)
+    RingPolicy_DropOldest,     // Discard the oldest entry in the ring to make room for the new one
+} CobbleRingPolicy;
+
+// Called with a pointer to an entry which is being discarded without being delivered
+// This allows entries which refer to other resources to release them
+typedef void (*cobble_ring_discard_fn)(void* ctx, void* elem);
+
+typedef struct {
+    uint8_t* slots;
+    size_t slot_size;
+    size_t elem_size;
+    uint64_t mask;
+    volatile uint32_t policy;
+    cobble_ring_discard_fn discard;
+    void* discard_ctx;
+
+    uint8_t pad0[COBBLE_CACHE_LINE];
+    volatile uint64_t enqueue_pos;
+    uint8_t pad1[COBBLE_CACHE_LINE - sizeof(uint64_t)];
+    volatile uint64_t dequeue_pos;
+    uint8_t pad2[COBBLE_CACHE_LINE - sizeof(uint64_t)];
+
+    // Overflow counters
+    volatile uint64_t pushed;
+    volatile uint64_t dropped;
+} cobble_ring;
+
+// Allocate storage for capacity entries of elem_size bytes each. Capacity is rounded up to a power of two.
+// This is the only allocation the ring makes. Returns false if the allocation failed.
+bool cobble_ring_init(cobble_ring* r, size_t capacity, size_t elem_size, CobbleRingPolicy policy);
+void cobble_ring_free(cobble_ring* r);
+
+void cobble_ring_set_policy(cobble_ring* r, CobbleRingPolicy policy);
+void cobble_ring_set_discard(cobble_ring* r, cobble_ring_discard_fn fn, void* ctx);
+
+// Copy elem into the ring. Returns false if the entry itself was dropped because the ring was full.
+// With RingPolicy_DropOldest this always succeeds, at the expense of the oldest undelivered entry.
+bool cobble_ring_push(cobble_ring* r, const void* elem);
+
+// Copy the oldest entry out into elem. Returns false if the ring is empty.
+bool cobble_ring_pop(cobble_ring* r, void* elem);
+
+// Read the first 8 bytes of the oldest entry without taking it, for entries which start with a key such as a sequence
+// number. Returns false if the ring is empty. A producer discarding the oldest entry can take it before the next pop.
+bool cobble_ring_peek_key(cobble_ring* r, uint64_t* key);
+
+// Discard the oldest entry (counted as dropped, and passed to the discard function). Returns false if the ring is empty.
+bool cobble_ring_discard_oldest(cobble_ring* r);
+
+// Approximate number of entries waiting - exact only when no other thread is pushing or popping
+size_t cobble_ring_count(cobble_ring* r);
+
+// Total entries pushed successfully, and total entries discarded (of either the newest or oldest)
+uint64_t cobble_ring_pushed(cobble_ring* r);
+uint64_t cobble_ring_dropped(cobble_ring* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -48,6 +48,14 @@ void usleep(unsigned int usec)
 
 volatile bool connecting = false;
 
+//Handed to the Read characteristic's own callback each time it is called
+typedef struct {
+    const char* label;
+    int received;
+} readState;
+
+static readState readCharacteristic = { "Read characteristic", 0 };
+
 //When we find the device of interest, connect to it. 
 //Once connected, the library will automatically stop scanning and attempt to discover all services and characteristics
 void on_scanresult(const char* name, int RSSI, const char* identifier) {
@@ -66,19 +74,30 @@ void on_scanresult(const char* name, int RSSI, const char* identifier) {
     }
 }
 
+//Values from the Read characteristic, which has a callback of its own
+void on_readvalue(void* ctx, cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    readState* state = (readState*)ctx;
+    state->received++;
+    printf("Received %i bytes from the %s (%i so far)\n", len, state->label, state->received);
+}
+
 //Once the characteristic of interest has been discovered, we can subscribe to it
 void on_characteristicdiscovered(const char* svc_uuid, const char* char_uuid) {
 
     if(!svc_uuid || !char_uuid)
         return;
 
-    if(strcmp(char_uuid, beelineRdCharacteristic) == 0) {
+    //Handles are compared as integers, and its values go straight to on_readvalue
+    cobble_char_handle characteristic = cobble_characteristic_handle(char_uuid);
+    if(characteristic == cobble_characteristic_handle(beelineRdCharacteristic)) {
         printf("Found the Read characteristic - subscribing to it...\n");
-        cobble_subscribe(char_uuid);
+        cobble_subscribe_cb(characteristic, &on_readvalue, &readCharacteristic);
     }
 
 }
 
+//Values from any other characteristic
 void on_updatevalue(const char* id, const uint8_t* data, int len) {
 
     printf("Received data from device with length %i\n", len);
@@ -92,12 +111,10 @@ void mainthread(void) {
     cobble_init();
 
     //Wait until the initialisation process is complete
-    //Other work could be done now / this could be done asynchronously or on a callback
-    while(cobble_status() != Initialised) {
-        if(cobble_status() == CobbleError) {
-            printf("An error was encountered whilst starting.\n");
-            return;
-        }
+    //Other work could be done now / this could be done asynchronously or on a callback (register_statuschanged_cb)
+    if(cobble_status_wait(Initialised, -1) != Initialised) {
+        printf("An error was encountered whilst starting.\n");
+        return;
     }
     printf("Initialised\n");
 
@@ -108,11 +125,9 @@ void mainthread(void) {
 
     cobble_scan_start(beelineService);
 
-    while(cobble_status() != Scanning) {
-        if(cobble_status() == CobbleError) {
-            printf("An error was encountered whilst scanning.\n");
-            return;
-        }
+    if(cobble_status_wait(Scanning, -1) != Scanning) {
+        printf("An error was encountered whilst scanning.\n");
+        return;
     }
     printf("Scanning started...\n");
 
@@ -0,0 +1,159 @@
+#include "cobble_scan_filter.h"
+#include "cobble_atomic.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The filter given by the application, and the two a scan can use. cobble_scan_filter_begin() fills in whichever the
+// backend isn't reading and then switches to it, so a filter is never changed while advertisements are checked against
+// it. Both are called on the application's thread.
+static cobble_scan_criteria requested;
+static cobble_scan_criteria criteria[2];
+static volatile uint32_t active = 0;
+
+// Count the entries of a comma-separated list, so that one which doesn't parse can be noticed
+static int list_length(const char* list) {
+
+    int count = 0;
+    for (const char* s = list; *s != '\0';) {
+        const char* end = strchr(s, ',');
+        size_t len = (end != NULL) ? (size_t)(end - s) : strlen(s);
+        if (len > 0)
+            count++;
+        s += len;
+        if (*s == ',')
+            s++;
+    }
+    return count;
+}
+
+EXPORTED bool cobble_scan_filter_set(const cobble_scan_filter* filter) {
+
+    cobble_scan_criteria c;
+    memset(&c, 0, sizeof(c));
+    c.manufacturerId = COBBLE_MANUFACTURER_ANY;
+
+    if (filter == NULL) {
+        requested = c;
+        return true;
+    }
+
+    if (filter->service_uuids != NULL) {
+        int entries = list_length(filter->service_uuids);
+        if (entries > COBBLE_SCAN_FILTER_MAX_SERVICES) {
+            printf("Scan filter has %i services, more than the %i allowed\n", entries, COBBLE_SCAN_FILTER_MAX_SERVICES);
+            return false;
+        }
+        c.serviceCount = cobble_uuid_list_parse(filter->service_uuids, c.services, COBBLE_SCAN_FILTER_MAX_SERVICES);
+        if (c.serviceCount != entries)
+            return false;
+        if (c.serviceCount > 0)
+            c.fields |= ScanField_Services;
+    }
+
+    if (filter->name_prefix != NULL && filter->name_prefix[0] != '\0') {
+        size_t len = strlen(filter->name_prefix);
+        if (len >= sizeof(c.namePrefix)) {
+            printf("Scan filter name prefix \"%s\" is longer than %i characters\n", filter->name_prefix, COBBLE_SCAN_FILTER_MAX_NAME - 1);
+            return false;
+        }
+        memcpy(c.namePrefix, filter->name_prefix, len + 1);
+        c.namePrefixLength = (int)len;
+        c.fields |= ScanField_Name;
+    }
+
+    if (filter->manufacturer_id != COBBLE_MANUFACTURER_ANY || filter->manufacturer_length > 0) {
+        if (filter->manufacturer_id < COBBLE_MANUFACTURER_ANY || filter->manufacturer_id > 0xFFFF
+                || filter->manufacturer_length < 0 || filter->manufacturer_length > COBBLE_SCAN_FILTER_MAX_DATA
+                || (filter->manufacturer_length > 0 && filter->manufacturer_data == NULL)) {
+            printf("Scan filter manufacturer data is not valid (company %i, %i bytes, up to %i allowed)\n",
+                filter->manufacturer_id, filter->manufacturer_length, COBBLE_SCAN_FILTER_MAX_DATA);
+            return false;
+        }
+        c.manufacturerId = filter->manufacturer_id;
+        c.manufacturerLength = filter->manufacturer_length;
+        for (int i = 0; i < c.manufacturerLength; i++) {
+            c.manufacturerMask[i] = (filter->manufacturer_mask != NULL) ? filter->manufacturer_mask[i] : 0xFF;
+            c.manufacturerData[i] = filter->manufacturer_data[i] & c.manufacturerMask[i];
+        }
+        c.fields |= ScanField_Manufacturer;
+    }
+
+    if (filter->rssi_min != 0) {
+        c.rssiMin = filter->rssi_min;
+        c.fields |= ScanField_Rssi;
+    }
+
+    requested = c;
+    return true;
+}
+
+const cobble_scan_criteria* cobble_scan_filter_begin(const char* service_uuids) {
+
+    uint32_t next = 1 - cobble_atomic_load_u32(&active);
+    cobble_scan_criteria* c = &criteria[next];
+
+    *c = requested;
+    if (service_uuids != NULL && service_uuids[0] != '\0') {
+        c->serviceCount = cobble_uuid_list_parse(service_uuids, c->services, COBBLE_SCAN_FILTER_MAX_SERVICES);
+        if (c->serviceCount > 0)
+            c->fields |= ScanField_Services;
+        else
+            c->fields &= ~(uint32_t)ScanField_Services;
+    }
+
+    cobble_atomic_store_u32(&active, next);
+    return c;
+}
+
+const cobble_scan_criteria* cobble_scan_filter_active(void) {
+    return &criteria[cobble_atomic_load_u32(&active)];
+}
+
+static bool manufacturer_matches(const cobble_scan_criteria* c, const cobble_advertisement* adv) {
+
+    if (adv->manufacturerId == COBBLE_MANUFACTURER_ANY)
+        return false;
+    if (c->manufacturerId != COBBLE_MANUFACTURER_ANY && adv->manufacturerId != c->manufacturerId)
+        return false;
+    if (adv->manufacturerLength < c->manufacturerLength)
+        return false;
+
+    for (int i = 0; i < c->manufacturerLength; i++) {
+        if ((adv->manufacturerData[i] & c->manufacturerMask[i]) != c->manufacturerData[i])
+            return false;
+    }
+    return true;
+}
+
+static bool has_service(const cobble_scan_criteria* c, const cobble_advertisement* adv) {
+
+    for (int i = 0; i < adv->serviceCount; i++) {
+        for (int j = 0; j < c->serviceCount; j++) {
+            if (cobble_uuid_equal(&adv->services[i], &c->services[j]))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool cobble_scan_filter_match(const cobble_advertisement* adv) {
+
+    const cobble_scan_criteria* c = cobble_scan_filter_active();
+
+    // Only what the backend filled in is checked, so the cheapest checks go first
+    uint32_t check = c->fields & adv->fields;
+    if (check == 0)
+        return true;
+
+    if ((check & ScanField_Rssi) && adv->rssi < c->rssiMin)
+        return false;
+    if ((check & ScanField_Name) && (adv->name == NULL || strncmp(adv->name, c->namePrefix, (size_t)c->namePrefixLength) != 0))
+        return false;
+    if ((check & ScanField_Manufacturer) && !manufacturer_matches(c, adv))
+        return false;
+    if ((check & ScanField_Services) && !has_service(c, adv))
+        return false;
+
+    return true;
+}
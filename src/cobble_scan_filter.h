@@ -0,0 +1,97 @@
+// Filtering of advertisements while scanning, so that those the application isn't interested in are dropped before a
+// scan result is formatted or queued for them
+//
+// A filter can ask for any of a list of services, a name prefix, manufacturer data (a company identifier and bytes
+// compared under a mask) and a minimum RSSI, and an advertisement must meet all of those given. Each backend hands as
+// much of the filter as it can to the OS, which may pass it on to the Bluetooth controller, and checks the rest itself
+// with cobble_scan_filter_match() as each advertisement arrives:
+// * Android gives services and manufacturer data to the controller as ScanFilters, and checks the name and RSSI before
+//   the result leaves Java
+// * CoreBluetooth and the simulator filter by service, and the rest is checked in Cobble
+// * BlueZ filters by service and RSSI, and the rest is checked in Cobble
+// * Windows filters by RSSI and manufacturer data, and by service if there is only one, and the rest is checked in Cobble
+#ifndef COBBLE_SCAN_FILTER_H
+#define COBBLE_SCAN_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+#include "cobble_uuid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COBBLE_SCAN_FILTER_MAX_SERVICES 16
+#define COBBLE_SCAN_FILTER_MAX_NAME 32
+// Manufacturer data compared, after the company identifier. A legacy advertisement has room for 27 bytes.
+#define COBBLE_SCAN_FILTER_MAX_DATA 32
+
+// Any company identifier, or no manufacturer data, in a filter or an advertisement
+#define COBBLE_MANUFACTURER_ANY -1
+
+typedef struct {
+    const char* service_uuids;          // Comma-separated. An advertisement must include one of them. NULL for any.
+    const char* name_prefix;            // NULL for any name (or none)
+    int manufacturer_id;                // Bluetooth SIG company identifier, or COBBLE_MANUFACTURER_ANY
+    const uint8_t* manufacturer_data;   // Compared with the start of the manufacturer data, after the company identifier
+    const uint8_t* manufacturer_mask;   // Bits to compare, or NULL for all of them
+    int manufacturer_length;            // Length of data and mask, 0 to match on the company identifier alone
+    int rssi_min;                       // Weaker advertisements are dropped. 0 for no minimum.
+} cobble_scan_filter;
+
+// Filter the scans started after this, or stop filtering if filter is NULL (the default). Services given to
+// cobble_scan_start() are used in place of the filter's. Returns false, leaving the filter unchanged, if it can't be
+// used: a UUID which doesn't parse, or a name prefix or manufacturer data that is too long.
+EXPORTED bool cobble_scan_filter_set(const cobble_scan_filter* filter);
+
+// For the backends. The filter as parsed when a scan starts, for handing on to the OS.
+typedef enum {
+    ScanField_Services = 1 << 0,
+    ScanField_Name = 1 << 1,
+    ScanField_Manufacturer = 1 << 2,
+    ScanField_Rssi = 1 << 3,
+} CobbleScanField;
+
+typedef struct {
+    uint32_t fields; // The ScanField_ values this filter checks
+    cobble_uuid services[COBBLE_SCAN_FILTER_MAX_SERVICES];
+    int serviceCount;
+    char namePrefix[COBBLE_SCAN_FILTER_MAX_NAME];
+    int namePrefixLength;
+    int manufacturerId;
+    uint8_t manufacturerData[COBBLE_SCAN_FILTER_MAX_DATA];
+    uint8_t manufacturerMask[COBBLE_SCAN_FILTER_MAX_DATA];
+    int manufacturerLength;
+    int rssiMin;
+} cobble_scan_criteria;
+
+// An advertisement, in whatever form the backend can get at most cheaply. fields says which of the rest it has filled
+// in: anything the filter checks which isn't filled in is taken to have been checked by the OS already.
+typedef struct {
+    uint32_t fields;
+    const cobble_uuid* services;
+    int serviceCount;
+    const char* name;                   // NULL if the advertisement has no name
+    int manufacturerId;                 // COBBLE_MANUFACTURER_ANY if it has no manufacturer data
+    const uint8_t* manufacturerData;    // After the company identifier
+    int manufacturerLength;
+    int rssi;
+} cobble_advertisement;
+
+// Called by cobble_scan_start() with the services it was given, before the scan starts. Returns the filter the scan is
+// to use, which stays the same until the next scan starts.
+const cobble_scan_criteria* cobble_scan_filter_begin(const char* service_uuids);
+
+// The filter of the scan under way, for the backend's threads
+const cobble_scan_criteria* cobble_scan_filter_active(void);
+
+// Whether an advertisement passes the filter of the scan under way
+bool cobble_scan_filter_match(const cobble_advertisement* adv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
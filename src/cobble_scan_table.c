@@ -0,0 +1,223 @@
+#include "cobble_scan_table.h"
+#include "cobble_atomic.h"
+#include "cobble_connections.h"
+
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#define MAX_IDENTIFIER_LENGTH 40
+#define MAX_DEVICES (COBBLE_SCAN_TABLE_SIZE / 4 * 3)
+
+// Slots looked at for expired devices on each update, so that they are cleared out without a pass over the whole table
+#define SWEEP_PER_UPDATE 4
+
+// RSSI is smoothed in sixteenths of a dBm, each advertisement moving it a quarter of the way to the new reading
+#define RSSI_SCALE 16
+#define RSSI_WEIGHT 4
+
+// Keys are never 0, which marks a free slot. Addresses and hashed identifiers are kept apart by their top bits.
+#define KEY_ADDRESS (1ULL << 62)
+#define KEY_HASHED (1ULL << 63)
+
+typedef struct {
+    uint64_t key;
+    uint64_t lastSeen;
+    uint64_t lastReported;
+    int rssi;
+    char name[COBBLE_SCAN_NAME_LENGTH];
+    char identifier[MAX_IDENTIFIER_LENGTH]; // Only compared for hashed keys
+} device;
+
+static device table[COBBLE_SCAN_TABLE_SIZE];
+static int deviceCount = 0;
+static uint32_t sweepPosition = 0;
+
+static volatile uint32_t intervalMs = 0;
+static uint32_t expiryMs = COBBLE_SCAN_DEFAULT_EXPIRY_MS;
+
+// Advertisements arrive on the Bluetooth stack's threads (several at once on Windows), and each holds the lock only
+// long enough to update one entry
+static volatile uint32_t lock = 0;
+
+static void table_lock(void) {
+    uint32_t expected = 0;
+    while (!cobble_atomic_cas_u32(&lock, &expected, 1))
+        expected = 0;
+}
+
+static void table_unlock(void) {
+    cobble_atomic_store_u32(&lock, 0);
+}
+
+static uint64_t now_ms(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    return GetTickCount64();
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static uint64_t identifier_key(const char* identifier) {
+
+    uint64_t address;
+    if (cobble_address_parse(identifier, &address))
+        return address | KEY_ADDRESS;
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = identifier; *c != '\0'; c++)
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    return hash | KEY_HASHED;
+}
+
+static uint32_t home_slot(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40) & (COBBLE_SCAN_TABLE_SIZE - 1);
+}
+
+static void copy_string(char* dest, size_t size, const char* src) {
+    size_t len = strlen(src);
+    if (len > size - 1)
+        len = size - 1;
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+// Linear probing, so a removed entry's place is filled by any later entry of the same run which could be moved back
+// into it, rather than leaving a marker behind
+static void remove_slot(uint32_t slot) {
+
+    uint32_t hole = slot;
+    for (uint32_t i = (slot + 1) & (COBBLE_SCAN_TABLE_SIZE - 1); table[i].key != 0; i = (i + 1) & (COBBLE_SCAN_TABLE_SIZE - 1)) {
+        uint32_t home = home_slot(table[i].key);
+        // Move the entry back if its home is not in the (circular) range after the hole up to where it is now
+        if (((i - home) & (COBBLE_SCAN_TABLE_SIZE - 1)) >= ((i - hole) & (COBBLE_SCAN_TABLE_SIZE - 1))) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole].key = 0;
+    deviceCount--;
+}
+
+static void sweep(uint64_t now, int slots) {
+    for (int n = 0; n < slots && deviceCount > 0; n++) {
+        uint32_t slot = sweepPosition++ & (COBBLE_SCAN_TABLE_SIZE - 1);
+        // An entry moved back into this slot by remove_slot() waits for the next pass
+        if (table[slot].key != 0 && now - table[slot].lastSeen >= expiryMs)
+            remove_slot(slot);
+    }
+}
+
+static device* find(uint64_t key, const char* identifier, uint32_t* freeSlot) {
+
+    for (uint32_t i = home_slot(key); ; i = (i + 1) & (COBBLE_SCAN_TABLE_SIZE - 1)) {
+        if (table[i].key == 0) {
+            *freeSlot = i;
+            return NULL;
+        }
+        if (table[i].key == key && ((key & KEY_HASHED) == 0 || strcmp(table[i].identifier, identifier) == 0))
+            return &table[i];
+    }
+}
+
+EXPORTED void cobble_scan_coalesce_set(int interval_ms, int expiry_ms) {
+    table_lock();
+    memset(table, 0, sizeof(table));
+    deviceCount = 0;
+    intervalMs = interval_ms > 0 ? (uint32_t)interval_ms : 0;
+    expiryMs = expiry_ms > 0 ? (uint32_t)expiry_ms : COBBLE_SCAN_DEFAULT_EXPIRY_MS;
+    table_unlock();
+}
+
+EXPORTED int cobble_scan_device_count(void) {
+    table_lock();
+    sweep(now_ms(), COBBLE_SCAN_TABLE_SIZE);
+    int count = deviceCount;
+    table_unlock();
+    return count;
+}
+
+void cobble_scan_table_clear(void) {
+    table_lock();
+    memset(table, 0, sizeof(table));
+    deviceCount = 0;
+    table_unlock();
+}
+
+bool cobble_scan_table_update(const char* name, int rssi, const char* identifier, cobble_scan_report* report) {
+
+    report->rssi = rssi;
+    report->name = name;
+
+    // Nothing to coalesce by without an identifier
+    if (cobble_atomic_load_u32(&intervalMs) == 0 || identifier == NULL)
+        return true;
+
+    uint64_t key = identifier_key(identifier);
+    uint64_t now = now_ms();
+    uint32_t freeSlot;
+
+    table_lock();
+
+    sweep(now, SWEEP_PER_UPDATE);
+
+    device* d = find(key, identifier, &freeSlot);
+    if (d == NULL) {
+
+        // A table full of devices still in range is made room in only as they expire. Until then, new ones are reported
+        // as they would be without coalescing.
+        if (deviceCount >= MAX_DEVICES) {
+            sweep(now, COBBLE_SCAN_TABLE_SIZE);
+            find(key, identifier, &freeSlot);
+            if (deviceCount >= MAX_DEVICES) {
+                table_unlock();
+                return true;
+            }
+        }
+
+        d = &table[freeSlot];
+        d->key = key;
+        d->lastReported = now - intervalMs;
+        d->rssi = rssi * RSSI_SCALE;
+        d->name[0] = '\0';
+        copy_string(d->identifier, sizeof(d->identifier), identifier);
+        deviceCount++;
+
+    } else {
+        d->rssi += (rssi * RSSI_SCALE - d->rssi) / RSSI_WEIGHT;
+    }
+
+    d->lastSeen = now;
+    if (name != NULL && name[0] != '\0')
+        copy_string(d->name, sizeof(d->name), name);
+
+    if (now - d->lastReported < intervalMs) {
+        table_unlock();
+        return false;
+    }
+    d->lastReported = now;
+
+    // Round to the nearest dBm
+    report->rssi = (d->rssi + (d->rssi < 0 ? -RSSI_SCALE / 2 : RSSI_SCALE / 2)) / RSSI_SCALE;
+    if ((name == NULL || name[0] == '\0') && d->name[0] != '\0') {
+        memcpy(report->nameBuffer, d->name, sizeof(report->nameBuffer));
+        report->name = report->nameBuffer;
+    }
+
+    table_unlock();
+    return true;
+}
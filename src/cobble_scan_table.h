@@ -0,0 +1,59 @@
+// Table of devices seen while scanning, so that a device which advertises many times a second is reported at a rate the
+// application can keep up with
+//
+// Without it, every advertisement becomes a scan result, and a scan in a room full of beacons can fill the event queue
+// with results for the same few devices. Once cobble_scan_coalesce_set() has been given an interval, each device is
+// reported the first time it is seen, then at most once per interval: advertisements in between are merged into its
+// entry, and the next result after the interval carries their smoothed RSSI and the latest name seen. A device which
+// has not advertised for the expiry time is dropped, so is reported straight away if it comes back.
+//
+// Devices are kept by address, or, on platforms which identify them some other way (eg CoreBluetooth's UUIDs), by a hash
+// of their identifier. The table is cleared whenever a scan starts.
+#ifndef COBBLE_SCAN_TABLE_H
+#define COBBLE_SCAN_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be a power of two. Once three quarters of the table is in use, new devices are reported on every advertisement.
+#define COBBLE_SCAN_TABLE_SIZE 1024
+
+// Names kept with a device, for advertisements which don't carry one, are truncated to this
+#define COBBLE_SCAN_NAME_LENGTH 64
+
+// Used when cobble_scan_coalesce_set() is given an expiry of 0
+#define COBBLE_SCAN_DEFAULT_EXPIRY_MS 30000
+
+// Report each device at most once every interval_ms, forgetting devices which haven't advertised for expiry_ms.
+// An interval of 0 (the default) reports every advertisement as it comes. Clears the table.
+EXPORTED void cobble_scan_coalesce_set(int interval_ms, int expiry_ms);
+
+// The number of devices seen within the expiry time, or 0 if results are not being coalesced
+EXPORTED int cobble_scan_device_count(void);
+
+// For the event cores. A scan result which is due to be reported, with its smoothed RSSI and the name to report with it
+// (NULL if none has been seen).
+typedef struct {
+    int rssi;
+    const char* name;
+    char nameBuffer[COBBLE_SCAN_NAME_LENGTH];
+} cobble_scan_report;
+
+// Merges an advertisement into the table. Returns true, filling in the report, if a scan result should be sent for it.
+// May be called from any thread.
+bool cobble_scan_table_update(const char* name, int rssi, const char* identifier, cobble_scan_report* report);
+
+// For the backends, when a scan starts
+void cobble_scan_table_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,197 @@
+#include "cobble_status.h"
+#include "cobble_atomic.h"
+#include "cobble_events.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+// The status in the low byte and the error above it, so that both change in one compare-and-swap
+#define STATE(status, error) ((uint32_t)(status) | ((uint32_t)(error) << 8))
+#define STATE_STATUS(state) ((CobbleStatus)((state) & 0xFF))
+#define STATE_ERROR(state) ((CobbleErrorCode)((state) >> 8))
+
+static volatile uint32_t state = STATE(Uninitialised, NoError);
+
+// Waiters sleep on a condition variable, which every change signals. Changing the status itself doesn't take the lock.
+#if defined(_WIN32) || defined(_WIN64)
+static SRWLOCK waitLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE waitChanged = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitChanged = PTHREAD_COND_INITIALIZER;
+#endif
+
+static const char* status_name(CobbleStatus status) {
+    switch (status) {
+    case Uninitialised: return "Uninitialised";
+    case Initialised: return "Initialised";
+    case Scanning: return "Scanning";
+    case Connecting: return "Connecting";
+    case Connected: return "Connected";
+    case CobbleError: return "CobbleError";
+    }
+    return "unknown";
+}
+
+static bool operational(CobbleStatus status) {
+    return status == Initialised || status == Scanning || status == Connecting || status == Connected;
+}
+
+// The moves a status can make, by [from][to]. A connection has to be started before it completes, so Connected is only
+// reached from Connecting. Connecting is reached from Initialised or Scanning, or from Connected on backends with several
+// connections, when the one connected ends while another is still being made. CobbleError is reached from anywhere by
+// cobble_status_error() instead.
+#define STATUS_COUNT (CobbleError + 1)
+
+static const bool transitions[STATUS_COUNT][STATUS_COUNT] = {
+    // [from][to]         Uninitialised  Initialised  Scanning  Connecting  Connected  CobbleError
+    /* Uninitialised */ { true,          true,        false,    false,      false,     false       },
+    /* Initialised   */ { true,          true,        true,     true,       false,     false       },
+    /* Scanning      */ { true,          true,        true,     true,       false,     false       },
+    /* Connecting    */ { true,          true,        true,     true,       true,      false       },
+    /* Connected     */ { true,          true,        true,     true,       true,      false       },
+    /* CobbleError   */ { true,          true,        false,    false,      false,     true        },
+};
+
+static bool allowed(CobbleStatus from, CobbleStatus to) {
+    return (unsigned)from < STATUS_COUNT && (unsigned)to < STATUS_COUNT && transitions[from][to];
+}
+
+// Wakes cobble_status_wait() and tells the application. Changes made at the same moment on different threads may be
+// reported in either order, but cobble_status() is always the latest.
+static void changed(uint32_t next) {
+
+#if defined(_WIN32) || defined(_WIN64)
+    AcquireSRWLockExclusive(&waitLock);
+    WakeAllConditionVariable(&waitChanged);
+    ReleaseSRWLockExclusive(&waitLock);
+#else
+    pthread_mutex_lock(&waitLock);
+    pthread_cond_broadcast(&waitChanged);
+    pthread_mutex_unlock(&waitLock);
+#endif
+
+    cobble_event_statuschanged(STATE_STATUS(next), STATE_ERROR(next));
+}
+
+bool cobble_status_set(CobbleStatus status) {
+
+    if (status == CobbleError) {
+        cobble_status_error(UnknownError);
+        return true;
+    }
+
+    uint32_t current = cobble_atomic_load_u32(&state);
+    do {
+        if (STATE_STATUS(current) == status)
+            return true;
+        if (!allowed(STATE_STATUS(current), status)) {
+            printf("Ignoring status change from %s to %s\n", status_name(STATE_STATUS(current)), status_name(status));
+            return false;
+        }
+    } while (!cobble_atomic_cas_u32(&state, &current, STATE(status, NoError)));
+
+    changed(STATE(status, NoError));
+    return true;
+}
+
+bool cobble_status_update(CobbleStatus status) {
+
+    if (!operational(status))
+        return false;
+
+    uint32_t current = cobble_atomic_load_u32(&state);
+    do {
+        if (!operational(STATE_STATUS(current)))
+            return false;
+        if (STATE_STATUS(current) == status)
+            return true;
+        if (!allowed(STATE_STATUS(current), status)) {
+            printf("Ignoring status change from %s to %s\n", status_name(STATE_STATUS(current)), status_name(status));
+            return false;
+        }
+    } while (!cobble_atomic_cas_u32(&state, &current, STATE(status, NoError)));
+
+    changed(STATE(status, NoError));
+    return true;
+}
+
+void cobble_status_error(CobbleErrorCode error) {
+
+    uint32_t next = STATE(CobbleError, error);
+    uint32_t current = cobble_atomic_load_u32(&state);
+    do {
+        if (current == next)
+            return;
+    } while (!cobble_atomic_cas_u32(&state, &current, next));
+
+    printf("Cobble error %i (was %s)\n", (int)error, status_name(STATE_STATUS(current)));
+    changed(next);
+}
+
+EXPORTED CobbleStatus cobble_status(void) {
+    return STATE_STATUS(cobble_atomic_load_u32(&state));
+}
+
+EXPORTED CobbleErrorCode cobble_error_get(void) {
+    return STATE_ERROR(cobble_atomic_load_u32(&state));
+}
+
+EXPORTED CobbleStatus cobble_status_wait(CobbleStatus status, int timeoutMs) {
+
+    CobbleStatus current;
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    ULONGLONG deadline = GetTickCount64() + (ULONGLONG)(timeoutMs > 0 ? timeoutMs : 0);
+
+    AcquireSRWLockExclusive(&waitLock);
+    for (;;) {
+        current = cobble_status();
+        if (current == status || current == CobbleError || timeoutMs == 0)
+            break;
+        DWORD wait = INFINITE;
+        if (timeoutMs > 0) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline)
+                break;
+            wait = (DWORD)(deadline - now);
+        }
+        SleepConditionVariableSRW(&waitChanged, &waitLock, wait, 0);
+    }
+    ReleaseSRWLockExclusive(&waitLock);
+
+#else
+
+    // Condition variables time out against the wall clock by default, which is the one clock every platform supports
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec deadline;
+    uint64_t ns = (uint64_t)tv.tv_usec * 1000 + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0) * 1000000;
+    deadline.tv_sec = tv.tv_sec + (time_t)(ns / 1000000000);
+    deadline.tv_nsec = (long)(ns % 1000000000);
+
+    pthread_mutex_lock(&waitLock);
+    for (;;) {
+        current = cobble_status();
+        if (current == status || current == CobbleError || timeoutMs == 0)
+            break;
+        if (timeoutMs < 0)
+            pthread_cond_wait(&waitChanged, &waitLock);
+        else if (pthread_cond_timedwait(&waitChanged, &waitLock, &deadline) != 0) {
+            current = cobble_status();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&waitLock);
+
+#endif
+
+    return current;
+}
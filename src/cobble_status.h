@@ -0,0 +1,41 @@
+// The library's status, as returned by cobble_status() and cobble_error_get(), kept by the core for every backend
+// The status and the error are held together in one atomic word, so that they are always read as a pair and backends can
+// change them from whichever thread their Bluetooth stack calls back on. Each change is checked against the moves which
+// make sense, and sent to the application as a statuschanged event:
+// * Uninitialised only becomes Initialised, or CobbleError if initialisation failed
+// * Initialised, Scanning, Connecting and Connected move between each other, except that Connected is only reached from
+//   Connecting. Connected only goes back to Connecting where there are several connections, when the one connected ends
+//   while another is still being made. Any of them can become CobbleError
+// * CobbleError only becomes Initialised, when the adapter is usable again, or Uninitialised
+// * Anything can become Uninitialised, which is what cobble_deinit() does
+// The error is only set while the status is CobbleError, and goes back to NoError when it is left.
+#ifndef COBBLE_STATUS_H
+#define COBBLE_STATUS_H
+
+#include <stdbool.h>
+
+#include "cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// For the backend's own initialisation and deinitialisation, and for the adapter becoming usable again. A move which isn't
+// allowed is logged and ignored, and false is returned. Setting the status it already has does nothing and returns true.
+// Use cobble_status_error() for CobbleError.
+bool cobble_status_set(CobbleStatus status);
+
+// For a status worked out from what the backend is doing (scanning, connecting, a connection ending), which only moves
+// between Initialised, Scanning, Connecting and Connected. Returns false without logging anything if the status is
+// Uninitialised or CobbleError, so a scan stopping or a late completion can't revive the library or hide an error. Other
+// moves which aren't allowed are logged and ignored, as by cobble_status_set().
+bool cobble_status_update(CobbleStatus status);
+
+// Moves to CobbleError for the reason given, from any status, as initialisation can fail as well as anything after it
+void cobble_status_error(CobbleErrorCode error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
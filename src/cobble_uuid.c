@@ -0,0 +1,163 @@
+#include "cobble_uuid.h"
+
+#include <stdio.h>
+
+// Positions of the 32 hex digits within the canonical 36-character form
+static const uint8_t canonicalDigits[32] = {
+    0, 1, 2, 3, 4, 5, 6, 7,
+    9, 10, 11, 12,
+    14, 15, 16, 17,
+    19, 20, 21, 22,
+    24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
+};
+
+static const cobble_uuid baseUuid = COBBLE_UUID32(0);
+
+#define BYTES(x) (0x0101010101010101ull * (uint8_t)(x))
+#define HIGH_BITS BYTES(0x80)
+
+// Set the high bit of each byte of x which lies within [lo, hi]. Only valid for bytes below 0x80.
+static inline uint64_t bytes_in_range(uint64_t x, uint8_t lo, uint8_t hi) {
+    return (x + BYTES(0x80 - lo)) & ~(x + BYTES(0x7F - hi)) & HIGH_BITS;
+}
+
+static inline uint64_t load4(const char* s) {
+    uint32_t x;
+    memcpy(&x, s, 4);
+    return x;
+}
+
+static inline uint64_t load8(const char* s) {
+    uint64_t x;
+    memcpy(&x, s, 8);
+    return x;
+}
+
+// Decode eight hex characters (in any case), loaded little-endian into x, into four bytes in memory order.
+// All eight characters are handled at once in a 64-bit word rather than branching on each one.
+// Returns false if any character is not a hex digit.
+static inline bool decode8(uint64_t x, uint32_t* out) {
+
+    uint64_t lower = x | BYTES(0x20);
+    uint64_t digit = bytes_in_range(x, '0', '9');
+    uint64_t letter = bytes_in_range(lower, 'a', 'f');
+
+    // Any byte with its high bit set is not ASCII, and would upset the range checks above
+    bool valid = ((digit | letter) == HIGH_BITS) & ((x & HIGH_BITS) == 0);
+
+    // Setting the high bit before subtracting stops borrows crossing into the neighbouring byte
+    uint64_t digitMask = (digit >> 7) * 0xFF;
+    uint64_t nibbles = ((((x | HIGH_BITS) - BYTES('0')) & digitMask) | (((lower | HIGH_BITS) - BYTES('a' - 10)) & ~digitMask)) & BYTES(0x0F);
+
+    // The first character of each pair is the high nibble, then squeeze the four bytes together
+    uint64_t pairs = ((nibbles & 0x000F000F000F000Full) << 4) | ((nibbles >> 8) & 0x000F000F000F000Full);
+    pairs = (pairs | (pairs >> 8)) & 0x0000FFFF0000FFFFull;
+    *out = (uint32_t)(pairs | (pairs >> 16));
+
+    return valid;
+}
+
+// Loads are little-endian on every platform we support, so the first character of a word is in its lowest byte.
+// The result is assembled in registers and written out once, as writing it a byte at a time and then copying it would
+// stall on store forwarding.
+EXPORTED bool cobble_uuid_parse(const char* str, cobble_uuid* out) {
+
+    if (str == NULL)
+        return false;
+
+    uint32_t w[4];
+    bool valid;
+
+    memcpy(w, baseUuid.bytes, 16);
+
+    switch (strnlen(str, 37)) {
+    case 4: {
+        // A 16-bit UUID is the low half of a 32-bit one, so pad it with zeros
+        uint32_t shortUuid;
+        valid = decode8(load4("0000") | (load4(str) << 32), &shortUuid);
+        w[0] = shortUuid;
+        break;
+    }
+    case 8:
+        valid = decode8(load8(str), &w[0]);
+        break;
+    case 32:
+        valid = decode8(load8(str), &w[0]) & decode8(load8(str + 8), &w[1]) & decode8(load8(str + 16), &w[2]) & decode8(load8(str + 24), &w[3]);
+        break;
+    case 36:
+        valid = (str[8] == '-') & (str[13] == '-') & (str[18] == '-') & (str[23] == '-');
+        valid &= decode8(load8(str), &w[0]);
+        valid &= decode8(load4(str + 9) | (load4(str + 14) << 32), &w[1]);
+        valid &= decode8(load4(str + 19) | (load4(str + 24) << 32), &w[2]);
+        valid &= decode8(load8(str + 28), &w[3]);
+        break;
+    default:
+        return false;
+    }
+
+    if (!valid)
+        return false;
+
+    memcpy(out->bytes, w, 16);
+    return true;
+}
+
+EXPORTED void cobble_uuid_format(const cobble_uuid* uuid, char* out) {
+
+    static const char digits[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+    for (int i = 0; i < 16; i++) {
+        out[canonicalDigits[i * 2]] = digits[uuid->bytes[i] >> 4];
+        out[canonicalDigits[i * 2 + 1]] = digits[uuid->bytes[i] & 0x0F];
+    }
+
+    out[8] = out[13] = out[18] = out[23] = '-';
+    out[36] = '\0';
+}
+
+int cobble_uuid_list_parse(const char* list, cobble_uuid* out, int max) {
+
+    int count = 0;
+
+    for (const char* s = (list != NULL) ? list : ""; *s != '\0';) {
+        size_t len = strcspn(s, ",");
+        char one[COBBLE_UUID_STRING_LENGTH];
+
+        snprintf(one, sizeof(one), "%.*s", (int)(len < sizeof(one) ? len : sizeof(one) - 1), s);
+        if (len == 0) {
+            // Empty entry
+        } else if (count == max || len >= sizeof(one) || !cobble_uuid_parse(one, &out[count])) {
+            printf("Could not create Service UUID from \"%.*s\"\n", (int)len, s);
+        } else {
+            count++;
+        }
+
+        s += len;
+        if (*s == ',')
+            s++;
+    }
+
+    return count;
+}
+
+bool cobble_uuid_from_bytes(const uint8_t* data, size_t len, cobble_uuid* out) {
+
+    cobble_uuid u = baseUuid;
+
+    switch (len) {
+    case 2:
+        memcpy(u.bytes + 2, data, 2);
+        break;
+    case 4:
+        memcpy(u.bytes, data, 4);
+        break;
+    case 16:
+        memcpy(u.bytes, data, 16);
+        break;
+    default:
+        return false;
+    }
+
+    *out = u;
+    return true;
+}
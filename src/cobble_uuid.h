@@ -0,0 +1,84 @@
+// Binary representation of Bluetooth UUIDs
+// Backends receive UUIDs in several forms (16-bit, 32-bit and 128-bit, upper or lower case, binary GUIDs). Converting them
+// all to this 16-byte value means that comparisons and lookups are two integer compares, however the UUID was written.
+#ifndef COBBLE_UUID_H
+#define COBBLE_UUID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Compatibility with Windows
+#if defined(_WIN32) || defined(_WIN64)
+#define EXPORTED __declspec(dllexport)
+#else
+#define EXPORTED
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bytes are held in the order they are written, eg 0000180F-0000-1000-8000-00805F9B34FB is {0x00, 0x00, 0x18, 0x0F, ...}
+typedef struct {
+    uint8_t bytes[16];
+} cobble_uuid;
+
+// Full UUIDs are 36 characters, eg "C5D70001-C45D-4F12-8693-7EF838E96446"
+#define COBBLE_UUID_STRING_LENGTH 37
+
+// Short (16- and 32-bit) UUIDs are offsets into the Bluetooth Base UUID, 00000000-0000-1000-8000-00805F9B34FB
+#define COBBLE_UUID32(x) {{ \
+    (uint8_t)((x) >> 24), (uint8_t)((x) >> 16), (uint8_t)((x) >> 8), (uint8_t)(x), \
+    0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0x80, 0x5F, 0x9B, 0x34, 0xFB }}
+#define COBBLE_UUID16(x) COBBLE_UUID32((uint16_t)(x))
+
+// Declares a UUID constant in a header, without unused variable warnings in files which don't use it
+#if defined(__cplusplus)
+#define COBBLE_UUID_CONSTANT static constexpr cobble_uuid
+#elif defined(__GNUC__)
+#define COBBLE_UUID_CONSTANT static const cobble_uuid __attribute__((unused))
+#else
+#define COBBLE_UUID_CONSTANT static const cobble_uuid
+#endif
+
+// Parse a UUID in any of the following forms, upper or lower case:
+// "180F" (16-bit), "0000180F" (32-bit), "0000180F00001000800000805F9B34FB" or "0000180F-0000-1000-8000-00805F9B34FB"
+// Returns false if the string is not a valid UUID.
+EXPORTED bool cobble_uuid_parse(const char* str, cobble_uuid* out);
+
+// Write the canonical upper-case form, with hyphens, into a buffer of at least COBBLE_UUID_STRING_LENGTH characters
+EXPORTED void cobble_uuid_format(const cobble_uuid* uuid, char* out);
+
+// Parse a comma-separated list of UUIDs, as scan filters and connection service lists are given, into at most max
+// entries. Anything which isn't a UUID is logged and skipped, as are entries past max. NULL is an empty list.
+// Returns the number of entries written.
+int cobble_uuid_list_parse(const char* list, cobble_uuid* out, int max);
+
+// Convert from the binary forms used in advertisements and by some platforms (2, 4 or 16 bytes, most significant first)
+// Returns false for any other length.
+bool cobble_uuid_from_bytes(const uint8_t* data, size_t len, cobble_uuid* out);
+
+static inline bool cobble_uuid_equal(const cobble_uuid* a, const cobble_uuid* b) {
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, a->bytes, 8);
+    memcpy(&a1, a->bytes + 8, 8);
+    memcpy(&b0, b->bytes, 8);
+    memcpy(&b1, b->bytes + 8, 8);
+    return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+}
+
+static inline uint32_t cobble_uuid_hash(const cobble_uuid* u) {
+    uint64_t a, b;
+    memcpy(&a, u->bytes, 8);
+    memcpy(&b, u->bytes + 8, 8);
+    uint64_t h = (a ^ (b * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
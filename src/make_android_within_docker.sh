@@ -20,6 +20,16 @@ export STRIP=$TOOLCHAIN/bin/$TARGET-strip
 echo "Building native code (arm64)"
 $CC \
 cobble_events.c \
+cobble_characteristics.c \
+cobble_uuid.c \
+cobble_connections.c \
+cobble_crc32.c \
+cobble_dfu.c \
+cobble_gatt_cache.c \
+cobble_scan_table.c \
+cobble_scan_filter.c \
+cobble_ad.c \
+cobble_status.c \
 platforms/android/AndroidBLE.c \
 -fPIC -shared -llog -o ./build/libCobble_android_arm64.so
 
@@ -35,5 +45,15 @@ export STRIP=$TOOLCHAIN/bin/$TARGET-strip
 echo "Building native code (armv7a)"
 $CC \
 cobble_events.c \
+cobble_characteristics.c \
+cobble_uuid.c \
+cobble_connections.c \
+cobble_crc32.c \
+cobble_dfu.c \
+cobble_gatt_cache.c \
+cobble_scan_table.c \
+cobble_scan_filter.c \
+cobble_ad.c \
+cobble_status.c \
 platforms/android/AndroidBLE.c \
 -fPIC -shared -llog -o ./build/libCobble_android_armv7a.so
@@ -0,0 +1,101 @@
+mkdir -p build/bench
+
+# Benchmarks for the platform-neutral core (Linux, glibc)
+# These drive the event functions directly, so no Bluetooth backend or hardware is required
+
+gcc -O2 -c cobble_ring.c -o build/bench/cobble_ring.o
+gcc -O2 -c cobble_pool.c -o build/bench/cobble_pool.o
+gcc -O2 -c cobble_characteristics.c -o build/bench/cobble_characteristics.o
+gcc -O2 -c cobble_uuid.c -o build/bench/cobble_uuid.o
+gcc -O2 -c cobble_connections.c -o build/bench/cobble_connections.o
+gcc -O2 -c cobble_crc32.c -o build/bench/cobble_crc32.o
+gcc -O2 -c cobble_dfu.c -o build/bench/cobble_dfu.o
+gcc -O2 -c cobble_gatt_cache.c -o build/bench/cobble_gatt_cache.o
+gcc -O2 -c cobble_scan_table.c -o build/bench/cobble_scan_table.o
+gcc -O2 -c cobble_scan_filter.c -o build/bench/cobble_scan_filter.o
+gcc -O2 -c cobble_ad.c -o build/bench/cobble_ad.o
+gcc -O2 -c cobble_status.c -o build/bench/cobble_status.o
+g++ -O2 -c cobble_events_win.cpp -o build/bench/cobble_events_win.o
+gcc -O2 -c ../bench/alloc_count.c -o build/bench/alloc_count.o
+
+CORE="build/bench/cobble_ring.o build/bench/cobble_pool.o build/bench/cobble_characteristics.o build/bench/cobble_uuid.o build/bench/cobble_connections.o build/bench/cobble_scan_table.o build/bench/cobble_scan_filter.o build/bench/cobble_ad.o build/bench/cobble_status.o build/bench/cobble_events_win.o build/bench/alloc_count.o"
+
+gcc -O2 ../bench/value_update.c $CORE -lstdc++ -pthread -o build/bench_value_update
+
+# The ring on its own, with several producer and consumer threads and a ring that is full most of the time, under both
+# overflow policies. Exits with an error if any entry is lost, torn, duplicated or out of order
+gcc -O2 ../bench/ring_stress.c build/bench/cobble_ring.o -pthread -o build/bench_ring_stress
+
+# Threads queuing values while the application sleeps until there are events, waking it at the moment it clears the last
+# wake, while the dispatcher is started and stopped, and while values are drained. Exits with an error if any wake is
+# lost, a stop hangs or draining leaves the wake set
+gcc -O2 ../bench/event_wake.c $CORE -lstdc++ -pthread -o build/bench_event_wake
+
+# Value updates taken a call at a time against in batches, as bindings in other languages take them
+gcc -O2 ../bench/batch_drain.c $CORE -lstdc++ -pthread -o build/bench_batch_drain
+
+# The order events are delivered in, and how long a backlog of values holds up the next connection event, taking them
+# all at once or a frame at a time
+gcc -O2 ../bench/event_order.c $CORE -lstdc++ -pthread -o build/bench_event_order
+
+# Notifications from several connections to a slow consumer, from cobble_queue_process() and from the dispatcher's threads
+gcc -O2 ../bench/dispatch.c $CORE -lstdc++ -pthread -o build/bench_dispatch
+
+# Scan results from many beacons, with and without per-device coalescing
+gcc -O2 ../bench/scan_coalesce.c $CORE -lstdc++ -pthread -o build/bench_scan_coalesce
+
+# Scans among many unwanted devices, with and without a scan filter
+gcc -O2 ../bench/scan_filter.c $CORE -lstdc++ -pthread -o build/bench_scan_filter
+
+# The pipeline benchmark is built against both the deferred core (as used on Windows and Linux) and the realtime core
+# (as used on Apple platforms and Android)
+gcc -O2 -c cobble_events.c -o build/bench/cobble_events.o
+REALTIME_CORE="build/bench/cobble_characteristics.o build/bench/cobble_uuid.o build/bench/cobble_connections.o build/bench/cobble_scan_table.o build/bench/cobble_scan_filter.o build/bench/cobble_ad.o build/bench/cobble_status.o build/bench/cobble_events.o build/bench/alloc_count.o"
+
+gcc -O2 ../bench/pipeline.c $CORE -lstdc++ -pthread -o build/bench_pipeline
+gcc -O2 -DBENCH_REALTIME ../bench/pipeline.c $REALTIME_CORE -pthread -o build/bench_pipeline_realtime
+
+# Readings taken from advertisements, through the raw advertisement callback, against both cores
+gcc -O2 ../bench/ad_ingest.c $CORE -lstdc++ -pthread -o build/bench_ad_ingest
+gcc -O2 -DBENCH_REALTIME ../bench/ad_ingest.c $REALTIME_CORE -pthread -o build/bench_ad_ingest_realtime
+
+# Values from many characteristics, found by comparing UUIDs in the shared callback or sent to each one's own callback,
+# against both cores
+gcc -O2 ../bench/value_route.c $CORE -lstdc++ -pthread -o build/bench_value_route
+gcc -O2 -DBENCH_REALTIME ../bench/value_route.c $REALTIME_CORE -pthread -o build/bench_value_route_realtime
+
+# Aggregate throughput over several connections, using the simulated backend in place of Bluetooth hardware
+gcc -O2 -c platforms/sim/SimBLE.c -o build/bench/SimBLE.o
+SIM="build/bench/SimBLE.o build/bench/cobble_crc32.o build/bench/cobble_dfu.o build/bench/cobble_gatt_cache.o"
+gcc -O2 ../bench/sim_connections.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_connections
+
+# Streamed writes against the capacity of the link, also using the simulated backend
+gcc -O2 ../bench/sim_write_stream.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_write_stream
+
+# Firmware updates against the simulated backend's DFU target, with and without receipts, corruption and reconnection
+gcc -O2 ../bench/sim_dfu.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_dfu
+
+# CPU used waiting for events by spinning, sleeping, cobble_queue_wait() and cobble_event_fd(), also using the simulated backend
+gcc -O2 ../bench/sim_idle_wait.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_idle_wait
+
+# Reconnect-to-first-write latency with and without the GATT cache, also using the simulated backend
+gcc -O2 ../bench/sim_reconnect.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_reconnect
+
+# The library's status as connections to two devices overlap, also using the simulated backend. Exits with an error if
+# the status doesn't follow the connections
+gcc -O2 ../bench/sim_status.c $SIM $CORE -lstdc++ -pthread -o build/bench_sim_status
+
+# The BlueZ benchmarks need the libdbus development files (eg libdbus-1-dev)
+if pkg-config --exists dbus-1; then
+    DBUS_CFLAGS=$(pkg-config --cflags dbus-1)
+    DBUS_LIBS=$(pkg-config --libs dbus-1)
+    gcc -O2 $DBUS_CFLAGS -c platforms/bluez/BlueZNotify.c -o build/bench/BlueZNotify.o
+    gcc -O2 $DBUS_CFLAGS ../bench/bluez_notify.c build/bench/BlueZNotify.o $CORE $DBUS_LIBS -lstdc++ -pthread -o build/bench_bluez_notify
+
+    # The BlueZ backend against a fake bluetoothd on a private bus (which needs dbus-daemon to run). Exits with an error
+    # if any check fails
+    gcc -O2 $DBUS_CFLAGS -c platforms/bluez/BlueZBLE.c -o build/bench/BlueZBLE.o
+    gcc -O2 $DBUS_CFLAGS ../bench/bluez_fake.c build/bench/BlueZBLE.o build/bench/BlueZNotify.o $CORE $DBUS_LIBS -lstdc++ -pthread -o build/bench_bluez_fake
+else
+    echo "libdbus not found - skipping bench_bluez_notify and bench_bluez_fake"
+fi
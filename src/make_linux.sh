@@ -0,0 +1,30 @@
+mkdir -p build/linux
+
+# Linux (BlueZ), talking to bluetoothd over D-Bus. Requires the libdbus development files (eg libdbus-1-dev).
+# Events are deferred until cobble_queue_process() is called, as on Windows.
+DBUS_CFLAGS=$(pkg-config --cflags dbus-1)
+DBUS_LIBS=$(pkg-config --libs dbus-1)
+
+gcc -O2 -fPIC -c cobble_ring.c -o build/linux/cobble_ring.o
+gcc -O2 -fPIC -c cobble_pool.c -o build/linux/cobble_pool.o
+gcc -O2 -fPIC -c cobble_characteristics.c -o build/linux/cobble_characteristics.o
+gcc -O2 -fPIC -c cobble_uuid.c -o build/linux/cobble_uuid.o
+gcc -O2 -fPIC -c cobble_connections.c -o build/linux/cobble_connections.o
+gcc -O2 -fPIC -c cobble_crc32.c -o build/linux/cobble_crc32.o
+gcc -O2 -fPIC -c cobble_dfu.c -o build/linux/cobble_dfu.o
+gcc -O2 -fPIC -c cobble_gatt_cache.c -o build/linux/cobble_gatt_cache.o
+gcc -O2 -fPIC -c cobble_scan_table.c -o build/linux/cobble_scan_table.o
+gcc -O2 -fPIC -c cobble_scan_filter.c -o build/linux/cobble_scan_filter.o
+gcc -O2 -fPIC -c cobble_ad.c -o build/linux/cobble_ad.o
+gcc -O2 -fPIC -c cobble_status.c -o build/linux/cobble_status.o
+g++ -O2 -fPIC -c cobble_events_win.cpp -o build/linux/cobble_events_win.o
+gcc -O2 -fPIC $DBUS_CFLAGS -c platforms/bluez/BlueZBLE.c -o build/linux/BlueZBLE.o
+gcc -O2 -fPIC $DBUS_CFLAGS -c platforms/bluez/BlueZNotify.c -o build/linux/BlueZNotify.o
+
+CORE="build/linux/cobble_ring.o build/linux/cobble_pool.o build/linux/cobble_characteristics.o build/linux/cobble_uuid.o build/linux/cobble_connections.o build/linux/cobble_crc32.o build/linux/cobble_dfu.o build/linux/cobble_gatt_cache.o build/linux/cobble_scan_table.o build/linux/cobble_scan_filter.o build/linux/cobble_ad.o build/linux/cobble_status.o build/linux/cobble_events_win.o build/linux/BlueZBLE.o build/linux/BlueZNotify.o"
+
+# Test executable
+gcc -O2 cobble_scan_example.c $CORE $DBUS_LIBS -lstdc++ -pthread -o build/cobble_linux
+
+# Library, as loaded by the Python binding
+g++ -shared $CORE $DBUS_LIBS -pthread -o build/cobble.so
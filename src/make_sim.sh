@@ -0,0 +1,24 @@
+mkdir -p build/sim
+
+# Simulated backend (Linux), with a scripted virtual peripheral in place of a radio - see platforms/sim/SimBLE.h
+# Link against build/cobble_sim.so instead of build/cobble.so to run an application without Bluetooth hardware.
+# Events are deferred until cobble_queue_process() is called, as on Linux and Windows.
+
+gcc -O2 -fPIC -c cobble_ring.c -o build/sim/cobble_ring.o
+gcc -O2 -fPIC -c cobble_pool.c -o build/sim/cobble_pool.o
+gcc -O2 -fPIC -c cobble_characteristics.c -o build/sim/cobble_characteristics.o
+gcc -O2 -fPIC -c cobble_uuid.c -o build/sim/cobble_uuid.o
+gcc -O2 -fPIC -c cobble_connections.c -o build/sim/cobble_connections.o
+gcc -O2 -fPIC -c cobble_crc32.c -o build/sim/cobble_crc32.o
+gcc -O2 -fPIC -c cobble_dfu.c -o build/sim/cobble_dfu.o
+gcc -O2 -fPIC -c cobble_gatt_cache.c -o build/sim/cobble_gatt_cache.o
+gcc -O2 -fPIC -c cobble_scan_table.c -o build/sim/cobble_scan_table.o
+gcc -O2 -fPIC -c cobble_scan_filter.c -o build/sim/cobble_scan_filter.o
+gcc -O2 -fPIC -c cobble_ad.c -o build/sim/cobble_ad.o
+gcc -O2 -fPIC -c cobble_status.c -o build/sim/cobble_status.o
+g++ -O2 -fPIC -c cobble_events_win.cpp -o build/sim/cobble_events_win.o
+gcc -O2 -fPIC -c platforms/sim/SimBLE.c -o build/sim/SimBLE.o
+
+CORE="build/sim/cobble_ring.o build/sim/cobble_pool.o build/sim/cobble_characteristics.o build/sim/cobble_uuid.o build/sim/cobble_connections.o build/sim/cobble_crc32.o build/sim/cobble_dfu.o build/sim/cobble_gatt_cache.o build/sim/cobble_scan_table.o build/sim/cobble_scan_filter.o build/sim/cobble_ad.o build/sim/cobble_status.o build/sim/cobble_events_win.o build/sim/SimBLE.o"
+
+g++ -shared $CORE -pthread -o build/cobble_sim.so
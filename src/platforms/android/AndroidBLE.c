@@ -1,5 +1,11 @@
 #include "../../cobble.h"
 #include "../../cobble_events.h"
+#include "../../cobble_characteristics.h"
+#include "../../cobble_connections.h"
+#include "../../cobble_ad.h"
+#include "../../cobble_scan_filter.h"
+#include "../../cobble_scan_table.h"
+#include "../../cobble_status.h"
 
 #include <jni.h>
 #include <android/log.h>
@@ -8,17 +14,6 @@
 #include <string.h>
 #include <unistd.h>
 
-CobbleStatus status = Uninitialised;
-CobbleErrorCode error_code = NoError;
-
-CobbleStatus cobble_status(void) {
-    return status;
-}
-
-CobbleErrorCode cobble_error_get(void) {
-    return error_code;
-}
-
 static JNIEnv* env = NULL;
 static JavaVM* gJVM;
 
@@ -84,17 +79,94 @@ void cobble_write(const char* characteristic_uuid, uint8_t *data, int len) {
     }
 }
 
-void cobble_connect(const char* identifier) {
+// The Java side connects to one device at a time, so there is only ever one connection handle in use
+static cobble_conn_handle currentConnection = COBBLE_CONNECTION_NONE;
+
+// The ATT MTU before any exchange, and so the smallest a connection can have
+#define DEFAULT_ATT_MTU 23
+
+// As reported by onMtuChanged. The Java side asks for the largest as soon as it connects.
+static volatile int attMtu = DEFAULT_ATT_MTU;
+static bool mtuReported = false;
+
+// The Java side copies the chunks out of the array it is given, and reports the end of the stream with writecomplete()
+bool cobble_write_stream(const char* characteristic_uuid, const uint8_t* data, int len) {
+
+    if (!cobble_connection_valid(currentConnection)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Not connected, cannot write a stream");
+        return false;
+    }
+
+    if (len < 0 || (len > 0 && data == NULL)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Cannot write %i bytes", len);
+        return false;
+    }
+
+    jbyteArray jarr_data = (*env)->NewByteArray(env, len);
+    (*env)->SetByteArrayRegion(env, jarr_data, 0, len, (const jbyte*)data);
+    jstring jstr_characteristic_uuid = (*env)->NewStringUTF(env, characteristic_uuid);
+
+    jclass cls = _GetImpl();
+    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_write_stream", "(Ljava/lang/String;[BI)V");
+    if (mid == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"void cobble_write_stream(String, byte[], int)\" not found");
+        return false;
+    }
+
+    (*env)->CallStaticVoidMethod(env, cls, mid, jstr_characteristic_uuid, jarr_data, (jint)cobble_max_writesize_get(false));
+    return true;
+}
+
+static void connection_ended(void) {
+    cobble_connection_close(currentConnection);
+    currentConnection = COBBLE_CONNECTION_NONE;
+    attMtu = DEFAULT_ATT_MTU;
+    mtuReported = false;
+}
+
+cobble_conn_handle cobble_connect(const char* identifier) {
+    return cobble_connect_ex(identifier, NULL, ConnectFlag_None);
+}
+
+// The list is passed on in full form, which java.util.UUID can parse. The stack keeps its own GATT cache, so
+// ConnectFlag_Uncached makes no difference.
+cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags) {
+
+    uint64_t address = COBBLE_ADDRESS_NONE;
+    cobble_uuid services[COBBLE_MAX_CONNECT_SERVICES];
+    char list[COBBLE_MAX_CONNECT_SERVICES * COBBLE_UUID_STRING_LENGTH] = "";
+
+    if (cobble_connection_valid(currentConnection)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Only one device can be connected at a time on this platform");
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    // Identifiers are MAC addresses
+    cobble_address_parse(identifier, &address);
+    currentConnection = cobble_connection_open(address);
+    if (currentConnection == COBBLE_CONNECTION_NONE)
+        return COBBLE_CONNECTION_NONE;
+
+    int count = cobble_uuid_list_parse(service_uuids, services, COBBLE_MAX_CONNECT_SERVICES);
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            strcat(list, ",");
+        cobble_uuid_format(&services[i], list + strlen(list));
+    }
 
     jstring jstr = (*env)->NewStringUTF(env, identifier);
+    jstring jstr_services = (*env)->NewStringUTF(env, list);
 
     jclass cls = _GetImpl();
-    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_connect", "(Ljava/lang/String;)V");
+    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_connect", "(Ljava/lang/String;Ljava/lang/String;I)V");
     if (mid == NULL) {
-        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"void cobble_connect(String)\" not found");
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"void cobble_connect(String, String, int)\" not found");
+        connection_ended();
     } else {
-        (*env)->CallStaticVoidMethod(env, cls, mid, jstr);
+        (*env)->CallStaticVoidMethod(env, cls, mid, jstr, jstr_services, (jint)flags);
     }
+
+    return currentConnection;
 }
 
 void cobble_disconnect(void) {
@@ -107,24 +179,51 @@ void cobble_init(void) {
 
 void cobble_deinit(void) {
     call_static_void_function("cobble_deinit");
+    connection_ended();
 }
 
 void cobble_scan_stop(void) {
     call_static_void_function("cobble_scan_stop");
 }
 
+// The whole filter goes to Java, which gives services and manufacturer data to the controller and checks the rest before
+// results are passed back, so nothing is filtered here
 void cobble_scan_start(const char* service_uuids) {
 
+    cobble_scan_table_clear();
+
+    const cobble_scan_criteria* filter = cobble_scan_filter_begin(service_uuids);
+    char services[COBBLE_SCAN_FILTER_MAX_SERVICES * COBBLE_UUID_STRING_LENGTH] = "";
+    for (int i = 0; i < filter->serviceCount && (filter->fields & ScanField_Services); i++) {
+        char uuid[COBBLE_UUID_STRING_LENGTH];
+        cobble_uuid_format(&filter->services[i], uuid);
+        if (i > 0)
+            strcat(services, ",");
+        strcat(services, uuid);
+    }
+
     jclass cls = _GetImpl();
-    jstring jstr = (*env)->NewStringUTF(env, service_uuids);
+    jstring jstr = (*env)->NewStringUTF(env, services);
+    jstring jname = (filter->fields & ScanField_Name) ? (*env)->NewStringUTF(env, filter->namePrefix) : NULL;
+
+    // No data (rather than empty data) when the filter doesn't look at manufacturer data
+    jbyteArray jdata = NULL;
+    jbyteArray jmask = NULL;
+    if (filter->fields & ScanField_Manufacturer) {
+        jdata = (*env)->NewByteArray(env, filter->manufacturerLength);
+        jmask = (*env)->NewByteArray(env, filter->manufacturerLength);
+        (*env)->SetByteArrayRegion(env, jdata, 0, filter->manufacturerLength, (const jbyte*)filter->manufacturerData);
+        (*env)->SetByteArrayRegion(env, jmask, 0, filter->manufacturerLength, (const jbyte*)filter->manufacturerMask);
+    }
 
-    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_scan_start", "(Ljava/lang/String;)V");
+    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_scan_start", "(Ljava/lang/String;I[B[BLjava/lang/String;I)V");
     if (mid == NULL) {
-        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"void cobble_scan_start(String)\" not found");
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"void cobble_scan_start(String, int, byte[], byte[], String, int)\" not found");
     } else {
-        (*env)->CallStaticVoidMethod(env, cls, mid, jstr);
+        (*env)->CallStaticVoidMethod(env, cls, mid, jstr, (jint)filter->manufacturerId, jdata, jmask, jname,
+            (jint)((filter->fields & ScanField_Rssi) ? filter->rssiMin : 0));
     }
-    
+
 }
 
 void cobble_subscribe(const char* characteristic) {
@@ -141,59 +240,195 @@ void cobble_subscribe(const char* characteristic) {
 
 }
 
+// Characteristics are looked up by UUID on the Java side, so the handle versions simply resolve the UUID string
+static const char* handle_uuid(cobble_char_handle characteristic) {
+    const char* uuid = cobble_characteristic_uuid(characteristic);
+    if (uuid == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Unknown characteristic handle %i", (int)characteristic);
+    }
+    return uuid;
+}
+
+void cobble_read_h(cobble_char_handle characteristic) {
+    const char* uuid = handle_uuid(characteristic);
+    if (uuid != NULL)
+        cobble_read(uuid);
+}
+
+void cobble_subscribe_h(cobble_char_handle characteristic) {
+    const char* uuid = handle_uuid(characteristic);
+    if (uuid != NULL)
+        cobble_subscribe(uuid);
+}
+
+void cobble_write_h(cobble_char_handle characteristic, uint8_t *data, int len) {
+    const char* uuid = handle_uuid(characteristic);
+    if (uuid != NULL)
+        cobble_write(uuid, data, len);
+}
+
+bool cobble_write_stream_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    const char* uuid = handle_uuid(characteristic);
+    return uuid != NULL && cobble_write_stream(uuid, data, len);
+}
+
+// Writes with response could be longer, as Android turns them into long writes, but that takes several round trips
 int cobble_max_writesize_get(bool withResponse) {
-    return 20; // Minimum spec value. Always safe, but slow.
+    return attMtu - 3;
+}
+
+bool cobble_mtu_request(int mtu) {
+
+    if (!cobble_connection_valid(currentConnection)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Not connected, cannot request an MTU");
+        return false;
+    }
+    if (mtu < DEFAULT_ATT_MTU || mtu > COBBLE_MAX_ATT_MTU) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Cannot request an MTU of %i", mtu);
+        return false;
+    }
+
+    jclass cls = _GetImpl();
+    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_mtu_request", "(I)Z");
+    if (mid == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"boolean cobble_mtu_request(int)\" not found");
+        return false;
+    }
+
+    return (*env)->CallStaticBooleanMethod(env, cls, mid, (jint)mtu);
+}
+
+bool cobble_discover_service(const char* service_uuid) {
+
+    cobble_uuid uuid;
+    char uuidString[COBBLE_UUID_STRING_LENGTH];
+
+    if (service_uuid == NULL || !cobble_uuid_parse(service_uuid, &uuid)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Could not create Service UUID from \"%s\"", service_uuid ? service_uuid : "(null)");
+        return false;
+    }
+    if (!cobble_connection_valid(currentConnection)) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Not connected, cannot discover a service");
+        return false;
+    }
+
+    cobble_uuid_format(&uuid, uuidString);
+    jstring jstr = (*env)->NewStringUTF(env, uuidString);
+
+    jclass cls = _GetImpl();
+    jmethodID mid = (*env)->GetStaticMethodID(env, cls, "cobble_discover_service", "(Ljava/lang/String;)Z");
+    if (mid == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "Method \"boolean cobble_discover_service(String)\" not found");
+        return false;
+    }
+
+    return (*env)->CallStaticBooleanMethod(env, cls, mid, jstr);
+}
+
+// Only the current connection can be operated on
+static bool is_current(cobble_conn_handle connection) {
+    if (connection != COBBLE_CONNECTION_NONE && connection == currentConnection)
+        return true;
+    __android_log_print(ANDROID_LOG_ERROR, "TRACKERS", "No connection has handle %i", (int)connection);
+    return false;
+}
+
+void cobble_disconnect_c(cobble_conn_handle connection) {
+    if (is_current(connection))
+        cobble_disconnect();
+}
+
+bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid) {
+    return is_current(connection) && cobble_discover_service(service_uuid);
+}
+
+void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    if (is_current(connection))
+        cobble_subscribe_h(characteristic);
+}
+
+void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_characteristic_cb_set(characteristic, cb, ctx);
+    cobble_subscribe_h(characteristic);
+}
+
+void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    if (is_current(connection))
+        cobble_subscribe_cb(characteristic, cb, ctx);
+}
+
+void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    if (is_current(connection))
+        cobble_read_h(characteristic);
+}
+
+void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t *data, int len) {
+    if (is_current(connection))
+        cobble_write_h(characteristic, data, len);
+}
+
+int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse) {
+    return is_current(connection) ? cobble_max_writesize_get(withResponse) : 0;
+}
+
+bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu) {
+    return is_current(connection) && cobble_mtu_request(mtu);
+}
+
+bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    return is_current(connection) && cobble_write_stream_h(characteristic, data, len);
 }
 
 JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_SetStatus(JNIEnv* env, jobject obj, jint newStatus) {
 
     // We handle it this way to avoid needing duplicate definitions of CobbleStatus and CobbleErrorCode between C and Java
+    // Java only reports Initialised as the end of cobble_init() and then when a scan or a connection ends, which mustn't
+    // clear an error such as the adapter being turned off, so only the first can leave Uninitialised
     switch(newStatus) {
         case 0:
-            status = Uninitialised;
+            cobble_status_set(Uninitialised);
             break;
         case 1:
-            status = Initialised;
+            if (cobble_status() == Uninitialised)
+                cobble_status_set(Initialised);
+            else
+                cobble_status_update(Initialised);
             break;
         case 2:
-            status = Scanning;
+            cobble_status_update(Scanning);
             break;
         case 3:
-            status = Connecting;
+            cobble_status_update(Connecting);
             break;
         case 4:
-            status = Connected;
+            cobble_status_update(Connected);
             break;
         default:
-            status = CobbleError; // Unhandled error code - Java code has a value the native code doesn't
+            cobble_status_error(UnknownError); // Unhandled status - Java code has a value the native code doesn't
             break;
     }
-    status = newStatus;
 }
 
 JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_SetError(JNIEnv* env, jobject obj, jint newError) {
 
-    status = CobbleError; // Setting the error code implies our base status should also be an error
-
+    // Setting the error code implies our base status should also be an error
     switch(newError) {
         case 0:
-            error_code = NoError;
+            cobble_status_error(NoError);
             break;
         case 1:
-            error_code = HardwareUnsupported;
+            cobble_status_error(HardwareUnsupported);
             break;
         case 2:
-            error_code = HardwareTurnedOff;
+            cobble_status_error(HardwareTurnedOff);
             break;
         case 3:
-            error_code = PermissionsNotGranted;
+            cobble_status_error(PermissionsNotGranted);
             break;
         default:
-            error_code = UnknownError;
+            cobble_status_error(UnknownError);
             break;
     }
-
-
 }
 
 JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_scanresult(JNIEnv* env, jobject obj, jstring name, jint rssi, jstring identifier) {
@@ -204,6 +439,24 @@ JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_scanresult(JNIEnv*
     (*env)->ReleaseStringUTFChars(env, identifier, nativeIdent);
 }
 
+// The advertisement and scan response as received (ScanRecord.getBytes()), copied out of the Java array only if anything
+// is listening for them
+JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_advertisement(JNIEnv* env, jobject obj, jstring identifier, jint rssi, jbyteArray j_arr) {
+
+    if (!cobble_event_advertisement_wanted() || j_arr == NULL)
+        return;
+
+    uint8_t data[COBBLE_AD_MAX_LENGTH];
+    jint num_bytes = (*env)->GetArrayLength(env, j_arr);
+    if (num_bytes > COBBLE_AD_MAX_LENGTH)
+        num_bytes = COBBLE_AD_MAX_LENGTH;
+    (*env)->GetByteArrayRegion(env, j_arr, 0, num_bytes, (jbyte*)data);
+
+    char* nativeIdent = (char*)((*env)->GetStringUTFChars(env, identifier, 0));
+    cobble_event_advertisement(nativeIdent, (int) rssi, data, (int) num_bytes);
+    (*env)->ReleaseStringUTFChars(env, identifier, nativeIdent);
+}
+
 JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_Connected(JNIEnv* env, jobject obj, jstring str) {
 
     char* nativeString = (char*)((*env)->GetStringUTFChars(env, str, 0));
@@ -219,6 +472,7 @@ JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_Disconnected(JNIEnv
     char* nativeString = (char*)((*env)->GetStringUTFChars(env, str, 0));
 
     cobble_event_connectionstatus(nativeString, ConnectionStatus_DidDisconnect);
+    connection_ended();
 
     (*env)->ReleaseStringUTFChars(env, str, nativeString);
 
@@ -229,11 +483,24 @@ JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_ConnectError(JNIEnv
     char* nativeString = (char*)((*env)->GetStringUTFChars(env, str, 0));
 
     cobble_event_connectionstatus(nativeString, ConnectionStatus_DidConnectFailed);
+    connection_ended();
     
     (*env)->ReleaseStringUTFChars(env, str, nativeString);
 
 }
 
+JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_mtuchanged(JNIEnv* env, jobject obj, jint mtu) {
+
+    // Asking again for the same MTU reports it again
+    if (mtu < DEFAULT_ATT_MTU || (mtuReported && mtu == attMtu))
+        return;
+
+    attMtu = mtu;
+    mtuReported = true;
+    cobble_event_mtuchanged(currentConnection, mtu, mtu - 3, mtu - 3);
+
+}
+
 JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_characteristicupdate(JNIEnv* env, jobject obj, jstring str, jbyteArray j_arr) {
 
     char* uuid = (char*)((*env)->GetStringUTFChars(env, str, 0));
@@ -257,3 +524,19 @@ JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_characteristicdisco
 
 }
 
+JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_discoverycomplete(JNIEnv* env, jobject obj, jint services, jint characteristics, jint elapsedMs) {
+
+    cobble_event_discoverycomplete(currentConnection, services, characteristics, elapsedMs);
+
+}
+
+JNIEXPORT void JNICALL Java_com_cjb248_cobble_AndroidBLEImpl_writecomplete(JNIEnv* env, jobject obj, jstring j_uuid, jint written, jint writeStatus) {
+
+    char* uuid = (char*)((*env)->GetStringUTFChars(env, j_uuid, 0));
+
+    cobble_event_writecomplete(currentConnection, cobble_characteristic_intern(uuid), (int)written, (int)writeStatus);
+
+    (*env)->ReleaseStringUTFChars(env, j_uuid, uuid);
+
+}
+
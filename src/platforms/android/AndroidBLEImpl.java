@@ -22,13 +22,16 @@ import android.content.Context;
 import android.content.Intent;
 import android.content.pm.PackageManager;
 import android.os.ParcelUuid;
+import android.os.SystemClock;
 import android.util.Log;
+import android.util.SparseArray;
 import java.lang.reflect.Field;
 import java.util.ArrayList;
 import java.util.HashMap;
 import java.util.List;
 import java.util.UUID;
 import java.util.concurrent.ArrayBlockingQueue;
+import java.util.concurrent.CopyOnWriteArraySet;
 import java.util.concurrent.BlockingQueue;
 import java.util.concurrent.TimeUnit;
 
@@ -38,18 +41,25 @@ public class AndroidBLEImpl {
     private static enum GattOperationType {
         SubscribeCharacteristic,
         ReadCharacteristic,
-        WriteCharacteristic
+        WriteCharacteristic,
+        WriteStreamChunk,
+        RequestMtu
     }
 
     private static class QueuedGattOperation {
         BluetoothGattCharacteristic c;
         byte[] data;
         GattOperationType operation;
+        int mtu;
         public QueuedGattOperation(BluetoothGattCharacteristic characteristic, byte[] characteristicData, GattOperationType operationType) {
             c = characteristic;
             data = characteristicData;
             operation = operationType;
         }
+        public QueuedGattOperation(int requestedMtu) {
+            operation = GattOperationType.RequestMtu;
+            mtu = requestedMtu;
+        }
     }
 
     private static BluetoothAdapter mBluetoothAdapter;
@@ -62,6 +72,11 @@ public class AndroidBLEImpl {
     private static BluetoothLeScanner mLEScanner;
     private static ScanSettings scanSettings;
     private static List<ScanFilter> scanFilters;
+    // The parts of the scan filter that a ScanFilter can't hold, checked as each result comes in
+    private static String scanNamePrefix;
+    private static int scanRssiMin;
+    private static byte[] scanManufacturerData;
+    private static byte[] scanManufacturerMask;
     private static BluetoothGatt mGatt;
 
     private static HashMap<String, BluetoothDevice> deviceCache = new HashMap<String, BluetoothDevice>();
@@ -69,12 +84,38 @@ public class AndroidBLEImpl {
     private static String currentDeviceIdentifier;
     private static BlockingQueue<QueuedGattOperation> queuedOperations = new ArrayBlockingQueue<>(1024); //Allocate memory in advance
     private static boolean operationInProgress = false;
+    private static QueuedGattOperation currentOperation;
+
+    // The block being written by cobble_write_stream(), queued a chunk at a time. The stack calls onCharacteristicWrite
+    // for writes without response too, once it has taken the packet, so that is also the signal to send the next chunk.
+    private static BluetoothGattCharacteristic streamCharacteristic;
+    private static byte[] streamData;
+    private static int streamChunkSize;
+    private static int streamSent;
+    private static int streamWritten;
+
+    // The largest ATT MTU, asked for as soon as the device connects. Services are discovered once the exchange is done,
+    // as both are GATT operations and only one can be in progress at a time.
+    private static final int MAX_ATT_MTU = 517;
+    private static boolean discoveryPending = false;
+    private static long connectedAt;
+
+    // The stack always discovers every service, but only those asked for by cobble_connect() and cobble_discover_service()
+    // are reported, unless connectAllServices. The others are kept, to be reported from the stack's table when asked for.
+    private static final int ConnectFlag_NoDiscovery = 1;
+    private static CopyOnWriteArraySet<UUID> connectServices = new CopyOnWriteArraySet<UUID>();
+    private static boolean connectAllServices = true;
+    private static boolean servicesDiscovered = false;
 
     protected static final UUID CHARACTERISTIC_UPDATE_NOTIFICATION_DESCRIPTOR_UUID = UUID.fromString("00002902-0000-1000-8000-00805f9b34fb");
 
     private static native void scanresult(String name, int RSSI, String identifier);
+    private static native void advertisement(String identifier, int RSSI, byte[] data);
     private static native void characteristicupdate(String uuid, byte[] packet, String identifier);
     private static native void characteristicdiscovered(String svc_uuid, String char_uuid);
+    private static native void writecomplete(String uuid, int written, int status);
+    private static native void mtuchanged(int mtu);
+    private static native void discoverycomplete(int services, int characteristics, int elapsedMs);
 
     private static native void Connected(String name);
     private static native void Disconnected(String name);
@@ -90,6 +131,10 @@ public class AndroidBLEImpl {
     private static final int Status_Connecting = 3;
     private static final int Status_Connected = 4;
 
+    private static final int WriteStatus_Complete = 0;
+    private static final int WriteStatus_Failed = 1;
+    private static final int WriteStatus_Busy = 2;
+
     private static final int Error_NoError = 0;
     private static final int Error_HardwareUnsupported = 1;
     private static final int Error_HardwareTurnedOff = 2;
@@ -175,7 +220,8 @@ public class AndroidBLEImpl {
         
     }
 
-    private static void cobble_connect(String identifier) {
+    // service_uuids is a comma-separated list of full UUIDs, or empty for every service
+    private static void cobble_connect(String identifier, String service_uuids, int flags) {
 
         Log.d("BLEImpl", "Connecting to " + identifier);
         BluetoothDevice dev = deviceCache.get(identifier);
@@ -190,6 +236,13 @@ public class AndroidBLEImpl {
             return;
         }
 
+        connectServices.clear();
+        if(!service_uuids.equals("")) {
+            for(String s: service_uuids.split(","))
+                connectServices.add(UUID.fromString(s));
+        }
+        connectAllServices = connectServices.isEmpty() && (flags & ConnectFlag_NoDiscovery) == 0;
+
         currentDeviceIdentifier = identifier;
         SetStatus(Status_Connecting);
         mGatt = dev.connectGatt(getCurrentActivity(), false, gattCallback, BluetoothDevice.TRANSPORT_LE);
@@ -247,6 +300,138 @@ public class AndroidBLEImpl {
 
     }
 
+    private static void cobble_write_stream(String characteristicUuidString, byte[] data, int chunkSize) {
+
+        BluetoothGattCharacteristic c = characteristicCache.get(characteristicUuidString.toUpperCase());
+
+        if(streamData != null) {
+            Log.e("BLEImpl", "A stream is already being written to this device");
+            writecomplete(characteristicUuidString, 0, WriteStatus_Busy);
+            return;
+        }
+
+        if(c == null || (c.getProperties() & (BluetoothGattCharacteristic.PROPERTY_WRITE | BluetoothGattCharacteristic.PROPERTY_WRITE_NO_RESPONSE)) == 0) {
+            Log.e("BLEImpl", "Failed to find writable " + characteristicUuidString + " in cache when trying to write a stream.");
+            writecomplete(characteristicUuidString, 0, WriteStatus_Failed);
+            return;
+        }
+
+        // Android sets the write type from the properties when it discovers the characteristic, so this is without
+        // response wherever it can be
+        streamCharacteristic = c;
+        streamData = data;
+        streamChunkSize = chunkSize;
+        streamSent = 0;
+        streamWritten = 0;
+
+        if(data.length == 0)
+            endStream(WriteStatus_Complete);
+        else
+            queueStreamChunk();
+
+    }
+
+    private static void queueStreamChunk() {
+
+        int length = Math.min(streamChunkSize, streamData.length - streamSent);
+        byte[] chunk = new byte[length];
+        System.arraycopy(streamData, streamSent, chunk, 0, length);
+        streamSent += length;
+
+        addToQueueAndProcess(new QueuedGattOperation(streamCharacteristic, chunk, GattOperationType.WriteStreamChunk));
+
+    }
+
+    private static void endStream(int status) {
+
+        if(streamData == null)
+            return;
+
+        String uuid = streamCharacteristic.getUuid().toString();
+        int written = streamWritten;
+        streamCharacteristic = null;
+        streamData = null;
+        writecomplete(uuid, written, status);
+
+    }
+
+    // Called once the stack has finished with each chunk, whether or not it was written
+    private static void streamChunkDone(QueuedGattOperation op, boolean success) {
+
+        if(streamData == null || op.c != streamCharacteristic)
+            return;
+
+        if(!success) {
+            endStream(WriteStatus_Failed);
+            return;
+        }
+
+        streamWritten += op.data.length;
+        if(streamSent < streamData.length)
+            queueStreamChunk();
+        else
+            endStream(WriteStatus_Complete);
+
+    }
+
+    private static boolean cobble_mtu_request(int mtu) {
+
+        if(mGatt == null) {
+            Log.e("BLEImpl", "Not connected, cannot request an MTU");
+            return false;
+        }
+
+        addToQueueAndProcess(new QueuedGattOperation(mtu));
+        return true;
+
+    }
+
+    private static boolean cobble_discover_service(String serviceUuidString) {
+
+        if(mGatt == null) {
+            Log.e("BLEImpl", "Not connected, cannot discover a service");
+            return false;
+        }
+
+        UUID uuid = UUID.fromString(serviceUuidString);
+        connectServices.add(uuid);
+
+        // Until the stack has discovered the services, this one is reported along with the rest
+        if(!servicesDiscovered)
+            return true;
+
+        BluetoothGattService s = mGatt.getService(uuid);
+        int characteristics = 0;
+        if(s != null)
+            characteristics = reportCharacteristics(s);
+
+        discoverycomplete(s != null ? 1 : 0, characteristics, 0);
+        return true;
+
+    }
+
+    // Returns the number of characteristics reported
+    private static int reportCharacteristics(BluetoothGattService s) {
+
+        int count = 0;
+        for(BluetoothGattCharacteristic c : s.getCharacteristics()) {
+            characteristicdiscovered(s.getUuid().toString(), c.getUuid().toString());
+            count++;
+        }
+        return count;
+
+    }
+
+    // Called once an MTU exchange has finished, whether or not it succeeded
+    private static void mtuExchanged() {
+
+        if(discoveryPending) {
+            discoveryPending = false;
+            mGatt.discoverServices();
+        }
+
+    }
+
     private static void processQueuedOperations() {
 
         //If a write is already in process, don't need to start another - the next item will be handled on callback when the previous one completes
@@ -268,10 +453,12 @@ public class AndroidBLEImpl {
 
         boolean success = false;
         operationInProgress = true;
+        currentOperation = op;
 
         // Process the queued operation according to its type
         switch(op.operation) {
             case WriteCharacteristic:
+            case WriteStreamChunk:
             {
                 //Tell the OS to perform the write
                 op.c.setValue(op.data);
@@ -283,6 +470,11 @@ public class AndroidBLEImpl {
                 success = mGatt.readCharacteristic(op.c);
                 break;
             }
+            case RequestMtu:
+            {
+                success = mGatt.requestMtu(op.mtu);
+                break;
+            }
             case SubscribeCharacteristic:
             {
                 // FIXME: Allow unsubscription
@@ -309,14 +501,19 @@ public class AndroidBLEImpl {
         }
 
         if(!success) {
-            Log.e("BLEImpl", "Failed to prepare an operation of type " + op.operation.name() + " on characteristic " + op.c.getUuid().toString() + " - permissions wrong or another operation pending?");
+            Log.e("BLEImpl", "Failed to prepare an operation of type " + op.operation.name() + (op.c != null ? " on characteristic " + op.c.getUuid().toString() : "") + " - permissions wrong or another operation pending?");
             //Could also be bad device, service, permissions, etc
 
             // Process the next operation in the queue
             operationInProgress = false;
+            currentOperation = null;
+            if(op.operation == GattOperationType.WriteStreamChunk)
+                streamChunkDone(op, false);
+            if(op.operation == GattOperationType.RequestMtu)
+                mtuExchanged();
             processQueuedOperations();
         } else {
-            Log.i("BLEImpl", "Succeeded in preparing operation of type " + op.operation.name() + " on characteristic " + op.c.getUuid().toString());
+            Log.i("BLEImpl", "Succeeded in preparing operation of type " + op.operation.name() + (op.c != null ? " on characteristic " + op.c.getUuid().toString() : ""));
         }
 
     }
@@ -346,21 +543,45 @@ public class AndroidBLEImpl {
         characteristicCache.clear();
         queuedOperations.clear();
         operationInProgress = false;
+        currentOperation = null;
+        streamCharacteristic = null;
+        streamData = null;
+        discoveryPending = false;
+        servicesDiscovered = false;
+        connectServices.clear();
+        connectAllServices = true;
 
     }
 
-    private static void cobble_scan_start(String service_uuids) {
+    // manufacturer_data is null if the filter doesn't look at manufacturer data, and rssi_min is 0 for no minimum
+    private static void cobble_scan_start(String service_uuids, int manufacturer_id, byte[] manufacturer_data, byte[] manufacturer_mask, String name_prefix, int rssi_min) {
         Log.d("BLEImpl", "cobble_scan_start");
         
         if(mLEScanner == null) {
             Log.e("BLEImpl", "Cannot start scanning, mLEScanner is null");
             return;
         }
+
+        // A ScanFilter needs a company identifier to match manufacturer data, so any company is checked here instead
+        boolean manufacturerFiltered = manufacturer_data != null && manufacturer_id >= 0;
+        scanManufacturerData = (manufacturer_data != null && !manufacturerFiltered) ? manufacturer_data : null;
+        scanManufacturerMask = manufacturer_mask;
+        scanNamePrefix = name_prefix;
+        scanRssiMin = rssi_min;
+
+        // One filter per service, as a device need only advertise one of them
         scanFilters.clear();
-        if(service_uuids != null && !service_uuids.equals("")) {
-            String[] uuid_strings = service_uuids.split(",");
-            for(String s: uuid_strings) {
-                scanFilters.add(new ScanFilter.Builder().setServiceUuid(ParcelUuid.fromString(s)).build());
+        String[] uuid_strings = (service_uuids != null && !service_uuids.equals("")) ? service_uuids.split(",") : new String[] { null };
+        for(String s: uuid_strings) {
+            ScanFilter.Builder builder = new ScanFilter.Builder();
+            if(s != null) {
+                builder.setServiceUuid(ParcelUuid.fromString(s));
+            }
+            if(manufacturerFiltered) {
+                builder.setManufacturerData(manufacturer_id, manufacturer_data, manufacturer_mask);
+            }
+            if(s != null || manufacturerFiltered) {
+                scanFilters.add(builder.build());
             }
         }
 
@@ -380,12 +601,37 @@ public class AndroidBLEImpl {
         mLEScanner.stopScan(scanCallback);
     }
 
+    private static boolean manufacturerDataMatches(ScanResult result) {
+        SparseArray<byte[]> manufacturers = result.getScanRecord().getManufacturerSpecificData();
+        for (int i = 0; manufacturers != null && i < manufacturers.size(); i++) {
+            byte[] data = manufacturers.valueAt(i);
+            if (data == null || data.length < scanManufacturerData.length) {
+                continue;
+            }
+            boolean matches = true;
+            for (int j = 0; j < scanManufacturerData.length && matches; j++) {
+                matches = (data[j] & scanManufacturerMask[j]) == scanManufacturerData[j];
+            }
+            if (matches) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     private static ScanCallback scanCallback = new ScanCallback() {
         @Override
         public void onScanResult(int callbackType, ScanResult result) {
             String devName = result.getScanRecord().getDeviceName();
             int RSSI = result.getRssi();
             String identifier = result.getDevice().getAddress();
+            if ((scanRssiMin != 0 && RSSI < scanRssiMin)
+                    || (scanNamePrefix != null && (devName == null || !devName.startsWith(scanNamePrefix)))
+                    || (scanManufacturerData != null && !manufacturerDataMatches(result))) {
+                return;
+            }
+            // Every advertisement, named or not, for devices that broadcast their readings
+            advertisement(identifier, RSSI, result.getScanRecord().getBytes());
             if (devName != null) { //TODO: Handle nameless devices correctly here...
                 // Log.i("BLEImpl", "Scan result: " + devName);
                 //Log.i("BLEImpl", "callbackType " + String.valueOf(callbackType));
@@ -438,6 +684,7 @@ public class AndroidBLEImpl {
                     case BluetoothAdapter.STATE_OFF:
                         Log.e("BLEImpl", "BluetoothAdapter transitioned to STATE_TURNING_OFF or STATE_OFF unexpectedly");
                         if(currentDeviceIdentifier != null) {
+                            endStream(WriteStatus_Failed);
                             ConnectError(currentDeviceIdentifier);
                             cleanupConnection();
                         }
@@ -464,12 +711,17 @@ public class AndroidBLEImpl {
                     Log.i("BLEImpl", "GATT Callback: Connected");
                     SetStatus(Status_Connected);
                     Connected(currentDeviceIdentifier);
-                    gatt.discoverServices();
+                    connectedAt = SystemClock.elapsedRealtime();
+                    discoveryPending = true;
+                    addToQueueAndProcess(new QueuedGattOperation(MAX_ATT_MTU));
                     break;
 
                 case BluetoothProfile.STATE_DISCONNECTED:
                     Log.i("BLEImpl", "GATT Callback: Disconnected");
 
+                    // Before the connection is reported as gone, so the stream's end is still for this connection
+                    endStream(WriteStatus_Failed);
+
                     if(status == BluetoothGatt.GATT_SUCCESS) {
                         SetStatus(Status_Initialised); // Clean disconnection
                         Disconnected(currentDeviceIdentifier);
@@ -500,12 +752,21 @@ public class AndroidBLEImpl {
             List<BluetoothGattService> services = gatt.getServices();
             Log.i("BLEImpl", "Discovered " + services.size() + " services, now caching and reporting characteristics.");
             
+            int reported = 0;
+            int characteristics = 0;
             for(BluetoothGattService s : services) {
-                for(BluetoothGattCharacteristic c : s.getCharacteristics()) {
+                for(BluetoothGattCharacteristic c : s.getCharacteristics())
                     characteristicCache.put(c.getUuid().toString().toUpperCase(), c);
-                    characteristicdiscovered(s.getUuid().toString(), c.getUuid().toString());
+                if(connectAllServices || connectServices.contains(s.getUuid())) {
+                    characteristics += reportCharacteristics(s);
+                    reported++;
                 }
             }
+            servicesDiscovered = true;
+
+            // The stack has looked up every service's characteristics before calling this
+            if(connectAllServices || !connectServices.isEmpty())
+                discoverycomplete(reported, characteristics, (int)(SystemClock.elapsedRealtime() - connectedAt));
 
         }
 
@@ -514,8 +775,13 @@ public class AndroidBLEImpl {
             
             Log.i("BLEImpl", "onCharacteristicWrite " + characteristic.toString() + " " + characteristic.getUuid());
 
+            QueuedGattOperation op = currentOperation;
+
             //Handle next event in queue if required
             operationInProgress = false;
+            currentOperation = null;
+            if(op != null && op.operation == GattOperationType.WriteStreamChunk)
+                streamChunkDone(op, status == BluetoothGatt.GATT_SUCCESS);
             processQueuedOperations();
 
         }
@@ -542,6 +808,22 @@ public class AndroidBLEImpl {
 
         }
 
+        @Override
+        public void onMtuChanged(BluetoothGatt gatt, int mtu, int status) {
+
+            Log.i("BLEImpl", "onMtuChanged " + mtu + " status " + status);
+
+            if(status == BluetoothGatt.GATT_SUCCESS)
+                mtuchanged(mtu);
+
+            //Handle next event in queue if required
+            operationInProgress = false;
+            currentOperation = null;
+            mtuExchanged();
+            processQueuedOperations();
+
+        }
+
         @Override
         public void onDescriptorWrite(BluetoothGatt gatt, BluetoothGattDescriptor descriptor, int status) {
 
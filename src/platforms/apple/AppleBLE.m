@@ -9,41 +9,144 @@
 
 #include "../../cobble.h"
 #include "../../cobble_events.h"
-
-// State exposed to the calling app
-CobbleStatus status = Uninitialised;
-CobbleErrorCode error_code = NoError;
+#include "../../cobble_ad.h"
+#include "../../cobble_characteristics.h"
+#include "../../cobble_connections.h"
+#include "../../cobble_scan_filter.h"
+#include "../../cobble_scan_table.h"
+#include "../../cobble_status.h"
+
+// CoreBluetooth identifies peripherals by UUID rather than by address, and this backend connects to one at a time, so
+// there is only ever one connection handle in use
+static cobble_conn_handle currentConnection = COBBLE_CONNECTION_NONE;
+
+// The largest write without response last reported through an mtuchanged event, 0 before the first
+static NSUInteger reportedWriteSize = 0;
+
+// Services whose characteristics are still being discovered, and what has been found so far. CoreBluetooth looks up
+// every service's characteristics at once, so discovery is complete when the last of them comes back.
+// Services asked for later with cobble_discover_service() are looked up the same way, and counted in with any still
+// pending.
+static int servicesPending = 0;
+static int discoveredServices = 0;
+static int discoveredCharacteristics = 0;
+static CFAbsoluteTime discoveryStarted;
+
+// What cobble_connect_ex() asked to discover: an array of CBUUIDs, or nil for every service
+static NSArray* connectServices = nil;
+static uint32_t connectFlags = ConnectFlag_None;
+
+static void connection_ended(void) {
+    cobble_connection_close(currentConnection);
+    currentConnection = COBBLE_CONNECTION_NONE;
+    reportedWriteSize = 0;
+    servicesPending = 0;
+    [connectServices release];
+    connectServices = nil;
+}
 
 @interface CoreBluetoothBackend : NSObject
 @end
 
 CoreBluetoothBackend* appleBackend = NULL;
 
+// Convert a CBUUID (which may hold a 16-, 32- or 128-bit UUID) to our binary form
+static cobble_uuid uuid_from_cbuuid(CBUUID* uuid) {
+    cobble_uuid u = COBBLE_UUID16(0);
+    NSData* data = [uuid data];
+    cobble_uuid_from_bytes([data bytes], [data length], &u);
+    return u;
+}
+
+// CoreBluetooth only hands over what it has parsed from an advertisement, so it is put back together from that, in the
+// order given in cobble_ad.h
+static int advertisement_from_dictionary(NSDictionary* advertisementData, uint8_t* out) {
+
+    int len = 0;
+
+    NSString *name = [advertisementData objectForKey:CBAdvertisementDataLocalNameKey];
+    if(name != nil) {
+        const char *utf8 = [name UTF8String];
+        len = cobble_ad_append(out, len, AdType_Name, (const uint8_t*)utf8, (int)strlen(utf8));
+    }
+
+    // Manufacturer data is given as it was sent, company identifier and all
+    NSData *manufacturerData = [advertisementData objectForKey:CBAdvertisementDataManufacturerDataKey];
+    if(manufacturerData != nil)
+        len = cobble_ad_append(out, len, AdType_ManufacturerData, [manufacturerData bytes], (int)[manufacturerData length]);
+
+    NSDictionary *serviceData = [advertisementData objectForKey:CBAdvertisementDataServiceDataKey];
+    for(CBUUID *service in serviceData) {
+        NSData *data = [serviceData objectForKey:service];
+        cobble_uuid uuid = uuid_from_cbuuid(service);
+        len = cobble_ad_append_service_data(out, len, &uuid, [data bytes], (int)[data length]);
+    }
+
+    NSArray *services = [advertisementData objectForKey:CBAdvertisementDataServiceUUIDsKey];
+    cobble_uuid uuids[COBBLE_AD_MAX_LENGTH / 2];
+    int count = 0;
+    for(CBUUID *service in services) {
+        if(count < (int)(sizeof(uuids) / sizeof(uuids[0])))
+            uuids[count++] = uuid_from_cbuuid(service);
+    }
+    len = cobble_ad_append_services(out, len, uuids, count);
+
+    NSNumber *txPower = [advertisementData objectForKey:CBAdvertisementDataTxPowerLevelKey];
+    if(txPower != nil) {
+        uint8_t dbm = (uint8_t)(int8_t)[txPower intValue];
+        len = cobble_ad_append(out, len, AdType_TxPower, &dbm, 1);
+    }
+
+    return len;
+}
+
 @interface CoreBluetoothBackend () <CBCentralManagerDelegate, CBPeripheralDelegate>
 
     @property (nonatomic, strong) CBCentralManager *centralManager;
     @property (nonatomic, strong) CBPeripheral *currentPeripheral;
 
-    //Cache of characteristics - we can't get characteristics from UUIDs without this
-    @property NSMutableDictionary *characteristicCache;
-
 @end
 
 @implementation CoreBluetoothBackend {
+    //Cache of characteristics, indexed by handle - we can't get characteristics from UUIDs without this
+    CBCharacteristic* characteristicCache[COBBLE_MAX_CHARACTERISTICS + 1];
+
+    //Services whose characteristics have been asked for on this connection
+    NSMutableSet* lookedUp;
+
+    //The block being written by cobble_write_stream(), if any
+    NSData* streamData;
+    CBCharacteristic* streamCharacteristic;
+    cobble_char_handle streamHandle;
+    NSUInteger streamSent;
+    NSUInteger streamWritten;
 }
 
 - (id)init {
 
     _centralManager = [[CBCentralManager alloc] initWithDelegate:self queue:nil options:nil];
-    _characteristicCache = [[NSMutableDictionary alloc] init];
 
     return self;
 }
 
+- (void)cacheCharacteristic:(CBCharacteristic*) characteristic handle:(cobble_char_handle) handle {
+    if(handle == COBBLE_CHARACTERISTIC_NONE)
+        return;
+    [characteristic retain];
+    [characteristicCache[handle] release];
+    characteristicCache[handle] = characteristic;
+}
+
+- (CBCharacteristic*)characteristicForHandle:(cobble_char_handle) handle {
+    if(handle == COBBLE_CHARACTERISTIC_NONE || handle > COBBLE_MAX_CHARACTERISTICS)
+        return nil;
+    return characteristicCache[handle];
+}
+
 - (void)pauseScan {
 
     [self.centralManager stopScan];
-    status = Initialised;
+    cobble_status_update(Initialised);
 
 }
 
@@ -51,7 +154,7 @@ CoreBluetoothBackend* appleBackend = NULL;
 
     //Allow duplicates to get updated RSSI readings on each packet. Note that this will impact power consumption.
     [self.centralManager scanForPeripheralsWithServices:scanFilter options: @{CBCentralManagerScanOptionAllowDuplicatesKey: @true }];
-    status = Scanning;
+    cobble_status_update(Scanning);
 
 }
 
@@ -59,7 +162,7 @@ CoreBluetoothBackend* appleBackend = NULL;
     [_currentPeripheral readValueForCharacteristic:characteristic];
 }
 
-- (void)write:(CBCharacteristic*) characteristic length:(uint8_t) len dataPtr:(uint8_t*) data {
+- (void)write:(CBCharacteristic*) characteristic length:(int) len dataPtr:(uint8_t*) data {
     if([characteristic properties] & CBCharacteristicPropertyWriteWithoutResponse) {
         [_currentPeripheral writeValue:[NSData dataWithBytes:data length:len] forCharacteristic:characteristic type:CBCharacteristicWriteWithoutResponse];
     } else {
@@ -67,12 +170,75 @@ CoreBluetoothBackend* appleBackend = NULL;
     }
 }
 
+- (void)endStream:(int) writeStatus {
+
+    if(streamData == nil)
+        return;
+
+    cobble_event_writecomplete(currentConnection, streamHandle, (int)streamWritten, writeStatus);
+
+    [streamData release];
+    [streamCharacteristic release];
+    streamData = nil;
+    streamCharacteristic = nil;
+}
+
+// Writes without response are sent for as long as CoreBluetooth will queue them, and resumed when it says it is ready
+// for more. Writes with response are sent one at a time, each once the one before has been answered.
+- (void)pumpStream {
+
+    if(streamData == nil)
+        return;
+
+    BOOL withoutResponse = ([streamCharacteristic properties] & CBCharacteristicPropertyWriteWithoutResponse) != 0;
+    CBCharacteristicWriteType type = withoutResponse ? CBCharacteristicWriteWithoutResponse : CBCharacteristicWriteWithResponse;
+    NSUInteger chunk = [_currentPeripheral maximumWriteValueLengthForType:type];
+
+    while(streamSent < [streamData length]) {
+
+        if(withoutResponse && ![_currentPeripheral canSendWriteWithoutResponse])
+            return;
+
+        NSUInteger len = MIN(chunk, [streamData length] - streamSent);
+        [_currentPeripheral writeValue:[streamData subdataWithRange:NSMakeRange(streamSent, len)] forCharacteristic:streamCharacteristic type:type];
+        streamSent += len;
+
+        if(!withoutResponse)
+            return;
+        streamWritten = streamSent;
+    }
+
+    if(withoutResponse || [streamData length] == 0)
+        [self endStream:WriteStatus_Complete];
+}
+
+- (void)writeStream:(CBCharacteristic*) characteristic handle:(cobble_char_handle) handle data:(NSData*) data {
+
+    if(streamData != nil) {
+        NSLog(@"A stream is already being written to this device");
+        cobble_event_writecomplete(currentConnection, handle, 0, WriteStatus_Busy);
+        return;
+    }
+
+    streamData = [data retain];
+    streamCharacteristic = [characteristic retain];
+    streamHandle = handle;
+    streamSent = 0;
+    streamWritten = 0;
+
+    [self pumpStream];
+}
+
 - (void)cleanup {
 
     [self disconnect];
+    [self endStream:WriteStatus_Failed];
 
     [_centralManager release];
-    [_characteristicCache release];
+    for (int i = 0; i <= COBBLE_MAX_CHARACTERISTICS; i++) {
+        [characteristicCache[i] release];
+        characteristicCache[i] = nil;
+    }
 
     _centralManager = NULL;
     [self cleanupOnDisconnect];
@@ -81,10 +247,11 @@ CoreBluetoothBackend* appleBackend = NULL;
 
 - (void)cleanupOnDisconnect {
     _currentPeripheral = NULL;
+    [lookedUp removeAllObjects];
     // [_characteristicCache removeAllObjects];
 }
 
-- (void) connect:(NSString*) identifier {
+- (BOOL) connect:(NSString*) identifier {
 
     //Try to find the peripheral device matching the given identifier
     NSUUID* iduuid = [[NSUUID UUID] initWithUUIDString:identifier];
@@ -93,14 +260,15 @@ CoreBluetoothBackend* appleBackend = NULL;
     // If no matching device is found, we can't do anything more
     if ([matching count] == 0) {
         NSLog(@"ERROR: can't find peripherial with identifier %@", identifier);
-        return;
+        return NO;
     }
 
     // Try to initiate a connection to the device
     CBPeripheral* peripheral = [matching firstObject];
     self.currentPeripheral = peripheral;
     [self.centralManager connectPeripheral:self.currentPeripheral options:nil];
-    status = Connecting;
+    cobble_status_update(Connecting);
+    return YES;
 
 }
 
@@ -119,35 +287,30 @@ CoreBluetoothBackend* appleBackend = NULL;
     {
           case CBManagerStateUnsupported:
                 state = @"Bluetooth Low Energy not supported.";
-                error_code = HardwareUnsupported;
-                status = CobbleError;
+                cobble_status_error(HardwareUnsupported);
                 break;
           case CBManagerStateUnauthorized:
                 state = @"Not authorized to use Bluetooth Low Energy.";
-                error_code = PermissionsNotGranted;
-                status = CobbleError;
+                cobble_status_error(PermissionsNotGranted);
                 break;
           case CBManagerStatePoweredOff:
                 state = @"Bluetooth on this device is powered off.";
-                error_code = HardwareTurnedOff;
-                status = CobbleError;
+                cobble_status_error(HardwareTurnedOff);
                 break;
           case CBManagerStateResetting:
                 state = @"BLE is resetting, state update pending.";
                 break;
           case CBManagerStatePoweredOn:
                 state = @"Bluetooth LE is turned on and ready for communication.";
-                status = Initialised;
+                cobble_status_set(Initialised);
                 break;
           case CBManagerStateUnknown:
                 state = @"BLE Manager status unknown.";
-                error_code = UnknownError;
-                status = CobbleError;
+                cobble_status_error(UnknownError);
                 break;
           default:
                 state = @"BLE Manager status unknown.";
-                error_code = UnknownError;
-                status = CobbleError;
+                cobble_status_error(UnknownError);
                 break;
     }
 
@@ -158,17 +321,51 @@ CoreBluetoothBackend* appleBackend = NULL;
 - (void)centralManager:(CBCentralManager *)central didDiscoverPeripheral:(CBPeripheral *)peripheral advertisementData:(NSDictionary *)advertisementData RSSI:(NSNumber *)RSSI {
 
     NSString *peripheralName = [advertisementData objectForKey:@"kCBAdvDataLocalName"];
+
+    // CoreBluetooth has filtered by service. Only what the rest of the filter needs is taken from the advertisement before
+    // it is checked.
+    const cobble_scan_criteria* filter = cobble_scan_filter_active();
+    cobble_advertisement adv;
+    adv.fields = ScanField_Name | ScanField_Rssi;
+    adv.services = NULL;
+    adv.serviceCount = 0;
+    adv.name = [peripheralName UTF8String];
+    adv.manufacturerId = COBBLE_MANUFACTURER_ANY;
+    adv.manufacturerData = NULL;
+    adv.manufacturerLength = 0;
+    adv.rssi = [RSSI intValue];
+
+    if(filter->fields & ScanField_Manufacturer) {
+        // The company identifier comes first, little-endian
+        NSData *manufacturerData = [advertisementData objectForKey:CBAdvertisementDataManufacturerDataKey];
+        adv.fields |= ScanField_Manufacturer;
+        if(manufacturerData != nil && [manufacturerData length] >= 2) {
+            const uint8_t *bytes = [manufacturerData bytes];
+            adv.manufacturerId = bytes[0] | (bytes[1] << 8);
+            adv.manufacturerData = bytes + 2;
+            adv.manufacturerLength = (int)[manufacturerData length] - 2;
+        }
+    }
+
+    if(!cobble_scan_filter_match(&adv))
+        return;
+
     NSString *peripheralUUID = peripheral.identifier.UUIDString;
+    cobble_event_scanresult(adv.name, adv.rssi, [peripheralUUID UTF8String]);
 
-    cobble_event_scanresult([peripheralName UTF8String], [RSSI intValue], [peripheralUUID UTF8String]);
+    if(cobble_event_advertisement_wanted()) {
+        uint8_t data[COBBLE_AD_MAX_LENGTH];
+        int len = advertisement_from_dictionary(advertisementData, data);
+        cobble_event_advertisement([peripheralUUID UTF8String], adv.rssi, data, len);
+    }
 
 }
 
 - (void)centralManager:(CBCentralManager *)central didConnectPeripheral:(CBPeripheral *)peripheral {
 
-    if(status == Connected) //TODO: Unclear why this is needed, but without it we get duplicate events.
+    if(cobble_status() == Connected) //TODO: Unclear why this is needed, but without it we get duplicate events.
         return;
-    status = Connected;
+    cobble_status_update(Connected);
 
     // TODO: Should the app control scanning behaviour instead?
     [self.centralManager stopScan];
@@ -179,68 +376,138 @@ CoreBluetoothBackend* appleBackend = NULL;
     //Register ourself as the delegate for CBPeripheral events
     self.currentPeripheral.delegate = self;
 
-    // Discover all services on the device.
-    // Discovering all services is slightly less energy-efficient than only obtaining the results we care about
-    // but the tiny energy saving is not worth the extra code complexity
-    [peripheral discoverServices:nil];
+    // Discover the services cobble_connect_ex() asked for, or all of them. Each service skipped saves looking up its
+    // characteristics, which adds up on devices with many services.
+    if (connectFlags & ConnectFlag_NoDiscovery)
+        return;
+    [self discoverServices:connectServices];
 
 }
 
 - (void)centralManager:(CBCentralManager *)central didFailToConnectPeripheral:(CBPeripheral *)peripheral error:(NSError *)error {
 
     if([self.centralManager isScanning])
-        status = Scanning;
+        cobble_status_update(Scanning);
     else
-        status = Initialised;
+        cobble_status_update(Initialised);
+
+    [self endStream:WriteStatus_Failed];
 
     NSString *peripheralUUID = peripheral.identifier.UUIDString;
     cobble_event_connectionstatus([peripheralUUID UTF8String], ConnectionStatus_DidConnectFailed);
+    connection_ended();
 
 }
 
 - (void)centralManager:(CBCentralManager *)central didDisconnectPeripheral:(CBPeripheral *)peripheral error:(NSError *)error {
 
-    status = Initialised;
+    cobble_status_update(Initialised);
+
+    [self endStream:WriteStatus_Failed];
 
     NSString *peripheralUUID = peripheral.identifier.UUIDString;
     cobble_event_connectionstatus([peripheralUUID UTF8String], ConnectionStatus_DidDisconnect);
+    connection_ended();
 
     [self cleanupOnDisconnect];
 }
 
+// peripheral.services holds every service found so far, so only those whose characteristics haven't been asked for are
+// looked up
 - (void)peripheral:(CBPeripheral *)peripheral didDiscoverServices:(NSError *)error {
 
+    NSMutableArray *found = [NSMutableArray array];
     for (CBService *service in peripheral.services) {
+        if (service.characteristics == nil && ![lookedUp containsObject:service])
+            [found addObject:service];
+    }
+    [lookedUp addObjectsFromArray:found];
 
-        NSString *serviceId = [service.UUID UUIDString];
-        if([serviceId length] == 4) { // Short UUID - extend it for consistency with other platforms
-            serviceId = [NSString stringWithFormat:@"0000%@-0000-1000-8000-00805F9B34FB", serviceId];
-        }
+    servicesPending += (int)found.count;
+    discoveredServices += (int)found.count;
+
+    if (servicesPending == 0)
+        [self discoveryComplete];
+
+    for (CBService *service in found) {
 
-        cobble_event_servicediscovered([serviceId UTF8String]);
+        // Short UUIDs are extended to the full form for consistency with other platforms
+        char serviceId[COBBLE_UUID_STRING_LENGTH];
+        cobble_uuid serviceUuid = uuid_from_cbuuid(service.UUID);
+        cobble_uuid_format(&serviceUuid, serviceId);
+
+        cobble_event_servicediscovered(serviceId);
         [peripheral discoverCharacteristics:nil forService:service];
     }
 }
 
-- (void)peripheral:(CBPeripheral *)peripheral didDiscoverCharacteristicsForService:(CBService *)service error:(NSError *)error {
+// Returns the number of characteristics reported
+- (int)reportCharacteristicsOf:(CBService *)service {
+    // Short UUIDs are extended to the full form for consistency with other platforms
+    char serviceId[COBBLE_UUID_STRING_LENGTH];
+    cobble_uuid serviceUuid = uuid_from_cbuuid(service.UUID);
+    cobble_uuid_format(&serviceUuid, serviceId);
+
+    int count = 0;
     for (CBCharacteristic *characteristic in service.characteristics) {
 
-        NSString *serviceId = [service.UUID UUIDString];
-        if([serviceId length] == 4) { // Short UUID - extend it for consistency with other platforms
-            serviceId = [NSString stringWithFormat:@"0000%@-0000-1000-8000-00805F9B34FB", serviceId];
-        }
+        cobble_uuid characteristicUuid = uuid_from_cbuuid(characteristic.UUID);
+        cobble_char_handle handle = cobble_characteristic_intern_uuid(&characteristicUuid);
 
-        NSString *characteristicId = [characteristic.UUID UUIDString];
-        if([characteristicId length] == 4) { // Short UUID - extend it for consistency with other platforms
-            characteristicId = [NSString stringWithFormat:@"0000%@-0000-1000-8000-00805F9B34FB", characteristicId];
-        }
+        //Cache for easy access to characteristics by handle
+        [self cacheCharacteristic:characteristic handle:handle];
+
+        cobble_event_characteristicdiscovered(serviceId, cobble_characteristic_uuid(handle));
+        count++;
+
+    }
+    return count;
+}
+
+- (void)peripheral:(CBPeripheral *)peripheral didDiscoverCharacteristicsForService:(CBService *)service error:(NSError *)error {
+
+    discoveredCharacteristics += [self reportCharacteristicsOf:service];
+
+    // CoreBluetooth exchanges the MTU itself and has done so by the time characteristics are known. It gives no event
+    // when the MTU changes, so it is checked here.
+    NSUInteger withoutResponse = [peripheral maximumWriteValueLengthForType:CBCharacteristicWriteWithoutResponse];
+    if (withoutResponse != reportedWriteSize) {
+        reportedWriteSize = withoutResponse;
+        cobble_event_mtuchanged(currentConnection, (int)withoutResponse + 3,
+                                (int)[peripheral maximumWriteValueLengthForType:CBCharacteristicWriteWithResponse],
+                                (int)withoutResponse);
+    }
 
-        //Cache for easy access to characteristics by UUID
-        [_characteristicCache setValue: characteristic forKey: characteristicId];
+    if (servicesPending > 0 && --servicesPending == 0)
+        [self discoveryComplete];
+}
 
-        cobble_event_characteristicdiscovered([serviceId UTF8String], [characteristicId UTF8String]);
+- (void)discoverServices:(NSArray *)services {
+    if (lookedUp == nil)
+        lookedUp = [[NSMutableSet alloc] init];
+    if (servicesPending == 0) {
+        discoveredServices = 0;
+        discoveredCharacteristics = 0;
+        discoveryStarted = CFAbsoluteTimeGetCurrent();
+    }
+    [self.currentPeripheral discoverServices:services];
+}
 
+// A service whose characteristics are already known is reported again straight away
+- (void)discoverService:(CBUUID *)uuid {
+    for (CBService *service in self.currentPeripheral.services) {
+        if ([service.UUID isEqual:uuid] && service.characteristics != nil && servicesPending == 0) {
+            int count = [self reportCharacteristicsOf:service];
+            cobble_event_discoverycomplete(currentConnection, 1, count, 0);
+            return;
+        }
     }
+    [self discoverServices:@[uuid]];
+}
+
+- (void)discoveryComplete {
+    cobble_event_discoverycomplete(currentConnection, discoveredServices, discoveredCharacteristics,
+                                   (int)((CFAbsoluteTimeGetCurrent() - discoveryStarted) * 1000));
 }
 
 - (void)peripheral:(CBPeripheral *)peripheral didUpdateNotificationStateForCharacteristic:(CBCharacteristic *)characteristic error:(NSError *)error {
@@ -254,6 +521,29 @@ CoreBluetoothBackend* appleBackend = NULL;
 
 }
 
+- (void)peripheral:(CBPeripheral *)peripheral didWriteValueForCharacteristic:(CBCharacteristic *)characteristic error:(NSError *)error {
+
+    if(streamData == nil || characteristic != streamCharacteristic)
+        return;
+
+    if (error) {
+          NSLog(@"Error writing stream: %@", [error localizedDescription]);
+          [self endStream:WriteStatus_Failed];
+          return;
+    }
+
+    streamWritten = streamSent;
+    if(streamSent == [streamData length])
+        [self endStream:WriteStatus_Complete];
+    else
+        [self pumpStream];
+}
+
+// CoreBluetooth has room for more writes without response
+- (void)peripheralIsReadyToSendWriteWithoutResponse:(CBPeripheral *)peripheral {
+    [self pumpStream];
+}
+
 - (void)peripheral:(CBPeripheral *)peripheral didUpdateValueForCharacteristic:(CBCharacteristic *)characteristic error:(NSError *)error {
     
     if (error) {
@@ -262,13 +552,9 @@ CoreBluetoothBackend* appleBackend = NULL;
     }
 
     NSData *dataBytes = characteristic.value;
-    NSString *characteristicId = [characteristic.UUID UUIDString];
-
-    if([characteristicId length] == 4) { // Short UUID - extend it for consistency with other platforms
-        characteristicId = [NSString stringWithFormat:@"0000%@-0000-1000-8000-00805F9B34FB", characteristicId];
-    }
+    cobble_uuid characteristicUuid = uuid_from_cbuuid(characteristic.UUID);
 
-    cobble_event_updatevalue([characteristicId UTF8String], [dataBytes bytes], [dataBytes length]);
+    cobble_event_updatevalue_h(cobble_characteristic_intern_uuid(&characteristicUuid), [dataBytes bytes], [dataBytes length]);
 
 }
 
@@ -291,31 +577,31 @@ void cobble_deinit(void) {
     }
     
     appleBackend = NULL;
+    connection_ended();
+    cobble_status_set(Uninitialised);
 
 }
 
-void cobble_read(const char* characteristic_uuid) {
+void cobble_read_h(cobble_char_handle characteristic_handle) {
 
-    //Find the characteristic object with the given UUID in the cache
-    NSString *characteristic_uuid_str = [NSString stringWithUTF8String:characteristic_uuid];
-    CBCharacteristic *characteristic = [appleBackend characteristicCache][characteristic_uuid_str];
+    //Find the characteristic object with the given handle in the cache
+    CBCharacteristic *characteristic = [appleBackend characteristicForHandle:characteristic_handle];
 
     if(characteristic == nil) {
-        NSLog(@"Could not find the characteristic %@ in the cache.", characteristic_uuid_str);
+        NSLog(@"Could not find the characteristic %s in the cache.", cobble_characteristic_uuid_get(characteristic_handle));
         return;
     }
 
    [appleBackend read: characteristic];
 }
 
-void cobble_subscribe(const char* characteristic_uuid) {
+void cobble_subscribe_h(cobble_char_handle characteristic_handle) {
 
-    //Find the characteristic object with the given UUID in the cache
-    NSString *characteristic_uuid_str = [NSString stringWithUTF8String:characteristic_uuid];
-    CBCharacteristic *characteristic = [appleBackend characteristicCache][characteristic_uuid_str];
+    //Find the characteristic object with the given handle in the cache
+    CBCharacteristic *characteristic = [appleBackend characteristicForHandle:characteristic_handle];
 
     if(characteristic == nil) {
-        NSLog(@"Could not find the characteristic %@ in the cache.", characteristic_uuid_str);
+        NSLog(@"Could not find the characteristic %s in the cache.", cobble_characteristic_uuid_get(characteristic_handle));
         return;
     }
 
@@ -323,53 +609,167 @@ void cobble_subscribe(const char* characteristic_uuid) {
     [appleBackend.currentPeripheral setNotifyValue:true forCharacteristic:characteristic];
 }
 
-void cobble_write(const char* characteristic_uuid, uint8_t *data, int len) {
+void cobble_write_h(cobble_char_handle characteristic_handle, uint8_t *data, int len) {
 
-    //Find the characteristic object with the given UUID in the cache
-    NSString *characteristic_uuid_str = [NSString stringWithUTF8String:characteristic_uuid];
-    CBCharacteristic *characteristic = [appleBackend characteristicCache][characteristic_uuid_str];
+    //Find the characteristic object with the given handle in the cache
+    CBCharacteristic *characteristic = [appleBackend characteristicForHandle:characteristic_handle];
 
     if(characteristic == nil) {
-        NSLog(@"Could not find the characteristic %@ in the cache.", characteristic_uuid_str);
+        NSLog(@"Could not find the characteristic %s in the cache.", cobble_characteristic_uuid_get(characteristic_handle));
         return;
     }
 
     [appleBackend write: characteristic length:len dataPtr: data];
 }
 
-void cobble_connect(const char* identifier) {
-    [appleBackend connect:[NSString stringWithUTF8String:identifier]];
+// The stream is run from CoreBluetooth's queue, where its flow control callbacks arrive
+bool cobble_write_stream_h(cobble_char_handle characteristic_handle, const uint8_t* data, int len) {
+
+    //Find the characteristic object with the given handle in the cache
+    CBCharacteristic *characteristic = [appleBackend characteristicForHandle:characteristic_handle];
+
+    if(characteristic == nil) {
+        NSLog(@"Could not find the characteristic %s in the cache.", cobble_characteristic_uuid_get(characteristic_handle));
+        return false;
+    }
+
+    if(len < 0 || (len > 0 && data == NULL)) {
+        NSLog(@"Cannot write %i bytes", len);
+        return false;
+    }
+
+    NSData* copy = [[NSData alloc] initWithBytes:data length:len];
+    CoreBluetoothBackend* backend = appleBackend;
+
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [backend writeStream:characteristic handle:characteristic_handle data:copy];
+        [copy release];
+    });
+
+    return true;
+}
+
+void cobble_read(const char* characteristic_uuid) {
+    cobble_read_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_subscribe(const char* characteristic_uuid) {
+    cobble_subscribe_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_write(const char* characteristic_uuid, uint8_t *data, int len) {
+    cobble_write_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+bool cobble_write_stream(const char* characteristic_uuid, const uint8_t* data, int len) {
+    return cobble_write_stream_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+// Returns nil for an empty list
+static NSArray* cbuuids_from_uuids(const cobble_uuid* uuids, int count) {
+
+    char uuidString[COBBLE_UUID_STRING_LENGTH];
+
+    if (count == 0)
+        return nil;
+
+    NSMutableArray *array = [NSMutableArray arrayWithCapacity:count];
+    for (int i = 0; i < count; i++) {
+        cobble_uuid_format(&uuids[i], uuidString);
+        [array addObject:[CBUUID UUIDWithString:[NSString stringWithUTF8String:uuidString]]];
+    }
+    return array;
+}
+
+static NSArray* cbuuids_from_list(const char* service_uuids) {
+    cobble_uuid uuids[COBBLE_MAX_CONNECT_SERVICES];
+    int count = cobble_uuid_list_parse(service_uuids, uuids, COBBLE_MAX_CONNECT_SERVICES);
+    return cbuuids_from_uuids(uuids, count);
+}
+
+cobble_conn_handle cobble_connect(const char* identifier) {
+    return cobble_connect_ex(identifier, NULL, ConnectFlag_None);
+}
+
+// CoreBluetooth keeps its own GATT cache, so ConnectFlag_Uncached makes no difference
+cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags) {
+
+    if (cobble_connection_valid(currentConnection)) {
+        NSLog(@"Only one device can be connected at a time on this platform");
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    connectServices = [cbuuids_from_list(service_uuids) retain];
+    connectFlags = flags;
+
+    currentConnection = cobble_connection_open(COBBLE_ADDRESS_NONE);
+    if (currentConnection != COBBLE_CONNECTION_NONE && ![appleBackend connect:[NSString stringWithUTF8String:identifier]])
+        connection_ended();
+
+    return currentConnection;
 }
 
 void cobble_disconnect(void) {
    [appleBackend disconnect];
 }
 
+// Only the current connection can be operated on
+static bool is_current(cobble_conn_handle connection) {
+    if (connection != COBBLE_CONNECTION_NONE && connection == currentConnection)
+        return true;
+    NSLog(@"No connection has handle %u", connection);
+    return false;
+}
+
+void cobble_disconnect_c(cobble_conn_handle connection) {
+    if (is_current(connection))
+        cobble_disconnect();
+}
+
+void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    if (is_current(connection))
+        cobble_subscribe_h(characteristic);
+}
+
+void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_characteristic_cb_set(characteristic, cb, ctx);
+    cobble_subscribe_h(characteristic);
+}
+
+void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    if (is_current(connection))
+        cobble_subscribe_cb(characteristic, cb, ctx);
+}
+
+void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    if (is_current(connection))
+        cobble_read_h(characteristic);
+}
+
+void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t* data, int len) {
+    if (is_current(connection))
+        cobble_write_h(characteristic, data, len);
+}
+
+bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+    return is_current(connection) && cobble_write_stream_h(characteristic, data, len);
+}
+
 void cobble_scan_start(const char* service_uuids) {
 
-    NSMutableArray *arrayOfCbuuids = nil;
+    cobble_scan_table_clear();
+
+    NSArray *arrayOfCbuuids = nil;
+    const cobble_scan_criteria* filter = cobble_scan_filter_begin(service_uuids);
 
     // Create our list of Service UUIDs to scan for
-    if(service_uuids == NULL) {
+    if((filter->fields & ScanField_Services) == 0) {
         // Monterey (macOS 12) introduced a bug with scan filters, whereby if you scan with no filters, no scan results will be provided.
         // This was at odds with the documented behaviour (which state that no scan filter results in all scan results being provided)
         // This behaviour was fixed in macOS Monterey Beta 21E5212f, and released in 12.3.
         NSLog(@"Scanning with no service_uuids filter will return no results on certain versions of Monterey! If you get no scan results, this might be why. For maximum compatibility you should specify service UUIDs.");
     } else {
-        // Split comma-separated values into strings
-        NSArray *arrayOfStrings = [[NSString stringWithUTF8String:service_uuids] componentsSeparatedByString:@","];
-
-        // Convert to CBUUID array
-        arrayOfCbuuids = [NSMutableArray arrayWithCapacity: [arrayOfStrings count]];
-        for (id obj in arrayOfStrings) {
-            @try {
-                [arrayOfCbuuids addObject: [CBUUID UUIDWithString:obj]];
-            }
-            @catch (NSException *exception) {
-                NSLog(@"Could not create Service UUID from \"%@\" to add to filter", obj);
-            }
-        }
-
+        arrayOfCbuuids = cbuuids_from_uuids(filter->services, filter->serviceCount);
     }
 
     [appleBackend resumeScan:arrayOfCbuuids]; //TODO: Report an error if we're not in the Initialised state
@@ -390,6 +790,47 @@ int cobble_max_writesize_get(bool withResponse) {
 
 }
 
+int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse) {
+    return is_current(connection) ? cobble_max_writesize_get(withResponse) : 0;
+}
+
+bool cobble_mtu_request(int mtu) {
+    NSLog(@"CoreBluetooth negotiates the MTU itself");
+    return false;
+}
+
+bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu) {
+    return is_current(connection) ? cobble_mtu_request(mtu) : false;
+}
+
+bool cobble_discover_service(const char* service_uuid) {
+
+    cobble_uuid uuid;
+    char uuidString[COBBLE_UUID_STRING_LENGTH];
+
+    if (service_uuid == NULL || !cobble_uuid_parse(service_uuid, &uuid)) {
+        NSLog(@"Could not create Service UUID from \"%s\"", service_uuid ? service_uuid : "(null)");
+        return false;
+    }
+    if (!cobble_connection_valid(currentConnection) || cobble_status() != Connected) {
+        NSLog(@"Not connected, cannot discover a service");
+        return false;
+    }
+
+    cobble_uuid_format(&uuid, uuidString);
+    CBUUID *cbuuid = [CBUUID UUIDWithString:[NSString stringWithUTF8String:uuidString]];
+    CoreBluetoothBackend* backend = appleBackend;
+
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [backend discoverService:cbuuid];
+    });
+    return true;
+}
+
+bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid) {
+    return is_current(connection) && cobble_discover_service(service_uuid);
+}
+
 // Run loop handling is required for console apps / some other specific use cases
 bool cobble_shutdown_requested = false;
 
@@ -408,14 +849,6 @@ void cobble_loop(void) {
 
 }
 
-CobbleStatus cobble_status(void) {
-    return status;
-}
-
-CobbleErrorCode cobble_error_get(void) {
-    return error_code;
-}
-
 void cobble_queue_process(void) {
     static bool warningShown = false;
     if(!warningShown) {
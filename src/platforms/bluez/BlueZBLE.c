@@ -0,0 +1,2302 @@
+// Common bindings for Bluetooth LE
+// Linux (BlueZ), over D-Bus using libdbus
+//
+// All D-Bus traffic happens on a single event loop thread, which polls the bus connection, a wakeup eventfd and any
+// notification sockets handed out by AcquireNotify, for every connected device. Nothing on that thread blocks once it is running: every method call
+// is asynchronous, with its reply handled when it arrives.
+// The application's calls are queued as commands for the loop thread, so they return immediately and may be made from
+// any thread.
+//
+// bluetoothd is found on the system bus. libdbus honours DBUS_SYSTEM_BUS_ADDRESS, so it can be pointed at a private bus
+// running a fake org.bluez for testing without a radio.
+#include "../../cobble.h"
+#include "../../cobble_events.h"
+#include "../../cobble_ad.h"
+#include "../../cobble_characteristics.h"
+#include "../../cobble_connections.h"
+#include "../../cobble_scan_filter.h"
+#include "../../cobble_scan_table.h"
+#include "../../cobble_status.h"
+#include "../../cobble_ring.h"
+
+#include "BlueZNotify.h"
+
+#include <dbus/dbus.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLUEZ_SERVICE "org.bluez"
+#define ADAPTER_INTERFACE "org.bluez.Adapter1"
+#define DEVICE_INTERFACE "org.bluez.Device1"
+#define SERVICE_INTERFACE "org.bluez.GattService1"
+#define CHARACTERISTIC_INTERFACE "org.bluez.GattCharacteristic1"
+#define OBJECT_MANAGER_INTERFACE "org.freedesktop.DBus.ObjectManager"
+#define PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+// The maximum size of a Bluetooth LE characteristic value (the ATT specification maximum)
+#define MAX_LENGTH 512
+
+#define MAX_NAME_LENGTH 248
+#define MAX_IDENTIFIER_LENGTH 40
+#define MAX_PATH_LENGTH 128
+
+// Devices seen while scanning, so that RSSI updates (which don't carry the name) can be reported with one
+#define MAX_DEVICES 256
+
+// What is kept of each device's service data and advertised services, to rebuild its advertisements
+#define MAX_SERVICE_DATA 32
+#define MAX_ADVERTISED_SERVICES 4
+
+#define COMMAND_QUEUE_LENGTH 64
+
+// libdbus normally asks for one or two watches, and adds a timeout for each method call awaiting a reply
+#define MAX_WATCHES 8
+#define MAX_TIMEOUTS 256
+
+// Acquired notification sockets polled at once, across all connections
+#define MAX_NOTIFY_SOCKETS 256
+
+// WriteValue calls a write stream keeps waiting for replies when it can't write to a socket. BlueZ replies to writes
+// without response as soon as it has queued them, so this only keeps the bus busy; the socket is better where offered.
+#define STREAM_WINDOW 8
+
+// Writes without response a connection holds while their write socket is full, to send in order once it has room
+#define WRITE_QUEUE_LENGTH 32
+
+// Connecting can take a while if the device is advertising slowly, so allow longer than the default D-Bus timeout
+#define CONNECT_TIMEOUT_MS 30000
+
+// The ATT MTU before any exchange, and so the smallest a connection can have
+#define DEFAULT_ATT_MTU 23
+
+/*
+ * Commands from the application to the event loop thread
+ */
+
+typedef enum {
+    Command_ScanStart,
+    Command_ScanStop,
+    Command_Connect,
+    Command_Disconnect,
+    Command_CharacteristicsGet,
+    Command_Subscribe,
+    Command_Read,
+    Command_Write,
+    Command_WriteStream,
+    Command_DiscoverService,
+    Command_Shutdown,
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    cobble_conn_handle connection;
+    cobble_char_handle characteristic;
+    int length; // Or the number of services in data
+    uint32_t flags; // For a connection
+    uint8_t data[MAX_LENGTH]; // Or the services to report, as cobble_uuids
+    uint8_t* stream; // Block to write, of length bytes, which the event loop frees
+} command;
+
+static cobble_ring commandQueue;
+static int wakeFd = -1;
+static pthread_t loopThread;
+static bool loopRunning = false;
+
+/*
+ * State owned by the event loop thread
+ */
+
+// Characteristic properties, from the Flags property
+#define FLAG_READ (1u << 0)
+#define FLAG_WRITE (1u << 1)
+#define FLAG_WRITE_WITHOUT_RESPONSE (1u << 2)
+#define FLAG_NOTIFY (1u << 3)
+#define FLAG_INDICATE (1u << 4)
+// Set if BlueZ offers AcquireNotify/AcquireWrite for this characteristic (the NotifyAcquired/WriteAcquired properties exist)
+#define FLAG_ACQUIRE_NOTIFY (1u << 5)
+#define FLAG_ACQUIRE_WRITE (1u << 6)
+
+typedef struct {
+    char* path;
+    char service[COBBLE_UUID_STRING_LENGTH];
+    uint32_t flags;
+    bool subscribed;
+    int notifyFd; // From AcquireNotify, or -1 if notifications arrive as PropertiesChanged signals
+    int notifyCapacity; // Largest value that can arrive on notifyFd
+    int writeFd; // From AcquireWrite, or -1 if writes go over D-Bus
+    bool writeAcquiring;
+} characteristic;
+
+typedef struct {
+    char address[18];
+    char name[MAX_NAME_LENGTH];
+    // BlueZ only sends properties which have changed, so the latest manufacturer data is kept for the scan filter
+    int manufacturerId;
+    int manufacturerLength;
+    uint8_t manufacturerData[COBBLE_SCAN_FILTER_MAX_DATA];
+    // The rest of what BlueZ has parsed from the device's advertisements, for register_advertisement_cb()
+    int rssi;
+    bool hasServiceData;
+    cobble_uuid serviceDataUuid;
+    int serviceDataLength;
+    uint8_t serviceData[MAX_SERVICE_DATA];
+    int serviceCount;
+    cobble_uuid services[MAX_ADVERTISED_SERVICES];
+    bool hasTxPower;
+    int txPower;
+} device;
+
+static DBusConnection* connection = NULL;
+static char adapterPath[MAX_PATH_LENGTH];
+
+static bool scanning = false;
+static device devices[MAX_DEVICES];
+
+// A block being written by cobble_write_stream_c()
+typedef struct {
+    bool active;
+    cobble_char_handle characteristic;
+    uint8_t* data;
+    int length;
+    int sent; // Bytes given to the socket or to WriteValue calls
+    int written; // Bytes the socket took, or whose WriteValue has succeeded
+    bool failed;
+    bool waitingForSocket; // Until the write socket has room again
+
+    // Lengths of the WriteValue calls awaiting replies, which arrive in the order the calls were made
+    int pendingLengths[STREAM_WINDOW];
+    int pendingHead;
+    int pending;
+} write_stream;
+
+// A write without response waiting for room in its characteristic's write socket
+typedef struct {
+    cobble_char_handle characteristic;
+    int length;
+    uint8_t data[MAX_LENGTH];
+} queued_write;
+
+// A device which is connected or being connected to
+typedef struct {
+    cobble_conn_handle handle; // COBBLE_CONNECTION_NONE if this slot is not in use
+    char path[MAX_PATH_LENGTH];
+    bool connected;
+    bool servicesDiscovered;
+    uint64_t connectedAt; // now_ms() when the link came up, to time discovery
+
+    // BlueZ discovers every service, but only those asked for by cobble_connect_ex() and cobble_discover_service() are
+    // reported, unless allServices
+    bool allServices;
+    char services[COBBLE_MAX_CONNECT_SERVICES][COBBLE_UUID_STRING_LENGTH];
+    int serviceCount;
+
+    // Discovered characteristics, indexed by handle
+    characteristic* characteristics;
+
+    // Handles of subscribed characteristics, so that notifications can be matched to them
+    cobble_char_handle* subscriptions;
+    int subscriptionCount;
+
+    volatile int attMtu;
+    bool mtuReported;
+
+    write_stream stream;
+
+    // Writes without response waiting for a full write socket, oldest first. Allocated when first needed.
+    queued_write* writeQueue;
+    int writeQueueHead;
+    int writeQueueCount;
+    bool writeQueueOverflowed; // Reported once until the queue drains
+} link_state;
+
+// Indexed by cobble_connection_index()
+static link_state links[COBBLE_MAX_CONNECTIONS];
+
+static DBusWatch* watches[MAX_WATCHES];
+
+typedef struct {
+    DBusTimeout* timeout;
+    uint64_t deadline;
+} timeout;
+
+static timeout timeouts[MAX_TIMEOUTS];
+static int timeoutCount = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Main loop integration for libdbus
+ */
+
+static dbus_bool_t add_watch(DBusWatch* watch, void* data) {
+    for (int i = 0; i < MAX_WATCHES; i++) {
+        if (watches[i] == NULL) {
+            watches[i] = watch;
+            return TRUE;
+        }
+    }
+    printf("Too many D-Bus watches\n");
+    return FALSE;
+}
+
+static void remove_watch(DBusWatch* watch, void* data) {
+    for (int i = 0; i < MAX_WATCHES; i++) {
+        if (watches[i] == watch)
+            watches[i] = NULL;
+    }
+}
+
+static bool watch_registered(DBusWatch* watch) {
+    for (int i = 0; i < MAX_WATCHES; i++) {
+        if (watches[i] == watch)
+            return true;
+    }
+    return false;
+}
+
+// Enabled state is checked each time round the loop, so there's nothing to do here
+static void toggle_watch(DBusWatch* watch, void* data) {
+}
+
+static void arm_timeout(timeout* t) {
+    t->deadline = now_ms() + dbus_timeout_get_interval(t->timeout);
+}
+
+static dbus_bool_t add_timeout(DBusTimeout* dt, void* data) {
+    if (timeoutCount == MAX_TIMEOUTS) {
+        printf("Too many D-Bus timeouts\n");
+        return FALSE;
+    }
+    timeouts[timeoutCount].timeout = dt;
+    arm_timeout(&timeouts[timeoutCount]);
+    timeoutCount++;
+    return TRUE;
+}
+
+static void remove_timeout(DBusTimeout* dt, void* data) {
+    for (int i = 0; i < timeoutCount; i++) {
+        if (timeouts[i].timeout == dt) {
+            timeouts[i] = timeouts[--timeoutCount];
+            return;
+        }
+    }
+}
+
+static void toggle_timeout(DBusTimeout* dt, void* data) {
+    for (int i = 0; i < timeoutCount; i++) {
+        if (timeouts[i].timeout == dt)
+            arm_timeout(&timeouts[i]);
+    }
+}
+
+/*
+ * D-Bus helpers
+ */
+
+static DBusMessage* method_call(const char* path, const char* interface, const char* method) {
+    return dbus_message_new_method_call(BLUEZ_SERVICE, path, interface, method);
+}
+
+// Send a method call, calling handler with the reply (or error) when it arrives. Takes ownership of the message.
+static void call_async(DBusMessage* msg, int timeout_ms, DBusPendingCallNotifyFunction handler, void* ctx) {
+
+    DBusPendingCall* pending = NULL;
+
+    if (!dbus_connection_send_with_reply(connection, msg, &pending, timeout_ms) || pending == NULL) {
+        printf("Failed to send %s.%s\n", dbus_message_get_interface(msg), dbus_message_get_member(msg));
+    } else {
+        dbus_pending_call_set_notify(pending, handler, ctx, NULL);
+        dbus_pending_call_unref(pending);
+    }
+
+    dbus_message_unref(msg);
+}
+
+// Take the reply from a completed call. Returns NULL, after logging it, if the call failed.
+static DBusMessage* take_reply(DBusPendingCall* pending, const char* what, char* errorName, size_t errorNameSize) {
+
+    DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+    if (reply == NULL)
+        return NULL;
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        const char* message = NULL;
+        dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &message, DBUS_TYPE_INVALID);
+        printf("%s failed: %s (%s)\n", what, dbus_message_get_error_name(reply), message ? message : "");
+        if (errorName != NULL)
+            snprintf(errorName, errorNameSize, "%s", dbus_message_get_error_name(reply));
+        dbus_message_unref(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+// Replies which only need checking for errors
+static void on_reply_logged(DBusPendingCall* pending, void* ctx) {
+    DBusMessage* reply = take_reply(pending, (const char*)ctx, NULL, 0);
+    if (reply != NULL)
+        dbus_message_unref(reply);
+}
+
+static void append_variant(DBusMessageIter* iter, int type, const void* value) {
+    char signature[2] = { (char)type, '\0' };
+    DBusMessageIter variant;
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signature, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(iter, &variant);
+}
+
+static void append_dict_entry(DBusMessageIter* dict, const char* key, int type, const void* value) {
+    DBusMessageIter entry;
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    append_variant(&entry, type, value);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_empty_options(DBusMessage* msg) {
+    DBusMessageIter iter, dict;
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    dbus_message_iter_close_container(&iter, &dict);
+}
+
+// Find a property in an a{sv} dictionary, leaving value pointing at its contents. Returns false if it isn't present.
+static bool dict_find(DBusMessageIter* dict, const char* key, DBusMessageIter* value) {
+
+    DBusMessageIter entries;
+    dbus_message_iter_recurse(dict, &entries);
+
+    while (dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter entry;
+        const char* name;
+        dbus_message_iter_recurse(&entries, &entry);
+        dbus_message_iter_get_basic(&entry, &name);
+        if (strcmp(name, key) == 0) {
+            DBusMessageIter variant;
+            dbus_message_iter_next(&entry);
+            dbus_message_iter_recurse(&entry, &variant);
+            *value = variant;
+            return true;
+        }
+        dbus_message_iter_next(&entries);
+    }
+
+    return false;
+}
+
+static const char* dict_string(DBusMessageIter* dict, const char* key) {
+    DBusMessageIter value;
+    const char* str = NULL;
+    if (dict_find(dict, key, &value) && (dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_STRING || dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_OBJECT_PATH))
+        dbus_message_iter_get_basic(&value, &str);
+    return str;
+}
+
+static bool dict_bool(DBusMessageIter* dict, const char* key, bool* out) {
+    DBusMessageIter value;
+    dbus_bool_t b;
+    if (!dict_find(dict, key, &value) || dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_BOOLEAN)
+        return false;
+    dbus_message_iter_get_basic(&value, &b);
+    *out = b;
+    return true;
+}
+
+// Get the contents of a variant holding a byte array
+static bool variant_bytes(DBusMessageIter* value, const uint8_t** data, int* len) {
+    DBusMessageIter array;
+    if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type(value) != DBUS_TYPE_BYTE)
+        return false;
+    dbus_message_iter_recurse(value, &array);
+    dbus_message_iter_get_fixed_array(&array, data, len);
+    return true;
+}
+
+static bool path_is_under(const char* path, const char* parent) {
+    size_t len = strlen(parent);
+    return len > 0 && strncmp(path, parent, len) == 0 && path[len] == '/';
+}
+
+// Device objects are named after their address, eg /org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF
+static bool address_from_path(const char* path, char* address) {
+    const char* dev = strrchr(path, '/');
+    if (dev == NULL || strncmp(dev, "/dev_", 5) != 0 || strlen(dev + 5) != 17)
+        return false;
+    for (int i = 0; i < 17; i++)
+        address[i] = (dev[5 + i] == '_') ? ':' : dev[5 + i];
+    address[17] = '\0';
+    return true;
+}
+
+/*
+ * Scanning
+ */
+
+static void update_status(void);
+
+static device* find_device(const char* address, bool add) {
+
+    uint32_t hash = 2166136261u;
+    for (const char* c = address; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+    for (int probes = 0; probes < MAX_DEVICES; probes++) {
+        device* d = &devices[(hash + probes) % MAX_DEVICES];
+        if (strcmp(d->address, address) == 0)
+            return d;
+        if (d->address[0] == '\0') {
+            if (!add)
+                return NULL;
+            snprintf(d->address, sizeof(d->address), "%s", address);
+            d->name[0] = '\0';
+            d->manufacturerId = COBBLE_MANUFACTURER_ANY;
+            d->manufacturerLength = 0;
+            d->rssi = 0;
+            d->hasServiceData = false;
+            d->serviceCount = 0;
+            d->hasTxPower = false;
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+// The first entry of a dictionary property, such as ManufacturerData (a{qv}) or ServiceData (a{sv}), as its key and a
+// byte array. BlueZ gives each company or service its own entry, but advertisements rarely carry more than one.
+static bool first_entry_bytes(DBusMessageIter* value, void* key, const uint8_t** data, int* len) {
+
+    DBusMessageIter entries, entry, variant;
+    if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+        return false;
+    dbus_message_iter_recurse(value, &entries);
+    if (dbus_message_iter_get_arg_type(&entries) != DBUS_TYPE_DICT_ENTRY)
+        return false;
+
+    dbus_message_iter_recurse(&entries, &entry);
+    dbus_message_iter_get_basic(&entry, key);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &variant);
+    return variant_bytes(&variant, data, len);
+}
+
+// BlueZ only passes on what it has parsed from an advertisement, so it is put back together from that, in the order
+// given in cobble_ad.h
+static int device_advertisement(const device* d, uint8_t* out) {
+
+    int len = 0;
+    if (d->name[0] != '\0')
+        len = cobble_ad_append(out, len, AdType_Name, (const uint8_t*)d->name, (int)strlen(d->name));
+    if (d->manufacturerId != COBBLE_MANUFACTURER_ANY)
+        len = cobble_ad_append_manufacturer_data(out, len, d->manufacturerId, d->manufacturerData, d->manufacturerLength);
+    if (d->hasServiceData)
+        len = cobble_ad_append_service_data(out, len, &d->serviceDataUuid, d->serviceData, d->serviceDataLength);
+    len = cobble_ad_append_services(out, len, d->services, d->serviceCount);
+    if (d->hasTxPower) {
+        uint8_t txPower = (uint8_t)(int8_t)d->txPower;
+        len = cobble_ad_append(out, len, AdType_TxPower, &txPower, 1);
+    }
+    return len;
+}
+
+// Called for new device objects, and for changes to existing ones
+static void device_properties(const char* path, DBusMessageIter* props) {
+
+    char address[18];
+    if (!path_is_under(path, adapterPath) || !address_from_path(path, address))
+        return;
+
+    device* d = find_device(address, true);
+
+    const char* name = dict_string(props, "Name");
+    if (name != NULL && d != NULL)
+        snprintf(d->name, sizeof(d->name), "%s", name);
+
+    // Only the first company and service are kept, as advertisements rarely carry more
+    DBusMessageIter value;
+    const uint8_t* bytes;
+    int len;
+    bool dataChanged = false;
+    if (d != NULL && dict_find(props, "ManufacturerData", &value)) {
+        dbus_uint16_t company;
+        d->manufacturerId = COBBLE_MANUFACTURER_ANY;
+        if (first_entry_bytes(&value, &company, &bytes, &len)) {
+            d->manufacturerId = company;
+            d->manufacturerLength = (len < COBBLE_SCAN_FILTER_MAX_DATA) ? len : COBBLE_SCAN_FILTER_MAX_DATA;
+            memcpy(d->manufacturerData, bytes, d->manufacturerLength);
+        }
+        dataChanged = true;
+    }
+    if (d != NULL && dict_find(props, "ServiceData", &value)) {
+        const char* uuid;
+        d->hasServiceData = first_entry_bytes(&value, &uuid, &bytes, &len) && cobble_uuid_parse(uuid, &d->serviceDataUuid);
+        if (d->hasServiceData) {
+            d->serviceDataLength = (len < MAX_SERVICE_DATA) ? len : MAX_SERVICE_DATA;
+            memcpy(d->serviceData, bytes, d->serviceDataLength);
+        }
+        dataChanged = true;
+    }
+    if (d != NULL && dict_find(props, "UUIDs", &value) && dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_ARRAY) {
+        DBusMessageIter uuids;
+        dbus_message_iter_recurse(&value, &uuids);
+        d->serviceCount = 0;
+        while (dbus_message_iter_get_arg_type(&uuids) == DBUS_TYPE_STRING && d->serviceCount < MAX_ADVERTISED_SERVICES) {
+            const char* uuid;
+            dbus_message_iter_get_basic(&uuids, &uuid);
+            if (cobble_uuid_parse(uuid, &d->services[d->serviceCount]))
+                d->serviceCount++;
+            dbus_message_iter_next(&uuids);
+        }
+    }
+    if (d != NULL && dict_find(props, "TxPower", &value) && dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_INT16) {
+        dbus_int16_t txPower;
+        dbus_message_iter_get_basic(&value, &txPower);
+        d->txPower = txPower;
+        d->hasTxPower = true;
+    }
+
+    // Each advertisement brings a new RSSI, and changes to its data come with one only if the RSSI changed too. Devices
+    // which BlueZ remembers from before, but which haven't been heard from since (so have no RSSI), aren't reported.
+    bool rssiChanged = false;
+    int rssi = (d != NULL) ? d->rssi : 0;
+    if (dict_find(props, "RSSI", &value) && dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_INT16) {
+        dbus_int16_t r;
+        dbus_message_iter_get_basic(&value, &r);
+        rssi = r;
+        rssiChanged = true;
+        if (d != NULL)
+            d->rssi = rssi;
+    }
+    if (!scanning || !(rssiChanged || (dataChanged && rssi != 0)))
+        return;
+
+    // Services were filtered by BlueZ. The devices table can be full, in which case there is nothing to go on.
+    cobble_advertisement adv;
+    adv.fields = (d != NULL) ? (ScanField_Name | ScanField_Manufacturer | ScanField_Rssi) : ScanField_Rssi;
+    adv.services = NULL;
+    adv.serviceCount = 0;
+    adv.name = (d != NULL && d->name[0] != '\0') ? d->name : NULL;
+    adv.manufacturerId = (d != NULL) ? d->manufacturerId : COBBLE_MANUFACTURER_ANY;
+    adv.manufacturerData = (d != NULL) ? d->manufacturerData : NULL;
+    adv.manufacturerLength = (d != NULL) ? d->manufacturerLength : 0;
+    adv.rssi = rssi;
+    if (!cobble_scan_filter_match(&adv))
+        return;
+
+    if (rssiChanged)
+        cobble_event_scanresult(adv.name, rssi, address);
+
+    if (d != NULL && cobble_event_advertisement_wanted()) {
+        uint8_t data[COBBLE_AD_MAX_LENGTH];
+        cobble_event_advertisement(address, rssi, data, device_advertisement(d, data));
+    }
+}
+
+// Iterate over a GetManagedObjects reply, calling fn for each interface of each object
+typedef void (*object_fn)(const char* path, const char* interface, DBusMessageIter* props);
+
+static void for_each_object(DBusMessage* reply, object_fn fn) {
+
+    DBusMessageIter iter, objects;
+    if (!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+
+    dbus_message_iter_recurse(&iter, &objects);
+    while (dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter object, interfaces;
+        const char* path;
+        dbus_message_iter_recurse(&objects, &object);
+        dbus_message_iter_get_basic(&object, &path);
+        dbus_message_iter_next(&object);
+        dbus_message_iter_recurse(&object, &interfaces);
+
+        while (dbus_message_iter_get_arg_type(&interfaces) == DBUS_TYPE_DICT_ENTRY) {
+            DBusMessageIter entry;
+            const char* interface;
+            dbus_message_iter_recurse(&interfaces, &entry);
+            dbus_message_iter_get_basic(&entry, &interface);
+            dbus_message_iter_next(&entry);
+            fn(path, interface, &entry);
+            dbus_message_iter_next(&interfaces);
+        }
+
+        dbus_message_iter_next(&objects);
+    }
+}
+
+static void known_device(const char* path, const char* interface, DBusMessageIter* props) {
+    if (strcmp(interface, DEVICE_INTERFACE) == 0)
+        device_properties(path, props);
+}
+
+// Devices BlueZ already knows about are not announced again, so pick up their names (and any recent RSSI) up front
+static void on_scan_objects(DBusPendingCall* pending, void* ctx) {
+    DBusMessage* reply = take_reply(pending, "GetManagedObjects", NULL, 0);
+    if (reply == NULL)
+        return;
+    for_each_object(reply, known_device);
+    dbus_message_unref(reply);
+}
+
+static void on_discovery_started(DBusPendingCall* pending, void* ctx) {
+
+    char errorName[128] = "";
+    DBusMessage* reply = take_reply(pending, "StartDiscovery", errorName, sizeof(errorName));
+
+    if (reply == NULL) {
+        scanning = false;
+        cobble_status_error((strcmp(errorName, "org.bluez.Error.NotReady") == 0) ? HardwareTurnedOff : UnknownError);
+        return;
+    }
+
+    dbus_message_unref(reply);
+}
+
+static void scan_start(void) {
+
+    const cobble_scan_criteria* filter = cobble_scan_filter_active();
+
+    // Until a device is heard from in this scan
+    for (int i = 0; i < MAX_DEVICES; i++)
+        devices[i].rssi = 0;
+
+    // BlueZ applies the service and RSSI filters itself, and we ask to hear about every advertisement for up-to-date RSSI
+    // readings. Its Pattern would match names too, but it is newer than the rest, and older versions reject the
+    // whole filter if it is given.
+    DBusMessage* msg = method_call(adapterPath, ADAPTER_INTERFACE, "SetDiscoveryFilter");
+    DBusMessageIter iter, dict, entry, variant, array;
+    const char* transport = "le";
+    dbus_bool_t duplicates = TRUE;
+    const char* key = "UUIDs";
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_dict_entry(&dict, "Transport", DBUS_TYPE_STRING, &transport);
+    append_dict_entry(&dict, "DuplicateData", DBUS_TYPE_BOOLEAN, &duplicates);
+    if (filter->fields & ScanField_Rssi) {
+        dbus_int16_t rssi = (dbus_int16_t)filter->rssiMin;
+        append_dict_entry(&dict, "RSSI", DBUS_TYPE_INT16, &rssi);
+    }
+
+    dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "as", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &array);
+
+    char uuids[COBBLE_SCAN_FILTER_MAX_SERVICES][COBBLE_UUID_STRING_LENGTH];
+    for (int i = 0; i < filter->serviceCount && (filter->fields & ScanField_Services); i++) {
+        cobble_uuid_format(&filter->services[i], uuids[i]);
+        const char* str = uuids[i];
+        dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &str);
+    }
+
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(&dict, &entry);
+    dbus_message_iter_close_container(&iter, &dict);
+
+    call_async(msg, DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "SetDiscoveryFilter");
+
+    call_async(dbus_message_new_method_call(BLUEZ_SERVICE, "/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects"),
+        DBUS_TIMEOUT_USE_DEFAULT, on_scan_objects, NULL);
+
+    call_async(method_call(adapterPath, ADAPTER_INTERFACE, "StartDiscovery"), DBUS_TIMEOUT_USE_DEFAULT, on_discovery_started, NULL);
+
+    scanning = true;
+    update_status();
+}
+
+static void scan_stop(void) {
+
+    if (scanning)
+        call_async(method_call(adapterPath, ADAPTER_INTERFACE, "StopDiscovery"), DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "StopDiscovery");
+
+    scanning = false;
+    update_status();
+}
+
+/*
+ * Connection and GATT discovery
+ */
+
+static void close_fd(int* fd) {
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+static link_state* find_link(cobble_conn_handle h) {
+    link_state* l = &links[cobble_connection_index(h)];
+    return (h != COBBLE_CONNECTION_NONE && l->handle == h) ? l : NULL;
+}
+
+// Writes without response must fit in one packet, while BlueZ splits long writes with response itself
+static void update_mtu(link_state* l, int mtu) {
+
+    if (l->mtuReported && mtu == l->attMtu)
+        return;
+
+    l->attMtu = mtu;
+    l->mtuReported = true;
+    cobble_event_mtuchanged(l->handle, mtu, MAX_LENGTH, mtu - 3);
+}
+
+// The connection a device object, or an object beneath it (eg a characteristic), belongs to
+static link_state* link_for_path(const char* path, bool exact) {
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        link_state* l = &links[i];
+        if (l->handle != COBBLE_CONNECTION_NONE && (exact ? strcmp(path, l->path) == 0 : path_is_under(path, l->path)))
+            return l;
+    }
+    return NULL;
+}
+
+// Replies to calls made for a characteristic carry its connection and handle, so that a reply arriving after the
+// connection has gone (and perhaps after its slot has been reused) is recognised and dropped
+static void* operation_context(link_state* l, cobble_char_handle h) {
+    return (void*)(((uintptr_t)l->handle << 16) | h);
+}
+
+static link_state* operation_link(void* ctx, cobble_char_handle* h) {
+    *h = (cobble_char_handle)((uintptr_t)ctx & 0xFFFF);
+    return find_link((cobble_conn_handle)((uintptr_t)ctx >> 16));
+}
+
+// Connected if any device is connected, otherwise Connecting if any connection is being made
+static void update_status(void) {
+
+    CobbleStatus s = scanning ? Scanning : Initialised;
+
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        if (links[i].handle == COBBLE_CONNECTION_NONE)
+            continue;
+        if (links[i].connected)
+            s = Connected;
+        else if (s != Connected)
+            s = Connecting;
+    }
+
+    cobble_status_update(s);
+}
+
+// Reports the end of the stream, however it ended
+static void end_stream(link_state* l, int status) {
+
+    write_stream* w = &l->stream;
+
+    if (!w->active)
+        return;
+
+    cobble_event_writecomplete(l->handle, w->characteristic, w->written, status);
+
+    free(w->data);
+    w->data = NULL;
+    w->active = false;
+}
+
+// Forget everything about a device's GATT database
+static void clear_characteristics(link_state* l) {
+
+    end_stream(l, WriteStatus_Failed);
+
+    if (l->characteristics != NULL) {
+        for (int h = 0; h <= COBBLE_MAX_CHARACTERISTICS; h++) {
+            characteristic* c = &l->characteristics[h];
+            free(c->path);
+            close_fd(&c->notifyFd);
+            close_fd(&c->writeFd);
+        }
+    }
+
+    free(l->characteristics);
+    free(l->subscriptions);
+    free(l->writeQueue);
+    l->characteristics = NULL;
+    l->subscriptions = NULL;
+    l->writeQueue = NULL;
+    l->writeQueueHead = 0;
+    l->writeQueueCount = 0;
+    l->writeQueueOverflowed = false;
+    l->subscriptionCount = 0;
+    l->servicesDiscovered = false;
+    l->attMtu = DEFAULT_ATT_MTU;
+    l->mtuReported = false;
+}
+
+// The status event must go before the handle is released, as it is reported with the connection's address
+static void device_gone(link_state* l, int event) {
+
+    if (l->handle == COBBLE_CONNECTION_NONE)
+        return;
+
+    clear_characteristics(l);
+    l->path[0] = '\0';
+    l->connected = false;
+
+    cobble_event_connectionstatus_c(l->handle, event);
+    cobble_connection_close(l->handle);
+    l->handle = COBBLE_CONNECTION_NONE;
+
+    update_status();
+}
+
+static const char* service_uuid_for(DBusMessage* reply, const char* servicePath, char* out);
+
+static uint32_t characteristic_flags(DBusMessageIter* props) {
+
+    uint32_t flags = 0;
+    DBusMessageIter value, array;
+
+    if (dict_find(props, "Flags", &value) && dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_ARRAY) {
+        dbus_message_iter_recurse(&value, &array);
+        while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING) {
+            const char* flag;
+            dbus_message_iter_get_basic(&array, &flag);
+            if (strcmp(flag, "read") == 0)
+                flags |= FLAG_READ;
+            else if (strcmp(flag, "write") == 0)
+                flags |= FLAG_WRITE;
+            else if (strcmp(flag, "write-without-response") == 0)
+                flags |= FLAG_WRITE_WITHOUT_RESPONSE;
+            else if (strcmp(flag, "notify") == 0)
+                flags |= FLAG_NOTIFY;
+            else if (strcmp(flag, "indicate") == 0)
+                flags |= FLAG_INDICATE;
+            dbus_message_iter_next(&array);
+        }
+    }
+
+    if (dict_find(props, "NotifyAcquired", &value))
+        flags |= FLAG_ACQUIRE_NOTIFY;
+    if (dict_find(props, "WriteAcquired", &value))
+        flags |= FLAG_ACQUIRE_WRITE;
+
+    return flags;
+}
+
+// The GetManagedObjects reply being walked, and the connection it is being walked for, so that characteristics can look
+// up the UUID of their service
+static DBusMessage* gattObjects = NULL;
+static link_state* gattLink = NULL;
+static int gattServices;
+static int gattCharacteristics;
+
+static bool service_wanted(link_state* l, const char* serviceId) {
+    for (int i = 0; i < l->serviceCount; i++) {
+        if (strcmp(l->services[i], serviceId) == 0)
+            return true;
+    }
+    return l->allServices;
+}
+
+static void found_service(const char* path, const char* interface, DBusMessageIter* props) {
+
+    if (strcmp(interface, SERVICE_INTERFACE) != 0 || !path_is_under(path, gattLink->path))
+        return;
+
+    char serviceId[COBBLE_UUID_STRING_LENGTH];
+    if (service_uuid_for(gattObjects, path, serviceId) != NULL && service_wanted(gattLink, serviceId)) {
+        gattServices++;
+        cobble_event_servicediscovered(serviceId);
+    }
+}
+
+static void found_characteristic(const char* path, const char* interface, DBusMessageIter* props) {
+
+    if (strcmp(interface, CHARACTERISTIC_INTERFACE) != 0 || !path_is_under(path, gattLink->path))
+        return;
+
+    cobble_uuid uuid;
+    const char* uuidString = dict_string(props, "UUID");
+    const char* servicePath = dict_string(props, "Service");
+    if (uuidString == NULL || servicePath == NULL || !cobble_uuid_parse(uuidString, &uuid))
+        return;
+
+    cobble_char_handle h = cobble_characteristic_intern_uuid(&uuid);
+    if (h == COBBLE_CHARACTERISTIC_NONE)
+        return;
+
+    characteristic* c = &gattLink->characteristics[h];
+    free(c->path);
+    c->path = strdup(path);
+    c->flags = characteristic_flags(props);
+    if (service_uuid_for(gattObjects, servicePath, c->service) == NULL)
+        c->service[0] = '\0';
+
+    // BlueZ 5.62 and later report the negotiated MTU on each characteristic
+    DBusMessageIter value;
+    if (dict_find(props, "MTU", &value) && dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_UINT16) {
+        uint16_t mtu;
+        dbus_message_iter_get_basic(&value, &mtu);
+        update_mtu(gattLink, mtu);
+    }
+
+    // Characteristics of the services not asked for are kept, so that cobble_discover_service() can report them
+    if (service_wanted(gattLink, c->service)) {
+        gattCharacteristics++;
+        cobble_event_characteristicdiscovered_c(gattLink->handle, c->service, cobble_characteristic_uuid(h));
+    }
+}
+
+// Service UUIDs are only held on the service objects, which may come before or after their characteristics
+static char lookupPath[MAX_PATH_LENGTH];
+static char* lookupResult;
+
+static void match_service(const char* path, const char* interface, DBusMessageIter* props) {
+    cobble_uuid uuid;
+    const char* uuidString;
+    if (lookupResult[0] != '\0' || strcmp(interface, SERVICE_INTERFACE) != 0 || strcmp(path, lookupPath) != 0)
+        return;
+    uuidString = dict_string(props, "UUID");
+    if (uuidString != NULL && cobble_uuid_parse(uuidString, &uuid))
+        cobble_uuid_format(&uuid, lookupResult);
+}
+
+static const char* service_uuid_for(DBusMessage* reply, const char* servicePath, char* out) {
+    snprintf(lookupPath, sizeof(lookupPath), "%s", servicePath);
+    lookupResult = out;
+    out[0] = '\0';
+    for_each_object(reply, match_service);
+    return (out[0] != '\0') ? out : NULL;
+}
+
+static bool deviceResolved;
+
+static void check_resolved(const char* path, const char* interface, DBusMessageIter* props) {
+    if (strcmp(interface, DEVICE_INTERFACE) == 0 && strcmp(path, gattLink->path) == 0)
+        dict_bool(props, "ServicesResolved", &deviceResolved);
+}
+
+static void on_gatt_objects(DBusPendingCall* pending, void* ctx) {
+
+    DBusMessage* reply = take_reply(pending, "GetManagedObjects", NULL, 0);
+    link_state* l = find_link((cobble_conn_handle)(uintptr_t)ctx);
+
+    if (reply == NULL)
+        return;
+
+    if (l != NULL && !l->servicesDiscovered) {
+
+        gattLink = l;
+
+        // Wait for ServicesResolved if BlueZ is still discovering (or reading its cache)
+        deviceResolved = false;
+        for_each_object(reply, check_resolved);
+
+        if (deviceResolved) {
+            l->servicesDiscovered = true;
+            gattObjects = reply;
+            gattServices = 0;
+            gattCharacteristics = 0;
+            for_each_object(reply, found_service);
+            for_each_object(reply, found_characteristic);
+            gattObjects = NULL;
+
+            // Older versions of BlueZ only give the MTU when a characteristic is acquired, so until then it's the
+            // smallest it could be
+            if (!l->mtuReported)
+                update_mtu(l, l->attMtu);
+
+            // BlueZ has looked up every service's characteristics by the time it sets ServicesResolved
+            if (l->allServices || l->serviceCount > 0)
+                cobble_event_discoverycomplete(l->handle, gattServices, gattCharacteristics, (int)(now_ms() - l->connectedAt));
+        }
+
+        gattLink = NULL;
+    }
+
+    dbus_message_unref(reply);
+}
+
+static void discover_services(link_state* l) {
+    call_async(dbus_message_new_method_call(BLUEZ_SERVICE, "/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects"),
+        DBUS_TIMEOUT_USE_DEFAULT, on_gatt_objects, (void*)(uintptr_t)l->handle);
+}
+
+static void on_connected(DBusPendingCall* pending, void* ctx) {
+
+    DBusMessage* reply = take_reply(pending, "Connect", NULL, 0);
+    link_state* l = find_link((cobble_conn_handle)(uintptr_t)ctx);
+
+    if (reply == NULL) {
+        if (l != NULL)
+            device_gone(l, ConnectionStatus_DidConnectFailed);
+        return;
+    }
+
+    dbus_message_unref(reply);
+
+    if (l == NULL || l->connected)
+        return;
+
+    l->connected = true;
+    l->connectedAt = now_ms();
+    update_status();
+    cobble_event_connectionstatus_c(l->handle, ConnectionStatus_DidConnect);
+
+    // Services may already be resolved, either from BlueZ's cache or because the device was already connected
+    discover_services(l);
+}
+
+// The handle was allocated by cobble_connect(), along with the device's address. services is a list of count UUIDs, or
+// empty for every service.
+static void connect_device(cobble_conn_handle h, const cobble_uuid* services, int count, uint32_t flags) {
+
+    link_state* l = &links[cobble_connection_index(h)];
+    uint64_t address = cobble_connection_address(h);
+
+    // Device objects are named after their address, eg /org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF
+    char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+    cobble_address_format(address, identifier);
+    snprintf(l->path, sizeof(l->path), "%s/dev_%s", adapterPath, identifier);
+    for (char* p = l->path + strlen(adapterPath); *p != '\0'; p++) {
+        if (*p == ':')
+            *p = '_';
+    }
+
+    // TODO: Should the app control scanning behaviour instead?
+    scan_stop();
+
+    l->handle = h;
+    l->connected = false;
+    l->servicesDiscovered = false;
+    l->attMtu = DEFAULT_ATT_MTU;
+    l->mtuReported = false;
+    l->subscriptionCount = 0;
+
+    // bluetoothd decides for itself whether to use its cache, so ConnectFlag_Uncached makes no difference
+    l->allServices = (count == 0 && !(flags & ConnectFlag_NoDiscovery));
+    l->serviceCount = count;
+    for (int i = 0; i < count; i++)
+        cobble_uuid_format(&services[i], l->services[i]);
+
+    // Indexed by characteristic handle, as for the characteristic table
+    l->characteristics = calloc(COBBLE_MAX_CHARACTERISTICS + 1, sizeof(characteristic));
+    l->subscriptions = calloc(COBBLE_MAX_CHARACTERISTICS, sizeof(cobble_char_handle));
+    if (l->characteristics == NULL || l->subscriptions == NULL) {
+        printf("Could not allocate the characteristic table for %s\n", identifier);
+        device_gone(l, ConnectionStatus_DidConnectFailed);
+        return;
+    }
+    for (int i = 0; i <= COBBLE_MAX_CHARACTERISTICS; i++) {
+        l->characteristics[i].notifyFd = -1;
+        l->characteristics[i].writeFd = -1;
+    }
+
+    update_status();
+
+    call_async(method_call(l->path, DEVICE_INTERFACE, "Connect"), CONNECT_TIMEOUT_MS, on_connected, (void*)(uintptr_t)h);
+}
+
+static void disconnect_device(link_state* l) {
+    call_async(method_call(l->path, DEVICE_INTERFACE, "Disconnect"), DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "Disconnect");
+}
+
+static void disconnect_all(void) {
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        if (links[i].handle != COBBLE_CONNECTION_NONE)
+            disconnect_device(&links[i]);
+    }
+}
+
+static void characteristics_get(link_state* l) {
+    for (int h = 1; h <= COBBLE_MAX_CHARACTERISTICS; h++) {
+        characteristic* c = &l->characteristics[h];
+        if (c->path != NULL && service_wanted(l, c->service))
+            cobble_event_characteristicdiscovered_c(l->handle, c->service, cobble_characteristic_uuid((cobble_char_handle)h));
+    }
+}
+
+// BlueZ has already found every service, so once it has resolved them the characteristics can be reported straight away.
+// Until then, the service is added to those to report.
+static void discover_service(link_state* l, const cobble_uuid* uuid) {
+
+    char serviceId[COBBLE_UUID_STRING_LENGTH];
+    int characteristics = 0;
+
+    cobble_uuid_format(uuid, serviceId);
+    if (!service_wanted(l, serviceId)) {
+        if (l->serviceCount == COBBLE_MAX_CONNECT_SERVICES) {
+            printf("Too many services asked for, cannot add %s\n", serviceId);
+            if (l->servicesDiscovered)
+                cobble_event_discoverycomplete(l->handle, 0, 0, 0);
+            return;
+        }
+        snprintf(l->services[l->serviceCount++], COBBLE_UUID_STRING_LENGTH, "%s", serviceId);
+    }
+
+    if (!l->servicesDiscovered)
+        return;
+
+    for (int h = 1; h <= COBBLE_MAX_CHARACTERISTICS; h++) {
+        characteristic* c = &l->characteristics[h];
+        if (c->path != NULL && strcmp(c->service, serviceId) == 0) {
+            if (characteristics++ == 0)
+                cobble_event_servicediscovered(serviceId);
+            cobble_event_characteristicdiscovered_c(l->handle, c->service, cobble_characteristic_uuid((cobble_char_handle)h));
+        }
+    }
+
+    cobble_event_discoverycomplete(l->handle, (characteristics > 0) ? 1 : 0, characteristics, 0);
+}
+
+/*
+ * Characteristic operations
+ */
+
+static characteristic* find_characteristic(link_state* l, cobble_char_handle h, const char* operation) {
+    if (h == COBBLE_CHARACTERISTIC_NONE || h > COBBLE_MAX_CHARACTERISTICS || l->characteristics[h].path == NULL) {
+        printf("No match in the cache for characteristic %s when trying to %s\n", cobble_characteristic_uuid(h) ? cobble_characteristic_uuid(h) : "(unknown)", operation);
+        return NULL;
+    }
+    return &l->characteristics[h];
+}
+
+static void add_subscription(link_state* l, cobble_char_handle h) {
+    if (!l->characteristics[h].subscribed) {
+        l->characteristics[h].subscribed = true;
+        l->subscriptions[l->subscriptionCount++] = h;
+    }
+}
+
+static void remove_subscription(link_state* l, cobble_char_handle h) {
+    l->characteristics[h].subscribed = false;
+    for (int i = 0; i < l->subscriptionCount; i++) {
+        if (l->subscriptions[i] == h) {
+            l->subscriptions[i] = l->subscriptions[--l->subscriptionCount];
+            break;
+        }
+    }
+}
+
+// Read a reply holding a file descriptor and an MTU, as returned by AcquireNotify and AcquireWrite. mtuOut may be NULL.
+static int acquired_fd(DBusPendingCall* pending, const char* what, link_state* l, uint16_t* mtuOut) {
+
+    DBusMessage* reply = take_reply(pending, what, NULL, 0);
+    int fd = -1;
+    uint16_t mtu = 0;
+
+    if (reply == NULL)
+        return -1;
+
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_UINT16, &mtu, DBUS_TYPE_INVALID))
+        fd = -1;
+    else if (l != NULL && mtu > l->attMtu)
+        update_mtu(l, mtu);
+
+    if (mtuOut != NULL)
+        *mtuOut = mtu;
+    dbus_message_unref(reply);
+    return fd;
+}
+
+static void on_acquire_notify(DBusPendingCall* pending, void* ctx) {
+
+    cobble_char_handle h;
+    link_state* l = operation_link(ctx, &h);
+    uint16_t mtu = 0;
+    int fd = acquired_fd(pending, "AcquireNotify", l, &mtu);
+    characteristic* c = (l != NULL) ? &l->characteristics[h] : NULL;
+
+    if (c == NULL || c->path == NULL || !c->subscribed) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // Notifications carry up to MTU - 3 bytes of value
+    if (fd >= 0) {
+        c->notifyFd = fd;
+        c->notifyCapacity = (mtu > 3) ? mtu - 3 : MAX_LENGTH;
+        return;
+    }
+
+    // Not available for this characteristic (eg indications only), so have notifications sent as D-Bus signals instead
+    call_async(method_call(c->path, CHARACTERISTIC_INTERFACE, "StartNotify"), DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "StartNotify");
+}
+
+static void subscribe(link_state* l, cobble_char_handle h) {
+
+    characteristic* c = find_characteristic(l, h, "subscribe");
+    if (c == NULL || c->subscribed)
+        return;
+
+    add_subscription(l, h);
+
+    // Where BlueZ can hand notifications over on a socket, that saves a D-Bus message per notification
+    if ((c->flags & FLAG_ACQUIRE_NOTIFY) && (c->flags & FLAG_NOTIFY)) {
+        DBusMessage* msg = method_call(c->path, CHARACTERISTIC_INTERFACE, "AcquireNotify");
+        append_empty_options(msg);
+        call_async(msg, DBUS_TIMEOUT_USE_DEFAULT, on_acquire_notify, operation_context(l, h));
+    } else {
+        call_async(method_call(c->path, CHARACTERISTIC_INTERFACE, "StartNotify"), DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "StartNotify");
+    }
+}
+
+static void on_read(DBusPendingCall* pending, void* ctx) {
+
+    cobble_char_handle h;
+    link_state* l = operation_link(ctx, &h);
+    DBusMessage* reply = take_reply(pending, "ReadValue", NULL, 0);
+    DBusMessageIter iter;
+    const uint8_t* data;
+    int len;
+
+    if (reply == NULL)
+        return;
+
+    if (l != NULL && dbus_message_iter_init(reply, &iter) && variant_bytes(&iter, &data, &len))
+        cobble_event_updatevalue_c(l->handle, h, data, len);
+
+    dbus_message_unref(reply);
+}
+
+static void read_characteristic(link_state* l, cobble_char_handle h) {
+
+    characteristic* c = find_characteristic(l, h, "read");
+    if (c == NULL)
+        return;
+
+    DBusMessage* msg = method_call(c->path, CHARACTERISTIC_INTERFACE, "ReadValue");
+    append_empty_options(msg);
+    call_async(msg, DBUS_TIMEOUT_USE_DEFAULT, on_read, operation_context(l, h));
+}
+
+static void pump_stream(link_state* l);
+
+static void on_acquire_write(DBusPendingCall* pending, void* ctx) {
+
+    cobble_char_handle h;
+    link_state* l = operation_link(ctx, &h);
+    int fd = acquired_fd(pending, "AcquireWrite", l, NULL);
+    characteristic* c = (l != NULL) ? &l->characteristics[h] : NULL;
+
+    if (c == NULL || c->path == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    c->writeAcquiring = false;
+    c->writeFd = fd;
+
+    // Don't keep asking if BlueZ won't give us one
+    if (fd < 0)
+        c->flags &= ~FLAG_ACQUIRE_WRITE;
+
+    // A stream waits for the socket, or goes over D-Bus if there isn't one
+    if (l->stream.active && l->stream.characteristic == h)
+        pump_stream(l);
+}
+
+static void request_write_socket(link_state* l, cobble_char_handle h) {
+
+    characteristic* c = &l->characteristics[h];
+    DBusMessage* acquire = method_call(c->path, CHARACTERISTIC_INTERFACE, "AcquireWrite");
+
+    append_empty_options(acquire);
+    c->writeAcquiring = true;
+    call_async(acquire, DBUS_TIMEOUT_USE_DEFAULT, on_acquire_write, operation_context(l, h));
+}
+
+static DBusMessage* write_value_call(characteristic* c, const uint8_t* data, int len, bool withoutResponse) {
+
+    DBusMessage* msg = method_call(c->path, CHARACTERISTIC_INTERFACE, "WriteValue");
+    DBusMessageIter iter, array, dict;
+    const char* type = withoutResponse ? "command" : "request";
+
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "y", &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &data, len);
+    dbus_message_iter_close_container(&iter, &array);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_dict_entry(&dict, "type", DBUS_TYPE_STRING, &type);
+    dbus_message_iter_close_container(&iter, &dict);
+
+    return msg;
+}
+
+// There's nothing to wait for on a write without response, and at high rates the replies would only add traffic
+static void send_write_command(characteristic* c, const uint8_t* data, int len) {
+
+    DBusMessage* msg = write_value_call(c, data, len, true);
+
+    dbus_message_set_no_reply(msg, TRUE);
+    dbus_connection_send(connection, msg, NULL);
+    dbus_message_unref(msg);
+}
+
+// Hold a write without response until its socket has room, dropping it if too many are already waiting
+static void queue_write(link_state* l, cobble_char_handle h, const uint8_t* data, int len) {
+
+    if (l->writeQueue == NULL)
+        l->writeQueue = malloc(WRITE_QUEUE_LENGTH * sizeof(queued_write));
+
+    if (l->writeQueue == NULL || l->writeQueueCount == WRITE_QUEUE_LENGTH) {
+        if (!l->writeQueueOverflowed)
+            printf("Too many writes waiting for the write socket - dropping writes until it has room\n");
+        l->writeQueueOverflowed = true;
+        return;
+    }
+
+    queued_write* q = &l->writeQueue[(l->writeQueueHead + l->writeQueueCount) % WRITE_QUEUE_LENGTH];
+    q->characteristic = h;
+    q->length = len;
+    memcpy(q->data, data, len);
+    l->writeQueueCount++;
+}
+
+// Send the queued writes for as long as their sockets have room. A socket which fails for any other reason than being
+// full is closed, and the writes for it go over D-Bus instead, still in order.
+static void flush_writes(link_state* l) {
+
+    while (l->writeQueueCount > 0) {
+        queued_write* q = &l->writeQueue[l->writeQueueHead];
+        characteristic* c = &l->characteristics[q->characteristic];
+
+        if (c->writeFd >= 0) {
+            ssize_t n = send(c->writeFd, q->data, q->length, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n != q->length) {
+                printf("Write to acquired socket failed (%s), falling back to D-Bus\n", (n < 0) ? strerror(errno) : "short write");
+                close_fd(&c->writeFd);
+            }
+        }
+        if (c->writeFd < 0)
+            send_write_command(c, q->data, q->length);
+
+        l->writeQueueHead = (l->writeQueueHead + 1) % WRITE_QUEUE_LENGTH;
+        l->writeQueueCount--;
+    }
+
+    l->writeQueueOverflowed = false;
+}
+
+static void write_characteristic(link_state* l, cobble_char_handle h, const uint8_t* data, int len) {
+
+    characteristic* c = find_characteristic(l, h, "write");
+    if (c == NULL)
+        return;
+
+    bool withoutResponse = (c->flags & FLAG_WRITE_WITHOUT_RESPONSE) != 0;
+
+    // Behind writes already waiting for a socket, so as not to overtake them
+    if (withoutResponse && l->writeQueueCount > 0) {
+        queue_write(l, h, data, len);
+        return;
+    }
+
+    // Writes without response can go straight to a socket once we have one. If it's full, the write waits for room
+    // rather than going over D-Bus, where it could overtake or be overtaken by those on the socket.
+    if (withoutResponse && c->writeFd >= 0) {
+        ssize_t n = send(c->writeFd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == len)
+            return;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            queue_write(l, h, data, len);
+            return;
+        }
+        printf("Write to acquired socket failed (%s), falling back to D-Bus\n", (n < 0) ? strerror(errno) : "short write");
+        close_fd(&c->writeFd);
+    }
+
+    // Ask for a socket for next time. BlueZ handles calls in order, so writes sent before it arrives still go first.
+    if (withoutResponse && (c->flags & FLAG_ACQUIRE_WRITE) && c->writeFd < 0 && !c->writeAcquiring)
+        request_write_socket(l, h);
+
+    if (withoutResponse)
+        send_write_command(c, data, len);
+    else
+        call_async(write_value_call(c, data, len, false), DBUS_TIMEOUT_USE_DEFAULT, on_reply_logged, "WriteValue");
+}
+
+/*
+ * Write streams
+ */
+
+static void on_stream_write(DBusPendingCall* pending, void* ctx) {
+
+    cobble_char_handle h;
+    link_state* l = operation_link(ctx, &h);
+    DBusMessage* reply = take_reply(pending, "WriteValue", NULL, 0);
+    write_stream* w = (l != NULL) ? &l->stream : NULL;
+
+    // A reply for a connection or stream which has since ended
+    if (w == NULL || !w->active || w->characteristic != h || w->pending == 0) {
+        if (reply != NULL)
+            dbus_message_unref(reply);
+        return;
+    }
+
+    int len = w->pendingLengths[w->pendingHead];
+    w->pendingHead = (w->pendingHead + 1) % STREAM_WINDOW;
+    w->pending--;
+
+    if (reply == NULL) {
+        w->failed = true;
+    } else {
+        if (!w->failed)
+            w->written += len;
+        dbus_message_unref(reply);
+    }
+
+    pump_stream(l);
+}
+
+// Write as much more of the stream as the socket or the window of WriteValue calls allows, and report the end once
+// everything has been written or has failed
+static void pump_stream(link_state* l) {
+
+    write_stream* w = &l->stream;
+    characteristic* c = &l->characteristics[w->characteristic];
+    bool withoutResponse = (c->flags & FLAG_WRITE_WITHOUT_RESPONSE) != 0;
+
+    w->waitingForSocket = false;
+
+    while (!w->failed && w->sent < w->length) {
+
+        int remaining = w->length - w->sent;
+
+        // Writes without response go to the socket for as long as it has room, then wait for it to have more
+        if (withoutResponse && c->writeFd >= 0) {
+            int len = (remaining < l->attMtu - 3) ? remaining : l->attMtu - 3;
+            ssize_t n = send(c->writeFd, w->data + w->sent, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n == len) {
+                w->sent += len;
+                w->written += len;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                w->waitingForSocket = true;
+                return;
+            }
+            printf("Write to acquired socket failed (%s), falling back to D-Bus\n", (n < 0) ? strerror(errno) : "short write");
+            close_fd(&c->writeFd);
+            continue;
+        }
+
+        // Anything sent over D-Bus now could overtake what is written to the socket once it arrives
+        if (withoutResponse && c->writeAcquiring)
+            return;
+
+        // Each write with response must be answered before the next is sent
+        if (w->pending == (withoutResponse ? STREAM_WINDOW : 1))
+            return;
+
+        int chunk = withoutResponse ? l->attMtu - 3 : MAX_LENGTH;
+        int len = (remaining < chunk) ? remaining : chunk;
+
+        call_async(write_value_call(c, w->data + w->sent, len, withoutResponse), DBUS_TIMEOUT_USE_DEFAULT, on_stream_write, operation_context(l, w->characteristic));
+        w->pendingLengths[(w->pendingHead + w->pending) % STREAM_WINDOW] = len;
+        w->pending++;
+        w->sent += len;
+    }
+
+    if (w->pending == 0)
+        end_stream(l, w->failed ? WriteStatus_Failed : WriteStatus_Complete);
+}
+
+static void write_stream_start(link_state* l, cobble_char_handle h, uint8_t* data, int len) {
+
+    write_stream* w = &l->stream;
+
+    if (w->active) {
+        printf("A stream is already being written to this device\n");
+        cobble_event_writecomplete(l->handle, h, 0, WriteStatus_Busy);
+        free(data);
+        return;
+    }
+
+    characteristic* c = find_characteristic(l, h, "write");
+    if (c == NULL) {
+        cobble_event_writecomplete(l->handle, h, 0, WriteStatus_Failed);
+        free(data);
+        return;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->active = true;
+    w->characteristic = h;
+    w->data = data;
+    w->length = len;
+
+    if ((c->flags & FLAG_WRITE_WITHOUT_RESPONSE) && (c->flags & FLAG_ACQUIRE_WRITE) && c->writeFd < 0 && !c->writeAcquiring)
+        request_write_socket(l, h);
+
+    pump_stream(l);
+}
+
+static void read_notifications(link_state* l, cobble_char_handle h) {
+
+    characteristic* c = &l->characteristics[h];
+
+    if (bluez_notify_recv(c->notifyFd, l->handle, h, c->notifyCapacity) < 0) {
+        close_fd(&c->notifyFd);
+        remove_subscription(l, h);
+    }
+}
+
+/*
+ * Signals from BlueZ
+ */
+
+static cobble_char_handle subscribed_handle(link_state* l, const char* path) {
+    for (int i = 0; i < l->subscriptionCount; i++) {
+        if (strcmp(l->characteristics[l->subscriptions[i]].path, path) == 0)
+            return l->subscriptions[i];
+    }
+    return COBBLE_CHARACTERISTIC_NONE;
+}
+
+static void properties_changed(DBusMessage* msg) {
+
+    const char* path = dbus_message_get_path(msg);
+    const char* interface;
+    DBusMessageIter iter;
+
+    if (path == NULL || !dbus_message_iter_init(msg, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return;
+    dbus_message_iter_get_basic(&iter, &interface);
+    dbus_message_iter_next(&iter);
+
+    if (strcmp(interface, CHARACTERISTIC_INTERFACE) == 0) {
+
+        link_state* l = link_for_path(path, false);
+        cobble_char_handle h = (l != NULL) ? subscribed_handle(l, path) : COBBLE_CHARACTERISTIC_NONE;
+
+        if (h != COBBLE_CHARACTERISTIC_NONE)
+            bluez_notify_signal(msg, l->handle, h);
+
+    } else if (strcmp(interface, DEVICE_INTERFACE) == 0) {
+
+        device_properties(path, &iter);
+
+        link_state* l = link_for_path(path, true);
+        if (l == NULL)
+            return;
+
+        bool value;
+        if (dict_bool(&iter, "Connected", &value) && !value)
+            device_gone(l, l->connected ? ConnectionStatus_DidDisconnect : ConnectionStatus_DidConnectFailed);
+        else if (dict_bool(&iter, "ServicesResolved", &value) && value && l->connected)
+            discover_services(l);
+
+    } else if (strcmp(interface, ADAPTER_INTERFACE) == 0 && strcmp(path, adapterPath) == 0) {
+
+        bool powered;
+        if (dict_bool(&iter, "Powered", &powered) && !powered) {
+            for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++)
+                device_gone(&links[i], ConnectionStatus_DidDisconnect);
+            scanning = false;
+            cobble_status_error(HardwareTurnedOff);
+        }
+    }
+}
+
+static void interfaces_added(DBusMessage* msg) {
+
+    DBusMessageIter iter, interfaces;
+    const char* path;
+
+    if (!dbus_message_iter_init(msg, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+        return;
+    dbus_message_iter_get_basic(&iter, &path);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_recurse(&iter, &interfaces);
+
+    while (dbus_message_iter_get_arg_type(&interfaces) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter entry;
+        const char* interface;
+        dbus_message_iter_recurse(&interfaces, &entry);
+        dbus_message_iter_get_basic(&entry, &interface);
+        dbus_message_iter_next(&entry);
+        if (strcmp(interface, DEVICE_INTERFACE) == 0)
+            device_properties(path, &entry);
+        dbus_message_iter_next(&interfaces);
+    }
+}
+
+static DBusHandlerResult signal_filter(DBusConnection* conn, DBusMessage* msg, void* data) {
+
+    if (dbus_message_is_signal(msg, PROPERTIES_INTERFACE, "PropertiesChanged"))
+        properties_changed(msg);
+    else if (dbus_message_is_signal(msg, OBJECT_MANAGER_INTERFACE, "InterfacesAdded"))
+        interfaces_added(msg);
+    else if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+        printf("Lost the connection to the system bus\n");
+        cobble_status_error(UnknownError);
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/*
+ * Start-up
+ */
+
+static bool adapterPowered;
+
+static void find_adapter(const char* path, const char* interface, DBusMessageIter* props) {
+    // Multiple adapters are not supported, so use the first one
+    if (adapterPath[0] == '\0' && strcmp(interface, ADAPTER_INTERFACE) == 0) {
+        snprintf(adapterPath, sizeof(adapterPath), "%s", path);
+        adapterPowered = false;
+        dict_bool(props, "Powered", &adapterPowered);
+    }
+}
+
+static void on_adapter_objects(DBusPendingCall* pending, void* ctx) {
+
+    DBusMessage* reply = take_reply(pending, "GetManagedObjects", NULL, 0);
+
+    if (reply == NULL) {
+        // bluetoothd isn't running
+        cobble_status_error(HardwareUnsupported);
+        return;
+    }
+
+    for_each_object(reply, find_adapter);
+    dbus_message_unref(reply);
+
+    if (adapterPath[0] == '\0') {
+        printf("No Bluetooth adapter found\n");
+        cobble_status_error(HardwareUnsupported);
+    } else if (!adapterPowered) {
+        printf("Bluetooth adapter %s is powered off\n", adapterPath);
+        cobble_status_error(HardwareTurnedOff);
+    } else {
+        cobble_status_set(Initialised);
+    }
+}
+
+static bool bus_open(void) {
+
+    DBusError err;
+    dbus_error_init(&err);
+
+    connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+    if (connection == NULL) {
+        printf("Could not connect to the system bus: %s\n", err.message);
+        dbus_error_free(&err);
+        return false;
+    }
+
+    dbus_connection_set_exit_on_disconnect(connection, FALSE);
+    dbus_connection_set_watch_functions(connection, add_watch, remove_watch, toggle_watch, NULL, NULL);
+    dbus_connection_set_timeout_functions(connection, add_timeout, remove_timeout, toggle_timeout, NULL, NULL);
+    dbus_connection_add_filter(connection, signal_filter, NULL, NULL);
+
+    // Without an error to fill in, these don't wait for the bus to reply
+    dbus_bus_add_match(connection, "type='signal',sender='" BLUEZ_SERVICE "',interface='" PROPERTIES_INTERFACE "',member='PropertiesChanged'", NULL);
+    dbus_bus_add_match(connection, "type='signal',sender='" BLUEZ_SERVICE "',interface='" OBJECT_MANAGER_INTERFACE "',member='InterfacesAdded'", NULL);
+
+    call_async(dbus_message_new_method_call(BLUEZ_SERVICE, "/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects"),
+        DBUS_TIMEOUT_USE_DEFAULT, on_adapter_objects, NULL);
+
+    return true;
+}
+
+static void bus_close(void) {
+
+    // Leave the adapter and devices as we found them. This is the one place we wait for the bus.
+    if (connection != NULL && dbus_connection_get_is_connected(connection)) {
+        disconnect_all();
+        scan_stop();
+        dbus_connection_flush(connection);
+    }
+
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++)
+        device_gone(&links[i], links[i].connected ? ConnectionStatus_DidDisconnect : ConnectionStatus_DidConnectFailed);
+
+    if (connection != NULL) {
+        dbus_connection_close(connection);
+        dbus_connection_unref(connection);
+        connection = NULL;
+    }
+}
+
+/*
+ * Event loop
+ */
+
+// A command which can't be carried out must still give back what it holds
+static void abandon_command(command* c) {
+    if (c->type == Command_Connect) {
+        cobble_connection_close(c->connection);
+    } else if (c->type == Command_WriteStream) {
+        cobble_event_writecomplete(c->connection, c->characteristic, 0, WriteStatus_Failed);
+        free(c->stream);
+    }
+}
+
+// Returns false if the loop should stop
+static bool run_commands(void) {
+
+    uint64_t count;
+    command c;
+
+    if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        printf("Failed to read the wakeup eventfd: %s\n", strerror(errno));
+
+    while (cobble_ring_pop(&commandQueue, &c)) {
+
+        link_state* l = NULL;
+
+        // Nothing but shutting down can be done without an adapter
+        if (c.type != Command_Shutdown && (connection == NULL || adapterPath[0] == '\0')) {
+            printf("Bluetooth is not available\n");
+            abandon_command(&c);
+            continue;
+        }
+
+        switch (c.type) {
+        case Command_CharacteristicsGet:
+        case Command_Subscribe:
+        case Command_Read:
+        case Command_Write:
+        case Command_WriteStream:
+        case Command_DiscoverService:
+            l = find_link(c.connection);
+            if (l == NULL) {
+                printf("No connection has handle %u\n", c.connection);
+                abandon_command(&c);
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (c.type) {
+        case Command_ScanStart:
+            scan_start();
+            break;
+        case Command_ScanStop:
+            scan_stop();
+            break;
+        case Command_Connect:
+            connect_device(c.connection, (const cobble_uuid*)c.data, c.length, c.flags);
+            break;
+        case Command_Disconnect:
+            if (c.connection == COBBLE_CONNECTION_NONE)
+                disconnect_all();
+            else if ((l = find_link(c.connection)) != NULL)
+                disconnect_device(l);
+            break;
+        case Command_CharacteristicsGet:
+            characteristics_get(l);
+            break;
+        case Command_Subscribe:
+            subscribe(l, c.characteristic);
+            break;
+        case Command_Read:
+            read_characteristic(l, c.characteristic);
+            break;
+        case Command_Write:
+            write_characteristic(l, c.characteristic, c.data, c.length);
+            break;
+        case Command_WriteStream:
+            write_stream_start(l, c.characteristic, c.stream, c.length);
+            break;
+        case Command_DiscoverService:
+            discover_service(l, (const cobble_uuid*)c.data);
+            break;
+        case Command_Shutdown:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void* event_loop(void* arg) {
+
+    struct pollfd fds[1 + MAX_WATCHES + MAX_NOTIFY_SOCKETS + 2 * COBBLE_MAX_CONNECTIONS];
+    DBusWatch* polledWatches[MAX_WATCHES];
+    struct {
+        link_state* link;
+        cobble_char_handle characteristic;
+    } polledNotifications[MAX_NOTIFY_SOCKETS];
+    link_state* polledStreams[COBBLE_MAX_CONNECTIONS];
+    link_state* polledWrites[COBBLE_MAX_CONNECTIONS];
+
+    if (!bus_open())
+        cobble_status_error(HardwareUnsupported);
+
+    for (;;) {
+
+        // Deliver everything that has arrived before waiting for more
+        while (connection != NULL && dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+            ;
+
+        int n = 0;
+        fds[n].fd = wakeFd;
+        fds[n].events = POLLIN;
+        n++;
+
+        int watchCount = 0;
+        for (int i = 0; i < MAX_WATCHES; i++) {
+            DBusWatch* w = watches[i];
+            if (w == NULL || !dbus_watch_get_enabled(w))
+                continue;
+            unsigned int flags = dbus_watch_get_flags(w);
+            fds[n].fd = dbus_watch_get_unix_fd(w);
+            fds[n].events = ((flags & DBUS_WATCH_READABLE) ? POLLIN : 0) | ((flags & DBUS_WATCH_WRITABLE) ? POLLOUT : 0);
+            polledWatches[watchCount++] = w;
+            n++;
+        }
+
+        int notificationCount = 0;
+        for (int l = 0; l < COBBLE_MAX_CONNECTIONS; l++) {
+            link_state* link = &links[l];
+            for (int i = 0; i < link->subscriptionCount && notificationCount < MAX_NOTIFY_SOCKETS; i++) {
+                characteristic* c = &link->characteristics[link->subscriptions[i]];
+                if (c->notifyFd < 0)
+                    continue;
+                fds[n].fd = c->notifyFd;
+                fds[n].events = POLLIN;
+                polledNotifications[notificationCount].link = link;
+                polledNotifications[notificationCount++].characteristic = link->subscriptions[i];
+                n++;
+            }
+        }
+
+        // Streams waiting for room in their write socket
+        int streamCount = 0;
+        for (int l = 0; l < COBBLE_MAX_CONNECTIONS; l++) {
+            link_state* link = &links[l];
+            if (!link->stream.active || !link->stream.waitingForSocket)
+                continue;
+            fds[n].fd = link->characteristics[link->stream.characteristic].writeFd;
+            fds[n].events = POLLOUT;
+            polledStreams[streamCount++] = link;
+            n++;
+        }
+
+        // Queued writes waiting for room in the first one's socket
+        int writeCount = 0;
+        for (int l = 0; l < COBBLE_MAX_CONNECTIONS; l++) {
+            link_state* link = &links[l];
+            if (link->writeQueueCount == 0)
+                continue;
+            // The socket may have been closed since, in which case they go over D-Bus now
+            int fd = link->characteristics[link->writeQueue[link->writeQueueHead].characteristic].writeFd;
+            if (fd < 0) {
+                flush_writes(link);
+                if (link->writeQueueCount == 0)
+                    continue;
+                fd = link->characteristics[link->writeQueue[link->writeQueueHead].characteristic].writeFd;
+            }
+            fds[n].fd = fd;
+            fds[n].events = POLLOUT;
+            polledWrites[writeCount++] = link;
+            n++;
+        }
+
+        // Sleep until something happens, or the next D-Bus timeout (eg an unanswered method call) is due
+        uint64_t now = now_ms();
+        int wait = -1;
+        for (int i = 0; i < timeoutCount; i++) {
+            if (!dbus_timeout_get_enabled(timeouts[i].timeout))
+                continue;
+            int remaining = (timeouts[i].deadline > now) ? (int)(timeouts[i].deadline - now) : 0;
+            if (wait < 0 || remaining < wait)
+                wait = remaining;
+        }
+
+        if (poll(fds, n, wait) < 0 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && !run_commands())
+            break;
+
+        for (int i = 0; i < watchCount; i++) {
+            short revents = fds[1 + i].revents;
+            unsigned int flags = 0;
+            if (revents & POLLIN)
+                flags |= DBUS_WATCH_READABLE;
+            if (revents & POLLOUT)
+                flags |= DBUS_WATCH_WRITABLE;
+            if (revents & POLLHUP)
+                flags |= DBUS_WATCH_HANGUP;
+            if (revents & POLLERR)
+                flags |= DBUS_WATCH_ERROR;
+            // Handling an earlier watch may have removed this one
+            if (flags != 0 && watch_registered(polledWatches[i]))
+                dbus_watch_handle(polledWatches[i], flags);
+        }
+
+        // Handling a command or a D-Bus message may have closed a socket, or the connection it belonged to
+        for (int i = 0; i < notificationCount; i++) {
+            link_state* link = polledNotifications[i].link;
+            cobble_char_handle h = polledNotifications[i].characteristic;
+            if (fds[1 + watchCount + i].revents != 0 && link->characteristics != NULL && link->characteristics[h].notifyFd == fds[1 + watchCount + i].fd)
+                read_notifications(link, h);
+        }
+
+        for (int i = 0; i < streamCount; i++) {
+            link_state* link = polledStreams[i];
+            struct pollfd* fd = &fds[1 + watchCount + notificationCount + i];
+            if (fd->revents != 0 && link->stream.active && link->stream.waitingForSocket && link->characteristics[link->stream.characteristic].writeFd == fd->fd)
+                pump_stream(link);
+        }
+
+        for (int i = 0; i < writeCount; i++) {
+            link_state* link = polledWrites[i];
+            struct pollfd* fd = &fds[1 + watchCount + notificationCount + streamCount + i];
+            if (fd->revents != 0 && link->writeQueueCount > 0)
+                flush_writes(link);
+        }
+
+        // Handling a timeout removes it (and may move another into its place), so start again after each one
+        now = now_ms();
+        for (int i = 0; i < timeoutCount;) {
+            DBusTimeout* t = timeouts[i].timeout;
+            if (!dbus_timeout_get_enabled(t) || timeouts[i].deadline > now) {
+                i++;
+                continue;
+            }
+            // Timeouts repeat until they are removed
+            arm_timeout(&timeouts[i]);
+            dbus_timeout_handle(t);
+            i = 0;
+        }
+    }
+
+    bus_close();
+    return NULL;
+}
+
+static bool post(command* c) {
+
+    uint64_t one = 1;
+
+    if (!loopRunning) {
+        printf("Cobble has not been initialised\n");
+        return false;
+    }
+
+    if (!cobble_ring_push(&commandQueue, c)) {
+        printf("Too many commands are waiting - command dropped\n");
+        return false;
+    }
+
+    if (write(wakeFd, &one, sizeof(one)) < 0)
+        printf("Failed to wake the event loop: %s\n", strerror(errno));
+    return true;
+}
+
+static void post_simple(CommandType type, cobble_conn_handle connection) {
+    command c;
+    c.type = type;
+    c.connection = connection;
+    post(&c);
+}
+
+/*
+ * Public interface
+ */
+
+void cobble_init(void) {
+
+    if (loopRunning)
+        return;
+
+    printf("Cobble initialising...\n");
+
+    cobble_status_set(Uninitialised);
+    adapterPath[0] = '\0';
+    scanning = false;
+    memset(devices, 0, sizeof(devices));
+    memset(watches, 0, sizeof(watches));
+    timeoutCount = 0;
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        links[i].handle = COBBLE_CONNECTION_NONE;
+        links[i].attMtu = DEFAULT_ATT_MTU;
+    }
+
+    dbus_threads_init_default();
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0 || !cobble_ring_init(&commandQueue, COMMAND_QUEUE_LENGTH, sizeof(command), RingPolicy_DropNewest)) {
+        printf("Could not allocate the command queue\n");
+        cobble_status_error(UnknownError);
+        return;
+    }
+
+    if (pthread_create(&loopThread, NULL, event_loop, NULL) != 0) {
+        printf("Could not start the event loop thread\n");
+        cobble_status_error(UnknownError);
+        return;
+    }
+
+    loopRunning = true;
+}
+
+void cobble_deinit(void) {
+
+    printf("Cobble deinitialising...\n");
+
+    if (loopRunning) {
+        command c;
+        post_simple(Command_Shutdown, COBBLE_CONNECTION_NONE);
+        pthread_join(loopThread, NULL);
+        loopRunning = false;
+        // Anything sent after the shutdown
+        while (cobble_ring_pop(&commandQueue, &c))
+            abandon_command(&c);
+        cobble_ring_free(&commandQueue);
+    }
+
+    if (wakeFd >= 0)
+        close(wakeFd);
+    wakeFd = -1;
+
+    cobble_status_set(Uninitialised);
+}
+
+void cobble_scan_start(const char* service_uuids) {
+    cobble_scan_table_clear();
+    cobble_scan_filter_begin(service_uuids);
+    post_simple(Command_ScanStart, COBBLE_CONNECTION_NONE);
+}
+
+void cobble_scan_stop(void) {
+    post_simple(Command_ScanStop, COBBLE_CONNECTION_NONE);
+}
+
+// The handle is allocated here, rather than on the event loop thread, so that it can be returned straight away
+cobble_conn_handle cobble_connect(const char* identifier) {
+    return cobble_connect_ex(identifier, NULL, ConnectFlag_None);
+}
+
+cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags) {
+
+    uint64_t address;
+    command c;
+
+    // Identifiers are MAC addresses, AA:BB:CC:DD:EE:FF
+    if (!cobble_address_parse(identifier, &address)) {
+        printf("Identifier %s does not look like a MAC address\n", identifier ? identifier : "(null)");
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    c.type = Command_Connect;
+    c.flags = flags;
+    c.length = cobble_uuid_list_parse(service_uuids, (cobble_uuid*)c.data, COBBLE_MAX_CONNECT_SERVICES);
+    c.connection = cobble_connection_open(address);
+    if (c.connection == COBBLE_CONNECTION_NONE) {
+        printf("Already connected to %s, or too many connections\n", identifier);
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    if (!post(&c)) {
+        cobble_connection_close(c.connection);
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    return c.connection;
+}
+
+void cobble_disconnect(void) {
+    post_simple(Command_Disconnect, COBBLE_CONNECTION_NONE);
+}
+
+void cobble_disconnect_c(cobble_conn_handle connection) {
+    if (connection != COBBLE_CONNECTION_NONE)
+        post_simple(Command_Disconnect, connection);
+}
+
+void cobble_characteristics_get_c(cobble_conn_handle connection) {
+    post_simple(Command_CharacteristicsGet, connection);
+}
+
+void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    command c;
+    c.type = Command_Subscribe;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    post(&c);
+}
+
+void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_characteristic_cb_set_c(connection, characteristic, cb, ctx);
+    cobble_subscribe_c(connection, characteristic);
+}
+
+void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    command c;
+    c.type = Command_Read;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    post(&c);
+}
+
+void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t* data, int len) {
+
+    command c;
+
+    if (len > MAX_LENGTH || len < 0) {
+        printf("Cannot write %i bytes, the maximum is %i\n", len, MAX_LENGTH);
+        return;
+    }
+
+    c.type = Command_Write;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    c.length = len;
+    memcpy(c.data, data, len);
+    post(&c);
+}
+
+bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    command c;
+
+    if (len < 0 || (len > 0 && data == NULL)) {
+        printf("Cannot write %i bytes\n", len);
+        return false;
+    }
+
+    c.type = Command_WriteStream;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    c.length = len;
+    c.stream = malloc(len > 0 ? len : 1);
+    if (c.stream == NULL) {
+        printf("Could not allocate %i bytes to write\n", len);
+        return false;
+    }
+    memcpy(c.stream, data, len);
+
+    if (!post(&c)) {
+        free(c.stream);
+        return false;
+    }
+    return true;
+}
+
+// Writes with response may be long writes, which BlueZ splits up itself. Without response, a value must fit in one packet.
+int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse) {
+    if (withResponse)
+        return MAX_LENGTH;
+    return links[cobble_connection_index(connection)].attMtu - 3;
+}
+
+void cobble_characteristics_get(void) {
+    cobble_characteristics_get_c(cobble_connection_latest());
+}
+
+void cobble_subscribe_h(cobble_char_handle characteristic) {
+    cobble_subscribe_c(cobble_connection_latest(), characteristic);
+}
+
+void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_subscribe_cb_c(cobble_connection_latest(), characteristic, cb, ctx);
+}
+
+void cobble_read_h(cobble_char_handle characteristic) {
+    cobble_read_c(cobble_connection_latest(), characteristic);
+}
+
+void cobble_write_h(cobble_char_handle characteristic, uint8_t* data, int len) {
+    cobble_write_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+bool cobble_write_stream_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    return cobble_write_stream_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+void cobble_subscribe(const char* characteristic_uuid) {
+    cobble_subscribe_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_read(const char* characteristic_uuid) {
+    cobble_read_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_write(const char* characteristic_uuid, uint8_t* data, int len) {
+    cobble_write_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+bool cobble_write_stream(const char* characteristic_uuid, const uint8_t* data, int len) {
+    return cobble_write_stream_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+int cobble_max_writesize_get(bool withResponse) {
+    return cobble_max_writesize_get_c(cobble_connection_latest(), withResponse);
+}
+
+// bluetoothd exchanges the MTU itself as it connects, asking for its ExchangeMTU setting (517 unless changed in
+// main.conf), and has no method to ask again
+bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu) {
+    (void)connection;
+    (void)mtu;
+    printf("BlueZ negotiates the MTU itself\n");
+    return false;
+}
+
+bool cobble_mtu_request(int mtu) {
+    return cobble_mtu_request_c(cobble_connection_latest(), mtu);
+}
+
+bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid) {
+
+    command c;
+    cobble_uuid uuid;
+
+    if (service_uuid == NULL || !cobble_uuid_parse(service_uuid, &uuid)) {
+        printf("Could not create Service UUID from \"%s\"\n", service_uuid ? service_uuid : "(null)");
+        return false;
+    }
+    if (!cobble_connection_valid(connection)) {
+        printf("No connection has handle %u\n", connection);
+        return false;
+    }
+
+    c.type = Command_DiscoverService;
+    c.connection = connection;
+    memcpy(c.data, &uuid, sizeof(uuid));
+    return post(&c);
+}
+
+bool cobble_discover_service(const char* service_uuid) {
+    return cobble_discover_service_c(cobble_connection_latest(), service_uuid);
+}
+
+// The event loop has its own thread, so this just waits until cobble_shutdown() is called, as on Apple platforms
+static pthread_mutex_t shutdownLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shutdownCondition = PTHREAD_COND_INITIALIZER;
+static bool cobble_shutdown_requested = false;
+
+void cobble_shutdown(void) {
+    pthread_mutex_lock(&shutdownLock);
+    cobble_shutdown_requested = true;
+    pthread_cond_broadcast(&shutdownCondition);
+    pthread_mutex_unlock(&shutdownLock);
+}
+
+void cobble_loop(void) {
+    pthread_mutex_lock(&shutdownLock);
+    while (!cobble_shutdown_requested)
+        pthread_cond_wait(&shutdownCondition, &shutdownLock);
+    pthread_mutex_unlock(&shutdownLock);
+}
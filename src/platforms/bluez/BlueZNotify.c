@@ -0,0 +1,83 @@
+#include "BlueZNotify.h"
+
+#include "../../cobble_events.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int bluez_notify_recv(int fd, cobble_conn_handle connection, cobble_char_handle characteristic, int capacity) {
+
+    int count;
+
+    for (count = 0; count < BLUEZ_NOTIFY_BATCH; count++) {
+
+        cobble_value_slot slot;
+        ssize_t len;
+
+        // Peeking with MSG_TRUNC gives the next value's length, so only as much of the payload memory is reserved as
+        // it needs, rather than the most a value can be
+        len = recv(fd, NULL, 0, MSG_PEEK | MSG_DONTWAIT | MSG_TRUNC);
+        if (len > 0) {
+            if (cobble_event_updatevalue_reserve(&slot, (len < capacity) ? (int)len : capacity)) {
+                // A value too long for the slot is cut short, and MSG_TRUNC reports its full length
+                len = recv(fd, slot.data, slot.capacity, MSG_DONTWAIT | MSG_TRUNC);
+                if (len > 0) {
+                    cobble_event_updatevalue_commit(&slot, connection, characteristic, (int)len);
+                    continue;
+                }
+                cobble_event_updatevalue_cancel(&slot);
+            } else {
+                // No room in the queue, but the value still has to be taken off the socket (reading part of a datagram discards the rest)
+                uint8_t discard;
+                len = recv(fd, &discard, sizeof(discard), MSG_DONTWAIT);
+                if (len > 0)
+                    continue;
+            }
+        }
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return count;
+
+        // BlueZ closes the socket when notifications stop, eg on disconnection
+        return -1;
+    }
+
+    return count;
+}
+
+bool bluez_notify_signal(DBusMessage* msg, cobble_conn_handle connection, cobble_char_handle characteristic) {
+
+    DBusMessageIter iter, changed;
+
+    // PropertiesChanged(s interface, a{sv} changed, as invalidated)
+    if (!dbus_message_iter_init(msg, &iter) || !dbus_message_iter_next(&iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return false;
+
+    dbus_message_iter_recurse(&iter, &changed);
+    while (dbus_message_iter_get_arg_type(&changed) == DBUS_TYPE_DICT_ENTRY) {
+
+        DBusMessageIter entry, variant, array;
+        const char* name;
+        const uint8_t* data;
+        int len;
+
+        dbus_message_iter_recurse(&changed, &entry);
+        dbus_message_iter_get_basic(&entry, &name);
+
+        if (strcmp(name, "Value") == 0) {
+            dbus_message_iter_next(&entry);
+            dbus_message_iter_recurse(&entry, &variant);
+            if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type(&variant) != DBUS_TYPE_BYTE)
+                return false;
+            dbus_message_iter_recurse(&variant, &array);
+            dbus_message_iter_get_fixed_array(&array, &data, &len);
+            cobble_event_updatevalue_c(connection, characteristic, data, len);
+            return true;
+        }
+
+        dbus_message_iter_next(&changed);
+    }
+
+    return false;
+}
@@ -0,0 +1,26 @@
+// Receiving notifications from BlueZ
+// BlueZ can deliver notifications in two ways:
+// * As a PropertiesChanged signal on the characteristic for each value, which costs a marshalled D-Bus message apiece
+// * Through a SOCK_SEQPACKET socket handed out by AcquireNotify, one datagram per value
+// The socket route is received straight into the event queue's payload memory, so values are not copied on the way.
+#ifndef BLUEZ_NOTIFY_H
+#define BLUEZ_NOTIFY_H
+
+#include <stdbool.h>
+
+#include <dbus/dbus.h>
+
+#include "../../cobble.h"
+
+// Values taken from a notification socket before returning to the event loop, so a busy socket can't starve the others
+#define BLUEZ_NOTIFY_BATCH 64
+
+// Deliver the values waiting on an acquired notification socket, each up to capacity bytes long. Each value's length is
+// found before it is received, so it takes only the room in the queue that it needs.
+// Returns the number of values taken from the socket, or -1 once BlueZ has closed it.
+int bluez_notify_recv(int fd, cobble_conn_handle connection, cobble_char_handle characteristic, int capacity);
+
+// Deliver the value carried by a PropertiesChanged signal from a characteristic, if it has one
+bool bluez_notify_signal(DBusMessage* msg, cobble_conn_handle connection, cobble_char_handle characteristic);
+
+#endif
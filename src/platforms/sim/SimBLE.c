@@ -0,0 +1,2233 @@
+// Common bindings for Bluetooth LE
+// Simulated backend, with a scripted virtual peripheral in place of a radio (see SimBLE.h for the script)
+//
+// The peripheral advertises, accepts a connection, exposes a GATT database and streams values with the timing of a real
+// link: values are generated at a steady rate, but only exchanged at connection events, which may be delayed by jitter,
+// and notifications may be lost on the way. Results are reported through the same cobble_event_* functions as the
+// hardware backends, so the whole event pipeline is exercised, and loss and seed make runs repeatable. Several
+// peripherals can be simulated, and connected to at the same time, each link having its own connection events.
+//
+// As on Linux, a single thread runs the simulation, and the application's calls are queued as commands for it, so they
+// return immediately and may be made from any thread.
+#define _GNU_SOURCE
+
+#include "../../cobble.h"
+#include "../../cobble_events.h"
+#include "../../cobble_ad.h"
+#include "../../cobble_characteristics.h"
+#include "../../cobble_connections.h"
+#include "../../cobble_scan_filter.h"
+#include "../../cobble_scan_table.h"
+#include "../../cobble_status.h"
+#include "../../cobble_gatt_cache.h"
+#include "../../cobble_ring.h"
+
+#include "SimBLE.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// The maximum size of a Bluetooth LE characteristic value (the ATT specification maximum)
+#define MAX_LENGTH 512
+
+#define MAX_NAME_LENGTH 248
+#define MAX_SCRIPT_LENGTH 65536
+
+#define MAX_SERVICES 16
+#define MAX_CHARACTERISTICS 32
+
+// Identical peripherals, at consecutive addresses
+#define MAX_DEVICES 64
+
+#define COMMAND_QUEUE_LENGTH 256
+
+// Reads and writes waiting for a connection event
+#define MAX_OPERATIONS 64
+
+// A stream keeps this many connection events' worth of writes without response queued, as an application does by
+// writing whenever the stack will take more
+#define STREAM_EVENTS_QUEUED 2
+
+// The ATT MTU before any exchange, and so the smallest a connection can have
+#define DEFAULT_ATT_MTU 23
+
+// DFU responses waiting for the next connection event
+#define MAX_DFU_RESPONSES 16
+#define DFU_RESPONSE_LENGTH 15
+
+// Nordic Secure DFU, from the nRF5 SDK's nrf_dfu_req_handler.h. The largest init packet its bootloaders accept is
+// INIT_COMMAND_MAX_SIZE.
+#define DFU_SERVICE "FE59"
+#define DFU_CONTROL_POINT "8EC90001-F315-4F60-9FB8-838830DAEA50"
+#define DFU_PACKET "8EC90002-F315-4F60-9FB8-838830DAEA50"
+#define DFU_COMMAND_MAX_SIZE 512
+
+#define DFU_OP_CREATE 0x01
+#define DFU_OP_RECEIPT_NOTIF_SET 0x02
+#define DFU_OP_CRC_GET 0x03
+#define DFU_OP_EXECUTE 0x04
+#define DFU_OP_SELECT 0x06
+#define DFU_OP_RESPONSE 0x60
+
+#define DFU_OBJECT_COMMAND 0x01
+#define DFU_OBJECT_DATA 0x02
+
+#define DFU_RESULT_SUCCESS 0x01
+#define DFU_RESULT_OP_CODE_NOT_SUPPORTED 0x02
+#define DFU_RESULT_INVALID_PARAMETER 0x03
+#define DFU_RESULT_INSUFFICIENT_RESOURCES 0x04
+#define DFU_RESULT_OPERATION_NOT_PERMITTED 0x08
+
+#define NS_PER_MS 1000000ull
+
+/*
+ * The virtual peripheral
+ */
+
+#define FLAG_READ (1u << 0)
+#define FLAG_WRITE (1u << 1)
+#define FLAG_WRITE_WITHOUT_RESPONSE (1u << 2)
+#define FLAG_NOTIFY (1u << 3)
+#define FLAG_INDICATE (1u << 4)
+
+typedef struct {
+    cobble_uuid uuid;
+    char uuidString[COBBLE_UUID_STRING_LENGTH];
+} service;
+
+typedef struct {
+    char uuid[COBBLE_UUID_STRING_LENGTH];
+    int service;
+    uint32_t flags;
+} characteristic;
+
+typedef struct {
+    char name[MAX_NAME_LENGTH];
+    uint64_t address;
+    int devices;
+    int rssi;
+    double advertisingInterval;
+    int manufacturerId; // COBBLE_MANUFACTURER_ANY if the peripheral doesn't advertise manufacturer data
+    int manufacturerLength;
+    uint8_t manufacturerData[COBBLE_SCAN_FILTER_MAX_DATA];
+    bool serviceData; // Whether advertisements carry readings, as service data for serviceDataUuid
+    cobble_uuid serviceDataUuid;
+    double connectDelay;
+    double disconnectAfter;
+    int mtu;
+    int mtuChange;
+    double mtuChangeAfter;
+    double interval;
+    int packets;
+    double jitter;
+    double loss;
+    double rate;
+    int payload;
+    uint64_t seed;
+    CobbleErrorCode adapter;
+    bool dfu;
+    int dfuObjectSize;
+    int dfuCorrupt;
+    int dfuControl; // Characteristic indices, or -1 without DFU
+    int dfuPacket;
+    bool dbHash;
+    int dbVersion;
+    double serviceChangedAfter;
+    int serviceCount;
+    service services[MAX_SERVICES];
+    int characteristicCount;
+    characteristic characteristics[MAX_CHARACTERISTICS];
+} peripheral;
+
+static peripheral config;
+static bool configured = false;
+
+static void peripheral_defaults(peripheral* p) {
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "Cobble Sim");
+    p->address = 0x5E1100000001ull;
+    p->devices = 1;
+    p->rssi = -60;
+    p->advertisingInterval = 100;
+    p->manufacturerId = COBBLE_MANUFACTURER_ANY;
+    p->connectDelay = 50;
+    p->disconnectAfter = 0;
+    p->mtu = 247;
+    p->mtuChange = 0;
+    p->mtuChangeAfter = 0;
+    p->interval = 7.5;
+    p->packets = 6;
+    p->jitter = 0;
+    p->loss = 0;
+    p->rate = 100;
+    p->payload = 20;
+    p->seed = 1;
+    p->adapter = NoError;
+    p->dfu = false;
+    p->dfuObjectSize = 4096;
+    p->dfuCorrupt = 0;
+    p->dfuControl = -1;
+    p->dfuPacket = -1;
+    p->dbHash = true;
+    p->dbVersion = 0;
+    p->serviceChangedAfter = 0;
+}
+
+static bool add_service(peripheral* p, const char* uuid) {
+
+    if (p->serviceCount == MAX_SERVICES) {
+        printf("Simulator: too many services, the maximum is %i\n", MAX_SERVICES);
+        return false;
+    }
+
+    service* s = &p->services[p->serviceCount];
+    if (!cobble_uuid_parse(uuid, &s->uuid)) {
+        printf("Simulator: invalid service UUID \"%s\"\n", uuid);
+        return false;
+    }
+    cobble_uuid_format(&s->uuid, s->uuidString);
+
+    p->serviceCount++;
+    return true;
+}
+
+// uuid,property,property...
+static bool add_characteristic(peripheral* p, char* definition) {
+
+    if (p->serviceCount == 0) {
+        printf("Simulator: characteristic \"%s\" must follow a service\n", definition);
+        return false;
+    }
+    if (p->characteristicCount == MAX_CHARACTERISTICS) {
+        printf("Simulator: too many characteristics, the maximum is %i\n", MAX_CHARACTERISTICS);
+        return false;
+    }
+
+    characteristic* c = &p->characteristics[p->characteristicCount];
+    char* saveptr;
+    char* uuid = strtok_r(definition, ",", &saveptr);
+    cobble_uuid parsed;
+
+    if (uuid == NULL || !cobble_uuid_parse(uuid, &parsed)) {
+        printf("Simulator: invalid characteristic UUID \"%s\"\n", uuid ? uuid : "");
+        return false;
+    }
+    cobble_uuid_format(&parsed, c->uuid);
+    c->service = p->serviceCount - 1;
+    c->flags = 0;
+
+    for (char* property = strtok_r(NULL, ",", &saveptr); property != NULL; property = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(property, "read") == 0)
+            c->flags |= FLAG_READ;
+        else if (strcmp(property, "write") == 0)
+            c->flags |= FLAG_WRITE;
+        else if (strcmp(property, "write_without_response") == 0)
+            c->flags |= FLAG_WRITE_WITHOUT_RESPONSE;
+        else if (strcmp(property, "notify") == 0)
+            c->flags |= FLAG_NOTIFY;
+        else if (strcmp(property, "indicate") == 0)
+            c->flags |= FLAG_INDICATE;
+        else {
+            printf("Simulator: unknown characteristic property \"%s\"\n", property);
+            return false;
+        }
+    }
+
+    if (c->flags == 0)
+        c->flags = FLAG_READ;
+
+    p->characteristicCount++;
+    return true;
+}
+
+static void add_default_gatt(peripheral* p) {
+    char battery[] = "2A19,read,notify";
+    char rx[] = "6E400002-B5A3-F393-E0A9-E50E24DCCA9E,write,write_without_response";
+    char tx[] = "6E400003-B5A3-F393-E0A9-E50E24DCCA9E,notify";
+
+    add_service(p, "180F");
+    add_characteristic(p, battery);
+    add_service(p, "6E400001-B5A3-F393-E0A9-E50E24DCCA9E");
+    add_characteristic(p, rx);
+    add_characteristic(p, tx);
+}
+
+// Added after the rest, as a bootloader's DFU service is alongside the application's
+static void add_dfu_gatt(peripheral* p) {
+    char control[] = DFU_CONTROL_POINT ",write,notify";
+    char packet[] = DFU_PACKET ",write_without_response";
+
+    if (p->serviceCount == MAX_SERVICES || p->characteristicCount + 2 > MAX_CHARACTERISTICS) {
+        printf("Simulator: no room for the DFU service\n");
+        return;
+    }
+
+    add_service(p, DFU_SERVICE);
+    p->dfuControl = p->characteristicCount;
+    add_characteristic(p, control);
+    p->dfuPacket = p->characteristicCount;
+    add_characteristic(p, packet);
+}
+
+static char* trim(char* s) {
+    while (isspace((unsigned char)*s))
+        s++;
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+static bool parse_number(const char* key, const char* value, double min, double max, double* out) {
+    char* end;
+    double d = strtod(value, &end);
+    if (end == value || *end != '\0' || d < min || d > max) {
+        printf("Simulator: %s must be a number from %g to %g, not \"%s\"\n", key, min, max, value);
+        return false;
+    }
+    *out = d;
+    return true;
+}
+
+// <company identifier>,<data>, both in hex, eg 0059,0102AABB
+static bool parse_manufacturer(peripheral* p, const char* value) {
+
+    char* end;
+    long id = strtol(value, &end, 16);
+    if (end == value || (*end != ',' && *end != '\0') || id < 0 || id > 0xFFFF) {
+        printf("Simulator: manufacturer must be a company identifier and data in hex, not \"%s\"\n", value);
+        return false;
+    }
+
+    const char* hex = (*end == ',') ? end + 1 : end;
+    size_t len = strlen(hex);
+    if (len % 2 != 0 || len / 2 > COBBLE_SCAN_FILTER_MAX_DATA) {
+        printf("Simulator: manufacturer data must be whole bytes, at most %i of them, not \"%s\"\n", COBBLE_SCAN_FILTER_MAX_DATA, hex);
+        return false;
+    }
+    for (size_t i = 0; i < len / 2; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) || sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            printf("Simulator: manufacturer data \"%s\" is not hex\n", hex);
+            return false;
+        }
+        p->manufacturerData[i] = (uint8_t)byte;
+    }
+
+    p->manufacturerId = (int)id;
+    p->manufacturerLength = (int)(len / 2);
+    return true;
+}
+
+static bool parse_setting(peripheral* p, const char* key, char* value) {
+
+    double d;
+
+    if (strcmp(key, "name") == 0) {
+        snprintf(p->name, sizeof(p->name), "%s", value);
+        return true;
+    }
+    if (strcmp(key, "address") == 0) {
+        if (!cobble_address_parse(value, &p->address)) {
+            printf("Simulator: address \"%s\" does not look like a MAC address\n", value);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(key, "adapter") == 0) {
+        if (strcmp(value, "on") == 0)
+            p->adapter = NoError;
+        else if (strcmp(value, "off") == 0)
+            p->adapter = HardwareTurnedOff;
+        else if (strcmp(value, "unsupported") == 0)
+            p->adapter = HardwareUnsupported;
+        else if (strcmp(value, "unauthorised") == 0)
+            p->adapter = PermissionsNotGranted;
+        else {
+            printf("Simulator: adapter must be on, off, unsupported or unauthorised, not \"%s\"\n", value);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(key, "dfu") == 0) {
+        if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0) {
+            p->dfu = strcmp(value, "on") == 0;
+            return true;
+        }
+        printf("Simulator: dfu must be on or off, not \"%s\"\n", value);
+        return false;
+    }
+    if (strcmp(key, "db_hash") == 0) {
+        if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0) {
+            p->dbHash = strcmp(value, "on") == 0;
+            return true;
+        }
+        printf("Simulator: db_hash must be on or off, not \"%s\"\n", value);
+        return false;
+    }
+    if (strcmp(key, "manufacturer") == 0)
+        return parse_manufacturer(p, value);
+    if (strcmp(key, "service_data") == 0) {
+        if (!cobble_uuid_parse(value, &p->serviceDataUuid)) {
+            printf("Simulator: service_data \"%s\" is not a UUID\n", value);
+            return false;
+        }
+        p->serviceData = true;
+        return true;
+    }
+    if (strcmp(key, "service") == 0)
+        return add_service(p, value);
+    if (strcmp(key, "characteristic") == 0)
+        return add_characteristic(p, value);
+
+    if (strcmp(key, "devices") == 0) {
+        if (!parse_number(key, value, 1, MAX_DEVICES, &d))
+            return false;
+        p->devices = (int)d;
+    } else if (strcmp(key, "rssi") == 0) {
+        if (!parse_number(key, value, -127, 20, &d))
+            return false;
+        p->rssi = (int)d;
+    } else if (strcmp(key, "advertising_interval") == 0) {
+        if (!parse_number(key, value, 1, 60000, &p->advertisingInterval))
+            return false;
+    } else if (strcmp(key, "connect_delay") == 0) {
+        if (!parse_number(key, value, 0, 60000, &p->connectDelay))
+            return false;
+    } else if (strcmp(key, "disconnect_after") == 0) {
+        if (!parse_number(key, value, 0, 1e9, &p->disconnectAfter))
+            return false;
+    } else if (strcmp(key, "mtu") == 0) {
+        if (!parse_number(key, value, DEFAULT_ATT_MTU, COBBLE_MAX_ATT_MTU, &d))
+            return false;
+        p->mtu = (int)d;
+    } else if (strcmp(key, "mtu_change") == 0) {
+        if (!parse_number(key, value, DEFAULT_ATT_MTU, COBBLE_MAX_ATT_MTU, &d))
+            return false;
+        p->mtuChange = (int)d;
+    } else if (strcmp(key, "mtu_change_after") == 0) {
+        if (!parse_number(key, value, 0, 1e9, &p->mtuChangeAfter))
+            return false;
+    } else if (strcmp(key, "interval") == 0) {
+        // The range allowed by the Bluetooth specification
+        if (!parse_number(key, value, 7.5, 4000, &p->interval))
+            return false;
+    } else if (strcmp(key, "packets") == 0) {
+        if (!parse_number(key, value, 1, MAX_OPERATIONS / STREAM_EVENTS_QUEUED, &d))
+            return false;
+        p->packets = (int)d;
+    } else if (strcmp(key, "jitter") == 0) {
+        if (!parse_number(key, value, 0, 4000, &p->jitter))
+            return false;
+    } else if (strcmp(key, "loss") == 0) {
+        if (!parse_number(key, value, 0, 1, &p->loss))
+            return false;
+    } else if (strcmp(key, "rate") == 0) {
+        if (!parse_number(key, value, 0, 1e7, &p->rate))
+            return false;
+    } else if (strcmp(key, "payload") == 0) {
+        if (!parse_number(key, value, 0, MAX_LENGTH, &d))
+            return false;
+        p->payload = (int)d;
+    } else if (strcmp(key, "dfu_object") == 0) {
+        if (!parse_number(key, value, 64, 65536, &d))
+            return false;
+        p->dfuObjectSize = (int)d;
+    } else if (strcmp(key, "dfu_corrupt") == 0) {
+        if (!parse_number(key, value, 0, 1e9, &d))
+            return false;
+        p->dfuCorrupt = (int)d;
+    } else if (strcmp(key, "db_version") == 0) {
+        if (!parse_number(key, value, 0, 65535, &d))
+            return false;
+        p->dbVersion = (int)d;
+    } else if (strcmp(key, "service_changed_after") == 0) {
+        if (!parse_number(key, value, 0, 1e9, &p->serviceChangedAfter))
+            return false;
+    } else if (strcmp(key, "seed") == 0) {
+        if (!parse_number(key, value, 0, 1e15, &d))
+            return false;
+        p->seed = (uint64_t)d;
+    } else {
+        printf("Simulator: unknown setting \"%s\"\n", key);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_script(const char* script, peripheral* p) {
+
+    char* copy = strdup(script);
+    char* saveptr;
+    bool ok = true;
+
+    if (copy == NULL)
+        return false;
+
+    peripheral_defaults(p);
+
+    for (char* line = strtok_r(copy, ";\n", &saveptr); line != NULL && ok; line = strtok_r(NULL, ";\n", &saveptr)) {
+
+        line = trim(line);
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        char* equals = strchr(line, '=');
+        if (equals == NULL) {
+            printf("Simulator: expected setting=value, not \"%s\"\n", line);
+            ok = false;
+            break;
+        }
+        *equals = '\0';
+        ok = parse_setting(p, trim(line), trim(equals + 1));
+    }
+
+    free(copy);
+
+    if (ok && p->serviceCount == 0)
+        add_default_gatt(p);
+    if (ok && p->dfu)
+        add_dfu_gatt(p);
+
+    return ok;
+}
+
+// COBBLE_SIM holds a script, or @ and the path of a file holding one
+static void configure_from_environment(void) {
+
+    const char* env = getenv("COBBLE_SIM");
+    char* script = NULL;
+
+    peripheral_defaults(&config);
+    add_default_gatt(&config);
+
+    if (env == NULL)
+        return;
+
+    if (env[0] == '@') {
+        FILE* f = fopen(env + 1, "r");
+        if (f == NULL) {
+            printf("Simulator: could not open %s: %s\n", env + 1, strerror(errno));
+            return;
+        }
+        script = calloc(MAX_SCRIPT_LENGTH + 1, 1);
+        if (script != NULL)
+            fread(script, 1, MAX_SCRIPT_LENGTH, f);
+        fclose(f);
+    } else {
+        script = strdup(env);
+    }
+
+    if (script == NULL || !parse_script(script, &config)) {
+        printf("Simulator: using the default peripheral\n");
+        peripheral_defaults(&config);
+        add_default_gatt(&config);
+    }
+
+    free(script);
+}
+
+/*
+ * Commands from the application to the simulation thread
+ */
+
+typedef enum {
+    Command_ScanStart,
+    Command_ScanStop,
+    Command_Connect,
+    Command_Disconnect,
+    Command_CharacteristicsGet,
+    Command_Subscribe,
+    Command_Read,
+    Command_Write,
+    Command_WriteStream,
+    Command_MtuRequest,
+    Command_DiscoverService,
+    Command_Shutdown,
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    cobble_conn_handle connection;
+    cobble_char_handle characteristic;
+    int length; // Or the MTU requested, or the number of services in data
+    uint32_t flags; // For a connection
+    uint8_t data[MAX_LENGTH]; // Or the services to discover, as cobble_uuids
+    uint8_t* stream; // Block to write, of length bytes, which the simulation thread frees
+} command;
+
+static cobble_ring commandQueue;
+static int wakeFd = -1;
+static pthread_t loopThread;
+static bool loopRunning = false;
+
+/*
+ * State owned by the simulation thread
+ */
+
+typedef enum {
+    Link_Idle,
+    Link_Connecting,
+    Link_Connected,
+} LinkState;
+
+typedef enum {
+    Operation_Read,
+    Operation_Write,
+    Operation_WriteWithoutResponse,
+} OperationType;
+
+// A read or write, which completes at connection event number 'due'
+typedef struct {
+    OperationType type;
+    int characteristic;
+    uint64_t due;
+    int length;
+    uint8_t data[MAX_LENGTH];
+    bool streamed; // Part of the connection's write stream
+} operation;
+
+// A block being written by cobble_write_stream_c(), one operation at a time
+typedef struct {
+    bool active;
+    int characteristic;
+    bool withResponse;
+    uint8_t* data;
+    int length;
+    int queued; // Bytes given to operations so far
+    int written; // Bytes which have reached the peripheral
+    int inFlight; // Operations queued but not yet carried out
+} write_stream;
+
+typedef struct {
+    bool subscribed;
+    uint64_t subscribedAt;
+    uint64_t generated; // Values generated since subscribing, which is the sequence number of the next
+    int length; // Of the value last written, or -1 if it has never been written
+    uint8_t value[MAX_LENGTH];
+} characteristic_state;
+
+typedef struct {
+    uint8_t data[DFU_RESPONSE_LENGTH];
+    int length;
+} dfu_response;
+
+// The bootloader's side of Nordic Secure DFU. Like a real bootloader, it keeps what it has received when the link drops,
+// so an update can be resumed.
+typedef struct {
+    int receiptPackets;
+    int packetsSinceReceipt;
+    int packetsReceived;
+    uint8_t selected; // The object type packets are added to
+
+    uint32_t commandSize;
+    uint32_t commandOffset;
+    uint32_t commandCrc;
+    bool commandExecuted;
+
+    uint32_t objectStart;
+    uint32_t objectSize;
+    uint32_t dataOffset;
+    uint32_t dataCrc;
+    uint32_t executedOffset; // The end of the data objects executed so far
+    uint32_t executedCrc;
+} dfu_target;
+
+// One of the peripherals, each of which can have one connection
+typedef struct {
+    uint64_t address;
+    char name[MAX_NAME_LENGTH];
+    uint64_t nextAdvertisement;
+    uint64_t advertisements; // Made so far, including lost ones, and the sequence number of the reading in the latest
+    bool connected;
+    dfu_target dfu;
+} device;
+
+typedef struct {
+    cobble_conn_handle handle; // COBBLE_CONNECTION_NONE if this slot is not in use
+    int device; // Or -1 if the address given to cobble_connect() isn't one of ours
+    LinkState state;
+    uint64_t connectAt;
+    uint64_t disconnectAt; // Zero if the peripheral keeps the link up
+    bool disconnectRequested;
+
+    // Services by index into config.services, as masks. Those wanted are asked for when connecting, and by
+    // cobble_discover_service() after that; those known have had their characteristics reported.
+    uint32_t flags;
+    bool allServices; // Every service is wanted, including those not on the device (for the GATT cache)
+    cobble_uuid services[COBBLE_MAX_CONNECT_SERVICES]; // Those asked for by cobble_connect_ex(), unless allServices
+    int serviceCount;
+    uint32_t servicesWanted;
+    uint32_t servicesKnown;
+
+    // A lookup is under way, which reports the services pending at connection event discoveryEvent
+    bool discoveryDue;
+    uint32_t servicesPending;
+    uint64_t discoveryEvent;
+    uint64_t discoveryStartedAt;
+
+    // A table from the GATT cache has been reported, and is still to be checked against the device's Database Hash
+    bool cacheChecking;
+    bool cachedHasHash;
+    uint8_t cachedHash[COBBLE_GATT_HASH_LENGTH];
+    uint64_t serviceChangedAt; // When the peripheral indicates Service Changed (see service_changed_after), or 0
+
+    // Connection events happen every interval from the time of connection, each delayed by up to the jitter
+    uint64_t eventNumber;
+    uint64_t nextEventNominal;
+    uint64_t nextEventAt;
+
+    operation operations[MAX_OPERATIONS];
+    int operationHead;
+    int operationCount;
+
+    volatile int attMtu;
+    bool mtuReported;
+    int mtuRequested; // Exchanged at the next connection event, or 0 if no exchange is waiting
+    uint64_t mtuChangeAt; // When the peripheral changes the MTU itself (see mtu_change), or 0
+
+    write_stream stream;
+
+    // A bootloader answers a request at the connection event after the one which brought it
+    dfu_response dfuResponses[MAX_DFU_RESPONSES];
+    int dfuResponseCount;
+
+    characteristic_state characteristics[MAX_CHARACTERISTICS];
+} connection;
+
+static cobble_char_handle characteristicHandles[MAX_CHARACTERISTICS];
+
+// Loaded from or stored to the GATT cache
+static cobble_gatt_table cacheTable;
+
+static device devices[MAX_DEVICES];
+static connection connections[COBBLE_MAX_CONNECTIONS];
+
+static uint64_t randomState;
+
+static bool scanning = false;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t ms_to_ns(double ms) {
+    return (uint64_t)(ms * NS_PER_MS);
+}
+
+// xorshift64*, seeded from the script so that loss and jitter repeat from run to run
+static double random_unit(void) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (double)((randomState * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool lost(void) {
+    return config.loss > 0 && random_unit() < config.loss;
+}
+
+static int payload_length(connection* c) {
+    return (config.payload < c->attMtu - 3) ? config.payload : c->attMtu - 3;
+}
+
+// Connected if any device is connected, otherwise Connecting if any connection is being made
+static void update_status(void) {
+
+    CobbleStatus s = scanning ? Scanning : Initialised;
+
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        if (connections[i].state == Link_Connected)
+            s = Connected;
+        else if (connections[i].state == Link_Connecting && s != Connected)
+            s = Connecting;
+    }
+
+    cobble_status_update(s);
+}
+
+/*
+ * Scanning
+ */
+
+// The simulated controller filters by service itself, as the real ones do, and leaves the rest of the filter to Cobble
+static bool advertises_filtered_service(void) {
+
+    const cobble_scan_criteria* filter = cobble_scan_filter_active();
+    if ((filter->fields & ScanField_Services) == 0)
+        return true;
+
+    for (int i = 0; i < filter->serviceCount; i++) {
+        for (int s = 0; s < config.serviceCount; s++) {
+            if (cobble_uuid_equal(&filter->services[i], &config.services[s].uuid))
+                return true;
+        }
+    }
+    return false;
+}
+
+static void generate_value(uint8_t* data, int len, uint64_t sequence, uint64_t generatedAt);
+
+// The advertisement and scan response, laid out as a real peripheral would send them. Services which don't fit are left
+// out, as they would be.
+static int advertising_data(device* d, uint64_t now, uint8_t* out) {
+
+    const uint8_t flags = 0x06; // LE General Discoverable, BR/EDR not supported
+    int len = cobble_ad_append(out, 0, AdType_Flags, &flags, 1);
+    len = cobble_ad_append(out, len, AdType_Name, (const uint8_t*)d->name, (int)strlen(d->name));
+
+    if (config.manufacturerId != COBBLE_MANUFACTURER_ANY)
+        len = cobble_ad_append_manufacturer_data(out, len, config.manufacturerId, config.manufacturerData, config.manufacturerLength);
+
+    // A reading: its sequence number and the time it was taken, as generated values have
+    if (config.serviceData) {
+        uint8_t reading[12];
+        generate_value(reading, sizeof(reading), d->advertisements, now);
+        len = cobble_ad_append_service_data(out, len, &config.serviceDataUuid, reading, sizeof(reading));
+    }
+
+    cobble_uuid services[MAX_SERVICES];
+    for (int i = 0; i < config.serviceCount; i++)
+        services[i] = config.services[i].uuid;
+    len = cobble_ad_append_services(out, len, services, config.serviceCount);
+
+    return len;
+}
+
+// Peripherals stop advertising once they are connected
+static void advertise(device* d, uint64_t now) {
+
+    d->nextAdvertisement += ms_to_ns(config.advertisingInterval);
+    if (d->nextAdvertisement <= now)
+        d->nextAdvertisement = now + ms_to_ns(config.advertisingInterval);
+
+    if (d->connected)
+        return;
+    d->advertisements++;
+    if (lost() || !advertises_filtered_service())
+        return;
+
+    cobble_advertisement adv;
+    adv.fields = ScanField_Name | ScanField_Manufacturer | ScanField_Rssi;
+    adv.services = NULL;
+    adv.serviceCount = 0;
+    adv.name = d->name;
+    adv.manufacturerId = config.manufacturerId;
+    adv.manufacturerData = config.manufacturerData;
+    adv.manufacturerLength = config.manufacturerLength;
+    adv.rssi = config.rssi + (int)(random_unit() * 7) - 3;
+    if (!cobble_scan_filter_match(&adv))
+        return;
+
+    char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+    cobble_address_format(d->address, identifier);
+    cobble_event_scanresult(d->name, adv.rssi, identifier);
+
+    if (cobble_event_advertisement_wanted()) {
+        uint8_t data[COBBLE_AD_MAX_LENGTH];
+        int len = advertising_data(d, now, data);
+        cobble_event_advertisement(identifier, adv.rssi, data, len);
+    }
+}
+
+static void scan_start(void) {
+
+    // Spread the devices' advertisements across the interval, as real devices are not in step
+    uint64_t now = now_ns();
+    for (int d = 0; d < config.devices; d++)
+        devices[d].nextAdvertisement = now + ms_to_ns(config.advertisingInterval) * d / config.devices;
+
+    scanning = true;
+    update_status();
+}
+
+static void scan_stop(void) {
+    scanning = false;
+    update_status();
+}
+
+/*
+ * Connection and GATT discovery
+ */
+
+static connection* find_connection(cobble_conn_handle h) {
+
+    connection* c = &connections[cobble_connection_index(h)];
+
+    if (h == COBBLE_CONNECTION_NONE || c->handle != h || c->state == Link_Idle) {
+        printf("No connection has handle %u\n", h);
+        return NULL;
+    }
+    return c;
+}
+
+// Reports the end of the stream, however it ended
+static void end_stream(connection* c, int status) {
+
+    write_stream* w = &c->stream;
+
+    if (!w->active)
+        return;
+
+    cobble_event_writecomplete(c->handle, characteristicHandles[w->characteristic], w->written, status);
+
+    free(w->data);
+    w->data = NULL;
+    w->active = false;
+}
+
+static void reset_connection(connection* c) {
+
+    for (int i = 0; i < config.characteristicCount; i++) {
+        characteristic_state* s = &c->characteristics[i];
+        s->subscribed = false;
+        s->generated = 0;
+        s->length = -1;
+    }
+
+    c->operationHead = 0;
+    c->operationCount = 0;
+    end_stream(c, WriteStatus_Failed);
+    c->servicesKnown = 0;
+    c->servicesPending = 0;
+    c->discoveryDue = false;
+    c->disconnectRequested = false;
+    c->attMtu = DEFAULT_ATT_MTU;
+}
+
+// The status event must go before the handle is released, as it is reported with the connection's address
+static void link_down(connection* c, int event) {
+
+    if (c->state == Link_Idle)
+        return;
+
+    if (c->device >= 0)
+        devices[c->device].connected = false;
+
+    c->state = Link_Idle;
+    reset_connection(c);
+    update_status();
+
+    cobble_event_connectionstatus_c(c->handle, event);
+    cobble_connection_close(c->handle);
+    c->handle = COBBLE_CONNECTION_NONE;
+}
+
+static int find_service(const cobble_uuid* uuid) {
+    for (int s = 0; s < config.serviceCount; s++) {
+        if (cobble_uuid_equal(uuid, &config.services[s].uuid))
+            return s;
+    }
+    return -1;
+}
+
+static uint32_t all_services(void) {
+    return (1u << config.serviceCount) - 1;
+}
+
+static int count_services(uint32_t mask) {
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        count++;
+    return count;
+}
+
+// services is a list of count UUIDs, or empty for every service
+static void connect_device(cobble_conn_handle h, const cobble_uuid* services, int count, uint32_t flags) {
+
+    connection* c = &connections[cobble_connection_index(h)];
+    uint64_t address = cobble_connection_address(h);
+
+    // TODO: Should the app control scanning behaviour instead?
+    scan_stop();
+
+    c->handle = h;
+    c->device = -1;
+    for (int d = 0; d < config.devices; d++) {
+        if (devices[d].address == address && !devices[d].connected) {
+            c->device = d;
+            devices[d].connected = true;
+            break;
+        }
+    }
+
+    // Connecting to a device which isn't there fails after the same delay. A real adapter would keep trying for longer.
+    if (c->device < 0) {
+        char identifier[COBBLE_ADDRESS_STRING_LENGTH];
+        cobble_address_format(address, identifier);
+        printf("No simulated device has identifier %s\n", identifier);
+    }
+
+    reset_connection(c);
+
+    c->flags = flags;
+    c->allServices = (count == 0 && !(flags & ConnectFlag_NoDiscovery));
+    c->serviceCount = count;
+    memcpy(c->services, services, count * sizeof(cobble_uuid));
+    c->servicesWanted = c->allServices ? all_services() : 0;
+    for (int i = 0; i < count; i++) {
+        int s = find_service(&services[i]);
+        if (s >= 0)
+            c->servicesWanted |= 1u << s;
+    }
+
+    c->state = Link_Connecting;
+    c->connectAt = now_ns() + ms_to_ns(config.connectDelay);
+    update_status();
+}
+
+/*
+ * GATT cache
+ */
+
+static uint32_t dfu_crc32(uint32_t crc, const uint8_t* data, int len);
+
+// Stands in for the AES-CMAC of the attribute table that a real device has: it changes with any characteristic, property
+// or db_version, and with nothing else
+static void database_hash(uint8_t* hash) {
+
+    uint8_t version[2] = { (uint8_t)config.dbVersion, (uint8_t)(config.dbVersion >> 8) };
+
+    for (int part = 0; part < COBBLE_GATT_HASH_LENGTH / 4; part++) {
+        uint32_t crc = dfu_crc32(0, (const uint8_t*)&part, sizeof(part));
+        crc = dfu_crc32(crc, version, sizeof(version));
+        for (int i = 0; i < config.characteristicCount; i++) {
+            characteristic* ch = &config.characteristics[i];
+            crc = dfu_crc32(crc, config.services[ch->service].uuid.bytes, 16);
+            crc = dfu_crc32(crc, (const uint8_t*)ch->uuid, (int)strlen(ch->uuid));
+            crc = dfu_crc32(crc, (const uint8_t*)&ch->flags, sizeof(ch->flags));
+        }
+        memcpy(hash + 4 * part, &crc, 4);
+    }
+}
+
+static uint8_t gatt_properties(uint32_t flags) {
+    return ((flags & FLAG_READ) ? COBBLE_GATT_PROPERTY_READ : 0)
+        | ((flags & FLAG_WRITE) ? COBBLE_GATT_PROPERTY_WRITE : 0)
+        | ((flags & FLAG_WRITE_WITHOUT_RESPONSE) ? COBBLE_GATT_PROPERTY_WRITE_WITHOUT_RESPONSE : 0)
+        | ((flags & FLAG_NOTIFY) ? COBBLE_GATT_PROPERTY_NOTIFY : 0)
+        | ((flags & FLAG_INDICATE) ? COBBLE_GATT_PROPERTY_INDICATE : 0);
+}
+
+static void store_cache(connection* c) {
+
+    cobble_gatt_table* t = &cacheTable;
+
+    t->hasHash = config.dbHash;
+    if (config.dbHash)
+        database_hash(t->hash);
+    t->serviceCount = config.serviceCount;
+    t->count = 0;
+    for (int i = 0; i < config.characteristicCount && t->count < COBBLE_GATT_CACHE_MAX_CHARACTERISTICS; i++) {
+        characteristic* ch = &config.characteristics[i];
+        cobble_gatt_entry* e = &t->entries[t->count++];
+        e->service = config.services[ch->service].uuid;
+        cobble_uuid_parse(ch->uuid, &e->characteristic);
+        e->properties = gatt_properties(ch->flags);
+    }
+
+    cobble_gatt_cache_store(devices[c->device].address, t);
+}
+
+// Report the table from the cache straight away, as discovery would. Operations on it go ahead before it is checked, as
+// they would with a real device, and fail if the device no longer has the characteristic.
+// Only tables from a discovery of every service are stored, so a service asked for which isn't in the table isn't on
+// the device.
+static bool replay_cache(connection* c) {
+
+    char serviceId[COBBLE_UUID_STRING_LENGTH];
+    cobble_gatt_table* t = &cacheTable;
+    int characteristics = 0;
+
+    if (!cobble_gatt_cache_load(devices[c->device].address, t))
+        return false;
+
+    int services = c->allServices ? t->serviceCount : 0;
+
+    for (int i = 0; i < c->serviceCount; i++) {
+        for (int e = 0; e < t->count; e++) {
+            if (cobble_uuid_equal(&t->entries[e].service, &c->services[i])) {
+                services++;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->count; i++) {
+        bool wanted = c->allServices;
+        for (int w = 0; w < c->serviceCount && !wanted; w++)
+            wanted = cobble_uuid_equal(&t->entries[i].service, &c->services[w]);
+
+        cobble_char_handle h = cobble_characteristic_intern_uuid(&t->entries[i].characteristic);
+        if (!wanted || h == COBBLE_CHARACTERISTIC_NONE)
+            continue;
+        cobble_uuid_format(&t->entries[i].service, serviceId);
+        cobble_event_characteristicdiscovered_c(c->handle, serviceId, cobble_characteristic_uuid(h));
+        characteristics++;
+    }
+
+    c->servicesKnown = c->servicesWanted;
+    c->cacheChecking = true;
+    c->cachedHasHash = t->hasHash;
+    memcpy(c->cachedHash, t->hash, COBBLE_GATT_HASH_LENGTH);
+
+    cobble_event_discoverycomplete(c->handle, services, characteristics, (int)((now_ns() - c->connectAt) / 1000000));
+    return true;
+}
+
+// Discovery takes a connection event to look the services up (every one, or those asked for by UUID), then one for each
+// service's characteristics. The lookups are all asked for at once, as the other backends do, so the peripheral answers
+// them back to back. Services asked for while a discovery is under way are added to it.
+static void start_discovery(connection* c, uint32_t services, uint64_t now) {
+
+    if (!c->discoveryDue) {
+        c->discoveryDue = true;
+        c->discoveryStartedAt = now;
+        c->servicesPending = 0;
+    }
+
+    c->servicesPending |= services;
+    c->discoveryEvent = c->eventNumber + 2 + count_services(c->servicesPending);
+}
+
+// Drop the cached table and discover the device again, starting at the next connection event
+static void rediscover(connection* c) {
+    cobble_gatt_cache_invalidate(devices[c->device].address);
+    uint32_t services = c->servicesWanted | c->servicesKnown;
+    c->servicesKnown = 0;
+    start_discovery(c, services, now_ns());
+}
+
+// The Database Hash is read at the first connection event. A device without one can't be checked, so its table is kept
+// until it indicates Service Changed.
+static void check_cache(connection* c) {
+
+    uint8_t hash[COBBLE_GATT_HASH_LENGTH];
+
+    c->cacheChecking = false;
+
+    if (!config.dbHash && !c->cachedHasHash)
+        return;
+
+    if (config.dbHash && c->cachedHasHash) {
+        database_hash(hash);
+        if (memcmp(hash, c->cachedHash, COBBLE_GATT_HASH_LENGTH) == 0)
+            return;
+    }
+
+    printf("Simulator: the cached GATT table for %s is out of date, discovering it again\n", devices[c->device].name);
+    rediscover(c);
+}
+
+static void connected(connection* c, uint64_t now) {
+
+    c->state = Link_Connected;
+    c->attMtu = DEFAULT_ATT_MTU;
+    update_status();
+
+    // The largest MTU is asked for straight away, as the other backends do
+    c->mtuReported = false;
+    c->mtuRequested = COBBLE_MAX_ATT_MTU;
+    c->mtuChangeAt = (config.mtuChange > 0) ? now + ms_to_ns(config.mtuChangeAfter) : 0;
+
+    c->eventNumber = 0;
+    c->dfuResponseCount = 0;
+    c->nextEventNominal = now + ms_to_ns(config.interval);
+    c->nextEventAt = c->nextEventNominal + ms_to_ns(config.jitter * random_unit());
+    c->disconnectAt = (config.disconnectAfter > 0) ? now + ms_to_ns(config.disconnectAfter) : 0;
+
+    c->cacheChecking = false;
+    c->serviceChangedAt = (config.serviceChangedAfter > 0) ? now + ms_to_ns(config.serviceChangedAfter) : 0;
+
+    cobble_event_connectionstatus_c(c->handle, ConnectionStatus_DidConnect);
+
+    if (c->flags & ConnectFlag_NoDiscovery)
+        return;
+    if (!cobble_gatt_cache_enabled() || (c->flags & ConnectFlag_Uncached) || !replay_cache(c))
+        start_discovery(c, c->servicesWanted, now);
+}
+
+// Returns the number reported
+static int report_characteristics(connection* c, uint32_t services) {
+    int count = 0;
+    for (int i = 0; i < config.characteristicCount; i++) {
+        characteristic* ch = &config.characteristics[i];
+        if (!(services & (1u << ch->service)))
+            continue;
+        cobble_event_characteristicdiscovered_c(c->handle, config.services[ch->service].uuidString, ch->uuid);
+        count++;
+    }
+    return count;
+}
+
+static void characteristics_get(connection* c) {
+    report_characteristics(c, c->servicesKnown);
+}
+
+static void discover_services(connection* c) {
+
+    uint32_t found = c->servicesPending;
+
+    for (int s = 0; s < config.serviceCount; s++) {
+        if (found & (1u << s))
+            cobble_event_servicediscovered(config.services[s].uuidString);
+    }
+
+    c->discoveryDue = false;
+    c->servicesPending = 0;
+    c->servicesKnown |= found;
+    int characteristics = report_characteristics(c, found);
+
+    if (cobble_gatt_cache_enabled() && c->servicesKnown == all_services())
+        store_cache(c);
+
+    cobble_event_discoverycomplete(c->handle, count_services(found), characteristics,
+                                   (int)((now_ns() - c->discoveryStartedAt) / 1000000));
+}
+
+// A service already known is reported again straight away
+static void discover_service(connection* c, const cobble_uuid* uuid) {
+
+    int s = find_service(uuid);
+    uint32_t service = (s >= 0) ? 1u << s : 0;
+
+    c->servicesWanted |= service;
+
+    if (service != 0 && (c->servicesKnown & service) && !c->discoveryDue) {
+        int characteristics = report_characteristics(c, service);
+        cobble_event_discoverycomplete(c->handle, 1, characteristics, 0);
+        return;
+    }
+
+    start_discovery(c, service, now_ns());
+}
+
+static void disconnect_device(connection* c) {
+    if (c->state == Link_Connecting)
+        link_down(c, ConnectionStatus_DidConnectFailed);
+    else if (c->state == Link_Connected)
+        c->disconnectRequested = true;
+}
+
+static void disconnect_all(void) {
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++)
+        disconnect_device(&connections[i]);
+}
+
+/*
+ * Characteristic operations
+ */
+
+static int find_characteristic(connection* c, cobble_char_handle h, const char* operation, uint32_t flags) {
+
+    if (c->servicesKnown != 0) {
+        for (int i = 0; i < config.characteristicCount; i++) {
+            if (characteristicHandles[i] != h || !(c->servicesKnown & (1u << config.characteristics[i].service)))
+                continue;
+            if ((config.characteristics[i].flags & flags) == 0) {
+                printf("Characteristic %s does not support %s\n", config.characteristics[i].uuid, operation);
+                return -1;
+            }
+            return i;
+        }
+    }
+
+    printf("No match in the cache for characteristic %s when trying to %s\n", cobble_characteristic_uuid(h) ? cobble_characteristic_uuid(h) : "(unknown)", operation);
+    return -1;
+}
+
+// A value generated by the peripheral: its sequence number, then the time it was generated, then a repeating pattern
+static void generate_value(uint8_t* data, int len, uint64_t sequence, uint64_t generatedAt) {
+
+    uint8_t header[12];
+    for (int i = 0; i < 4; i++)
+        header[i] = (uint8_t)(sequence >> (8 * i));
+    for (int i = 0; i < 8; i++)
+        header[4 + i] = (uint8_t)(generatedAt >> (8 * i));
+
+    for (int i = 0; i < len; i++)
+        data[i] = (i < (int)sizeof(header)) ? header[i] : (uint8_t)(sequence + i);
+}
+
+static void send_value(connection* c, int i, uint64_t sequence, uint64_t generatedAt) {
+
+    cobble_value_slot slot;
+    int len = payload_length(c);
+
+    if (!cobble_event_updatevalue_reserve(&slot, len))
+        return;
+
+    generate_value(slot.data, len, sequence, generatedAt);
+    cobble_event_updatevalue_commit(&slot, c->handle, characteristicHandles[i], len);
+}
+
+static void subscribe(connection* c, cobble_char_handle h) {
+
+    int i = find_characteristic(c, h, "subscribe", FLAG_NOTIFY | FLAG_INDICATE);
+    if (i < 0 || c->characteristics[i].subscribed)
+        return;
+
+    // The Client Characteristic Configuration descriptor is written at the next connection event
+    c->characteristics[i].subscribed = true;
+    c->characteristics[i].subscribedAt = c->nextEventAt;
+    c->characteristics[i].generated = 0;
+}
+
+static operation* queue_operation(connection* c, OperationType type, int i, uint64_t due, const uint8_t* data, int len) {
+
+    if (c->operationCount == MAX_OPERATIONS) {
+        printf("Too many reads and writes are waiting - %s dropped\n", (type == Operation_Read) ? "read" : "write");
+        return NULL;
+    }
+
+    operation* op = &c->operations[(c->operationHead + c->operationCount++) % MAX_OPERATIONS];
+    op->type = type;
+    op->characteristic = i;
+    op->due = due;
+    op->length = len;
+    op->streamed = false;
+    if (len > 0)
+        memcpy(op->data, data, len);
+    return op;
+}
+
+// Requests are sent at the next connection event, and answered at the one after
+static void read_characteristic(connection* c, cobble_char_handle h) {
+    int i = find_characteristic(c, h, "read", FLAG_READ);
+    if (i >= 0)
+        queue_operation(c, Operation_Read, i, c->eventNumber + 2, NULL, 0);
+}
+
+static void write_characteristic(connection* c, cobble_char_handle h, const uint8_t* data, int len) {
+
+    int i = find_characteristic(c, h, "write", FLAG_WRITE | FLAG_WRITE_WITHOUT_RESPONSE);
+    if (i < 0)
+        return;
+
+    if (config.characteristics[i].flags & FLAG_WRITE_WITHOUT_RESPONSE) {
+        if (len > c->attMtu - 3) {
+            printf("Cannot write %i bytes without response, the maximum is %i\n", len, c->attMtu - 3);
+            return;
+        }
+        queue_operation(c, Operation_WriteWithoutResponse, i, c->eventNumber + 1, data, len);
+    } else {
+        queue_operation(c, Operation_Write, i, c->eventNumber + 2, data, len);
+    }
+}
+
+// Queue the stream's next writes, for as long as the stack would accept more
+static void fill_stream(connection* c) {
+
+    write_stream* w = &c->stream;
+
+    // Only one request can be waiting for a response at a time
+    int window = w->withResponse ? 1 : config.packets * STREAM_EVENTS_QUEUED;
+    int chunk = w->withResponse ? MAX_LENGTH : c->attMtu - 3;
+
+    while (w->active && w->queued < w->length && w->inFlight < window && c->operationCount < MAX_OPERATIONS) {
+
+        int len = (w->length - w->queued < chunk) ? w->length - w->queued : chunk;
+        operation* op;
+
+        if (w->withResponse)
+            op = queue_operation(c, Operation_Write, w->characteristic, c->eventNumber + 2, w->data + w->queued, len);
+        else
+            op = queue_operation(c, Operation_WriteWithoutResponse, w->characteristic, c->eventNumber + 1, w->data + w->queued, len);
+
+        op->streamed = true;
+        w->queued += len;
+        w->inFlight++;
+    }
+}
+
+static void write_stream_start(connection* c, cobble_char_handle h, uint8_t* data, int len) {
+
+    write_stream* w = &c->stream;
+
+    if (w->active) {
+        printf("A stream is already being written to this device\n");
+        cobble_event_writecomplete(c->handle, h, 0, WriteStatus_Busy);
+        free(data);
+        return;
+    }
+
+    int i = find_characteristic(c, h, "write", FLAG_WRITE | FLAG_WRITE_WITHOUT_RESPONSE);
+    if (i < 0) {
+        cobble_event_writecomplete(c->handle, h, 0, WriteStatus_Failed);
+        free(data);
+        return;
+    }
+
+    w->active = true;
+    w->characteristic = i;
+    w->withResponse = (config.characteristics[i].flags & FLAG_WRITE_WITHOUT_RESPONSE) == 0;
+    w->data = data;
+    w->length = len;
+    w->queued = 0;
+    w->written = 0;
+    w->inFlight = 0;
+
+    if (len == 0)
+        end_stream(c, WriteStatus_Complete);
+    else
+        fill_stream(c);
+}
+
+/*
+ * DFU target
+ */
+
+// Bit by bit, so that it checks the library's own CRC rather than sharing its tables
+static uint32_t dfu_crc32(uint32_t crc, const uint8_t* data, int len) {
+    crc = ~crc;
+    for (int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    return ~crc;
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Responses are notifications on the Control Point, which the bootloader only sends once they have been enabled
+static void dfu_respond(connection* c, uint8_t op, uint8_t result, const uint8_t* extra, int extraLength) {
+
+    dfu_response* r = &c->dfuResponses[c->dfuResponseCount];
+
+    if (!c->characteristics[config.dfuControl].subscribed)
+        return;
+    if (c->dfuResponseCount == MAX_DFU_RESPONSES) {
+        printf("Simulator: too many DFU responses waiting, dropping one\n");
+        return;
+    }
+
+    r->data[0] = DFU_OP_RESPONSE;
+    r->data[1] = op;
+    r->data[2] = result;
+    if (extraLength > 0)
+        memcpy(r->data + 3, extra, extraLength);
+    r->length = 3 + extraLength;
+    c->dfuResponseCount++;
+}
+
+static void dfu_send_responses(connection* c) {
+    for (int i = 0; i < c->dfuResponseCount; i++)
+        cobble_event_updatevalue_c(c->handle, characteristicHandles[config.dfuControl], c->dfuResponses[i].data, c->dfuResponses[i].length);
+    c->dfuResponseCount = 0;
+}
+
+static void dfu_respond_crc(connection* c, dfu_target* t) {
+    uint8_t extra[8];
+    bool command = t->selected == DFU_OBJECT_COMMAND;
+    put_u32(extra, command ? t->commandOffset : t->dataOffset);
+    put_u32(extra + 4, command ? t->commandCrc : t->dataCrc);
+    dfu_respond(c, DFU_OP_CRC_GET, DFU_RESULT_SUCCESS, extra, sizeof(extra));
+}
+
+static void dfu_control(connection* c, const uint8_t* data, int len) {
+
+    dfu_target* t = &devices[c->device].dfu;
+    uint8_t extra[12];
+
+    if (len < 1)
+        return;
+
+    switch (data[0]) {
+    case DFU_OP_RECEIPT_NOTIF_SET:
+        if (len < 3) {
+            dfu_respond(c, data[0], DFU_RESULT_INVALID_PARAMETER, NULL, 0);
+            return;
+        }
+        t->receiptPackets = data[1] | data[2] << 8;
+        t->packetsSinceReceipt = 0;
+        dfu_respond(c, data[0], DFU_RESULT_SUCCESS, NULL, 0);
+        return;
+
+    case DFU_OP_SELECT:
+        if (len < 2 || (data[1] != DFU_OBJECT_COMMAND && data[1] != DFU_OBJECT_DATA)) {
+            dfu_respond(c, data[0], DFU_RESULT_INVALID_PARAMETER, NULL, 0);
+            return;
+        }
+        t->selected = data[1];
+        if (t->selected == DFU_OBJECT_COMMAND) {
+            put_u32(extra, DFU_COMMAND_MAX_SIZE);
+            put_u32(extra + 4, t->commandOffset);
+            put_u32(extra + 8, t->commandCrc);
+        } else {
+            put_u32(extra, config.dfuObjectSize);
+            put_u32(extra + 4, t->dataOffset);
+            put_u32(extra + 8, t->dataCrc);
+        }
+        dfu_respond(c, data[0], DFU_RESULT_SUCCESS, extra, sizeof(extra));
+        return;
+
+    case DFU_OP_CREATE:
+        if (len < 6 || (data[1] != DFU_OBJECT_COMMAND && data[1] != DFU_OBJECT_DATA)) {
+            dfu_respond(c, data[0], DFU_RESULT_INVALID_PARAMETER, NULL, 0);
+            return;
+        }
+        t->selected = data[1];
+        t->packetsSinceReceipt = 0;
+        if (t->selected == DFU_OBJECT_COMMAND) {
+            if (get_u32(data + 2) > DFU_COMMAND_MAX_SIZE) {
+                dfu_respond(c, data[0], DFU_RESULT_INSUFFICIENT_RESOURCES, NULL, 0);
+                return;
+            }
+            // A new init packet starts a new update
+            t->commandSize = get_u32(data + 2);
+            t->commandOffset = 0;
+            t->commandCrc = 0;
+            t->commandExecuted = false;
+            t->executedOffset = t->executedCrc = 0;
+            t->dataOffset = t->dataCrc = 0;
+        } else {
+            if (!t->commandExecuted) {
+                dfu_respond(c, data[0], DFU_RESULT_OPERATION_NOT_PERMITTED, NULL, 0);
+                return;
+            }
+            if (get_u32(data + 2) == 0 || get_u32(data + 2) > (uint32_t)config.dfuObjectSize) {
+                dfu_respond(c, data[0], DFU_RESULT_INSUFFICIENT_RESOURCES, NULL, 0);
+                return;
+            }
+            // Anything received of an object which wasn't executed is discarded
+            t->objectStart = t->executedOffset;
+            t->objectSize = get_u32(data + 2);
+            t->dataOffset = t->executedOffset;
+            t->dataCrc = t->executedCrc;
+        }
+        dfu_respond(c, data[0], DFU_RESULT_SUCCESS, NULL, 0);
+        return;
+
+    case DFU_OP_CRC_GET:
+        dfu_respond_crc(c, t);
+        return;
+
+    case DFU_OP_EXECUTE:
+        if (t->selected == DFU_OBJECT_COMMAND) {
+            if (t->commandSize == 0 || t->commandOffset != t->commandSize) {
+                dfu_respond(c, data[0], DFU_RESULT_OPERATION_NOT_PERMITTED, NULL, 0);
+                return;
+            }
+            t->commandExecuted = true;
+        } else {
+            if (t->dataOffset == t->executedOffset || t->dataOffset != t->objectStart + t->objectSize) {
+                dfu_respond(c, data[0], DFU_RESULT_OPERATION_NOT_PERMITTED, NULL, 0);
+                return;
+            }
+            t->executedOffset = t->dataOffset;
+            t->executedCrc = t->dataCrc;
+        }
+        dfu_respond(c, data[0], DFU_RESULT_SUCCESS, NULL, 0);
+        return;
+
+    default:
+        dfu_respond(c, data[0], DFU_RESULT_OP_CODE_NOT_SUPPORTED, NULL, 0);
+        return;
+    }
+}
+
+static void dfu_packet(connection* c, uint8_t* data, int len) {
+
+    dfu_target* t = &devices[c->device].dfu;
+
+    // Flip a bit of one packet, as a corrupted transfer would
+    if (++t->packetsReceived == config.dfuCorrupt && len > 0)
+        data[0] ^= 0x01;
+
+    // Anything beyond the end of the object is ignored
+    if (t->selected == DFU_OBJECT_COMMAND) {
+        if (t->commandOffset + len > t->commandSize)
+            return;
+        t->commandCrc = dfu_crc32(t->commandCrc, data, len);
+        t->commandOffset += len;
+    } else if (t->selected == DFU_OBJECT_DATA) {
+        if (t->dataOffset + len > t->objectStart + t->objectSize)
+            return;
+        t->dataCrc = dfu_crc32(t->dataCrc, data, len);
+        t->dataOffset += len;
+    }
+
+    if (t->receiptPackets > 0 && ++t->packetsSinceReceipt == t->receiptPackets) {
+        t->packetsSinceReceipt = 0;
+        dfu_respond_crc(c, t);
+    }
+}
+
+// Each connection event carries up to config.packets reads and writes. A long write takes a packet for each part.
+static void run_operations(connection* c, uint64_t now) {
+
+    int packets = 0;
+
+    while (c->operationCount > 0 && c->operations[c->operationHead].due <= c->eventNumber) {
+
+        operation* op = &c->operations[c->operationHead];
+        characteristic_state* s = &c->characteristics[op->characteristic];
+        cobble_char_handle h = characteristicHandles[op->characteristic];
+
+        int cost = (op->type == Operation_Write && op->length > 0) ? (op->length + c->attMtu - 4) / (c->attMtu - 3) : 1;
+        if (packets > 0 && packets + cost > config.packets)
+            break;
+        packets += cost;
+
+        switch (op->type) {
+        case Operation_Read:
+            if (s->length >= 0) {
+                cobble_event_updatevalue_c(c->handle, h, s->value, s->length);
+            } else {
+                uint8_t value[MAX_LENGTH];
+                int len = payload_length(c);
+                generate_value(value, len, s->generated, now);
+                cobble_event_updatevalue_c(c->handle, h, value, len);
+            }
+            break;
+        case Operation_Write:
+        case Operation_WriteWithoutResponse:
+            if (op->characteristic == config.dfuControl)
+                dfu_control(c, op->data, op->length);
+            else if (op->characteristic == config.dfuPacket)
+                dfu_packet(c, op->data, op->length);
+            memcpy(s->value, op->data, op->length);
+            s->length = op->length;
+            break;
+        }
+
+        if (op->streamed) {
+            c->stream.written += op->length;
+            c->stream.inFlight--;
+        }
+
+        c->operationHead = (c->operationHead + 1) % MAX_OPERATIONS;
+        c->operationCount--;
+    }
+
+    if (c->stream.active && c->stream.written == c->stream.length)
+        end_stream(c, WriteStatus_Complete);
+    else
+        fill_stream(c);
+}
+
+// Deliver the values each subscribed characteristic has generated since the last connection event
+static void send_values(connection* c, uint64_t now) {
+
+    for (int i = 0; i < config.characteristicCount; i++) {
+
+        // The DFU Control Point only sends responses
+        characteristic_state* s = &c->characteristics[i];
+        if (!s->subscribed || now <= s->subscribedAt || config.rate <= 0 || i == config.dfuControl)
+            continue;
+
+        double period = 1e9 / config.rate;
+        uint64_t target = (uint64_t)((double)(now - s->subscribedAt) / period);
+
+        // Each indication must be confirmed before the next is sent, so only one goes per connection event, and none are lost
+        if (!(config.characteristics[i].flags & FLAG_NOTIFY)) {
+            if (s->generated < target) {
+                send_value(c, i, s->generated, s->subscribedAt + (uint64_t)(s->generated * period));
+                s->generated++;
+            }
+            continue;
+        }
+
+        for (; s->generated < target; s->generated++) {
+            if (!lost())
+                send_value(c, i, s->generated, s->subscribedAt + (uint64_t)(s->generated * period));
+        }
+    }
+}
+
+static void set_mtu(connection* c, int mtu) {
+
+    if (c->mtuReported && mtu == c->attMtu)
+        return;
+
+    c->attMtu = mtu;
+    c->mtuReported = true;
+    cobble_event_mtuchanged(c->handle, mtu, MAX_LENGTH, mtu - 3);
+}
+
+static void connection_event(connection* c, uint64_t now) {
+
+    c->eventNumber++;
+
+    c->nextEventNominal += ms_to_ns(config.interval);
+    if (c->nextEventNominal <= now)
+        c->nextEventNominal = now + ms_to_ns(config.interval);
+    c->nextEventAt = c->nextEventNominal + ms_to_ns(config.jitter * random_unit());
+
+    if (c->disconnectRequested || (c->disconnectAt != 0 && now >= c->disconnectAt)) {
+        link_down(c, ConnectionStatus_DidDisconnect);
+        return;
+    }
+
+    // An exchange takes the whole of a connection event, so is settled before anything else is sent
+    if (c->mtuRequested != 0) {
+        set_mtu(c, (c->mtuRequested < config.mtu) ? c->mtuRequested : config.mtu);
+        c->mtuRequested = 0;
+    }
+    if (c->mtuChangeAt != 0 && now >= c->mtuChangeAt) {
+        set_mtu(c, config.mtuChange);
+        c->mtuChangeAt = 0;
+    }
+
+    if (c->cacheChecking)
+        check_cache(c);
+    if (c->serviceChangedAt != 0 && now >= c->serviceChangedAt) {
+        c->serviceChangedAt = 0;
+        rediscover(c);
+    }
+
+    dfu_send_responses(c);
+    run_operations(c, now);
+
+    if (c->discoveryDue && c->eventNumber >= c->discoveryEvent)
+        discover_services(c);
+
+    send_values(c, now);
+}
+
+/*
+ * Simulation thread
+ */
+
+// A command which can't be carried out must still give back what it holds
+static void abandon_command(command* c) {
+    if (c->type == Command_Connect) {
+        cobble_connection_close(c->connection);
+    } else if (c->type == Command_WriteStream) {
+        cobble_event_writecomplete(c->connection, c->characteristic, 0, WriteStatus_Failed);
+        free(c->stream);
+    }
+}
+
+// Returns false if the loop should stop
+static bool run_commands(void) {
+
+    uint64_t count;
+    command c;
+
+    if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        printf("Failed to read the wakeup eventfd: %s\n", strerror(errno));
+
+    while (cobble_ring_pop(&commandQueue, &c)) {
+
+        connection* conn = NULL;
+
+        // Nothing but shutting down can be done without an adapter
+        if (c.type != Command_Shutdown && config.adapter != NoError) {
+            printf("Bluetooth is not available\n");
+            abandon_command(&c);
+            continue;
+        }
+
+        switch (c.type) {
+        case Command_CharacteristicsGet:
+        case Command_Subscribe:
+        case Command_Read:
+        case Command_Write:
+        case Command_WriteStream:
+        case Command_MtuRequest:
+        case Command_DiscoverService:
+            conn = find_connection(c.connection);
+            if (conn == NULL) {
+                abandon_command(&c);
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (c.type) {
+        case Command_ScanStart:
+            scan_start();
+            break;
+        case Command_ScanStop:
+            scan_stop();
+            break;
+        case Command_Connect:
+            connect_device(c.connection, (const cobble_uuid*)c.data, c.length, c.flags);
+            break;
+        case Command_Disconnect:
+            if (c.connection == COBBLE_CONNECTION_NONE)
+                disconnect_all();
+            else if ((conn = find_connection(c.connection)) != NULL)
+                disconnect_device(conn);
+            break;
+        case Command_CharacteristicsGet:
+            characteristics_get(conn);
+            break;
+        case Command_Subscribe:
+            subscribe(conn, c.characteristic);
+            break;
+        case Command_Read:
+            read_characteristic(conn, c.characteristic);
+            break;
+        case Command_Write:
+            write_characteristic(conn, c.characteristic, c.data, c.length);
+            break;
+        case Command_WriteStream:
+            write_stream_start(conn, c.characteristic, c.stream, c.length);
+            break;
+        case Command_MtuRequest:
+            conn->mtuRequested = c.length;
+            break;
+        case Command_DiscoverService:
+            discover_service(conn, (const cobble_uuid*)c.data);
+            break;
+        case Command_Shutdown:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void* event_loop(void* arg) {
+    (void)arg;
+
+    if (config.adapter != NoError)
+        cobble_status_error(config.adapter);
+    else
+        cobble_status_set(Initialised);
+
+    for (;;) {
+
+        uint64_t now = now_ns();
+        uint64_t next = UINT64_MAX;
+
+        // Do whatever is due, and find when the next thing is
+        for (int d = 0; d < config.devices && scanning; d++) {
+            if (now >= devices[d].nextAdvertisement)
+                advertise(&devices[d], now);
+            if (devices[d].nextAdvertisement < next)
+                next = devices[d].nextAdvertisement;
+        }
+
+        for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+            connection* c = &connections[i];
+
+            if (c->state == Link_Connecting && now >= c->connectAt) {
+                if (c->device < 0)
+                    link_down(c, ConnectionStatus_DidConnectFailed);
+                else
+                    connected(c, now);
+            }
+
+            if (c->state == Link_Connected && now >= c->nextEventAt)
+                connection_event(c, now);
+
+            if (c->state == Link_Connecting && c->connectAt < next)
+                next = c->connectAt;
+            if (c->state == Link_Connected && c->nextEventAt < next)
+                next = c->nextEventAt;
+        }
+
+        // Sleep until then, or until a command arrives
+        struct pollfd pfd = { wakeFd, POLLIN, 0 };
+        struct timespec wait;
+        if (next != UINT64_MAX) {
+            now = now_ns();
+            uint64_t remaining = (next > now) ? next - now : 0;
+            wait.tv_sec = remaining / 1000000000ull;
+            wait.tv_nsec = remaining % 1000000000ull;
+        }
+
+        if (ppoll(&pfd, 1, (next != UINT64_MAX) ? &wait : NULL, NULL) < 0 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if ((pfd.revents & POLLIN) && !run_commands())
+            break;
+    }
+
+    // Anything still connected is gone
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        if (connections[i].state != Link_Idle)
+            link_down(&connections[i], (connections[i].state == Link_Connected) ? ConnectionStatus_DidDisconnect : ConnectionStatus_DidConnectFailed);
+    }
+
+    return NULL;
+}
+
+static bool post(command* c) {
+
+    uint64_t one = 1;
+
+    if (!loopRunning) {
+        printf("Cobble has not been initialised\n");
+        return false;
+    }
+
+    if (!cobble_ring_push(&commandQueue, c)) {
+        printf("Too many commands are waiting - command dropped\n");
+        return false;
+    }
+
+    if (write(wakeFd, &one, sizeof(one)) < 0)
+        printf("Failed to wake the event loop: %s\n", strerror(errno));
+    return true;
+}
+
+static void post_simple(CommandType type, cobble_conn_handle connection) {
+    command c;
+    c.type = type;
+    c.connection = connection;
+    post(&c);
+}
+
+/*
+ * Public interface
+ */
+
+bool cobble_sim_configure(const char* script) {
+
+    peripheral p;
+
+    if (loopRunning) {
+        printf("Simulator: the peripheral must be configured before cobble_init()\n");
+        return false;
+    }
+
+    if (script == NULL) {
+        configured = false;
+        return true;
+    }
+
+    if (!parse_script(script, &p))
+        return false;
+
+    config = p;
+    configured = true;
+    return true;
+}
+
+void cobble_init(void) {
+
+    if (loopRunning)
+        return;
+
+    printf("Cobble initialising...\n");
+
+    if (!configured)
+        configure_from_environment();
+
+    cobble_status_set(Uninitialised);
+    scanning = false;
+    randomState = config.seed * 0x9E3779B97F4A7C15ull + 1;
+
+    // Devices after the first take the following addresses
+    for (int d = 0; d < config.devices; d++) {
+        devices[d].address = (config.address + d) & 0xFFFFFFFFFFFFull;
+        devices[d].connected = false;
+        memset(&devices[d].dfu, 0, sizeof(devices[d].dfu));
+        // The name is cut short if need be to leave room for the number, at most " 64"
+        if (config.devices > 1)
+            snprintf(devices[d].name, sizeof(devices[d].name), "%.*s %i", MAX_NAME_LENGTH - 4, config.name, d + 1);
+        else
+            snprintf(devices[d].name, sizeof(devices[d].name), "%s", config.name);
+    }
+
+    for (int i = 0; i < config.characteristicCount; i++)
+        characteristicHandles[i] = cobble_characteristic_handle(config.characteristics[i].uuid);
+
+    for (int i = 0; i < COBBLE_MAX_CONNECTIONS; i++) {
+        connections[i].handle = COBBLE_CONNECTION_NONE;
+        connections[i].state = Link_Idle;
+        reset_connection(&connections[i]);
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0 || !cobble_ring_init(&commandQueue, COMMAND_QUEUE_LENGTH, sizeof(command), RingPolicy_DropNewest)) {
+        printf("Could not allocate the command queue\n");
+        cobble_status_error(UnknownError);
+        return;
+    }
+
+    if (pthread_create(&loopThread, NULL, event_loop, NULL) != 0) {
+        printf("Could not start the event loop thread\n");
+        cobble_status_error(UnknownError);
+        return;
+    }
+
+    loopRunning = true;
+}
+
+void cobble_deinit(void) {
+
+    printf("Cobble deinitialising...\n");
+
+    if (loopRunning) {
+        command c;
+        post_simple(Command_Shutdown, COBBLE_CONNECTION_NONE);
+        pthread_join(loopThread, NULL);
+        loopRunning = false;
+        // Anything sent after the shutdown
+        while (cobble_ring_pop(&commandQueue, &c))
+            abandon_command(&c);
+        cobble_ring_free(&commandQueue);
+    }
+
+    if (wakeFd >= 0)
+        close(wakeFd);
+    wakeFd = -1;
+
+    cobble_status_set(Uninitialised);
+}
+
+void cobble_scan_start(const char* service_uuids) {
+    cobble_scan_table_clear();
+    cobble_scan_filter_begin(service_uuids);
+    post_simple(Command_ScanStart, COBBLE_CONNECTION_NONE);
+}
+
+void cobble_scan_stop(void) {
+    post_simple(Command_ScanStop, COBBLE_CONNECTION_NONE);
+}
+
+// The handle is allocated here, rather than on the simulation thread, so that it can be returned straight away
+cobble_conn_handle cobble_connect(const char* identifier) {
+    return cobble_connect_ex(identifier, NULL, ConnectFlag_None);
+}
+
+cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags) {
+
+    uint64_t address;
+    command c;
+
+    if (!cobble_address_parse(identifier, &address)) {
+        printf("Identifier %s does not look like a MAC address\n", identifier ? identifier : "(null)");
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    c.type = Command_Connect;
+    c.flags = flags;
+    c.length = cobble_uuid_list_parse(service_uuids, (cobble_uuid*)c.data, COBBLE_MAX_CONNECT_SERVICES);
+    c.connection = cobble_connection_open(address);
+    if (c.connection == COBBLE_CONNECTION_NONE) {
+        printf("Already connected to %s, or too many connections\n", identifier);
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    if (!post(&c)) {
+        cobble_connection_close(c.connection);
+        return COBBLE_CONNECTION_NONE;
+    }
+
+    return c.connection;
+}
+
+void cobble_disconnect(void) {
+    post_simple(Command_Disconnect, COBBLE_CONNECTION_NONE);
+}
+
+void cobble_disconnect_c(cobble_conn_handle connection) {
+    if (connection != COBBLE_CONNECTION_NONE)
+        post_simple(Command_Disconnect, connection);
+}
+
+void cobble_characteristics_get_c(cobble_conn_handle connection) {
+    post_simple(Command_CharacteristicsGet, connection);
+}
+
+void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    command c;
+    c.type = Command_Subscribe;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    post(&c);
+}
+
+void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_characteristic_cb_set_c(connection, characteristic, cb, ctx);
+    cobble_subscribe_c(connection, characteristic);
+}
+
+void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+    command c;
+    c.type = Command_Read;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    post(&c);
+}
+
+void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t* data, int len) {
+
+    command c;
+
+    if (len > MAX_LENGTH || len < 0) {
+        printf("Cannot write %i bytes, the maximum is %i\n", len, MAX_LENGTH);
+        return;
+    }
+
+    c.type = Command_Write;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    c.length = len;
+    memcpy(c.data, data, len);
+    post(&c);
+}
+
+bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+
+    command c;
+
+    if (len < 0 || (len > 0 && data == NULL)) {
+        printf("Cannot write %i bytes\n", len);
+        return false;
+    }
+
+    c.type = Command_WriteStream;
+    c.connection = connection;
+    c.characteristic = characteristic;
+    c.length = len;
+    c.stream = malloc(len > 0 ? len : 1);
+    if (c.stream == NULL) {
+        printf("Could not allocate %i bytes to write\n", len);
+        return false;
+    }
+    memcpy(c.stream, data, len);
+
+    if (!post(&c)) {
+        free(c.stream);
+        return false;
+    }
+    return true;
+}
+
+// As with BlueZ, long writes with response are split up, but a value without response must fit in one packet
+int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse) {
+    if (withResponse)
+        return MAX_LENGTH;
+    return connections[cobble_connection_index(connection)].attMtu - 3;
+}
+
+bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu) {
+
+    command c;
+
+    if (mtu < DEFAULT_ATT_MTU || mtu > COBBLE_MAX_ATT_MTU) {
+        printf("Cannot request an MTU of %i, it must be from %i to %i\n", mtu, DEFAULT_ATT_MTU, COBBLE_MAX_ATT_MTU);
+        return false;
+    }
+    if (!cobble_connection_valid(connection)) {
+        printf("No connection has handle %u\n", connection);
+        return false;
+    }
+
+    c.type = Command_MtuRequest;
+    c.connection = connection;
+    c.length = mtu;
+    return post(&c);
+}
+
+bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid) {
+
+    command c;
+    cobble_uuid uuid;
+
+    if (service_uuid == NULL || !cobble_uuid_parse(service_uuid, &uuid)) {
+        printf("Could not create Service UUID from \"%s\"\n", service_uuid ? service_uuid : "(null)");
+        return false;
+    }
+    if (!cobble_connection_valid(connection)) {
+        printf("No connection has handle %u\n", connection);
+        return false;
+    }
+
+    c.type = Command_DiscoverService;
+    c.connection = connection;
+    memcpy(c.data, &uuid, sizeof(uuid));
+    return post(&c);
+}
+
+void cobble_characteristics_get(void) {
+    cobble_characteristics_get_c(cobble_connection_latest());
+}
+
+void cobble_subscribe_h(cobble_char_handle characteristic) {
+    cobble_subscribe_c(cobble_connection_latest(), characteristic);
+}
+
+void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+    cobble_subscribe_cb_c(cobble_connection_latest(), characteristic, cb, ctx);
+}
+
+void cobble_read_h(cobble_char_handle characteristic) {
+    cobble_read_c(cobble_connection_latest(), characteristic);
+}
+
+void cobble_write_h(cobble_char_handle characteristic, uint8_t* data, int len) {
+    cobble_write_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+bool cobble_write_stream_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
+    return cobble_write_stream_c(cobble_connection_latest(), characteristic, data, len);
+}
+
+void cobble_subscribe(const char* characteristic_uuid) {
+    cobble_subscribe_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_read(const char* characteristic_uuid) {
+    cobble_read_h(cobble_characteristic_handle(characteristic_uuid));
+}
+
+void cobble_write(const char* characteristic_uuid, uint8_t* data, int len) {
+    cobble_write_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+bool cobble_write_stream(const char* characteristic_uuid, const uint8_t* data, int len) {
+    return cobble_write_stream_h(cobble_characteristic_handle(characteristic_uuid), data, len);
+}
+
+int cobble_max_writesize_get(bool withResponse) {
+    return cobble_max_writesize_get_c(cobble_connection_latest(), withResponse);
+}
+
+bool cobble_mtu_request(int mtu) {
+    return cobble_mtu_request_c(cobble_connection_latest(), mtu);
+}
+
+bool cobble_discover_service(const char* service_uuid) {
+    return cobble_discover_service_c(cobble_connection_latest(), service_uuid);
+}
+
+// The simulation has its own thread, so this just waits until cobble_shutdown() is called
+static pthread_mutex_t shutdownLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shutdownCondition = PTHREAD_COND_INITIALIZER;
+static bool cobble_shutdown_requested = false;
+
+void cobble_shutdown(void) {
+    pthread_mutex_lock(&shutdownLock);
+    cobble_shutdown_requested = true;
+    pthread_cond_broadcast(&shutdownCondition);
+    pthread_mutex_unlock(&shutdownLock);
+}
+
+void cobble_loop(void) {
+    pthread_mutex_lock(&shutdownLock);
+    while (!cobble_shutdown_requested)
+        pthread_cond_wait(&shutdownCondition, &shutdownLock);
+    pthread_mutex_unlock(&shutdownLock);
+}
@@ -0,0 +1,81 @@
+// Simulated backend: configuration of the virtual peripheral
+//
+// The peripheral is described by a script of settings, separated by semicolons or newlines. Lines starting with # are
+// ignored. Anything not given keeps the default shown here.
+//
+//   name=Cobble Sim              Advertised name
+//   address=5E:11:00:00:00:01    Identifier to pass to cobble_connect()
+//   devices=1                    Number of identical peripherals (up to 64). Each has the next address after the one
+//                                before, and a number after its name. Each can be connected to at once, and has its own
+//                                link with the settings below.
+//   rssi=-60                     Mean RSSI of scan results, which vary by up to 3 dBm either side
+//   advertising_interval=100     ms between scan results while scanning
+//   manufacturer=                Manufacturer data to advertise, as a company identifier then data, both in hex (eg
+//                                manufacturer=0059,0102AABB), or none if not given
+//   service_data=                If set, a service UUID under which each advertisement carries a reading as service
+//                                data: a sequence number counting the device's advertisements, then the time it was
+//                                made, as generated values start (see below)
+//   connect_delay=50             ms from cobble_connect() to the connection being made
+//   disconnect_after=0           ms after connecting that the peripheral drops the link, or 0 for never
+//   mtu=247                      Largest ATT MTU the peripheral supports. Each link starts at 23, and at its first connection
+//                                event takes the smaller of this and the MTU Cobble asks for (the largest, 517, unless
+//                                cobble_mtu_request() asks again for something else).
+//   mtu_change=0                 If set, the peripheral changes the link's MTU to this, mtu_change_after ms after connecting
+//   mtu_change_after=0
+//   interval=7.5                 Connection interval (ms). Values, reads and writes are only exchanged at connection events.
+//   packets=6                    Reads and writes carried by each connection event, so the link's capacity for writes
+//                                without response is packets * (mtu - 3) bytes per interval. A long write takes one for
+//                                each part.
+//   jitter=0                     Each connection event is delayed by a random amount of up to this many ms
+//   loss=0                       Fraction (0 to 1) of notifications and scan results which are lost
+//   rate=100                     Values per second generated by each subscribed characteristic
+//   payload=20                   Bytes per value, limited to mtu - 3
+//   seed=1                       Seed for jitter, loss and RSSI, so that a run can be repeated
+//   adapter=on                   on, off, unsupported or unauthorised, to simulate a missing or disabled adapter
+//   dfu=off                      on to add a Nordic Secure DFU service (FE59), as a device in its bootloader has. Its
+//                                Control Point answers requests as an nRF5 SDK bootloader does, and it keeps what it has
+//                                been sent across connections, so an interrupted update can be resumed.
+//   dfu_object=4096              Largest data object the DFU target accepts, in bytes (64 to 65536)
+//   dfu_corrupt=0                Flips a bit of this packet (counting from 1) written to the DFU Packet characteristic,
+//                                or 0 for none
+//   db_hash=on                   Whether the peripheral has a Database Hash, which changes with its characteristics and
+//                                db_version. A table in the GATT cache (see cobble_gatt_cache.h) is reported as soon as
+//                                the link is up, and checked against the hash at the first connection event.
+//   db_version=0                 Changes the hash without changing the characteristics, as new firmware might
+//   service_changed_after=0      If set, the peripheral indicates Service Changed this many ms after connecting, and its
+//                                characteristics are discovered again
+//   service=<uuid>               Adds a service. Characteristics that follow belong to it.
+//   characteristic=<uuid>,<properties>
+//                                Adds a characteristic, with properties from read, write, write_without_response,
+//                                notify and indicate (eg characteristic=2A19,read,notify)
+//
+// Without any services, the peripheral has a Battery service (180F) with a readable and notifying Battery Level (2A19),
+// and a Nordic UART service (6E400001-B5A3-F393-E0A9-E50E24DCCA9E) with a writeable RX characteristic (6E400002-...) and
+// a notifying TX characteristic (6E400003-...).
+//
+// Generated values start with a sequence number (uint32) and, if there is room, the CLOCK_MONOTONIC time in ns at which
+// the peripheral generated the value (uint64), both little-endian. An application in the same process can compare that
+// with the time it receives the value to measure end-to-end latency. Values written to a characteristic are returned by
+// later reads of it.
+#ifndef SIMBLE_H
+#define SIMBLE_H
+
+#include <stdbool.h>
+
+#include "../../cobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Configure the peripheral from a script, before cobble_init(). A NULL script restores the defaults.
+// If this is not called, cobble_init() reads the script from the COBBLE_SIM environment variable, or from a file if the
+// variable holds @ followed by a path.
+// Returns false, leaving the configuration unchanged, if the script is invalid or Cobble is already initialised.
+EXPORTED bool cobble_sim_configure(const char* script);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,13 @@
 extern "C" {
 #include "../../cobble.h"
 #include "../../cobble_events.h"
+#include "../../cobble_characteristics.h"
+#include "../../cobble_connections.h"
+#include "../../cobble_ad.h"
+#include "../../cobble_gatt_cache.h"
+#include "../../cobble_scan_filter.h"
+#include "../../cobble_scan_table.h"
+#include "../../cobble_status.h"
 }
 
 using namespace std;
@@ -25,31 +32,91 @@ using namespace Windows::Devices::Enumeration;
 
 #pragma comment(lib, "windowsapp")
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <winerror.h>
 using namespace Windows::Storage::Streams;
 
 
-CobbleStatus status = Uninitialised;
-CobbleErrorCode error = NoError;
-
 // Bluetooth stack state we track
 std::list<GattDeviceService> serviceCache;
-std::list<GattCharacteristic> characteristicCache;
+std::mutex serviceCacheLock;
+
+// Discovered characteristics, indexed by handle. Written by discovery completions, read by the application's thread.
+std::vector<GattCharacteristic> characteristicCache(COBBLE_MAX_CHARACTERISTICS + 1, nullptr);
+std::mutex characteristicCacheLock;
+
+// Characteristics reported from Cobble's GATT cache, which are only looked up in Windows' cache when first used. Also
+// indexed by handle, and guarded by characteristicCacheLock.
+struct stored_characteristic {
+	bool known = false;
+	winrt::guid service {};
+	winrt::guid characteristic {};
+};
+std::vector<stored_characteristic> storedCharacteristics(COBBLE_MAX_CHARACTERISTICS + 1);
+
 BluetoothLEDevice currentDevice { nullptr };
+// Only one device is connected at a time on Windows, so there is only ever one connection handle in use
+cobble_conn_handle currentConnection = COBBLE_CONNECTION_NONE;
 BluetoothLEAdvertisementWatcher advWatcher { nullptr };
 GattSession sess { nullptr };
 
-__declspec(dllexport) CobbleStatus cobble_status(void) {
-	return status;
-}
+// What cobble_connect_ex() asked to discover. No services means every service.
+std::vector<winrt::guid> connectServices;
+uint32_t connectFlags = ConnectFlag_None;
 
-__declspec(dllexport)CobbleErrorCode cobble_error_get(void) {
-	return error;
-}
+cobble_uuid ToUuid(winrt::guid const& guid);
 
 void advertisementHandler(BluetoothLEAdvertisementWatcher watcher, BluetoothLEAdvertisementReceivedEventArgs args) {
 
+	// The watcher has already checked what it could of the filter (see cobble_scan_start()). Only what is left is read out
+	// of the advertisement, before anything is formatted.
+	const cobble_scan_criteria* filter = cobble_scan_filter_active();
+	cobble_advertisement adv = {};
+	adv.fields = ScanField_Rssi;
+	adv.rssi = args.RawSignalStrengthInDBm();
+	adv.manufacturerId = COBBLE_MANUFACTURER_ANY;
+
+	std::string name;
+	if (filter->fields & ScanField_Name) {
+		name = winrt::to_string(args.Advertisement().LocalName());
+		adv.name = name.empty() ? nullptr : name.c_str();
+		adv.fields |= ScanField_Name;
+	}
+
+	IBuffer manufacturerData { nullptr };
+	if (filter->fields & ScanField_Manufacturer) {
+		auto manufacturers = args.Advertisement().ManufacturerData();
+		if (manufacturers.Size() > 0) {
+			manufacturerData = manufacturers.GetAt(0).Data();
+			adv.manufacturerId = manufacturers.GetAt(0).CompanyId();
+			adv.manufacturerData = manufacturerData.data();
+			adv.manufacturerLength = (int)manufacturerData.Length();
+		}
+		adv.fields |= ScanField_Manufacturer;
+	}
+
+	// A single service is checked by the watcher
+	cobble_uuid services[COBBLE_SCAN_FILTER_MAX_SERVICES];
+	if ((filter->fields & ScanField_Services) && filter->serviceCount > 1) {
+		for (winrt::guid const& guid : args.Advertisement().ServiceUuids()) {
+			if (adv.serviceCount == COBBLE_SCAN_FILTER_MAX_SERVICES)
+				break;
+			services[adv.serviceCount++] = ToUuid(guid);
+		}
+		adv.services = services;
+		adv.fields |= ScanField_Services;
+	}
+
+	if (!cobble_scan_filter_match(&adv))
+		return;
+
 	// TODO: Verify this works with Unicode strings
 	char short_name[256];
 	snprintf(short_name, sizeof(short_name), "%ws", args.Advertisement().LocalName().c_str());
@@ -69,6 +136,17 @@ void advertisementHandler(BluetoothLEAdvertisementWatcher watcher, BluetoothLEAd
 	cout << "Adv: Device has name " << short_name << " and address " << short_id << std::endl;
 	cobble_event_scanresult(short_name, args.RawSignalStrengthInDBm(), short_id);
 
+	// The data sections are the AD structures as received, so only need their length and type bytes putting back
+	if (cobble_event_advertisement_wanted()) {
+		uint8_t data[COBBLE_AD_MAX_LENGTH];
+		int len = 0;
+		for (BluetoothLEAdvertisementDataSection const& section : args.Advertisement().DataSections()) {
+			IBuffer buffer = section.Data();
+			len = cobble_ad_append(data, len, section.DataType(), buffer.data(), (int)buffer.Length());
+		}
+		cobble_event_advertisement(short_id, args.RawSignalStrengthInDBm(), data, len);
+	}
+
 }
 
 // Used only if GattSession is used to preserve/resume connections
@@ -82,6 +160,8 @@ void sessionStatusChangedHandler(GattSession session, GattSessionStatusChangedEv
 	//Closed = 0 //The GATT session is closed.
 }
 
+void stream_failed();
+
 void connectionStatusChangedHandler(BluetoothLEDevice dev, IInspectable unused) {
 
 	int cobble_status_callback = 0;
@@ -109,8 +189,17 @@ void connectionStatusChangedHandler(BluetoothLEDevice dev, IInspectable unused)
 
 	cout << "Connection status for device " << short_id << " changed to " << ((cobble_status_callback == ConnectionStatus_DidConnect) ? "Connected" : "Disconnected") << std::endl;
 
+	if (cobble_status_callback == ConnectionStatus_DidDisconnect)
+		stream_failed();
+
 	cobble_event_connectionstatus(short_id, cobble_status_callback);
 
+	if (cobble_status_callback == ConnectionStatus_DidDisconnect) {
+		cobble_connection_close(currentConnection);
+		currentConnection = COBBLE_CONNECTION_NONE;
+		cobble_status_update(Initialised);
+	}
+
 }
 
 
@@ -121,7 +210,7 @@ EXPORTED void cobble_init(void)
 
 	std::cout << "Cobble initialised\n";
 
-	status = Initialised;
+	cobble_status_set(Initialised);
 
 }
 
@@ -133,23 +222,42 @@ EXPORTED void cobble_deinit(void)
 
 	std::cout << "Cobble deinitialised\n";
 
-	status = Uninitialised;
+	cobble_status_set(Uninitialised);
 
 }
 
 
 
+// GUIDs hold their first three fields as native integers, which are written most significant byte first
+cobble_uuid ToUuid(winrt::guid const& guid) {
+	cobble_uuid u;
+	u.bytes[0] = (uint8_t)(guid.Data1 >> 24);
+	u.bytes[1] = (uint8_t)(guid.Data1 >> 16);
+	u.bytes[2] = (uint8_t)(guid.Data1 >> 8);
+	u.bytes[3] = (uint8_t)(guid.Data1);
+	u.bytes[4] = (uint8_t)(guid.Data2 >> 8);
+	u.bytes[5] = (uint8_t)(guid.Data2);
+	u.bytes[6] = (uint8_t)(guid.Data3 >> 8);
+	u.bytes[7] = (uint8_t)(guid.Data3);
+	memcpy(&u.bytes[8], guid.Data4, 8);
+	return u;
+}
+
+winrt::guid ToGuid(cobble_uuid const& u) {
+	winrt::guid guid;
+	guid.Data1 = ((uint32_t)u.bytes[0] << 24) | ((uint32_t)u.bytes[1] << 16) | ((uint32_t)u.bytes[2] << 8) | u.bytes[3];
+	guid.Data2 = (uint16_t)((u.bytes[4] << 8) | u.bytes[5]);
+	guid.Data3 = (uint16_t)((u.bytes[6] << 8) | u.bytes[7]);
+	memcpy(guid.Data4, &u.bytes[8], 8);
+	return guid;
+}
+
 std::string ToString(winrt::guid guid) {
 
-	char guid_string[37]; // 32 hex chars + 4 hyphens + null terminator
-	
-	snprintf(
-		guid_string, sizeof(guid_string),
-		"%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-		guid.Data1, guid.Data2, guid.Data3,
-		guid.Data4[0], guid.Data4[1], guid.Data4[2],
-		guid.Data4[3], guid.Data4[4], guid.Data4[5],
-		guid.Data4[6], guid.Data4[7]);
+	char guid_string[COBBLE_UUID_STRING_LENGTH];
+
+	cobble_uuid u = ToUuid(guid);
+	cobble_uuid_format(&u, guid_string);
 
 	return guid_string;
 }
@@ -159,44 +267,213 @@ std::ostream& operator<<(std::ostream& os, winrt::guid guid) {
 	return os;
 }
 
+// The characteristic lookups of every service run at once. This is shared between them so that the last to finish can
+// say that discovery is complete. A discovery of every service also collects the GATT table, to be stored once it is.
+struct discovery_join {
+	cobble_conn_handle connection;
+	uint64_t address = 0;
+	bool allServices = false;
+	std::atomic<bool> failed { false };
+	std::atomic<int> services;
+	std::atomic<int> pending;
+	std::atomic<int> characteristics;
+	std::chrono::steady_clock::time_point started;
+	std::mutex tableLock;
+	cobble_gatt_table table {};
+};
+
+void discovery_complete(discovery_join& join) {
+	int elapsed = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - join.started).count();
+	if (join.allServices && !join.failed && cobble_gatt_cache_enabled()) {
+		std::lock_guard<std::mutex> lock(join.tableLock);
+		join.table.serviceCount = join.services;
+		cobble_gatt_cache_store(join.address, &join.table);
+	}
+	cobble_event_discoverycomplete(join.connection, join.services, join.characteristics, elapsed);
+}
+
+// Windows doesn't give the Database Hash to applications, but keeps its own cache up to date from it and from Service
+// Changed indications, so discovery uses that cache when Cobble's is enabled.
+BluetoothCacheMode discovery_cache_mode() {
+	if (!cobble_gatt_cache_enabled() || (connectFlags & ConnectFlag_Uncached))
+		return BluetoothCacheMode::Uncached;
+	return BluetoothCacheMode::Cached;
+}
+
+uint8_t gatt_properties(GattCharacteristicProperties properties) {
+	return (uint8_t)((uint32_t)properties & (COBBLE_GATT_PROPERTY_READ | COBBLE_GATT_PROPERTY_WRITE_WITHOUT_RESPONSE
+		| COBBLE_GATT_PROPERTY_WRITE | COBBLE_GATT_PROPERTY_NOTIFY | COBBLE_GATT_PROPERTY_INDICATE));
+}
+
+// Report the table from Cobble's cache straight away, as discovery would. The characteristics Windows hands out are its
+// own objects, so each one is only looked up (in Windows' cache) when it is first used, by with_characteristic().
+// Only tables from a discovery of every service are stored, so a service asked for which isn't in the table isn't on
+// the device.
+bool replay_cache(std::shared_ptr<discovery_join> join) {
+
+	char serviceId[COBBLE_UUID_STRING_LENGTH];
+	cobble_gatt_table* t = &join->table;
+	int services = 0;
+	int characteristics = 0;
+
+	if (!cobble_gatt_cache_load(join->address, t))
+		return false;
+
+	if (connectServices.empty())
+		services = t->serviceCount;
+	for (auto const& wanted : connectServices) {
+		for (int e = 0; e < t->count; e++) {
+			if (ToGuid(t->entries[e].service) == wanted) {
+				services++;
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < t->count; i++) {
+		winrt::guid service = ToGuid(t->entries[i].service);
+		bool wanted = connectServices.empty() || std::find(connectServices.begin(), connectServices.end(), service) != connectServices.end();
+
+		cobble_char_handle h = cobble_characteristic_intern_uuid(&t->entries[i].characteristic);
+		if (!wanted || h == COBBLE_CHARACTERISTIC_NONE)
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(characteristicCacheLock);
+			storedCharacteristics[h].known = true;
+			storedCharacteristics[h].service = service;
+			storedCharacteristics[h].characteristic = ToGuid(t->entries[i].characteristic);
+		}
+		cobble_uuid_format(&t->entries[i].service, serviceId);
+		cobble_event_characteristicdiscovered(serviceId, cobble_characteristic_uuid(h));
+		characteristics++;
+	}
+
+	join->services = services;
+	join->characteristics = characteristics;
+	discovery_complete(*join);
+	return true;
+}
+
 // Called in a callback when the service has been discovered.
-void discover_characteristics(GattDeviceService s) {
+void discover_characteristics(GattDeviceService s, std::shared_ptr<discovery_join> join) {
 	//std::cout << "Discovering c for s " << s.Uuid() << std::endl;
 
-	IAsyncOperation < GattCharacteristicsResult> res = s.GetCharacteristicsAsync(BluetoothCacheMode::Uncached);
+	IAsyncOperation < GattCharacteristicsResult> res = s.GetCharacteristicsAsync(discovery_cache_mode());
+
+	res.Completed([s, join](IAsyncOperation< GattCharacteristicsResult> as_async, AsyncStatus as_status) {
+		// A lookup which failed still counts towards the join, so that discovery completes with what was found
+		if (as_status != AsyncStatus::Completed) {
+			join->failed = true;
+			if (--join->pending == 0)
+				discovery_complete(*join);
+			return;
+		}
 
-	res.Completed([s](IAsyncOperation< GattCharacteristicsResult> as_async, AsyncStatus as_status) {
 		auto res = as_async.GetResults();
 		//std::cout << "Service " << s.Uuid() << " has " << res.Characteristics().Size() << " results: " ;
 
 		for (auto c : res.Characteristics()) {
 			//std::cout << "CharUUID found " << c.Uuid() << ", ";
-			characteristicCache.push_front(c);
-			cobble_event_characteristicdiscovered(ToString(s.Uuid()).c_str(), ToString(c.Uuid()).c_str());
+			cobble_uuid uuid = ToUuid(c.Uuid());
+			cobble_char_handle h = cobble_characteristic_intern_uuid(&uuid);
+			{
+				std::lock_guard<std::mutex> lock(characteristicCacheLock);
+				characteristicCache[h] = c;
+			}
+			if (join->allServices) {
+				std::lock_guard<std::mutex> lock(join->tableLock);
+				if (join->table.count < COBBLE_GATT_CACHE_MAX_CHARACTERISTICS) {
+					cobble_gatt_entry* e = &join->table.entries[join->table.count++];
+					e->service = ToUuid(s.Uuid());
+					e->characteristic = uuid;
+					e->properties = gatt_properties(c.CharacteristicProperties());
+				}
+				else {
+					join->failed = true;
+				}
+			}
+			cobble_event_characteristicdiscovered(ToString(s.Uuid()).c_str(), cobble_characteristic_uuid(h));
+			join->characteristics++;
 			
 		}
 		//std::cout << std::endl;
+
+		if (--join->pending == 0)
+			discovery_complete(*join);
 	});
 }
 
+// Each service asked for is looked up by UUID, and its characteristics as soon as it is found. A lookup adds the services
+// it found to the join before it counts itself done, so the join can't complete while their characteristics are pending.
+void discover_services_by_uuid(BluetoothLEDevice dev, std::vector<winrt::guid> const& uuids, std::shared_ptr<discovery_join> join) {
+
+	join->services = 0;
+	join->characteristics = 0;
+	join->pending = (int)uuids.size();
+
+	for (auto const& uuid : uuids) {
+		IAsyncOperation<GattDeviceServicesResult> ao = dev.GetGattServicesForUuidAsync(uuid, discovery_cache_mode());
+
+		ao.Completed([join](IAsyncOperation<GattDeviceServicesResult> as_async, AsyncStatus as_status) {
+			if (as_status == AsyncStatus::Completed) {
+				auto res = as_async.GetResults();
+				int found = (int)res.Services().Size();
+				join->services += found;
+				join->pending += found;
+
+				for (auto s : res.Services()) {
+					{
+						std::lock_guard<std::mutex> lock(serviceCacheLock);
+						serviceCache.push_front(s);
+					}
+					cobble_event_servicediscovered(ToString(s.Uuid()).c_str());
+					discover_characteristics(s, join);
+				}
+			}
+
+			if (--join->pending == 0)
+				discovery_complete(*join);
+		});
+	}
+}
+
 
 void DiscoverServices(BluetoothLEDevice dev);
+void report_mtu(GattSession s);
+
+EXPORTED cobble_conn_handle cobble_connect(const char* identifier) {
+	return cobble_connect_ex(identifier, NULL, ConnectFlag_None);
+}
 
-EXPORTED void cobble_connect(const char* identifier) {
+EXPORTED cobble_conn_handle cobble_connect_ex(const char* identifier, const char* service_uuids, uint32_t flags) {
 	// TODO: It seems that Windows doesn't simply support just connecting to devices? It automatically opens a connection when you interact with a characteristic.
 	// It's unclear when this is triggered again - some kind of GC when the number of connections falls to zero across all apps?
 	// "Bluetooth LE Explorer" seems to have some degree of control over connections. Clicking on the device opens up a connection (albeit, only if you've recently been connected. If you leave for a while you need to notify.).
 	// Pressing Back disconnects after a couple of seconds.
 	// May be something to do with a handle being open until it's Closed as part of its IClosable spec?
 
-	uint32_t address[6] = { 0 };
+	uint64_t addr_full = 0;
 
-	if (sscanf_s(identifier, "%02X:%02X:%02X:%02X:%02X:%02X", &address[0], &address[1], &address[2], &address[3], &address[4], &address[5]) != 6) {
+	if (!cobble_address_parse(identifier, &addr_full)) {
 		std::cout << "Matching address failed: identifier " << identifier << " does not look like a MAC address" << std::endl;
-		return;
+		return COBBLE_CONNECTION_NONE;
+	}
+
+	if (cobble_connection_valid(currentConnection)) {
+		std::cout << "Only one device can be connected at a time on this platform" << std::endl;
+		return COBBLE_CONNECTION_NONE;
 	}
 
-	uint64_t addr_full = ((uint64_t)address[0] << (8 * 5)) | ((uint64_t)address[1] << (8 * 4)) | ((uint64_t)address[2] << (8 * 3)) | ((uint64_t)address[3] << (8 * 2)) | ((uint64_t)address[4] << (8 * 1)) | ((uint64_t)address[5] << (8 * 0));
+	currentConnection = cobble_connection_open(addr_full);
+	if (currentConnection == COBBLE_CONNECTION_NONE)
+		return COBBLE_CONNECTION_NONE;
+
+	cobble_uuid services[COBBLE_MAX_CONNECT_SERVICES];
+	int serviceCount = cobble_uuid_list_parse(service_uuids, services, COBBLE_MAX_CONNECT_SERVICES);
+	connectServices.clear();
+	for (int i = 0; i < serviceCount; i++)
+		connectServices.push_back(ToGuid(services[i]));
+	connectFlags = flags;
 
 
 	// Create the BluetoothLE device
@@ -224,6 +501,10 @@ EXPORTED void cobble_connect(const char* identifier) {
 			sess.MaintainConnection(true);
 			sess.SessionStatusChanged(sessionStatusChangedHandler);
 
+			// Windows exchanges the MTU itself, so report what it has settled on and any later change
+			report_mtu(sess);
+			sess.MaxPduSizeChanged([](GattSession s, IInspectable) { report_mtu(s); });
+
 			// Discover services for the device
 			//DiscoverServices(dev);
 
@@ -234,7 +515,9 @@ EXPORTED void cobble_connect(const char* identifier) {
 
 
 	cobble_scan_stop(); //TODO: Don't stop scanning until connected?
-	status = Connecting;
+	cobble_status_update(Connecting);
+
+	return currentConnection;
 }
 
 void DiscoverServices(BluetoothLEDevice dev) {
@@ -252,23 +535,50 @@ void DiscoverServices(BluetoothLEDevice dev) {
 
 
 	currentDevice = dev;
-	status = Connected;
+	cobble_status_update(Connected);
 	cobble_event_connectionstatus(short_id, ConnectionStatus_DidConnect);
 	
 	std::wcout << "Getting services for device " << dev.Name().c_str() << std::endl;
 
+	if (connectFlags & ConnectFlag_NoDiscovery)
+		return;
+
+	auto join = std::make_shared<discovery_join>();
+	join->connection = currentConnection;
+	join->address = dev.BluetoothAddress();
+	join->started = std::chrono::steady_clock::now();
+
+	if (cobble_gatt_cache_enabled() && !(connectFlags & ConnectFlag_Uncached) && replay_cache(join))
+		return;
+
+	if (!connectServices.empty()) {
+		discover_services_by_uuid(dev, connectServices, join);
+		return;
+	}
+
 	// Returns GattDeviceServicesResult
-	IAsyncOperation<GattDeviceServicesResult> ao = dev.GetGattServicesAsync(BluetoothCacheMode::Uncached);
+	join->allServices = true;
+	IAsyncOperation<GattDeviceServicesResult> ao = dev.GetGattServicesAsync(discovery_cache_mode());
 
-	ao.Completed([](IAsyncOperation<GattDeviceServicesResult> as_async, AsyncStatus as_status) {
+	ao.Completed([join](IAsyncOperation<GattDeviceServicesResult> as_async, AsyncStatus as_status) {
 		auto res = as_async.GetResults();
 		std::cout << "Service discovery complete with " << res.Services().Size() << " services discovered." << std::endl;
 
+		// Every lookup is counted before any is started, so that an early finisher can't complete the join
+		join->services = res.Services().Size();
+		join->pending = join->services;
+		join->characteristics = 0;
+		if (join->services == 0)
+			discovery_complete(*join);
+
 		for (auto s : res.Services()) {
-			serviceCache.push_front(s);
+			{
+				std::lock_guard<std::mutex> lock(serviceCacheLock);
+				serviceCache.push_front(s);
+			}
 			//std::cout << "Got service " << s.Uuid() << std::endl;
 			cobble_event_servicediscovered(ToString(s.Uuid()).c_str());
-			discover_characteristics(s);
+			discover_characteristics(s, join);
 		}
 
 	});
@@ -283,11 +593,24 @@ EXPORTED void cobble_disconnect(void) {
 	if (currentDevice != nullptr)
 		currentDevice.Close();
 
-	for (auto s : serviceCache)
-		s.Close();
+	{
+		std::lock_guard<std::mutex> lock(serviceCacheLock);
+		for (auto s : serviceCache)
+			s.Close();
+		serviceCache.clear();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(characteristicCacheLock);
+		for (auto& c : characteristicCache)
+			c = nullptr;
+		for (auto& stored : storedCharacteristics)
+			stored = stored_characteristic();
+	}
 
-	characteristicCache.clear();
-	serviceCache.clear();
+	stream_failed();
+	cobble_connection_close(currentConnection);
+	currentConnection = COBBLE_CONNECTION_NONE;
 
 }
 
@@ -300,12 +623,42 @@ EXPORTED void cobble_scan_stop() {
 
 EXPORTED void cobble_scan_start(const char* svc_uuids) {
 
-	// TODO: Use svc_uuids
+	cobble_scan_table_clear();
+
+	const cobble_scan_criteria* filter = cobble_scan_filter_begin(svc_uuids);
 	
 	// Listen for actual BLE advertisement packets being sent over the air.
 	// Unlike DeviceInformation, it can be used to scan indefinitely.
 
 	advWatcher = BluetoothLEAdvertisementWatcher();
+
+	// Hand the watcher what it can check of the filter. Devices moving out of range are still reported, with an RSSI of
+	// -127, and are dropped by cobble_scan_filter_match().
+	if (filter->fields & ScanField_Rssi) {
+		advWatcher.SignalStrengthFilter().InRangeThresholdInDBm((int16_t)filter->rssiMin);
+		advWatcher.SignalStrengthFilter().OutOfRangeThresholdInDBm((int16_t)(filter->rssiMin - 1));
+	}
+	// Every service in the watcher's filter must be advertised, so it can only be given one
+	if ((filter->fields & ScanField_Services) && filter->serviceCount == 1)
+		advWatcher.AdvertisementFilter().Advertisement().ServiceUuids().Append(ToGuid(filter->services[0]));
+	// A byte pattern matches the start of the manufacturer data: the company identifier (little-endian), then as many
+	// bytes as are compared in full
+	if (filter->fields & ScanField_Manufacturer) {
+		DataWriter writer;
+		int offset = 2;
+		if (filter->manufacturerId != COBBLE_MANUFACTURER_ANY) {
+			writer.WriteByte((uint8_t)(filter->manufacturerId & 0xFF));
+			writer.WriteByte((uint8_t)(filter->manufacturerId >> 8));
+			offset = 0;
+		}
+		for (int i = 0; i < filter->manufacturerLength && filter->manufacturerMask[i] == 0xFF; i++)
+			writer.WriteByte(filter->manufacturerData[i]);
+		if (writer.UnstoredBufferLength() > 0) {
+			BluetoothLEAdvertisementBytePattern pattern(BluetoothLEAdvertisementDataTypes::ManufacturerSpecificData(), (int16_t)offset, writer.DetachBuffer());
+			advWatcher.AdvertisementFilter().BytePatterns().Append(pattern);
+		}
+	}
+
 	advWatcher.Received(advertisementHandler);
 	try {
 		advWatcher.Start();
@@ -314,22 +667,26 @@ EXPORTED void cobble_scan_start(const char* svc_uuids) {
 
 		if (ex.to_abi() == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_AVAILABLE)) {
 			cout << "Cannot start scanning - device is not available." << endl;
-			status = CobbleError;
-			error = HardwareTurnedOff;
+			cobble_status_error(HardwareTurnedOff);
 		}
 		else {
 			cout << "Error whilst starting scan: " << ex.code() << endl;
-			status = CobbleError;
-			error = UnknownError;
+			cobble_status_error(UnknownError);
 		}
 
 		return;
 	}
 
-	status = Scanning;
+	cobble_status_update(Scanning);
 
 }
 
+// The MTU and the payload either kind of write can carry, for the current connection
+void report_mtu(GattSession s) {
+	int mtu = s.MaxPduSize();
+	cobble_event_mtuchanged(currentConnection, mtu, mtu-3, mtu-3);
+}
+
 int cobble_max_writesize_get(bool withResponse) {
 	if (sess != nullptr)
 		return sess.MaxPduSize()-3;
@@ -337,89 +694,384 @@ int cobble_max_writesize_get(bool withResponse) {
 		return 20; // Safe but slow
 }
 
-void onValueChange(GattCharacteristic const& charateristic, GattValueChangedEventArgs const& args)
-{
-		//std::wcout << std::hex << "\t\tNotified GattCharacteristic - Guid: [" << ToString(charateristic.Uuid()).c_str() << "]" << std::endl;
-		cobble_event_updatevalue(ToString(charateristic.Uuid()).c_str(), args.CharacteristicValue().data(), args.CharacteristicValue().Length());
+// Only the current connection can be operated on
+bool is_current(cobble_conn_handle connection) {
+	if (connection != COBBLE_CONNECTION_NONE && connection == currentConnection)
+		return true;
+	std::cout << "No connection has handle " << connection << std::endl;
+	return false;
 }
 
-EXPORTED void cobble_subscribe(const char* characteristic) {
+EXPORTED void cobble_disconnect_c(cobble_conn_handle connection) {
+	if (is_current(connection))
+		cobble_disconnect();
+}
 
-	//std::cout << "Subscribing to characteristic " << characteristic << " when there are " << characteristicCache.size() << " items" << std::endl;
+EXPORTED int cobble_max_writesize_get_c(cobble_conn_handle connection, bool withResponse) {
+	return is_current(connection) ? cobble_max_writesize_get(withResponse) : 0;
+}
 
-	// Get the Characteristic object
-	for (auto cc : characteristicCache) {
-		if (ToString(cc.Uuid()) == characteristic) {
-			//std::cout << "MATCHED " << ToString(cc.Uuid()).c_str() << std::endl;
-			
-			cc.ValueChanged(onValueChange);
+bool cobble_mtu_request(int mtu) {
+	std::cout << "Windows negotiates the MTU itself" << std::endl;
+	return false;
+}
 
-			GattClientCharacteristicConfigurationDescriptorValue dv;
+EXPORTED bool cobble_mtu_request_c(cobble_conn_handle connection, int mtu) {
+	return is_current(connection) ? cobble_mtu_request(mtu) : false;
+}
 
-			// If notifications are available, use them. Otherwise, use indications.
-			if (((cc.CharacteristicProperties()) & GattCharacteristicProperties::Notify) != GattCharacteristicProperties::None) {
-				dv = GattClientCharacteristicConfigurationDescriptorValue::Notify;
-			}
-			else {
-				dv = GattClientCharacteristicConfigurationDescriptorValue::Indicate;
-			}
+// The service is looked up on its own, once the device has been opened, whatever was discovered when connecting
+EXPORTED bool cobble_discover_service(const char* service_uuid) {
+
+	cobble_uuid uuid;
+
+	if (service_uuid == NULL || !cobble_uuid_parse(service_uuid, &uuid)) {
+		std::cout << "Could not create Service UUID from \"" << (service_uuid ? service_uuid : "(null)") << "\"" << std::endl;
+		return false;
+	}
+	if (currentDevice == nullptr) {
+		std::cout << "Not connected, cannot discover a service" << std::endl;
+		return false;
+	}
+
+	auto join = std::make_shared<discovery_join>();
+	join->connection = currentConnection;
+	join->started = std::chrono::steady_clock::now();
+	discover_services_by_uuid(currentDevice, { ToGuid(uuid) }, join);
+	return true;
+}
+
+EXPORTED bool cobble_discover_service_c(cobble_conn_handle connection, const char* service_uuid) {
+	return is_current(connection) && cobble_discover_service(service_uuid);
+}
+
+// Look up a discovered characteristic by handle. Returns nullptr if it has not been discovered on the current device.
+GattCharacteristic cached_characteristic(cobble_char_handle characteristic) {
+	if (characteristic == COBBLE_CHARACTERISTIC_NONE || characteristic > COBBLE_MAX_CHARACTERISTICS)
+		return nullptr;
+	std::lock_guard<std::mutex> lock(characteristicCacheLock);
+	return characteristicCache[characteristic];
+}
+
+void resolved(cobble_conn_handle connection, cobble_char_handle characteristic, GattCharacteristic c, std::function<void(GattCharacteristic)> then) {
+
+	if (connection != currentConnection)
+		c = nullptr;
+
+	if (c != nullptr) {
+		std::lock_guard<std::mutex> lock(characteristicCacheLock);
+		characteristicCache[characteristic] = c;
+	}
+	else if (connection == currentConnection) {
+		// Windows no longer has what the table said, so it is out of date, and the device is discovered afresh next time
+		std::cout << "Characteristic " << characteristic << " from the GATT cache was not found, dropping the cached table" << std::endl;
+		cobble_gatt_cache_invalidate(cobble_connection_address(connection));
+	}
+
+	then(c);
+}
+
+// Calls then with the characteristic, or nullptr if the current device doesn't have it. One reported from Cobble's GATT
+// cache is looked up in Windows' cache first, which doesn't go to the device. The application's thread mustn't block on
+// that (see cobble_connect_ex()), so then may be called later, from another thread.
+void with_characteristic(cobble_char_handle characteristic, std::function<void(GattCharacteristic)> then) {
 
-			cc.WriteClientCharacteristicConfigurationDescriptorAsync(dv);
+	GattCharacteristic cc = cached_characteristic(characteristic);
+	stored_characteristic stored;
 
+	if (cc == nullptr && characteristic != COBBLE_CHARACTERISTIC_NONE && characteristic <= COBBLE_MAX_CHARACTERISTICS) {
+		std::lock_guard<std::mutex> lock(characteristicCacheLock);
+		stored = storedCharacteristics[characteristic];
+	}
+	if (cc != nullptr || !stored.known || currentDevice == nullptr) {
+		then(cc);
+		return;
+	}
+
+	cobble_conn_handle connection = currentConnection;
+	IAsyncOperation<GattDeviceServicesResult> ao = currentDevice.GetGattServicesForUuidAsync(stored.service, BluetoothCacheMode::Cached);
+	ao.Completed([connection, characteristic, stored, then](IAsyncOperation<GattDeviceServicesResult> as_async, AsyncStatus as_status) {
+		if (as_status != AsyncStatus::Completed || as_async.GetResults().Services().Size() == 0) {
+			resolved(connection, characteristic, nullptr, then);
 			return;
 		}
-	}
 
-	std::cout << "No match in the cache for characteristic" << characteristic << " when trying to subscribe!" << std::endl;
-	return;
+		GattDeviceService s = as_async.GetResults().Services().GetAt(0);
+		{
+			std::lock_guard<std::mutex> lock(serviceCacheLock);
+			serviceCache.push_front(s);
+		}
 
+		IAsyncOperation<GattCharacteristicsResult> co = s.GetCharacteristicsForUuidAsync(stored.characteristic, BluetoothCacheMode::Cached);
+		co.Completed([connection, characteristic, then](IAsyncOperation<GattCharacteristicsResult> c_async, AsyncStatus c_status) {
+			GattCharacteristic c { nullptr };
+			if (c_status == AsyncStatus::Completed && c_async.GetResults().Characteristics().Size() > 0)
+				c = c_async.GetResults().Characteristics().GetAt(0);
+			resolved(connection, characteristic, c, then);
+		});
+	});
 }
 
+EXPORTED void cobble_subscribe_h(cobble_char_handle characteristic) {
+	with_characteristic(characteristic, [characteristic](GattCharacteristic cc) {
+		if (cc == nullptr) {
+			std::cout << "No match in the cache for characteristic " << characteristic << " when trying to subscribe!" << std::endl;
+			return;
+		}
 
-__declspec(dllexport) void cobble_write(const char* characteristic, uint8_t* data, int len) {
+		// The handle is known here, so notifications never need to format or look up the UUID
+		cc.ValueChanged([characteristic](GattCharacteristic const& c, GattValueChangedEventArgs const& args) {
+			cobble_event_updatevalue_h(characteristic, args.CharacteristicValue().data(), args.CharacteristicValue().Length());
+		});
 
-	//std::cout << "Writing " << len << " bytes to characteristic " << characteristic << " when there are " << characteristicCache.size() << " items" << std::endl;
+		GattClientCharacteristicConfigurationDescriptorValue dv;
 
-	// Get the Characteristic object
-	for (auto cc : characteristicCache) {
-		if (ToString(cc.Uuid()) == characteristic) {
-			
-			// Create an IBuffer around our given data. TODO: Profile this to see if we need something more efficient.
-			DataWriter writer;
-			array_view av((const uint8_t*)data, (const uint8_t*)(data + len));
-			writer.WriteBytes(av);
-			IBuffer b = writer.DetachBuffer();
-			
-			cc.WriteValueAsync(b); // TODO: Something with the asynchronous status result from this op
+		// If notifications are available, use them. Otherwise, use indications.
+		if (((cc.CharacteristicProperties()) & GattCharacteristicProperties::Notify) != GattCharacteristicProperties::None) {
+			dv = GattClientCharacteristicConfigurationDescriptorValue::Notify;
+		}
+		else {
+			dv = GattClientCharacteristicConfigurationDescriptorValue::Indicate;
+		}
+
+		cc.WriteClientCharacteristicConfigurationDescriptorAsync(dv);
+	});
+
+}
+
+EXPORTED void cobble_write_h(cobble_char_handle characteristic, uint8_t* data, int len) {
+
+	// Create an IBuffer around our given data. TODO: Profile this to see if we need something more efficient.
+	// It is made straight away, as the characteristic may have to be looked up before it can be written.
+	DataWriter writer;
+	array_view av((const uint8_t*)data, (const uint8_t*)(data + len));
+	writer.WriteBytes(av);
+	IBuffer b = writer.DetachBuffer();
+
+	with_characteristic(characteristic, [characteristic, b, len](GattCharacteristic cc) {
+		if (cc == nullptr) {
+			std::cout << "No match in the cache for characteristic " << characteristic << " when trying to write " << len << " bytes!" << std::endl;
 			return;
 		}
+
+		cc.WriteValueAsync(b); // TODO: Something with the asynchronous status result from this op
+	});
+
+}
+
+// The block being written by cobble_write_stream(). Up to STREAM_WINDOW writes without response are kept in flight, so
+// that the stack has the next packet ready for each connection event. A write with response waits for the one before.
+#define STREAM_WINDOW 8
+
+struct write_stream {
+	bool active = false;
+	uint32_t id = 0; // Completions of writes from a stream which has since ended are ignored
+	cobble_conn_handle connection = COBBLE_CONNECTION_NONE;
+	cobble_char_handle characteristic = COBBLE_CHARACTERISTIC_NONE;
+	GattCharacteristic c { nullptr };
+	GattWriteOption option = GattWriteOption::WriteWithResponse;
+	std::vector<uint8_t> data;
+	int chunk = 0;
+	int sent = 0;
+	int written = 0;
+	int inFlight = 0;
+	bool failed = false;
+};
+
+// Recursive, as a write's completion can run straight away on the thread which started it
+write_stream stream;
+std::recursive_mutex streamLock;
+
+void end_stream(int writeStatus) {
+	cobble_event_writecomplete(stream.connection, stream.characteristic, stream.written, writeStatus);
+	stream.active = false;
+	stream.id++;
+	stream.c = nullptr;
+	stream.data.clear();
+}
+
+void stream_failed() {
+	std::lock_guard<std::recursive_mutex> lock(streamLock);
+	if (stream.active)
+		end_stream(WriteStatus_Failed);
+}
+
+void on_stream_write(uint32_t id, int len, bool success);
+
+void pump_stream() {
+
+	int window = (stream.option == GattWriteOption::WriteWithoutResponse) ? STREAM_WINDOW : 1;
+
+	while (stream.active && !stream.failed && stream.inFlight < window && stream.sent < (int)stream.data.size()) {
+
+		int len = std::min(stream.chunk, (int)stream.data.size() - stream.sent);
+		const uint8_t* chunk = stream.data.data() + stream.sent;
+
+		DataWriter writer;
+		writer.WriteBytes(array_view<const uint8_t>(chunk, chunk + len));
+		IBuffer b = writer.DetachBuffer();
+
+		stream.sent += len;
+		stream.inFlight++;
+
+		uint32_t id = stream.id;
+		IAsyncOperation<GattWriteResult> ao = stream.c.WriteValueWithResultAsync(b, stream.option);
+		ao.Completed([id, len](IAsyncOperation<GattWriteResult> iao, AsyncStatus as_status) {
+			on_stream_write(id, len, as_status == AsyncStatus::Completed && iao.GetResults().Status() == GattCommunicationStatus::Success);
+		});
+	}
+
+}
+
+void on_stream_write(uint32_t id, int len, bool success) {
+
+	std::lock_guard<std::recursive_mutex> lock(streamLock);
+
+	if (!stream.active || stream.id != id)
+		return;
+
+	stream.inFlight--;
+	if (success)
+		stream.written += len;
+	else
+		stream.failed = true;
+
+	// After a failure, the writes already in flight are let finish so that the count of bytes written is right
+	if (stream.failed) {
+		if (stream.inFlight == 0)
+			end_stream(WriteStatus_Failed);
 	}
+	else if (stream.written == (int)stream.data.size()) {
+		end_stream(WriteStatus_Complete);
+	}
+	else {
+		pump_stream();
+	}
+
+}
+
+void start_stream(cobble_conn_handle connection, cobble_char_handle characteristic, GattCharacteristic cc, std::vector<uint8_t>& data) {
 
-	std::cout << "No match in the cache for characteristic " << characteristic << " when trying to write " << len << " bytes!" << std::endl;
-	return;
+	std::lock_guard<std::recursive_mutex> lock(streamLock);
+
+	if (stream.active) {
+		std::cout << "A stream is already being written to this device" << std::endl;
+		cobble_event_writecomplete(connection, characteristic, 0, WriteStatus_Busy);
+		return;
+	}
+
+	GattCharacteristicProperties writable = GattCharacteristicProperties::Write | GattCharacteristicProperties::WriteWithoutResponse;
+	if (cc == nullptr || (cc.CharacteristicProperties() & writable) == GattCharacteristicProperties::None) {
+		std::cout << "No writable match in the cache for characteristic " << characteristic << " when trying to write a stream!" << std::endl;
+		cobble_event_writecomplete(connection, characteristic, 0, WriteStatus_Failed);
+		return;
+	}
+
+	stream.active = true;
+	stream.connection = connection;
+	stream.characteristic = characteristic;
+	stream.c = cc;
+	if ((cc.CharacteristicProperties() & GattCharacteristicProperties::WriteWithoutResponse) != GattCharacteristicProperties::None)
+		stream.option = GattWriteOption::WriteWithoutResponse;
+	else
+		stream.option = GattWriteOption::WriteWithResponse;
+	stream.data.swap(data);
+	stream.chunk = cobble_max_writesize_get(stream.option == GattWriteOption::WriteWithResponse);
+	stream.sent = 0;
+	stream.written = 0;
+	stream.inFlight = 0;
+	stream.failed = false;
+
+	if (stream.data.empty())
+		end_stream(WriteStatus_Complete);
+	else
+		pump_stream();
 
 }
 
-EXPORTED void cobble_read(const char* characteristic) {
+// The data is copied straight away, as the characteristic may have to be looked up before the stream can start
+EXPORTED bool cobble_write_stream_h(cobble_char_handle characteristic, const uint8_t* data, int len) {
 
-	//std::cout << "Reading from characteristic " << characteristic << " when there are " << characteristicCache.size() << " items" << std::endl;
+	if (!cobble_connection_valid(currentConnection)) {
+		std::cout << "Not connected, cannot write a stream" << std::endl;
+		return false;
+	}
 
-	// Get the Characteristic object
-	for (auto cc : characteristicCache) {
-		if (ToString(cc.Uuid()) == characteristic) {
-			IAsyncOperation<GattReadResult> ao = cc.ReadValueAsync();
-			ao.Completed([cc](IAsyncOperation<GattReadResult> iao, AsyncStatus as_status) {
-				GattReadResult result = iao.GetResults();
-				std::cout << "Result: got some bytes " << (result.Value().Length()) << std::endl;
-				cobble_event_updatevalue(ToString(cc.Uuid()).c_str(), result.Value().data(), result.Value().Length());
-				}
-			);
+	if (len < 0 || (len > 0 && data == NULL)) {
+		std::cout << "Cannot write " << len << " bytes" << std::endl;
+		return false;
+	}
+
+	cobble_conn_handle connection = currentConnection;
+	auto copy = std::make_shared<std::vector<uint8_t>>(data, data + len);
+	with_characteristic(characteristic, [connection, characteristic, copy](GattCharacteristic cc) {
+		start_stream(connection, characteristic, cc, *copy);
+	});
+
+	return true;
+
+}
+
+EXPORTED void cobble_read_h(cobble_char_handle characteristic) {
+
+	with_characteristic(characteristic, [characteristic](GattCharacteristic cc) {
+		if (cc == nullptr) {
+			std::cout << "No match in the cache for characteristic " << characteristic << " when trying to read!" << std::endl;
 			return;
 		}
-	}
 
-	std::cout << "No match in the cache for characteristic " << characteristic << " when trying to read!" << std::endl;
-	return;
+		IAsyncOperation<GattReadResult> ao = cc.ReadValueAsync();
+		ao.Completed([characteristic](IAsyncOperation<GattReadResult> iao, AsyncStatus as_status) {
+			GattReadResult result = iao.GetResults();
+			std::cout << "Result: got some bytes " << (result.Value().Length()) << std::endl;
+			cobble_event_updatevalue_h(characteristic, result.Value().data(), result.Value().Length());
+			}
+		);
+	});
+
+}
+
+EXPORTED void cobble_subscribe(const char* characteristic) {
+	cobble_subscribe_h(cobble_characteristic_handle(characteristic));
+}
 
+__declspec(dllexport) void cobble_write(const char* characteristic, uint8_t* data, int len) {
+	cobble_write_h(cobble_characteristic_handle(characteristic), data, len);
 }
 
+EXPORTED bool cobble_write_stream(const char* characteristic, const uint8_t* data, int len) {
+	return cobble_write_stream_h(cobble_characteristic_handle(characteristic), data, len);
+}
+
+EXPORTED void cobble_read(const char* characteristic) {
+	cobble_read_h(cobble_characteristic_handle(characteristic));
+}
+
+EXPORTED void cobble_subscribe_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+	if (is_current(connection))
+		cobble_subscribe_h(characteristic);
+}
+
+EXPORTED void cobble_subscribe_cb(cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+	cobble_characteristic_cb_set(characteristic, cb, ctx);
+	cobble_subscribe_h(characteristic);
+}
+
+EXPORTED void cobble_subscribe_cb_c(cobble_conn_handle connection, cobble_char_handle characteristic, cobble_value_cb cb, void* ctx) {
+	if (is_current(connection))
+		cobble_subscribe_cb(characteristic, cb, ctx);
+}
+
+EXPORTED void cobble_write_c(cobble_conn_handle connection, cobble_char_handle characteristic, uint8_t* data, int len) {
+	if (is_current(connection))
+		cobble_write_h(characteristic, data, len);
+}
+
+EXPORTED void cobble_read_c(cobble_conn_handle connection, cobble_char_handle characteristic) {
+	if (is_current(connection))
+		cobble_read_h(characteristic);
+}
+
+EXPORTED bool cobble_write_stream_c(cobble_conn_handle connection, cobble_char_handle characteristic, const uint8_t* data, int len) {
+	return is_current(connection) && cobble_write_stream_h(characteristic, data, len);
+}